@@ -3,6 +3,8 @@
 #include <thread>
 #include <vector>
 
+#include "harness.h"
+
 const int NUM_RUNS = 10;
 const int NUM_THREADS = 40;
 const int NUM_LOOPS = 1000000;
@@ -23,15 +25,18 @@ void run_thread(int thread_id) {
     data.m1.unlock();
 }
 
-int main() {
-    for (int i = 0; i < NUM_RUNS; ++i) {
+int main(int argc, char *argv[]) {
+    bench::Harness harness("basicLocks", argc, argv, NUM_RUNS, NUM_THREADS,
+                           NUM_THREADS);
+
+    harness.measure("lock with data", [&] {
         std::vector<std::thread> threads;
-        for (int i = 0; i < NUM_THREADS; ++i) {
-            threads.emplace_back(run_thread, i);
+        for (unsigned i = 0; i < harness.threads(); ++i) {
+            threads.emplace_back(harness.spawn(i, run_thread, i));
         }
         for (auto &thread : threads) {
             thread.join();
         }
-    }
+    });
     return data.m1Data[0] == 123 ? 1 : 0;
-}
\ No newline at end of file
+}
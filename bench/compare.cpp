@@ -0,0 +1,151 @@
+// Compares benchmark results written with --json, and fails if any case got
+// slower than allowed.
+//
+//   bench-compare [-t percent] baseline.jsonl candidate.jsonl
+//       compares each case with the same case, variant, and thread count in
+//       the other file, e.g. results from before and after a change
+//   bench-compare [-t percent] [-v baseline candidate] results.jsonl
+//       compares two variants within one file (default: original and fixed)
+//
+// A case regresses if its median grew by more than the threshold (default
+// 5%). The exit code is 1 if any case regressed or is missing.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <tuple>
+
+namespace {
+
+struct Result {
+  double median = 0;
+  double stddev = 0;
+};
+
+// benchmark, case, threads, variant
+using Key = std::tuple<std::string, std::string, unsigned, std::string>;
+
+void usage(const char *argv0) {
+  std::cerr << "Usage: " << argv0
+            << " [-t max regression percent] baseline.jsonl candidate.jsonl\n"
+            << "       " << argv0
+            << " [-t max regression percent] [-v baseline candidate] "
+               "results.jsonl"
+            << std::endl;
+  exit(2);
+}
+
+// Reads the value after "key": in a flat JSON object written by the harness.
+bool field(const std::string &line, const std::string &key,
+           std::string &value) {
+  size_t pos = line.find("\"" + key + "\":");
+  if (pos == std::string::npos) {
+    return false;
+  }
+  pos = line.find_first_not_of(' ', pos + key.size() + 3);
+  if (pos == std::string::npos) {
+    return false;
+  }
+  value.clear();
+  if (line[pos] != '"') {
+    size_t end = line.find_first_of(",}", pos);
+    value = line.substr(pos, end - pos);
+    return true;
+  }
+  for (++pos; pos < line.size() && line[pos] != '"'; ++pos) {
+    if (line[pos] == '\\' && pos + 1 < line.size()) {
+      ++pos;
+    }
+    value += line[pos];
+  }
+  return true;
+}
+
+std::map<Key, Result> readResults(const char *path) {
+  std::ifstream in(path);
+  if (!in.is_open()) {
+    std::cerr << "Could not open " << path << std::endl;
+    exit(2);
+  }
+  std::map<Key, Result> results;
+  std::string line;
+  while (std::getline(in, line)) {
+    std::string benchmark, name, threads, variant, median, stddev;
+    if (!field(line, "benchmark", benchmark) || !field(line, "case", name) ||
+        !field(line, "threads", threads) || !field(line, "variant", variant) ||
+        !field(line, "median_ms", median) ||
+        !field(line, "stddev_ms", stddev)) {
+      continue;
+    }
+    // A later run of the same case replaces an earlier one.
+    results[Key(benchmark, name, std::stoul(threads), variant)] =
+        Result{std::stod(median), std::stod(stddev)};
+  }
+  return results;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  double threshold = 5;
+  std::string baselineVariant = "original";
+  std::string candidateVariant = "fixed";
+  int first = 1;
+  for (; first < argc && argv[first][0] == '-'; ++first) {
+    if (std::strcmp(argv[first], "-t") == 0 && first + 1 < argc) {
+      threshold = std::atof(argv[++first]);
+    } else if (std::strcmp(argv[first], "-v") == 0 && first + 2 < argc) {
+      baselineVariant = argv[++first];
+      candidateVariant = argv[++first];
+    } else {
+      usage(argv[0]);
+    }
+  }
+  if (argc - first != 1 && argc - first != 2) {
+    usage(argv[0]);
+  }
+
+  bool twoFiles = argc - first == 2;
+  auto baseline = readResults(argv[first]);
+  auto candidate = twoFiles ? readResults(argv[first + 1]) : baseline;
+
+  printf("%-16s %-20s %7s %-10s %12s %12s %8s\n", "benchmark", "case",
+         "threads", "variant", "base ms", "new ms", "change");
+  int regressions = 0;
+  int missing = 0;
+  for (auto &pair : baseline) {
+    auto &key = pair.first;
+    if (!twoFiles && std::get<3>(key) != baselineVariant) {
+      continue;
+    }
+    Key candidateKey = key;
+    if (!twoFiles) {
+      std::get<3>(candidateKey) = candidateVariant;
+    }
+    auto found = candidate.find(candidateKey);
+    const char *variant = std::get<3>(candidateKey).c_str();
+    if (found == candidate.end()) {
+      printf("%-16s %-20s %7u %-10s %12.3f %12s %8s\n",
+             std::get<0>(key).c_str(), std::get<1>(key).c_str(),
+             std::get<2>(key), variant, pair.second.median, "-", "MISSING");
+      ++missing;
+      continue;
+    }
+    double base = pair.second.median;
+    double now = found->second.median;
+    double change = base > 0 ? (now - base) / base * 100 : 0;
+    bool regressed = change > threshold;
+    regressions += regressed;
+    printf("%-16s %-20s %7u %-10s %12.3f %12.3f %+7.1f%%%s\n",
+           std::get<0>(key).c_str(), std::get<1>(key).c_str(), std::get<2>(key),
+           variant, base, now, change, regressed ? "  REGRESSION" : "");
+  }
+
+  printf("\n%d regression(s) over %.1f%%, %d missing case(s)\n", regressions,
+         threshold, missing);
+  return regressions > 0 || missing > 0 ? 1 : 0;
+}
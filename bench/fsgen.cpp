@@ -0,0 +1,229 @@
+// Generates benchmark programs with a chosen number of threads, data layout,
+// and access mix, to measure detection accuracy, profiler overhead, and fix
+// speedups beyond the handwritten benchmarks.
+//
+// Each thread repeatedly accesses its own int, `stride` ints after the
+// previous thread's. A percentage of the accesses can instead go to one int
+// that every thread shares (true sharing). The generated program times one
+// case with harness.h and takes the same options as the other benchmarks.
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+namespace {
+
+const unsigned MAX_THREADS = 1024;
+
+struct Options {
+  unsigned threads = 4;
+  std::string layout = "array";   // globals, struct, or array
+  std::string storage = "static"; // static or heap
+  unsigned stride = 1;            // in ints between threads' data
+  unsigned writePercent = 100;    // of accesses to a thread's own int
+  unsigned sharedPercent = 0;     // of all accesses, to the shared int
+  unsigned long loops = 1000000;
+  unsigned runs = 10;
+  std::string harness = "harness.h";
+  std::string name = "generated"; // for results
+  std::string output;
+};
+
+void usage(const char *argv0) {
+  std::cerr
+      << "Usage: " << argv0
+      << " [-t threads] [-l globals|struct|array] [-s static|heap]"
+      << " [-d stride] [-w write percent] [-x shared percent]"
+      << " [-n loops per thread] [-r runs] [-i path to harness.h]"
+      << " [-b benchmark name] [-o output file]" << std::endl;
+  exit(1);
+}
+
+unsigned long number(const char *argv0, const char *text, unsigned long min,
+                     unsigned long max) {
+  char *end;
+  unsigned long value = std::strtoul(text, &end, 10);
+  if (*text == '\0' || *end != '\0' || value < min || value > max) {
+    usage(argv0);
+  }
+  return value;
+}
+
+// Declarations of the threads' data, and initSlots(), which points
+// slotTable[t] at thread t's int.
+void writeData(std::ostream &out, const Options &options) {
+  unsigned padding = options.stride - 1;
+  bool heap = options.storage == "heap";
+  std::string prefix;
+
+  if (options.layout == "globals" || options.layout == "struct") {
+    bool isStruct = options.layout == "struct";
+    out << (isStruct ? "namespace {\nstruct Slots {\n" : "namespace {\n");
+    const char *indent = isStruct ? "  " : "";
+    for (unsigned t = 0; t < options.threads; ++t) {
+      out << indent << "volatile int slot" << t
+          << (isStruct ? ";\n" : " = 0;\n");
+      if (padding > 0 && t + 1 < options.threads) {
+        out << indent << "volatile int padding" << t << "[" << padding
+            << "];\n";
+      }
+    }
+    if (isStruct) {
+      out << "};\n} // namespace\n\n"
+          << (heap ? "Slots *slots;\n" : "Slots slots;\n");
+      prefix = heap ? "slots->" : "slots.";
+    } else {
+      out << "} // namespace\n";
+    }
+  } else if (heap) {
+    out << "volatile int *slots;\n";
+  } else {
+    out << "volatile int slots[NUM_THREADS * STRIDE];\n";
+  }
+
+  out << "\nvolatile int *slotTable[NUM_THREADS];\n\n"
+      << "void initSlots() {\n";
+  if (heap) {
+    // Cache line aligned, so the layout within lines matches static storage.
+    if (options.layout == "struct") {
+      out << "  slots = new (std::align_val_t(64)) Slots();\n";
+    } else {
+      out << "  slots = new (std::align_val_t(64)) "
+             "int[NUM_THREADS * STRIDE]();\n";
+    }
+  }
+  if (options.layout == "array") {
+    out << "  for (unsigned t = 0; t < NUM_THREADS; ++t) {\n"
+        << "    slotTable[t] = &slots[t * STRIDE];\n"
+        << "  }\n";
+  } else {
+    for (unsigned t = 0; t < options.threads; ++t) {
+      out << "  slotTable[" << t << "] = &" << prefix << "slot" << t << ";\n";
+    }
+  }
+  out << "}\n";
+}
+
+void generate(std::ostream &out, const Options &options, const char *command) {
+  std::ostringstream label;
+  label << options.threads << " threads, " << options.layout << ", "
+        << options.storage << ", stride " << options.stride << ", "
+        << options.writePercent << "% writes, " << options.sharedPercent
+        << "% shared";
+
+  out << "// Generated by: " << command << "\n"
+      << "// " << label.str() << "\n\n"
+      << "#include <new>\n"
+      << "#include <thread>\n"
+      << "#include <vector>\n\n"
+      << "#include \"" << options.harness << "\"\n\n"
+      << "const unsigned NUM_THREADS = " << options.threads << ";\n"
+      << "const unsigned STRIDE = " << options.stride << ";\n"
+      << "const unsigned WRITE_PERCENT = " << options.writePercent << ";\n"
+      << "const unsigned SHARED_PERCENT = " << options.sharedPercent << ";\n"
+      << "const long NUM_LOOPS = " << options.loops << ";\n"
+      << "const int NUM_RUNS = " << options.runs << ";\n\n"
+      << "// Accessed by every thread\n"
+      << "alignas(64) volatile int shared_slot = 0;\n\n";
+
+  writeData(out, options);
+
+  out << "\nvoid runThread(volatile int *slot) {\n"
+      << "  int sum = 0;\n"
+      << "  for (long i = 0; i < NUM_LOOPS; ++i) {\n"
+      << "    unsigned pick = i % 100;\n"
+      << "    if (pick < SHARED_PERCENT) {\n"
+      << "      ++shared_slot;\n"
+      << "    } else if ((pick - SHARED_PERCENT) * 100 <\n"
+      << "               WRITE_PERCENT * (100 - SHARED_PERCENT)) {\n"
+      << "      ++(*slot);\n"
+      << "    } else {\n"
+      << "      sum += *slot;\n"
+      << "    }\n"
+      << "  }\n"
+      << "  volatile int discard = sum;\n"
+      << "  (void)discard;\n"
+      << "}\n\n"
+      << "int main(int argc, char *argv[]) {\n"
+      << "  bench::Harness harness(\"" << options.name
+      << "\", argc, argv, NUM_RUNS,\n"
+      << "                         NUM_THREADS, NUM_THREADS);\n"
+      << "  initSlots();\n\n"
+      << "  harness.measure(\"" << label.str() << "\", [&] {\n"
+      << "    std::vector<std::thread> threads;\n"
+      << "    for (unsigned t = 0; t < harness.threads(); ++t) {\n"
+      << "      threads.push_back(harness.spawn(t, runThread, slotTable[t]));\n"
+      << "    }\n"
+      << "    for (auto &thread : threads) {\n"
+      << "      thread.join();\n"
+      << "    }\n"
+      << "  });\n\n"
+      << "  return 0;\n"
+      << "}\n";
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  Options options;
+  std::ostringstream command;
+  command << "fsgen";
+  for (int i = 1; i < argc; ++i) {
+    if (i + 1 == argc) {
+      usage(argv[0]);
+    }
+    const char *flag = argv[i];
+    const char *value = argv[++i];
+    if (std::strcmp(flag, "-o") != 0) {
+      command << ' ' << flag << ' ' << value;
+    }
+    if (std::strcmp(flag, "-t") == 0) {
+      options.threads = number(argv[0], value, 1, MAX_THREADS);
+    } else if (std::strcmp(flag, "-l") == 0) {
+      options.layout = value;
+    } else if (std::strcmp(flag, "-s") == 0) {
+      options.storage = value;
+    } else if (std::strcmp(flag, "-d") == 0) {
+      options.stride = number(argv[0], value, 1, 4096);
+    } else if (std::strcmp(flag, "-w") == 0) {
+      options.writePercent = number(argv[0], value, 0, 100);
+    } else if (std::strcmp(flag, "-x") == 0) {
+      options.sharedPercent = number(argv[0], value, 0, 100);
+    } else if (std::strcmp(flag, "-n") == 0) {
+      options.loops = number(argv[0], value, 1, ~0UL);
+    } else if (std::strcmp(flag, "-r") == 0) {
+      options.runs = number(argv[0], value, 1, ~0U);
+    } else if (std::strcmp(flag, "-i") == 0) {
+      options.harness = value;
+    } else if (std::strcmp(flag, "-b") == 0) {
+      options.name = value;
+    } else if (std::strcmp(flag, "-o") == 0) {
+      options.output = value;
+    } else {
+      usage(argv[0]);
+    }
+  }
+  if ((options.layout != "globals" && options.layout != "struct" &&
+       options.layout != "array") ||
+      (options.storage != "static" && options.storage != "heap")) {
+    usage(argv[0]);
+  }
+  if (options.layout == "globals" && options.storage == "heap") {
+    std::cerr << "Separate globals cannot be on the heap" << std::endl;
+    exit(1);
+  }
+
+  if (options.output.empty()) {
+    generate(std::cout, options, command.str().c_str());
+    return 0;
+  }
+  std::ofstream out(options.output);
+  if (!out.is_open()) {
+    std::cerr << "Could not open output file: " << options.output << std::endl;
+    exit(1);
+  }
+  generate(out, options, command.str().c_str());
+}
@@ -0,0 +1,237 @@
+//// Timing harness shared by the benchmarks ////
+//
+// Header-only, so each benchmark is still one translation unit that
+// src/run.sh can compile to bitcode and instrument on its own.
+//
+// Every benchmark accepts:
+//   --runs N      timed runs of each case (default: the benchmark's own)
+//   --warmup N    untimed runs before them (default 1)
+//   --threads N   worker threads, for benchmarks where the count is free
+//   --pin         pin worker i to CPU i (mod the number of CPUs)
+//   --json FILE   append one JSON object per case to FILE ("-" for stdout)
+//   --variant V   label for the results (default: BENCH_VARIANT, or
+//                 "original"), e.g. to tell fixed builds apart
+#pragma once
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifndef BENCH_VARIANT
+#define BENCH_VARIANT "original"
+#endif
+
+namespace bench {
+
+// Summary of the timed runs of one case, in milliseconds.
+struct Stats {
+  unsigned runs = 0;
+  double mean = 0;
+  double median = 0;
+  double p99 = 0;
+  double stddev = 0;
+  double min = 0;
+  double max = 0;
+};
+
+inline Stats summarize(std::vector<double> times) {
+  Stats stats;
+  stats.runs = times.size();
+  if (times.empty()) {
+    return stats;
+  }
+  std::sort(times.begin(), times.end());
+  size_t n = times.size();
+  stats.min = times.front();
+  stats.max = times.back();
+  stats.median = n % 2 ? times[n / 2] : (times[n / 2 - 1] + times[n / 2]) / 2;
+  // Nearest rank, so with fewer than 100 runs this is the maximum.
+  stats.p99 = times[std::min(n - 1, (size_t)std::ceil(0.99 * n) - 1)];
+  for (double time : times) {
+    stats.mean += time;
+  }
+  stats.mean /= n;
+  if (n > 1) {
+    double squares = 0;
+    for (double time : times) {
+      squares += (time - stats.mean) * (time - stats.mean);
+    }
+    stats.stddev = std::sqrt(squares / (n - 1));
+  }
+  return stats;
+}
+
+// Pins `thread` to CPU `index`, wrapping around the CPUs available.
+inline void pinThread(pthread_t thread, unsigned index) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(index % (cpus > 0 ? cpus : 1), &set);
+  pthread_setaffinity_np(thread, sizeof(set), &set);
+}
+
+class Harness {
+public:
+  // `defaultThreads` is used when --threads is not given; --threads is
+  // rejected for benchmarks whose thread count is fixed (maxThreads == 0) and
+  // capped at maxThreads otherwise.
+  Harness(const char *name, int argc, char **argv, unsigned defaultRuns,
+          unsigned defaultThreads = 2, unsigned maxThreads = 0)
+      : name(name), runs(defaultRuns), threadCount(defaultThreads),
+        variant(BENCH_VARIANT) {
+    for (int i = 1; i < argc; ++i) {
+      const char *arg = argv[i];
+      const char *value = i + 1 < argc ? argv[i + 1] : nullptr;
+      if (std::strcmp(arg, "--pin") == 0) {
+        pin = true;
+        continue;
+      }
+      if (!value) {
+        usage(argv[0]);
+      }
+      ++i;
+      if (std::strcmp(arg, "--runs") == 0) {
+        runs = parseCount(argv[0], value, 1);
+      } else if (std::strcmp(arg, "--warmup") == 0) {
+        warmup = parseCount(argv[0], value, 0);
+      } else if (std::strcmp(arg, "--threads") == 0) {
+        threadCount = parseCount(argv[0], value, 1);
+        if (threadCount > maxThreads) {
+          if (maxThreads == 0) {
+            fprintf(stderr, "%s always uses %u threads\n", name,
+                    defaultThreads);
+          } else {
+            fprintf(stderr, "%s supports at most %u threads\n", name,
+                    maxThreads);
+          }
+          exit(1);
+        }
+      } else if (std::strcmp(arg, "--json") == 0) {
+        jsonFile = value;
+      } else if (std::strcmp(arg, "--variant") == 0) {
+        variant = value;
+      } else {
+        usage(argv[0]);
+      }
+    }
+  }
+
+  unsigned threads() const { return threadCount; }
+
+  // Starts worker `index` running f(args...), pinned if --pin was given.
+  template <typename F, typename... Args>
+  std::thread spawn(unsigned index, F &&f, Args &&...args) {
+    std::thread thread(std::forward<F>(f), std::forward<Args>(args)...);
+    if (pin) {
+      pinThread(thread.native_handle(), index);
+    }
+    return thread;
+  }
+
+  // Pins a worker started with pthread_create, if --pin was given.
+  void pinWorker(pthread_t thread, unsigned index) const {
+    if (pin) {
+      pinThread(thread, index);
+    }
+  }
+
+  // Times `body` once per run, after the warmup runs, and reports the result
+  // under `label`.
+  template <typename F> Stats measure(const char *label, F &&body) {
+    for (unsigned i = 0; i < warmup; ++i) {
+      body();
+    }
+    std::vector<double> times;
+    for (unsigned i = 0; i < runs; ++i) {
+      auto start = std::chrono::steady_clock::now();
+      body();
+      auto end = std::chrono::steady_clock::now();
+      times.push_back(
+          std::chrono::duration<double, std::milli>(end - start).count());
+    }
+    Stats stats = summarize(std::move(times));
+    printf("%s, %s: median %f ms, mean %f ms, p99 %f ms, stddev %f ms "
+           "(%u runs)\n",
+           name, label, stats.median, stats.mean, stats.p99, stats.stddev,
+           stats.runs);
+    writeJson(label, stats);
+    return stats;
+  }
+
+private:
+  [[noreturn]] static void usage(const char *argv0) {
+    fprintf(stderr,
+            "Usage: %s [--runs N] [--warmup N] [--threads N] [--pin] "
+            "[--json file] [--variant name]\n",
+            argv0);
+    exit(1);
+  }
+
+  static unsigned parseCount(const char *argv0, const char *value,
+                             unsigned min) {
+    char *end;
+    unsigned long count = strtoul(value, &end, 10);
+    if (*value == '\0' || *end != '\0' || count < min) {
+      usage(argv0);
+    }
+    return count;
+  }
+
+  static std::string quote(const std::string &text) {
+    std::string quoted = "\"";
+    for (char c : text) {
+      if (c == '"' || c == '\\') {
+        quoted += '\\';
+      }
+      quoted += c;
+    }
+    return quoted + '"';
+  }
+
+  void writeJson(const char *label, const Stats &stats) const {
+    if (jsonFile.empty()) {
+      return;
+    }
+    FILE *out = jsonFile == "-" ? stdout : fopen(jsonFile.c_str(), "a");
+    if (!out) {
+      fprintf(stderr, "Could not open %s\n", jsonFile.c_str());
+      exit(1);
+    }
+    fprintf(out,
+            "{\"benchmark\": %s, \"case\": %s, \"variant\": %s, "
+            "\"threads\": %u, \"pinned\": %s, \"warmup\": %u, \"runs\": %u, "
+            "\"median_ms\": %.6f, \"mean_ms\": %.6f, \"p99_ms\": %.6f, "
+            "\"stddev_ms\": %.6f, \"min_ms\": %.6f, \"max_ms\": %.6f}\n",
+            quote(name).c_str(), quote(label).c_str(), quote(variant).c_str(),
+            threadCount, pin ? "true" : "false", warmup, stats.runs,
+            stats.median, stats.mean, stats.p99, stats.stddev, stats.min,
+            stats.max);
+    if (out != stdout) {
+      fclose(out);
+    }
+  }
+
+  const char *name;
+  unsigned runs;
+  unsigned warmup = 1;
+  unsigned threadCount;
+  bool pin = false;
+  std::string jsonFile;
+  std::string variant;
+};
+
+} // namespace bench
@@ -1,11 +1,11 @@
 #include <condition_variable>
 #include <iostream>
 #include <mutex>
-#include <sys/times.h>
 #include <thread>
-#include <time.h>
 #include <vector>
 
+#include "harness.h"
+
 std::mutex m1;
 std::mutex m2;
 std::condition_variable c1;
@@ -16,13 +16,6 @@ std::vector<int> v2;
 const int NUM_LOOPS = 10000;
 const int NUM_RUNS = 500;
 
-double compute(struct timespec start, struct timespec end) {
-  double t;
-  t = (end.tv_sec - start.tv_sec) * 1000;
-  t += (end.tv_nsec - start.tv_nsec) * 0.000001;
-  return t;
-}
-
 void producer(const int threadID) {
   for (int i = 0; i < NUM_LOOPS; ++i) {
     switch (threadID) {
@@ -70,27 +63,20 @@ void consumer(int threadID) {
   }
 }
 
-int main() {
-  timespec tpBegin1, tpEnd1;
+int main(int argc, char *argv[]) {
+  bench::Harness harness("locks", argc, argv, NUM_RUNS, 4);
 
-  clock_gettime(CLOCK_REALTIME, &tpBegin1);
-  for (int i = 0; i < NUM_RUNS; i++) {
-    std::thread thread1{producer, 1};
-    std::thread thread3{consumer, 1};
+  harness.measure("false sharing", [&] {
+    std::thread thread1 = harness.spawn(0, producer, 1);
+    std::thread thread3 = harness.spawn(1, consumer, 1);
 
-    std::thread thread2{producer, 2};
-    std::thread thread4{consumer, 2};
+    std::thread thread2 = harness.spawn(2, producer, 2);
+    std::thread thread4 = harness.spawn(3, consumer, 2);
     thread1.join();
     thread2.join();
     thread3.join();
     thread4.join();
-  }
-  clock_gettime(CLOCK_REALTIME, &tpEnd1);
-
-  auto time1 = compute(tpBegin1, tpEnd1);
-
-  printf("Average time taken over %d runs with false sharing      : %f ms\n",
-         NUM_RUNS, time1 / NUM_RUNS);
+  });
 
   return 0;
 }
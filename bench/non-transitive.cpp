@@ -1,7 +1,7 @@
 #include <iostream>
-#include <sys/times.h>
 #include <thread>
-#include <time.h>
+
+#include "harness.h"
 
 namespace {
 volatile int thread_data1 = 0;
@@ -15,13 +15,6 @@ volatile int thread_data5 = 0;
 const int NUM_LOOPS = 100000;
 const int NUM_RUNS = 1;
 
-double compute(struct timespec start, struct timespec end) {
-  double t;
-  t = (end.tv_sec - start.tv_sec) * 1000;
-  t += (end.tv_nsec - start.tv_nsec) * 0.000001;
-  return t;
-}
-
 void runThread(volatile int *threadData, volatile int *threadData2) {
   for (int i = 0; i < NUM_LOOPS; ++i) {
     ++(*threadData);
@@ -31,27 +24,18 @@ void runThread(volatile int *threadData, volatile int *threadData2) {
   }
 }
 
-int main() {
-  timespec tpBegin1, tpEnd1;
-  volatile int *thread1_data;
-  volatile int *thread2_data;
-  int data_choice1, data_choice2;
-
-  clock_gettime(CLOCK_REALTIME, &tpBegin1);
-  for (int i = 0; i < NUM_RUNS; i++) {
-    std::thread thread1{runThread, &thread_data1, nullptr};
-    std::thread thread2{runThread, &thread_data2, &thread_data4};
-    std::thread thread3{runThread, &thread_data5, nullptr};
+int main(int argc, char *argv[]) {
+  bench::Harness harness("non-transitive", argc, argv, NUM_RUNS, 3);
+
+  harness.measure("non-transitive", [&] {
+    std::thread thread1 = harness.spawn(0, runThread, &thread_data1, nullptr);
+    std::thread thread2 =
+        harness.spawn(1, runThread, &thread_data2, &thread_data4);
+    std::thread thread3 = harness.spawn(2, runThread, &thread_data5, nullptr);
     thread1.join();
     thread2.join();
     thread3.join();
-  }
-  clock_gettime(CLOCK_REALTIME, &tpEnd1);
-
-  auto time1 = compute(tpBegin1, tpEnd1);
-
-  printf("Average time taken over %d runs: %f ms\n", NUM_RUNS,
-         time1 / NUM_RUNS);
+  });
 
   return 0;
 }
@@ -2,122 +2,72 @@
 
 #include <pthread.h>
 #include <stdio.h>
-#include <sys/times.h>
-#include <time.h>
 
-#ifndef _GNU_SOURCE
-#define _GNU_SOURCE
-#endif
-#include <sched.h>
+#include "harness.h"
 
-struct timespec tpBegin1, tpEnd1, tpBegin2, tpEnd2, tpBegin3,
-    tpEnd3; // These are inbuilt structures to store the time related activities
-
-void print_cpu(const char *label) {
-  unsigned cpu, numa;
-  // getcpu(&cpu, &numa);
-  // printf("[%s] cpu: %u, numa: %u\n", label, cpu, numa);
-}
-
-double
-compute(struct timespec start,
-        struct timespec end) // computes time in milliseconds given
-                             // endTime and startTime timespec structures.
-{
-  print_cpu("compute begin");
-  double t;
-  t = (end.tv_sec - start.tv_sec) * 1000;
-  t += (end.tv_nsec - start.tv_nsec) * 0.000001;
-  print_cpu("compute end");
-  return t;
-}
+// Elements NO_SHARING_STRIDE apart are on different cache lines.
+const int NO_SHARING_STRIDE = 16;
+const int MAX_THREADS = 7;
 
 int array[100];
 
 void *expensive_function(void *param) {
-  print_cpu("expensive_function begin");
   int index = *((int *)param);
   int i;
   for (i = 0; i < 10; i++)
     array[index] += 1;
-  print_cpu("expensive_function end");
   return nullptr;
 }
 
-int main(int argc, char *argv[]) {
-  int first_elem = 0;
-  int bad_elem = 1;
-  int good_elem = 99;
-  double time1;
-  double time2;
-  double time3;
-  pthread_t thread_1;
-  pthread_t thread_2;
+// Runs expensive_function on elements[0..threads) in parallel.
+void run_parallel(bench::Harness &harness, int *elements) {
+  pthread_t threads[MAX_THREADS];
+  for (unsigned t = 0; t < harness.threads(); t++) {
+    pthread_create(&threads[t], NULL, expensive_function, (void *)&elements[t]);
+    harness.pinWorker(threads[t], t);
+  }
+  for (unsigned t = 0; t < harness.threads(); t++) {
+    pthread_join(threads[t], NULL);
+  }
+}
 
+int main(int argc, char *argv[]) {
   const int NUM_RUNS = 10;
-
-  print_cpu("main");
+  bench::Harness harness("sharedArray", argc, argv, NUM_RUNS, 2, MAX_THREADS);
+
+  // Adjacent elements share a cache line; strided ones do not.
+  int bad_elems[MAX_THREADS];
+  int good_elems[MAX_THREADS];
+  for (int t = 0; t < MAX_THREADS; t++) {
+    bad_elems[t] = t;
+    good_elems[t] = t * NO_SHARING_STRIDE;
+  }
 
   //-------------START--------Serial Computation-------------------------------
 
-  printf("\nDoing serial computation of expensive function\n");
-  clock_gettime(CLOCK_REALTIME, &tpBegin1);
-  for (int i = 0; i < NUM_RUNS; i++) {
-    expensive_function((void *)&first_elem);
-    expensive_function((void *)&bad_elem);
-  }
-  clock_gettime(CLOCK_REALTIME, &tpEnd1);
-
-  //-------------END----------Serial Computation-------------------------------
+  harness.measure("sequential", [&] {
+    for (unsigned t = 0; t < harness.threads(); t++) {
+      expensive_function((void *)&bad_elems[t]);
+    }
+  });
 
   //-------------START--------parallel computation with False Sharing----------
 
-  printf("\nDoing parallel computation with false sharing (two expensive "
-         "functions)\n");
-  clock_gettime(CLOCK_REALTIME, &tpBegin2);
-  for (int i = 0; i < NUM_RUNS; i++) {
-    pthread_create(&thread_1, NULL, expensive_function, (void *)&first_elem);
-    pthread_create(&thread_2, NULL, expensive_function, (void *)&bad_elem);
-    pthread_join(thread_1, NULL);
-    pthread_join(thread_2, NULL);
-  }
-  clock_gettime(CLOCK_REALTIME, &tpEnd2);
-
-  //-------------END----------parallel computation with False Sharing----------
+  harness.measure("false sharing",
+                  [&] { run_parallel(harness, bad_elems); });
 
   //-------------START--------parallel computation without False Sharing-------
 
-  printf("\nDoing parallel computation with NO false sharing (two expensive "
-         "functions)\n");
-  clock_gettime(CLOCK_REALTIME, &tpBegin3);
-  for (int i = 0; i < NUM_RUNS; i++) {
-    pthread_create(&thread_1, NULL, expensive_function, (void *)&first_elem);
-    pthread_create(&thread_2, NULL, expensive_function, (void *)&good_elem);
-    pthread_join(thread_1, NULL);
-    pthread_join(thread_2, NULL);
-  }
-  clock_gettime(CLOCK_REALTIME, &tpEnd3);
-
-  //-------------END--------parallel computation without False Sharing---------
+  harness.measure("no false sharing",
+                  [&] { run_parallel(harness, good_elems); });
 
   //------------START------------------OUTPUT STATS----------------------------
   printf("\nStats:\n");
   printf("array[first_element]: %d\t\t "
          "array[bad_element]: %d\t\t "
          "array[good_element]: %d\n\n",
-         array[first_elem], array[bad_elem], array[good_elem]);
-
-  time1 = compute(tpBegin1, tpEnd1);
-  time2 = compute(tpBegin2, tpEnd2);
-  time3 = compute(tpBegin3, tpEnd3);
-  printf("Average time taken over %d runs with false sharing      : %f ms\n",
-         NUM_RUNS, time2 / NUM_RUNS);
-  printf("Average time taken over %d runs without false sharing  : %f ms\n",
-         NUM_RUNS, time3 / NUM_RUNS);
-  printf("Average time taken over %d runs in Sequential computing : %f ms\n",
-         NUM_RUNS, time1 / NUM_RUNS);
-
-  //------------END------------------OUTPUT STATS------------------------------
+         array[bad_elems[0]], array[bad_elems[1 % harness.threads()]],
+         array[good_elems[1 % harness.threads()]]);
 
   return 0;
 }
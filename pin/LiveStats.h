@@ -0,0 +1,105 @@
+#pragma once
+
+// Counters that mdcache -stats publishes while the program runs, for fsstat
+// to read from another process.
+//
+// The file holds a live_stats_header, then max_caches live_stats_cache
+// entries, then max_interferences live_stats_interference entries, of which
+// the first `caches` and `interferences` are in use. The tool rewrites it in
+// place under a sequence lock: `sequence` is odd while an update is under way,
+// so a reader copies everything and retries if the sequence was odd or has
+// changed meanwhile.
+//
+// Header-only and free of exceptions, so Pin tools can use it as is.
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+static const char LIVE_STATS_MAGIC[8] = {'F', 'S', 'S', 'T', 'A', 'T', '1', '\0'};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "stats are shared between processes");
+
+struct live_stats_cache {
+  uint64_t thread;
+  uint64_t load_hits;
+  uint64_t load_misses; // including misses on lines a peer invalidated
+  uint64_t store_hits;
+  uint64_t store_misses;
+};
+
+// Same meaning as a line of a *.interferences file
+struct live_stats_interference {
+  uint64_t addr1;
+  uint64_t addr2;
+  uint64_t count;
+  uint64_t size1;
+  uint64_t size2;
+  uint64_t ww;
+  uint64_t wr;
+  uint64_t rw;
+  uint64_t transfers;
+};
+
+struct live_stats_header {
+  char magic[8];
+  uint32_t max_caches;
+  uint32_t max_interferences;
+  std::atomic<uint64_t> sequence;
+  uint64_t pid;
+  uint64_t updates;
+  uint64_t elapsed_ms; // since the tool started, at the last update
+  uint32_t caches;
+  uint32_t interferences; // the ones with the most transfers
+  uint64_t total_interferences; // distinct address pairs kept so far
+  uint64_t total_transfers;
+};
+
+inline size_t live_stats_size(uint32_t max_caches,
+                              uint32_t max_interferences) {
+  return sizeof(live_stats_header) + max_caches * sizeof(live_stats_cache) +
+         max_interferences * sizeof(live_stats_interference);
+}
+
+inline live_stats_cache *live_stats_caches(void *file) {
+  return reinterpret_cast<live_stats_cache *>(static_cast<char *>(file) +
+                                              sizeof(live_stats_header));
+}
+
+inline live_stats_interference *live_stats_interferences(void *file) {
+  const live_stats_header *header = static_cast<live_stats_header *>(file);
+  return reinterpret_cast<live_stats_interference *>(
+      live_stats_caches(file) + header->max_caches);
+}
+
+// Brackets an update by the only writer.
+inline void live_stats_begin(live_stats_header *header) {
+  header->sequence.fetch_add(1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+}
+
+inline void live_stats_end(live_stats_header *header) {
+  header->sequence.fetch_add(1, std::memory_order_release);
+}
+
+// Copies a consistent snapshot of the whole file into `copy`, which must be
+// live_stats_size() bytes. Fails if the writer kept it busy for `attempts`
+// tries in a row.
+inline bool live_stats_read(void *file, void *copy, int attempts = 1000) {
+  live_stats_header *header = static_cast<live_stats_header *>(file);
+  size_t size = live_stats_size(header->max_caches, header->max_interferences);
+  for (int i = 0; i < attempts; ++i) {
+    uint64_t before = header->sequence.load(std::memory_order_acquire);
+    if (before & 1) {
+      continue;
+    }
+    std::memcpy(copy, file, size);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (header->sequence.load(std::memory_order_relaxed) == before) {
+      return true;
+    }
+  }
+  return false;
+}
@@ -1,8 +1,201 @@
 #include "AccessInfo.h"
 
+#include <algorithm>
+#include <cctype>
+#include <sstream>
+#include <stdexcept>
+#include <tuple>
+#include <utility>
+
+const char *const SORTED_INTERFERENCES_HEADER = "# sorted by addr1, addr2";
+
+std::vector<global_var> read_global_vars(std::istream &in) {
+  std::vector<global_var> global_vars;
+  std::string line;
+  while (std::getline(in, line)) {
+    std::istringstream iss(line);
+    global_var global{"", 0, 0, 0, 0};
+    if (!(iss >> global.name >> std::hex >> global.start_addr >> std::dec >>
+          global.size)) {
+      continue;
+    }
+    iss >> std::hex >> global.module_hash >> global.guid;
+    if (!iss) {
+      global.module_hash = global.guid = 0;
+    }
+    global_vars.push_back(global);
+  }
+  return global_vars;
+}
+
+bool read_interference(std::istream &in, interference_record &record) {
+  std::string line;
+  while (std::getline(in, line)) {
+    std::istringstream iss(line);
+    if (!(iss >> std::hex >> record.addr1 >> record.addr2)) {
+      continue; // blank or malformed line
+    }
+    if (!(iss >> std::dec >> record.count)) {
+      record.count = 1;
+    }
+    if (!(iss >> record.size1 >> record.size2)) {
+      record.size1 = record.size2 = 1;
+    }
+    if (!(iss >> record.ww >> record.wr >> record.rw >> record.transfers)) {
+      record.ww = record.wr = record.rw = 0;
+      record.transfers = record.count;
+    }
+    return true;
+  }
+  return false;
+}
+
+void write_interference(std::ostream &out, const interference_record &record) {
+  out << std::hex << record.addr1 << "\t" << record.addr2 << "\t" << std::dec
+      << record.count << "\t" << record.size1 << "\t" << record.size2 << "\t"
+      << record.ww << "\t" << record.wr << "\t" << record.rw << "\t"
+      << record.transfers << '\n';
+}
+
+std::string slice_path(const std::string &interferences_path, uint64_t slice) {
+  static const std::string suffix = ".interferences";
+  std::string base = interferences_path;
+  if (base.size() >= suffix.size() &&
+      base.compare(base.size() - suffix.size(), suffix.size(), suffix) == 0) {
+    base.resize(base.size() - suffix.size());
+  }
+  return base + ".slice" + std::to_string(slice) + suffix;
+}
+
+bool path_slice(const std::string &path, uint64_t &slice) {
+  size_t name = path.find_last_of('/');
+  size_t at = path.rfind(".slice");
+  if (at == std::string::npos || (name != std::string::npos && at < name)) {
+    return false;
+  }
+  size_t digits = at + 6, end = digits;
+  while (end < path.size() && std::isdigit(static_cast<unsigned char>(path[end]))) {
+    ++end;
+  }
+  if (end == digits || end == path.size() || path[end] != '.') {
+    return false;
+  }
+  slice = std::stoull(path.substr(digits, end - digits));
+  return true;
+}
+
+std::string pages_path(const std::string &trace_path, uint64_t page_size) {
+  return trace_path + ".page" + std::to_string(page_size) + ".pages";
+}
+
+bool path_page_size(const std::string &path, uint64_t &page_size) {
+  static const std::string suffix = ".pages";
+  if (path.size() < suffix.size() ||
+      path.compare(path.size() - suffix.size(), suffix.size(), suffix) != 0) {
+    return false;
+  }
+  size_t end = path.size() - suffix.size(), digits = end;
+  while (digits > 0 &&
+         std::isdigit(static_cast<unsigned char>(path[digits - 1]))) {
+    --digits;
+  }
+  if (digits == end || digits < 5 || path.compare(digits - 5, 5, ".page") != 0) {
+    return false;
+  }
+  page_size = std::stoull(path.substr(digits, end - digits));
+  return true;
+}
+
+uint64_t interference_cost(const interference_record &record,
+                           unsigned ww_weight) {
+  uint64_t classified = record.ww + record.wr + record.rw;
+  if (classified == 0) {
+    return record.transfers;
+  }
+  uint64_t weighted = classified + (ww_weight - 1) * record.ww;
+  uint64_t cost = (record.transfers * weighted + classified - 1) / classified;
+  return std::max<uint64_t>(cost, 1);
+}
+
+bool read_site(std::istream &in, site_record &record) {
+  std::string line;
+  while (std::getline(in, line)) {
+    std::istringstream iss(line);
+    if (!(iss >> std::hex >> record.addr1 >> record.addr2 >> record.ip1 >>
+          record.ip2 >> std::dec >> record.count)) {
+      continue; // header, blank, or malformed line
+    }
+    if (record.addr1 > record.addr2) {
+      std::swap(record.addr1, record.addr2);
+      std::swap(record.ip1, record.ip2);
+    }
+    return true;
+  }
+  return false;
+}
+
+void write_site(std::ostream &out, const site_record &record) {
+  out << std::hex << record.addr1 << "\t" << record.addr2 << "\t" << record.ip1
+      << "\t" << record.ip2 << "\t" << std::dec << record.count << '\n';
+}
+
+// Puts the lower address first, keeping each size with its address.
+static void normalize(interference_record &record) {
+  if (record.addr1 > record.addr2) {
+    std::swap(record.addr1, record.addr2);
+    std::swap(record.size1, record.size2);
+  }
+}
+
+interference_reader::interference_reader(std::istream &in_in) : in(in_in) {
+  streaming = false;
+  if (in.peek() == '#') {
+    std::string header;
+    std::getline(in, header);
+    streaming = header == SORTED_INTERFERENCES_HEADER;
+  }
+  if (streaming) {
+    return;
+  }
+
+  interference_record record;
+  while (read_interference(in, record)) {
+    normalize(record);
+    loaded.push_back(record);
+  }
+  std::sort(loaded.begin(), loaded.end(), [](auto &left, auto &right) {
+    return std::tie(left.addr1, left.addr2) < std::tie(right.addr1, right.addr2);
+  });
+}
+
+bool interference_reader::next(interference_record &record) {
+  if (!streaming) {
+    if (loaded_index == loaded.size()) {
+      return false;
+    }
+    record = loaded[loaded_index++];
+    return true;
+  }
+
+  if (!read_interference(in, record)) {
+    return false;
+  }
+  normalize(record);
+  if (std::tie(record.addr1, record.addr2) <
+      std::tie(last_addr1, last_addr2)) {
+    throw std::runtime_error("Interference file claims to be sorted but is not");
+  }
+  last_addr1 = record.addr1;
+  last_addr2 = record.addr2;
+  return true;
+}
+
 bool operator==(const conflicting_addr &left, const conflicting_addr &right) {
-  return (left.addr1 == right.addr1 && left.addr2 == right.addr2) ||
-         (left.addr1 == right.addr2 && left.addr2 == right.addr1);
+  return left.addr1 == right.addr1 && left.addr2 == right.addr2;
+}
+
+bool operator<(const conflicting_addr &left, const conflicting_addr &right) {
+  return std::tie(left.addr1, left.addr2) < std::tie(right.addr1, right.addr2);
 }
 
 bool operator<(const global_var &left, const global_var &right) {
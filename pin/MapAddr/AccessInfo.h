@@ -1,25 +1,33 @@
 #pragma once
 
+#include <cstdint>
+#include <functional>
+#include <istream>
+#include <ostream>
 #include <string>
+#include <vector>
 
 struct global_var {
   std::string name;
   uint64_t start_addr;
   size_t size;
+  uint64_t module_hash; // 0 if fs_globals.txt predates module hashes
+  uint64_t guid;
 };
 
+// Reads fs_globals.txt lines: "name addr size [module_hash guid]". The last
+// two columns are missing in files written by older builds of the globals
+// pass.
+std::vector<global_var> read_global_vars(std::istream &in);
+
+// An access within a global variable, identified by its GlobalIndex id.
 struct memory_access {
-  std::string name;
+  uint32_t var;
   uint64_t accessOffset;
   uint64_t accessSize;
 };
 
-struct conflicting_access {
-  memory_access var1;
-  memory_access var2;
-  uint64_t priority;
-};
-
+// A pair of addresses, stored with addr1 <= addr2.
 struct conflicting_addr {
   uint64_t addr1;
   uint64_t addr2;
@@ -27,13 +35,96 @@ struct conflicting_addr {
 
 template <> struct std::hash<conflicting_addr> {
   std::size_t operator()(conflicting_addr const &ca) const noexcept {
-    std::size_t h1 = std::hash<uint64_t>{}(ca.addr1);
-    std::size_t h2 = std::hash<uint64_t>{}(ca.addr2);
-    return h1 ^ h2; // or use boost::hash_combine
+    // boost::hash_combine
+    std::size_t h = std::hash<uint64_t>{}(ca.addr1);
+    h ^= std::hash<uint64_t>{}(ca.addr2) + 0x9e3779b97f4a7c15 + (h << 6) +
+         (h >> 2);
+    return h;
   }
 };
 
+// One line of a *.interferences file written by detect or mdcache:
+// "addr1 addr2 [count [size1 size2 [ww wr rw transfers]]]". Older files have
+// no sizes, in which case the accesses are assumed to be 1 byte, and no
+// classification, in which case every touch counts as one transfer.
+//
+// ww, wr, and rw split count by whether the earlier access (as remembered by
+// the detector) and the later one were writes or reads. transfers estimates
+// how often the cache line moved between the two accesses' threads.
+struct interference_record {
+  uint64_t addr1;
+  uint64_t addr2;
+  uint64_t count;
+  uint64_t size1;
+  uint64_t size2;
+  uint64_t ww;
+  uint64_t wr;
+  uint64_t rw;
+  uint64_t transfers;
+};
+
+bool read_interference(std::istream &in, interference_record &record);
+void write_interference(std::ostream &out, const interference_record &record);
+
+// Weight of a write-write touch relative to a write-read or read-write one
+constexpr unsigned DEFAULT_WRITE_WRITE_WEIGHT = 4;
+
+// The priority an interference adds to its conflict: its transfers, scaled up
+// by the share of them that are write-write ping-pong, where each write
+// invalidates the other copy. Transfers with no classified touches (as in
+// older files) cost one each.
+uint64_t interference_cost(const interference_record &record,
+                           unsigned ww_weight);
+
+// detect -s and mdcache -slice split a run into time slices and write the
+// interferences of slice N beside the whole run's
+// "<name>.interferences", as "<name>.sliceN.interferences".
+std::string slice_path(const std::string &interferences_path, uint64_t slice);
+// Reads N back from such a path; false for a whole-run file.
+bool path_slice(const std::string &path, uint64_t &slice);
+
+// detect -p writes the pages of page_size bytes that threads on different
+// NUMA nodes share to "<trace>.page<page_size>.pages".
+std::string pages_path(const std::string &trace_path, uint64_t page_size);
+// Reads the page size back from such a path; false for any other file.
+bool path_page_size(const std::string &path, uint64_t &page_size);
+
+// First line of *.interferences files whose records are sorted by
+// (addr1, addr2) with addr1 <= addr2.
+extern const char *const SORTED_INTERFERENCES_HEADER;
+
+// Reads the records of a *.interferences file in (addr1, addr2) order with
+// addr1 <= addr2. Sorted files are streamed; files without the sorted header
+// (written by older detectors) are loaded and sorted in memory first.
+class interference_reader {
+public:
+  explicit interference_reader(std::istream &in);
+  bool next(interference_record &record);
+
+private:
+  std::istream &in;
+  bool streaming;
+  std::vector<interference_record> loaded;
+  size_t loaded_index = 0;
+  uint64_t last_addr1 = 0, last_addr2 = 0;
+};
+
+// One line of a *.sites file written next to a *.interferences file:
+// "addr1 addr2 ip1 ip2 count", where ip1 is the instruction that accessed
+// addr1 and ip2 the one that accessed addr2, with addr1 <= addr2.
+struct site_record {
+  uint64_t addr1;
+  uint64_t addr2;
+  uint64_t ip1;
+  uint64_t ip2;
+  uint64_t count;
+};
+
+bool read_site(std::istream &in, site_record &record);
+void write_site(std::ostream &out, const site_record &record);
+
 bool operator==(const conflicting_addr &left, const conflicting_addr &right);
+bool operator<(const conflicting_addr &left, const conflicting_addr &right);
 
 bool operator<(const global_var &left, const global_var &right);
 
@@ -0,0 +1,74 @@
+#include "ConflictAggregator.h"
+
+#include <algorithm>
+#include <tuple>
+#include <utility>
+
+// Number of address pairs resolved against the index at once
+constexpr size_t BATCH_SIZE = 4096;
+
+bool ConflictAggregator::named_conflict::operator<(
+    const named_conflict &right) const {
+  return std::tie(var1, offset1, var2, offset2) <
+         std::tie(right.var1, right.offset1, right.var2, right.offset2);
+}
+
+ConflictAggregator::ConflictAggregator(const GlobalIndex &index_in,
+                                       unsigned ww_weight_in)
+    : index(index_in), ww_weight(ww_weight_in) {
+  batch.reserve(BATCH_SIZE);
+}
+
+void ConflictAggregator::add(const interference_record &record) {
+  batch.push_back(record);
+  if (batch.size() == BATCH_SIZE) {
+    flush();
+  }
+}
+
+void ConflictAggregator::flush() {
+  addrs.resize(2 * batch.size());
+  ids.resize(2 * batch.size());
+  for (size_t i = 0; i < batch.size(); ++i) {
+    addrs[2 * i] = batch[i].addr1;
+    addrs[2 * i + 1] = batch[i].addr2;
+  }
+  index.resolve(addrs.data(), addrs.size(), ids.data());
+
+  for (size_t i = 0; i < batch.size(); ++i) {
+    auto &r = batch[i];
+    if (ids[2 * i] == GlobalIndex::npos || ids[2 * i + 1] == GlobalIndex::npos) {
+      continue;
+    }
+    memory_access ma1 = index.access(ids[2 * i], r.addr1, r.size1);
+    memory_access ma2 = index.access(ids[2 * i + 1], r.addr2, r.size2);
+    if (std::tie(ma2.var, ma2.accessOffset) <
+        std::tie(ma1.var, ma1.accessOffset)) {
+      std::swap(ma1, ma2);
+    }
+    auto &info =
+        conflicts[{ma1.var, ma1.accessOffset, ma2.var, ma2.accessOffset}];
+    info.priority += interference_cost(r, ww_weight);
+    info.size1 = std::max(info.size1, ma1.accessSize);
+    info.size2 = std::max(info.size2, ma2.accessSize);
+  }
+  batch.clear();
+}
+
+void ConflictAggregator::write(std::ostream &out) {
+  flush();
+  for (auto &conflict : conflicts) {
+    auto &key = conflict.first;
+    auto &info = conflict.second;
+    out << index.name(key.var1) << " " << key.offset1 << " " << info.size1
+        << " " << index.name(key.var2) << " " << key.offset2 << " "
+        << info.size2 << " " << info.priority;
+    // Module hashes and GUIDs let fs-profdata build an indexed profile.
+    if (index.guid(key.var1) != 0 && index.guid(key.var2) != 0) {
+      out << std::hex << " " << index.module_hash(key.var1) << " "
+          << index.guid(key.var1) << " " << index.module_hash(key.var2) << " "
+          << index.guid(key.var2) << std::dec;
+    }
+    out << '\n';
+  }
+}
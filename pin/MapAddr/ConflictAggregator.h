@@ -0,0 +1,51 @@
+#pragma once
+
+#include "AccessInfo.h"
+#include "GlobalIndex.h"
+
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <vector>
+
+// Resolves interferences between addresses to conflicts between accesses of
+// named globals, in batches, and sums their priorities (see
+// interference_cost). Memory use is proportional to the distinct named
+// conflicts, not the address pairs.
+class ConflictAggregator {
+public:
+  explicit ConflictAggregator(const GlobalIndex &index_in,
+                              unsigned ww_weight_in = DEFAULT_WRITE_WRITE_WEIGHT);
+
+  void add(const interference_record &record);
+  // Resolves any records still waiting for a full batch.
+  void flush();
+
+  // Writes mapped_conflicts.out lines: "name1 off1 size1 name2 off2 size2
+  // priority [module1 guid1 module2 guid2]".
+  void write(std::ostream &out);
+
+private:
+  // A conflict between two named accesses, with the lower (var, offset) first
+  struct named_conflict {
+    uint32_t var1;
+    uint64_t offset1;
+    uint32_t var2;
+    uint64_t offset2;
+
+    bool operator<(const named_conflict &right) const;
+  };
+
+  struct named_conflict_info {
+    uint64_t priority;
+    uint64_t size1;
+    uint64_t size2;
+  };
+
+  const GlobalIndex &index;
+  unsigned ww_weight;
+  std::vector<interference_record> batch;
+  std::vector<uint64_t> addrs;
+  std::vector<uint32_t> ids;
+  std::map<named_conflict, named_conflict_info> conflicts;
+};
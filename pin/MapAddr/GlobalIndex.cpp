@@ -0,0 +1,111 @@
+#include "GlobalIndex.h"
+
+#include <algorithm>
+
+// Lanes resolved together in a batch, so their cache misses overlap.
+static constexpr size_t BATCH_LANES = 16;
+
+// Fills tree[k] (and its subtrees) in order from sorted[next...].
+static void fill_eytzinger(const std::vector<uint64_t> &sorted,
+                           std::vector<uint64_t> &tree,
+                           std::vector<uint32_t> &tree_rank, size_t k,
+                           size_t &next) {
+  if (k >= tree.size()) {
+    return;
+  }
+  fill_eytzinger(sorted, tree, tree_rank, 2 * k, next);
+  tree[k] = next < sorted.size() ? sorted[next] : UINT64_MAX;
+  tree_rank[k] = static_cast<uint32_t>(next);
+  ++next;
+  fill_eytzinger(sorted, tree, tree_rank, 2 * k + 1, next);
+}
+
+GlobalIndex::GlobalIndex(std::vector<global_var> globals) {
+  std::sort(globals.begin(), globals.end());
+
+  starts.reserve(globals.size());
+  ends.reserve(globals.size());
+  module_hashes.reserve(globals.size());
+  guids.reserve(globals.size());
+  name_offsets.reserve(globals.size());
+  for (auto &global : globals) {
+    starts.push_back(global.start_addr);
+    ends.push_back(global.start_addr + global.size);
+    module_hashes.push_back(global.module_hash);
+    guids.push_back(global.guid);
+    name_offsets.push_back(static_cast<uint32_t>(name_pool.size()));
+    name_pool += global.name;
+    name_pool += '\0';
+  }
+
+  // Pad to a complete tree so every lookup takes exactly tree_depth steps.
+  tree_depth = 0;
+  size_t tree_size = 0;
+  while (tree_size < starts.size()) {
+    ++tree_depth;
+    tree_size = 2 * tree_size + 1;
+  }
+  tree.assign(tree_size + 1, UINT64_MAX);
+  tree_rank.assign(tree_size + 1, 0);
+  size_t next = 0;
+  fill_eytzinger(starts, tree, tree_rank, 1, next);
+  // Slot 0 means no start address is greater than the searched one.
+  tree_rank[0] = static_cast<uint32_t>(tree_size);
+}
+
+// k is the final position of a search for addr; the variable that may
+// contain addr is the one just before the first start greater than addr.
+uint32_t GlobalIndex::candidate(size_t k, uint64_t addr) const {
+  // Undo the trailing right turns to find the first start greater than addr.
+  k >>= __builtin_ffsll(~static_cast<long long>(k));
+  size_t upper = std::min<size_t>(tree_rank[k], starts.size());
+  if (upper == 0) {
+    return npos;
+  }
+  uint32_t id = static_cast<uint32_t>(upper - 1);
+  return addr < ends[id] ? id : npos;
+}
+
+uint32_t GlobalIndex::resolve(uint64_t addr) const {
+  size_t k = 1;
+  for (unsigned depth = 0; depth < tree_depth; ++depth) {
+    __builtin_prefetch(tree.data() + 16 * k);
+    k = 2 * k + (tree[k] <= addr);
+  }
+  return candidate(k, addr);
+}
+
+void GlobalIndex::resolve(const uint64_t *addrs, size_t count,
+                          uint32_t *ids) const {
+  size_t k[BATCH_LANES];
+  for (size_t base = 0; base < count; base += BATCH_LANES) {
+    const size_t lanes = std::min(BATCH_LANES, count - base);
+    for (size_t lane = 0; lane < lanes; ++lane) {
+      k[lane] = 1;
+    }
+    for (unsigned depth = 0; depth < tree_depth; ++depth) {
+      for (size_t lane = 0; lane < lanes; ++lane) {
+        __builtin_prefetch(tree.data() + 16 * k[lane]);
+        k[lane] = 2 * k[lane] + (tree[k[lane]] <= addrs[base + lane]);
+      }
+    }
+    for (size_t lane = 0; lane < lanes; ++lane) {
+      ids[base + lane] = candidate(k[lane], addrs[base + lane]);
+    }
+  }
+}
+
+std::vector<uint32_t> GlobalIndex::overlapping(uint64_t addr,
+                                               uint64_t size) const {
+  std::vector<uint32_t> ids;
+  uint32_t id = resolve(addr);
+  if (id != npos) {
+    ids.push_back(id);
+  }
+  // Variables do not overlap, so the rest start inside the range.
+  for (auto start = std::upper_bound(starts.begin(), starts.end(), addr);
+       start != starts.end() && *start < addr + size; ++start) {
+    ids.push_back(static_cast<uint32_t>(start - starts.begin()));
+  }
+  return ids;
+}
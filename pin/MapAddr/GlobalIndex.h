@@ -0,0 +1,62 @@
+#pragma once
+
+#include "AccessInfo.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Maps addresses to the global variable containing them.
+//
+// Start addresses are kept apart from everything else in an Eytzinger
+// (breadth-first) layout padded to a complete tree, so a lookup is a fixed
+// number of branchless steps whose next cache lines can be prefetched, and
+// batches of lookups overlap their memory accesses. Names are interned in a
+// single string pool and referred to by variable id.
+class GlobalIndex {
+public:
+  static constexpr uint32_t npos = UINT32_MAX;
+
+  explicit GlobalIndex(std::vector<global_var> globals);
+
+  // Returns the id of the variable containing addr, or npos.
+  uint32_t resolve(uint64_t addr) const;
+  // Resolves addrs[0..count) into ids[0..count).
+  void resolve(const uint64_t *addrs, size_t count, uint32_t *ids) const;
+  // Ids of the variables overlapping [addr, addr + size), in address order.
+  std::vector<uint32_t> overlapping(uint64_t addr, uint64_t size) const;
+
+  size_t size() const { return starts.size(); }
+  const char *name(uint32_t id) const {
+    return name_pool.data() + name_offsets[id];
+  }
+  uint64_t start(uint32_t id) const { return starts[id]; }
+  uint64_t module_hash(uint32_t id) const { return module_hashes[id]; }
+  uint64_t guid(uint32_t id) const { return guids[id]; }
+
+  // The access at addr of accessSize bytes, relative to variable id.
+  memory_access access(uint32_t id, uint64_t addr, uint64_t accessSize) const {
+    if (id == npos) {
+      return {npos, 0, 0};
+    }
+    return {id, addr - starts[id], accessSize};
+  }
+
+private:
+  uint32_t candidate(size_t k, uint64_t addr) const;
+
+  // Sorted by start address; indexed by variable id.
+  std::vector<uint64_t> starts;
+  std::vector<uint64_t> ends;
+  std::vector<uint64_t> module_hashes;
+  std::vector<uint64_t> guids;
+  std::vector<uint32_t> name_offsets;
+  std::string name_pool;
+
+  // 1-based Eytzinger layout of starts, padded with UINT64_MAX.
+  std::vector<uint64_t> tree;
+  // Number of starts <= tree[k], i.e. the sorted rank just past slot k.
+  std::vector<uint32_t> tree_rank;
+  unsigned tree_depth;
+};
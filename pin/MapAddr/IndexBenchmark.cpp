@@ -0,0 +1,112 @@
+// Compares GlobalIndex against the std::lower_bound lookup MapAddr used to do,
+// on a synthetic program with many globals.
+// Usage: ./IndexBenchmark [number of globals] [number of lookups]
+
+#include "AccessInfo.h"
+#include "GlobalIndex.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+// The previous MapAddr lookup: binary search over a vector of global_var,
+// copying the name out for every address.
+static std::pair<std::string, uint64_t>
+lower_bound_lookup(uint64_t addr, const std::vector<global_var> &global_vars) {
+  auto search_val = global_var{"", addr, 0, 0, 0};
+  auto it =
+      std::lower_bound(global_vars.begin(), global_vars.end(), search_val);
+
+  if (it == global_vars.end()) {
+    it = global_vars.begin() + global_vars.size() - 1;
+  } else if (it->start_addr == addr) {
+    // no offset
+  } else if (it != global_vars.begin()) {
+    it--;
+  }
+
+  if (addr >= it->start_addr && addr < it->start_addr + it->size) {
+    return {it->name, addr - it->start_addr};
+  }
+  return {"", 0};
+}
+
+template <typename F> static double time_ms(F f) {
+  auto begin = std::chrono::steady_clock::now();
+  f();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::milli>(end - begin).count();
+}
+
+int main(int argc, char **argv) {
+  size_t num_globals = argc > 1 ? std::stoull(argv[1]) : 1000000;
+  size_t num_lookups = argc > 2 ? std::stoull(argv[2]) : 4000000;
+  if (num_globals == 0) {
+    std::cerr << "Need at least one global" << std::endl;
+    return 1;
+  }
+
+  std::mt19937_64 rng(583);
+  std::uniform_int_distribution<uint64_t> size_dist(1, 256);
+  std::uniform_int_distribution<uint64_t> gap_dist(0, 64);
+
+  std::vector<global_var> global_vars;
+  global_vars.reserve(num_globals);
+  uint64_t addr = 0x555555554000;
+  for (size_t i = 0; i < num_globals; ++i) {
+    uint64_t size = size_dist(rng);
+    global_vars.push_back({"_ZN12_GLOBAL__N_1L6global" + std::to_string(i) + "E",
+                           addr, size, 0, i + 1});
+    addr += size + gap_dist(rng);
+  }
+  const uint64_t low = global_vars.front().start_addr;
+  const uint64_t high = addr + 4096;
+
+  std::uniform_int_distribution<uint64_t> addr_dist(low - 4096, high);
+  std::vector<uint64_t> addrs(num_lookups);
+  for (auto &a : addrs) {
+    a = addr_dist(rng);
+  }
+
+  std::vector<global_var> sorted = global_vars;
+  std::sort(sorted.begin(), sorted.end());
+  GlobalIndex index(global_vars);
+
+  std::vector<std::pair<std::string, uint64_t>> expected(num_lookups);
+  std::vector<uint32_t> single(num_lookups), batched(num_lookups);
+
+  double lower_bound_ms = time_ms([&] {
+    for (size_t i = 0; i < num_lookups; ++i) {
+      expected[i] = lower_bound_lookup(addrs[i], sorted);
+    }
+  });
+  double single_ms = time_ms([&] {
+    for (size_t i = 0; i < num_lookups; ++i) {
+      single[i] = index.resolve(addrs[i]);
+    }
+  });
+  double batched_ms = time_ms(
+      [&] { index.resolve(addrs.data(), addrs.size(), batched.data()); });
+
+  size_t mismatches = 0;
+  for (size_t i = 0; i < num_lookups; ++i) {
+    bool found = batched[i] != GlobalIndex::npos;
+    if (single[i] != batched[i] || found != !expected[i].first.empty() ||
+        (found && (expected[i].first != index.name(batched[i]) ||
+                   expected[i].second != addrs[i] - index.start(batched[i])))) {
+      ++mismatches;
+    }
+  }
+
+  std::cout << num_globals << " globals, " << num_lookups << " lookups"
+            << std::endl;
+  std::cout << "std::lower_bound:        " << lower_bound_ms << " ms" << std::endl;
+  std::cout << "GlobalIndex (single):    " << single_ms << " ms" << std::endl;
+  std::cout << "GlobalIndex (batched):   " << batched_ms << " ms" << std::endl;
+  std::cout << "Mismatches:              " << mismatches << std::endl;
+  return mismatches == 0 ? 0 : 1;
+}
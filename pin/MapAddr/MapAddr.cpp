@@ -1,116 +1,310 @@
 #include "../detect/InterferenceDetector.h"
 #include "AccessInfo.h"
+#include "ConflictAggregator.h"
+#include "GlobalIndex.h"
+#include "SiteReport.h"
+#include "Symbolizer.h"
 #include <algorithm>
-#include <cassert>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <queue>
+#include <sstream>
 #include <string>
-#include <unordered_map>
+#include <tuple>
 #include <vector>
 
 using namespace std;
 
+// Weight of the interference files of time slices first..last (see
+// slice_path), from -t "first[-[last]]:weight". 0 leaves the slices out.
+struct phase_weight {
+  uint64_t first;
+  uint64_t last;
+  uint64_t weight;
+};
 
-// <name, accessOffsetInVar, accessSize>
-memory_access addr_to_named_access(uint64_t addr,
-                                   const std::vector<global_var> &global_vars) {
-  auto search_val = global_var{"", addr, 0};
-  auto it =
-      std::lower_bound(global_vars.begin(), global_vars.end(), search_val);
-
-  if (it == global_vars.end()) {
-    assert(global_vars.size() > 0);
-    it = global_vars.begin() + global_vars.size() - 1;
-  } else if (it->start_addr == addr) {
-    // no offset
-  } else if (it != global_vars.begin()) {
-    assert(it->start_addr > addr);
-    it--;
+bool parse_phase_weight(const std::string &text, phase_weight &phase) {
+  size_t colon = text.find(':');
+  size_t dash = text.find('-');
+  if (colon == std::string::npos || (dash != std::string::npos && dash > colon)) {
+    return false;
   }
+  try {
+    size_t first_end = dash == std::string::npos ? colon : dash;
+    phase.first = string_to_uint64(text.substr(0, first_end), 10);
+    phase.last = phase.first;
+    if (dash != std::string::npos) {
+      phase.last = dash + 1 == colon
+                       ? UINT64_MAX
+                       : string_to_uint64(text.substr(dash + 1, colon - dash - 1), 10);
+    }
+    phase.weight = string_to_uint64(text.substr(colon + 1), 10);
+  } catch (std::runtime_error &e) {
+    return false;
+  }
+  return phase.first <= phase.last;
+}
+
+// Files that are not slices always count once; for slices, the last -t that
+// covers them applies.
+uint64_t weight_of(const std::string &path,
+                   const std::vector<phase_weight> &phases) {
+  uint64_t slice, weight = 1;
+  if (path_slice(path, slice)) {
+    for (const phase_weight &phase : phases) {
+      if (phase.first <= slice && slice <= phase.last) {
+        weight = phase.weight;
+      }
+    }
+  }
+  return weight;
+}
 
-  if (addr >= it->start_addr &&
-      addr < it->start_addr + it->size) { // TODO: Check overflow?
-    return {it->name, addr - it->start_addr, 1};
+// k-way merge-join of sorted interference files. Records for the same address
+// pair are combined across files (summing counts, scaled by the file's
+// weight) before they are resolved.
+void merge_interferences(std::vector<std::unique_ptr<interference_reader>> &readers,
+                         const std::vector<uint64_t> &weights,
+                         ConflictAggregator &aggregator) {
+  using head = std::pair<interference_record, size_t>; // record, reader index
+  auto later = [](const head &left, const head &right) {
+    return std::tie(left.first.addr1, left.first.addr2) >
+           std::tie(right.first.addr1, right.first.addr2);
+  };
+  std::priority_queue<head, std::vector<head>, decltype(later)> heads(later);
+  for (size_t i = 0; i < readers.size(); ++i) {
+    interference_record record;
+    if (readers[i]->next(record)) {
+      heads.push({record, i});
+    }
   }
-  return {"", 0, 0};
 
-  // TODO: we always assume access of size 1 byte
-  // return {it->name, addr - it->start_addr, 1};
+  while (!heads.empty()) {
+    interference_record merged = heads.top().first;
+    merged.count = 0;
+    merged.size1 = merged.size2 = 0;
+    merged.ww = merged.wr = merged.rw = merged.transfers = 0;
+    while (!heads.empty() && heads.top().first.addr1 == merged.addr1 &&
+           heads.top().first.addr2 == merged.addr2) {
+      head top = heads.top();
+      heads.pop();
+      uint64_t weight = weights[top.second];
+      merged.count += weight * top.first.count;
+      merged.size1 = std::max(merged.size1, top.first.size1);
+      merged.size2 = std::max(merged.size2, top.first.size2);
+      merged.ww += weight * top.first.ww;
+      merged.wr += weight * top.first.wr;
+      merged.rw += weight * top.first.rw;
+      merged.transfers += weight * top.first.transfers;
+      interference_record record;
+      if (readers[top.second]->next(record)) {
+        heads.push({record, top.second});
+      }
+    }
+    aggregator.add(merged);
+  }
 }
 
-int main(int argc, char **argv) {
-  unordered_map<conflicting_addr, conflicting_access> priority_cache;
-  std::vector<global_var> global_vars;
-  std::string outfile("mapped_conflicts.out");
-  ofstream out(outfile);
+void usage(const char *argv0) {
+  std::cerr << "Usage: " << argv0
+            << " [-w write-write weight] [-s path to *.sites]..."
+            << " [-t first slice[-[last slice]]:weight]..."
+            << " [-e executable [-l load bias]] [-p path to *.pages]..."
+            << " [path to mdcache.out.cacheline64.interferences] [path to "
+               "*.interferences]..."
+            << " [path to fs_globals.txt] " << std::endl;
+  exit(1);
+}
 
-  if (argc != 4) {
-    std::cerr << "Usage: " << argv[0]
-              << " [path to mdcache.out.cacheline64.interferences] [path to "
-                 "*.interferences]"
-              << "[path to fs_globals.txt] " << std::endl;
-    exit(1);
+// Ranks the instruction pairs in `site_paths` into hot_sites.out, with
+// source locations if `executable` is given.
+void report_sites(const std::vector<std::string> &site_paths,
+                  const GlobalIndex &index, const std::string &executable,
+                  uint64_t load_bias) {
+  SiteReport report(index);
+  for (auto &path : site_paths) {
+    ifstream sites(path);
+    if (!sites.is_open()) {
+      std::cerr << "Could not open sites file: " << path << std::endl;
+      exit(1);
+    }
+    site_record record;
+    while (read_site(sites, record)) {
+      report.add(record);
+    }
   }
 
-  ifstream realized_conflicting_addrs(argv[1]);
-  ifstream potential_conflicting_addrs(argv[2]);
-  ifstream global_addresses(argv[3]);
-  std::string addr1, addr2;
-  int64_t priority = 1;
-
-  std::string global_addr;
-  std::string global_name;
-  size_t size;
-  while (global_addresses >> global_name >> global_addr >> size) {
-    auto addr = string_to_uint64(global_addr, 16);
-    auto el = global_var{global_name, addr, size};
-    global_vars.push_back(el);
+  std::map<uint64_t, source_location> locations;
+  if (!executable.empty()) {
+    try {
+      locations = symbolize(executable, report.instructions(), load_bias);
+    } catch (std::runtime_error &e) {
+      std::cerr << e.what() << "; writing hot_sites.out without source "
+                << "locations" << std::endl;
+    }
   }
-  std::sort(global_vars.begin(), global_vars.end());
-  printf("done sorting\n");
-
-  while (realized_conflicting_addrs >> addr1 >> addr2 >> priority) {
-    auto realaddr1 = string_to_uint64(addr1, 16);
-    auto realaddr2 = string_to_uint64(addr2, 16);
-    conflicting_addr addrs = {realaddr1, realaddr2};
-    conflicting_access ca;
-    ca.priority = priority;
-    ca.var1 = addr_to_named_access(realaddr1, global_vars);
-    ca.var2 = addr_to_named_access(realaddr2, global_vars);
-    if (ca.var1.name.empty() || ca.var2.name.empty()) {
-      continue;
+  ofstream out("hot_sites.out");
+  report.write(out, locations);
+}
+
+// Maps the pages that detect -p found shared across NUMA nodes to the globals
+// on them, into mapped_pages.out: "name page_size remote_writes [module_hash
+// guid]", most remote writes first. A page holding a single global cannot be
+// split, so only pages with two or more count. A global on several pages gets
+// the largest page size and the sum of their remote writes, so Fix583
+// -false-sharing-pages-profile can give it pages of its own.
+void map_pages(const std::vector<std::string> &page_paths,
+               const GlobalIndex &index) {
+  std::map<uint32_t, std::pair<uint64_t, uint64_t>> shared; // size, writes
+  for (auto &path : page_paths) {
+    uint64_t page_size;
+    if (!path_page_size(path, page_size)) {
+      std::cerr << "Not a <trace>.page<size>.pages file: " << path << std::endl;
+      exit(1);
+    }
+    ifstream pages(path);
+    if (!pages.is_open()) {
+      std::cerr << "Could not open pages file: " << path << std::endl;
+      exit(1);
+    }
+    std::string line;
+    while (std::getline(pages, line)) {
+      if (line.empty() || line[0] == '#') {
+        continue;
+      }
+      // page, threads, first thread, home node, reads, writes, remote reads,
+      // remote writes, node:writes...
+      std::istringstream fields(line);
+      uint64_t page, skipped, remote_writes;
+      fields >> std::hex >> page >> std::dec;
+      for (int i = 0; i < 6; ++i) {
+        fields >> skipped;
+      }
+      if (!(fields >> remote_writes)) {
+        std::cerr << "Malformed line in " << path << ": " << line << std::endl;
+        exit(1);
+      }
+      auto ids = index.overlapping(page, page_size);
+      if (ids.size() < 2) {
+        continue;
+      }
+      for (uint32_t id : ids) {
+        auto &global = shared[id];
+        global.first = std::max(global.first, page_size);
+        global.second += remote_writes;
+      }
+    }
+  }
+
+  std::vector<std::pair<uint32_t, std::pair<uint64_t, uint64_t>>> sorted(
+      shared.begin(), shared.end());
+  std::stable_sort(sorted.begin(), sorted.end(), [](auto &left, auto &right) {
+    return left.second.second > right.second.second;
+  });
+  ofstream out("mapped_pages.out");
+  for (auto &global : sorted) {
+    uint32_t id = global.first;
+    out << index.name(id) << " " << global.second.first << " "
+        << global.second.second;
+    if (index.guid(id) != 0) {
+      out << std::hex << " " << index.module_hash(id) << " " << index.guid(id)
+          << std::dec;
     }
-    if (priority_cache.count(addrs)) {
-      priority_cache[addrs].priority += 1;
+    out << '\n';
+  }
+  std::cout << "Mapped " << sorted.size()
+            << " globals on pages shared across nodes to mapped_pages.out"
+            << std::endl;
+}
+
+int main(int argc, char **argv) {
+  std::vector<std::string> site_paths;
+  std::vector<std::string> page_paths;
+  std::string executable;
+  uint64_t load_bias = 0;
+  unsigned ww_weight = DEFAULT_WRITE_WRITE_WEIGHT;
+  std::vector<phase_weight> phases;
+  int first = 1;
+  for (; first + 1 < argc && argv[first][0] == '-'; first += 2) {
+    if (std::strcmp(argv[first], "-s") == 0) {
+      site_paths.push_back(argv[first + 1]);
+    } else if (std::strcmp(argv[first], "-p") == 0) {
+      page_paths.push_back(argv[first + 1]);
+    } else if (std::strcmp(argv[first], "-w") == 0) {
+      try {
+        ww_weight = string_to_uint64(argv[first + 1], 10);
+      } catch (std::runtime_error &e) {
+        usage(argv[0]);
+      }
+      if (ww_weight == 0) {
+        usage(argv[0]);
+      }
+    } else if (std::strcmp(argv[first], "-t") == 0) {
+      phase_weight phase;
+      if (!parse_phase_weight(argv[first + 1], phase)) {
+        usage(argv[0]);
+      }
+      phases.push_back(phase);
+    } else if (std::strcmp(argv[first], "-e") == 0) {
+      executable = argv[first + 1];
+    } else if (std::strcmp(argv[first], "-l") == 0) {
+      try {
+        load_bias = string_to_uint64(argv[first + 1], 16);
+      } catch (std::runtime_error &e) {
+        usage(argv[0]);
+      }
     } else {
-      priority_cache[addrs] = ca;
+      usage(argv[0]);
     }
   }
+  // Pages alone need no interference file.
+  if (argc - first < (page_paths.empty() ? 2 : 1)) {
+    usage(argv[0]);
+  }
 
-  priority = 1;
-  while (potential_conflicting_addrs >> addr1 >> addr2 >> priority) {
-    auto realaddr1 = string_to_uint64(addr1, 16);
-    auto realaddr2 = string_to_uint64(addr2, 16);
-    conflicting_addr addrs = {realaddr1, realaddr2};
-    conflicting_access ca;
-    ca.priority = priority;
-    ca.var1 = addr_to_named_access(realaddr1, global_vars);
-    ca.var2 = addr_to_named_access(realaddr2, global_vars);
-    if (ca.var1.name.empty() || ca.var2.name.empty()) {
+  std::string outfile("mapped_conflicts.out");
+  ofstream out(outfile);
+
+  // Every argument but the last is an interference file to merge.
+  std::vector<std::unique_ptr<ifstream>> interference_files;
+  std::vector<std::unique_ptr<interference_reader>> readers;
+  std::vector<uint64_t> weights;
+  for (int i = first; i < argc - 1; ++i) {
+    uint64_t weight = weight_of(argv[i], phases);
+    if (weight == 0) {
       continue;
     }
-    if (priority_cache.count(addrs)) {
-      priority_cache[addrs].priority += priority;
-    } else {
-      priority_cache[addrs] = ca;
+    weights.push_back(weight);
+    interference_files.push_back(std::make_unique<ifstream>(argv[i]));
+    if (!interference_files.back()->is_open()) {
+      std::cerr << "Could not open interference file: " << argv[i] << std::endl;
+      exit(1);
     }
+    readers.push_back(
+        std::make_unique<interference_reader>(*interference_files.back()));
   }
+  ifstream global_addresses(argv[argc - 1]);
+  auto global_vars = read_global_vars(global_addresses);
+  GlobalIndex index(std::move(global_vars));
+  printf("done indexing\n");
 
-  for (auto &ca : priority_cache) {
-    auto &ma1 = ca.second.var1;
-    auto &ma2 = ca.second.var2;
-    out << ma1.name << " " << ma1.accessOffset << " " << ma1.accessSize << " "
-        << ma2.name << " " << ma2.accessOffset << " " << ma2.accessSize << " "
-        << ca.second.priority << std::endl;
+  ConflictAggregator aggregator(index, ww_weight);
+  try {
+    merge_interferences(readers, weights, aggregator);
+  } catch (std::runtime_error &e) {
+    std::cerr << e.what() << std::endl;
+    exit(1);
+  }
+
+  aggregator.write(out);
+
+  if (!site_paths.empty()) {
+    report_sites(site_paths, index, executable, load_bias);
+  }
+  if (!page_paths.empty()) {
+    map_pages(page_paths, index);
   }
 }
@@ -0,0 +1,96 @@
+#include "SiteReport.h"
+
+#include <algorithm>
+#include <sstream>
+
+// Conflicts listed per site; the rest are summed up.
+constexpr size_t MAX_CONFLICTS = 3;
+
+SiteReport::SiteReport(const GlobalIndex &index_in) : index(index_in) {}
+
+std::string SiteReport::describe(uint64_t addr) const {
+  std::ostringstream out;
+  uint32_t id = index.resolve(addr);
+  if (id == GlobalIndex::npos) {
+    out << "0x" << std::hex << addr;
+  } else {
+    out << index.name(id) << "+" << addr - index.start(id);
+  }
+  return out.str();
+}
+
+void SiteReport::add(const site_record &record) {
+  uint64_t ip1 = record.ip1, ip2 = record.ip2;
+  uint64_t addr1 = record.addr1, addr2 = record.addr2;
+  if (ip2 < ip1) {
+    std::swap(ip1, ip2);
+    std::swap(addr1, addr2);
+  }
+  site_info &site = sites[{ip1, ip2}];
+  site.count += record.count;
+  site.conflicts[describe(addr1) + "/" + describe(addr2)] += record.count;
+}
+
+std::vector<uint64_t> SiteReport::instructions() const {
+  std::vector<uint64_t> ips;
+  for (auto &site : sites) {
+    ips.push_back(site.first.first);
+    ips.push_back(site.first.second);
+  }
+  std::sort(ips.begin(), ips.end());
+  ips.erase(std::unique(ips.begin(), ips.end()), ips.end());
+  return ips;
+}
+
+static void write_location(std::ostream &out, uint64_t ip,
+                           const std::map<uint64_t, source_location> &locations) {
+  out << "\t0x" << std::hex << ip << std::dec << "\t";
+  auto found = locations.find(ip);
+  if (found == locations.end() || found->second.function.empty()) {
+    out << "??";
+  } else {
+    out << found->second.function;
+  }
+  out << "\t";
+  if (found == locations.end() || found->second.file.empty()) {
+    out << "??:0";
+  } else {
+    out << found->second.file << ":" << found->second.line;
+  }
+}
+
+void SiteReport::write(
+    std::ostream &out,
+    const std::map<uint64_t, source_location> &locations) const {
+  std::vector<decltype(sites)::const_iterator> ranked;
+  for (auto it = sites.begin(); it != sites.end(); ++it) {
+    ranked.push_back(it);
+  }
+  std::stable_sort(ranked.begin(), ranked.end(), [](auto &left, auto &right) {
+    return left->second.count > right->second.count;
+  });
+
+  out << "# count, ip1, function1, location1, ip2, function2, location2, "
+         "conflicts\n";
+  for (auto &site : ranked) {
+    out << site->second.count;
+    write_location(out, site->first.first, locations);
+    write_location(out, site->first.second, locations);
+
+    std::vector<std::pair<std::string, uint64_t>> conflicts(
+        site->second.conflicts.begin(), site->second.conflicts.end());
+    std::stable_sort(conflicts.begin(), conflicts.end(),
+                     [](auto &left, auto &right) {
+                       return left.second > right.second;
+                     });
+    out << "\t";
+    for (size_t i = 0; i < conflicts.size() && i < MAX_CONFLICTS; ++i) {
+      out << (i ? " " : "") << conflicts[i].first << " (" << conflicts[i].second
+          << ")";
+    }
+    if (conflicts.size() > MAX_CONFLICTS) {
+      out << " and " << conflicts.size() - MAX_CONFLICTS << " more";
+    }
+    out << '\n';
+  }
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "AccessInfo.h"
+#include "GlobalIndex.h"
+
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Where an instruction comes from. Empty if it could not be symbolized.
+struct source_location {
+  std::string function;
+  std::string file;
+  uint32_t line = 0;
+};
+
+// Ranks the pairs of instructions that interfered, so the code sites behind
+// false sharing can be found. A pair is counted in either order, and lists
+// the accesses of named globals it conflicted on.
+class SiteReport {
+public:
+  explicit SiteReport(const GlobalIndex &index_in);
+
+  void add(const site_record &record);
+
+  // Every instruction of the sites added so far, in ascending order.
+  std::vector<uint64_t> instructions() const;
+
+  // Writes hot_sites.out lines, hottest first: "count ip1 function1
+  // file1:line1 ip2 function2 file2:line2 conflicts", separated by tabs.
+  // Conflicts are "name1+offset1/name2+offset2" by decreasing count; an
+  // address outside every global is given as itself.
+  void write(std::ostream &out,
+             const std::map<uint64_t, source_location> &locations) const;
+
+private:
+  std::string describe(uint64_t addr) const;
+
+  struct site_info {
+    uint64_t count = 0;
+    // "name1+offset1/name2+offset2" -> count
+    std::map<std::string, uint64_t> conflicts;
+  };
+
+  const GlobalIndex &index;
+  // (ip1, ip2) with ip1 <= ip2
+  std::map<std::pair<uint64_t, uint64_t>, site_info> sites;
+};
@@ -0,0 +1,85 @@
+#include "Symbolizer.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <stdexcept>
+#include <unistd.h>
+
+static std::string quote(const std::string &text) {
+  std::string quoted = "'";
+  for (char c : text) {
+    quoted += c == '\'' ? std::string("'\\''") : std::string(1, c);
+  }
+  return quoted + "'";
+}
+
+static bool read_line(FILE *in, std::string &line) {
+  line.clear();
+  int c;
+  while ((c = fgetc(in)) != EOF && c != '\n') {
+    line += static_cast<char>(c);
+  }
+  return c != EOF || !line.empty();
+}
+
+// llvm-symbolizer prints, for each address, the function, then
+// "file:line:column", then a blank line; unknown parts are "??" and 0.
+std::map<uint64_t, source_location>
+symbolize(const std::string &binary, const std::vector<uint64_t> &ips,
+          uint64_t load_bias) {
+  std::map<uint64_t, source_location> locations;
+  if (ips.empty()) {
+    return locations;
+  }
+
+  char input_path[] = "/tmp/fs583-symbolize-XXXXXX";
+  int fd = mkstemp(input_path);
+  if (fd < 0) {
+    throw std::runtime_error("Could not create a file for llvm-symbolizer");
+  }
+  close(fd);
+  {
+    std::ofstream input(input_path);
+    for (uint64_t ip : ips) {
+      input << "0x" << std::hex << ip - load_bias << '\n';
+    }
+  }
+
+  const char *symbolizer = getenv("LLVM_SYMBOLIZER");
+  std::string command =
+      quote(symbolizer ? symbolizer : "llvm-symbolizer") + " --obj=" +
+      quote(binary) + " --no-inlines --demangle < " + quote(input_path);
+  FILE *output = popen(command.c_str(), "r");
+  if (!output) {
+    unlink(input_path);
+    throw std::runtime_error("Could not run: " + command);
+  }
+
+  std::string function, location, blank;
+  for (uint64_t ip : ips) {
+    if (!read_line(output, function) || !read_line(output, location)) {
+      break;
+    }
+    read_line(output, blank);
+    source_location &result = locations[ip];
+    if (function != "??") {
+      result.function = function;
+    }
+    // file:line:column, where the file may itself contain ':'
+    size_t column = location.rfind(':');
+    size_t line = column == std::string::npos || column == 0
+                      ? std::string::npos
+                      : location.rfind(':', column - 1);
+    if (line != std::string::npos && location.compare(0, line, "??") != 0) {
+      result.file = location.substr(0, line);
+      result.line = std::strtoul(location.c_str() + line + 1, nullptr, 10);
+    }
+  }
+  int status = pclose(output);
+  unlink(input_path);
+  if (status != 0) {
+    throw std::runtime_error("Failed: " + command);
+  }
+  return locations;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include "SiteReport.h"
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+// Symbolizes `ips` in `binary`, loaded `load_bias` bytes above its link-time
+// addresses, with llvm-symbolizer (or the one named by $LLVM_SYMBOLIZER).
+// Throws std::runtime_error if it cannot be run.
+std::map<uint64_t, source_location>
+symbolize(const std::string &binary, const std::vector<uint64_t> &ips,
+          uint64_t load_bias);
@@ -0,0 +1,71 @@
+#pragma once
+
+// Memory accesses passed from mdring (a Pin tool) to mdanalyze through shared
+// memory, so the cache simulation runs outside the application's threads.
+//
+// mdanalyze creates the segment: a shm_ring_header, `rings` shm_ring
+// structures, then each ring's `capacity` records. Every application thread
+// claims a free ring and is its only producer; one mdanalyze thread is its
+// only consumer. The producer advances `head` and the consumer `tail`, so
+// neither takes a lock. Both count records since the start, and a record's
+// slot is its count modulo the capacity, a power of two. Once a thread has
+// exited (SHM_RING_FINISHED) and its records are analyzed, mdanalyze empties
+// its ring and frees it for a later thread.
+//
+// Header-only and free of exceptions, so Pin tools can use it as is.
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+static const char SHM_RING_MAGIC[8] = {'F', 'S', 'R', 'I', 'N', 'G', '1', '\0'};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "rings are shared between processes");
+
+// One memory access; same meaning as in a pinatrace.out line.
+struct shm_ring_record {
+  uint64_t ip;
+  uint64_t addr;
+  uint32_t size;
+  uint32_t is_write;
+};
+
+enum shm_ring_state : uint32_t {
+  SHM_RING_FREE = 0,
+  SHM_RING_ATTACHED, // claimed by a running thread
+  SHM_RING_FINISHED, // its thread has exited; head will not move again
+};
+
+struct alignas(64) shm_ring_header {
+  char magic[8];
+  uint32_t rings;
+  uint32_t capacity; // records per ring
+  std::atomic<uint32_t> done; // the program has exited
+  std::atomic<uint32_t> untracked_threads; // started with no free ring left
+};
+
+// head and tail are on separate cache lines so the producer and the consumer
+// do not falsely share them.
+struct shm_ring {
+  alignas(64) std::atomic<uint64_t> head; // records written
+  alignas(64) std::atomic<uint64_t> tail; // records analyzed
+  alignas(64) std::atomic<uint32_t> state;
+};
+
+inline size_t shm_ring_segment_size(uint32_t rings, uint32_t capacity) {
+  return sizeof(shm_ring_header) + rings * sizeof(shm_ring) +
+         static_cast<size_t>(rings) * capacity * sizeof(shm_ring_record);
+}
+
+inline shm_ring *shm_rings(void *segment) {
+  return reinterpret_cast<shm_ring *>(static_cast<char *>(segment) +
+                                      sizeof(shm_ring_header));
+}
+
+inline shm_ring_record *shm_ring_records(void *segment, uint32_t ring) {
+  const shm_ring_header *header = static_cast<shm_ring_header *>(segment);
+  char *records = reinterpret_cast<char *>(shm_rings(segment) + header->rings);
+  return reinterpret_cast<shm_ring_record *>(records) +
+         static_cast<size_t>(ring) * header->capacity;
+}
@@ -0,0 +1,139 @@
+#pragma once
+
+// Counts per key in at most `capacity` entries, keeping the keys with the
+// most events (the Space-Saving algorithm of Metwally, Agrawal and El
+// Abbadi). When it is full, a new key takes the place of the key with the
+// fewest events: it inherits their number as its weight and its error, and
+// its value starts over. So a kept key's value may miss up to `error` events,
+// and a key that is not kept had at most minWeight() events.
+//
+// With capacity 0 every key is kept, as in a hash map.
+//
+// Header-only and free of exceptions, so Pin tools can use it as is.
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+template <typename KEY, typename VALUE, typename HASH = std::hash<KEY>>
+class SpaceSaving {
+public:
+  struct Entry {
+    KEY key;
+    VALUE value;
+    uint64_t weight; // events counted for the key, including error
+    uint64_t error;  // events of the keys it replaced
+  };
+
+  explicit SpaceSaving(size_t capacity = 0) : max_entries(capacity) {}
+
+  // Only while empty
+  void setCapacity(size_t capacity) { max_entries = capacity; }
+  size_t capacity() const { return max_entries; }
+
+  // Counts `weight` more events of key and returns its value.
+  VALUE &add(const KEY &key, uint64_t weight = 1) {
+    auto found = index.find(key);
+    if (found != index.end()) {
+      heap[found->second].weight += weight;
+      return heap[siftDown(found->second)].value;
+    }
+    if (max_entries == 0 || heap.size() < max_entries) {
+      index.emplace(key, heap.size());
+      heap.push_back({key, VALUE(), weight, 0});
+      return heap[siftUp(heap.size() - 1)].value;
+    }
+    // Replaces the key with the fewest events, at the top of the heap.
+    Entry &least = heap[0];
+    index.erase(least.key);
+    index.emplace(key, 0);
+    least.key = key;
+    least.value = VALUE();
+    least.error = least.weight;
+    least.weight += weight;
+    ++replaced;
+    return heap[siftDown(0)].value;
+  }
+
+  // Keeps key with the given counts, as saved from entries().
+  void restore(const KEY &key, const VALUE &value, uint64_t weight,
+               uint64_t error) {
+    add(key, weight) = value;
+    heap[index.find(key)->second].error = error;
+  }
+
+  void restoreEvictions(uint64_t evictions) { replaced = evictions; }
+
+  VALUE *find(const KEY &key) {
+    auto found = index.find(key);
+    return found == index.end() ? nullptr : &heap[found->second].value;
+  }
+  const VALUE *find(const KEY &key) const {
+    auto found = index.find(key);
+    return found == index.end() ? nullptr : &heap[found->second].value;
+  }
+
+  // In no particular order
+  const std::vector<Entry> &entries() const { return heap; }
+  size_t size() const { return heap.size(); }
+  // Keys that made room for others
+  uint64_t evictions() const { return replaced; }
+  // The most events a key that is not kept can have had; 0 if none was ever
+  // replaced.
+  uint64_t minWeight() const {
+    return replaced == 0 || heap.empty() ? 0 : heap[0].weight;
+  }
+
+  void clear() {
+    heap.clear();
+    index.clear();
+    replaced = 0;
+  }
+
+private:
+  size_t max_entries;
+  uint64_t replaced = 0;
+  // A min-heap by weight when bounded; otherwise in insertion order.
+  std::vector<Entry> heap;
+  std::unordered_map<KEY, size_t, HASH> index; // key -> position in heap
+
+  void swapEntries(size_t a, size_t b) {
+    std::swap(heap[a], heap[b]);
+    index[heap[a].key] = a;
+    index[heap[b].key] = b;
+  }
+
+  // Both return the entry's new position.
+  size_t siftUp(size_t i) {
+    if (max_entries == 0) {
+      return i;
+    }
+    while (i > 0 && heap[i].weight < heap[(i - 1) / 2].weight) {
+      swapEntries(i, (i - 1) / 2);
+      i = (i - 1) / 2;
+    }
+    return i;
+  }
+
+  size_t siftDown(size_t i) {
+    if (max_entries == 0) {
+      return i;
+    }
+    while (true) {
+      size_t least = i;
+      for (size_t child = 2 * i + 1; child <= 2 * i + 2; ++child) {
+        if (child < heap.size() && heap[child].weight < heap[least].weight) {
+          least = child;
+        }
+      }
+      if (least == i) {
+        return i;
+      }
+      swapEntries(i, least);
+      i = least;
+    }
+  }
+};
@@ -0,0 +1,388 @@
+#pragma once
+
+// Compressed memory traces, written by pinatrace -compress and read by detect.
+//
+// A trace is TRACE_MAGIC followed by blocks. Each block has a 12 byte header
+// (raw size, stored size, and record count, as little-endian 32 bit numbers)
+// and its payload, compressed with lz_compress unless the stored size equals
+// the raw size. A block with no records ends the trace, unless it has a
+// payload: then it marks records that pinatrace -drop left out, and its
+// (uncompressed) payload is their number.
+//
+// Each record is encoded as varints: thread id, (size << 2 | has value << 1 |
+// is write), the zigzag deltas of the ip and address from the thread's
+// previous record in the block, and the value if it has one. Deltas start
+// from 0 in every block, so blocks can be decoded on their own.
+//
+// Header-only and free of exceptions, so Pin tools can use it as is.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+static const char TRACE_MAGIC[8] = {'F', 'S', 'T', 'R', 'A', 'C', 'E', '1'};
+// Raw bytes buffered before a block is compressed and written
+const size_t TRACE_BLOCK_SIZE = 1 << 20;
+const size_t TRACE_BLOCK_HEADER_SIZE = 12;
+
+// One memory access, as in a line of a text pinatrace.out.
+struct trace_record {
+  uint64_t ip;
+  uint64_t addr;
+  uint64_t size;
+  uint64_t thread;
+  uint64_t value; // only if has_value
+  bool is_write;
+  bool has_value;
+};
+
+inline void put_varint(std::string &out, uint64_t value) {
+  while (value >= 0x80) {
+    out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  out.push_back(static_cast<char>(value));
+}
+
+inline bool get_varint(const unsigned char *&in, const unsigned char *end,
+                       uint64_t &value) {
+  value = 0;
+  for (int shift = 0; shift < 64 && in < end; shift += 7) {
+    unsigned char byte = *in++;
+    value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+inline uint64_t zigzag(uint64_t delta) {
+  return (delta << 1) ^ (0 - (delta >> 63));
+}
+inline uint64_t unzigzag(uint64_t value) {
+  return (value >> 1) ^ (0 - (value & 1));
+}
+
+inline void put_u32(std::string &out, uint32_t value) {
+  for (int i = 0; i < 4; ++i) {
+    out.push_back(static_cast<char>(value >> (8 * i)));
+  }
+}
+
+inline uint32_t get_u32(const unsigned char *in) {
+  return in[0] | in[1] << 8 | in[2] << 16 | static_cast<uint32_t>(in[3]) << 24;
+}
+
+/* ===================================================================== */
+/* LZ block codec                                                        */
+/* ===================================================================== */
+
+// An LZ77 codec in the style of LZ4 blocks: a sequence is a token (literal
+// length in the high nibble, match length - 4 in the low one, 15 meaning
+// more length bytes follow), the literals, and a 2 byte match offset. The
+// last sequence has only literals.
+const unsigned LZ_HASH_BITS = 14;
+const size_t LZ_MIN_MATCH = 4;
+const size_t LZ_MAX_OFFSET = 65535;
+// Bytes at the end of the input that are never searched for matches
+const size_t LZ_END_LITERALS = 8;
+
+inline uint32_t lz_load32(const unsigned char *in) {
+  uint32_t value;
+  std::memcpy(&value, in, sizeof(value));
+  return value;
+}
+
+inline void lz_put_length(std::string &out, size_t length) {
+  for (; length >= 255; length -= 255) {
+    out.push_back(static_cast<char>(255));
+  }
+  out.push_back(static_cast<char>(length));
+}
+
+inline void lz_put_sequence(std::string &out, const unsigned char *literals,
+                            size_t literal_length, size_t offset,
+                            size_t match_length) {
+  size_t match_code = match_length ? match_length - LZ_MIN_MATCH : 0;
+  out.push_back(static_cast<char>((literal_length < 15 ? literal_length : 15)
+                                      << 4 |
+                                  (match_code < 15 ? match_code : 15)));
+  if (literal_length >= 15) {
+    lz_put_length(out, literal_length - 15);
+  }
+  out.append(reinterpret_cast<const char *>(literals), literal_length);
+  if (match_length == 0) {
+    return;
+  }
+  out.push_back(static_cast<char>(offset & 0xff));
+  out.push_back(static_cast<char>(offset >> 8));
+  if (match_code >= 15) {
+    lz_put_length(out, match_code - 15);
+  }
+}
+
+inline void lz_compress(const std::string &in, std::string &out) {
+  out.clear();
+  const unsigned char *src = reinterpret_cast<const unsigned char *>(in.data());
+  const size_t size = in.size();
+  std::vector<uint32_t> table(1u << LZ_HASH_BITS, UINT32_MAX);
+  size_t anchor = 0, pos = 0;
+  while (size >= LZ_END_LITERALS + LZ_MIN_MATCH &&
+         pos + LZ_MIN_MATCH + LZ_END_LITERALS <= size) {
+    uint32_t sequence = lz_load32(src + pos);
+    uint32_t hash = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+    uint32_t candidate = table[hash];
+    table[hash] = static_cast<uint32_t>(pos);
+    if (candidate == UINT32_MAX || pos - candidate > LZ_MAX_OFFSET ||
+        lz_load32(src + candidate) != sequence) {
+      ++pos;
+      continue;
+    }
+    size_t end = pos + LZ_MIN_MATCH;
+    while (end + LZ_END_LITERALS < size &&
+           src[end] == src[end - pos + candidate]) {
+      ++end;
+    }
+    lz_put_sequence(out, src + anchor, pos - anchor, pos - candidate,
+                    end - pos);
+    pos = anchor = end;
+  }
+  lz_put_sequence(out, src + anchor, size - anchor, 0, 0);
+}
+
+inline bool lz_get_length(const unsigned char *&in, const unsigned char *end,
+                          size_t &length) {
+  unsigned char byte;
+  do {
+    if (in == end) {
+      return false;
+    }
+    byte = *in++;
+    length += byte;
+  } while (byte == 255);
+  return true;
+}
+
+// Returns false if `in` is not a valid block of raw_size bytes.
+inline bool lz_decompress(const unsigned char *in, size_t in_size,
+                          size_t raw_size, std::string &out) {
+  out.clear();
+  out.reserve(raw_size);
+  const unsigned char *end = in + in_size;
+  while (in < end) {
+    unsigned char token = *in++;
+    size_t literal_length = token >> 4;
+    if (literal_length == 15 && !lz_get_length(in, end, literal_length)) {
+      return false;
+    }
+    if (literal_length > static_cast<size_t>(end - in) ||
+        out.size() + literal_length > raw_size) {
+      return false;
+    }
+    out.append(reinterpret_cast<const char *>(in), literal_length);
+    in += literal_length;
+    if (in == end) {
+      break;
+    }
+
+    if (end - in < 2) {
+      return false;
+    }
+    size_t offset = in[0] | in[1] << 8;
+    in += 2;
+    size_t match_length = token & 15;
+    if (match_length == 15 && !lz_get_length(in, end, match_length)) {
+      return false;
+    }
+    match_length += LZ_MIN_MATCH;
+    if (offset == 0 || offset > out.size() ||
+        out.size() + match_length > raw_size) {
+      return false;
+    }
+    // Byte by byte, since a match may overlap what it copies.
+    size_t from = out.size() - offset;
+    for (size_t i = 0; i < match_length; ++i) {
+      out.push_back(out[from + i]);
+    }
+  }
+  return out.size() == raw_size;
+}
+
+/* ===================================================================== */
+/* Trace blocks                                                          */
+/* ===================================================================== */
+
+class TraceBlockEncoder {
+public:
+  TraceBlockEncoder() : records(0) {}
+
+  void add(const trace_record &record) {
+    thread_state &state = threads[record.thread];
+    put_varint(raw, record.thread);
+    put_varint(raw, record.size << 2 | (record.has_value ? 2 : 0) |
+                        (record.is_write ? 1 : 0));
+    put_varint(raw, zigzag(record.ip - state.ip));
+    put_varint(raw, zigzag(record.addr - state.addr));
+    if (record.has_value) {
+      put_varint(raw, record.value);
+    }
+    state.ip = record.ip;
+    state.addr = record.addr;
+    ++records;
+  }
+
+  // Raw bytes buffered so far
+  size_t size() const { return raw.size(); }
+
+  // Appends the block of the records added so far to `out`, and starts a new
+  // one. Finishing an empty block writes the end of the trace.
+  void finish(std::string &out) {
+    lz_compress(raw, compressed);
+    const std::string &stored =
+        compressed.size() < raw.size() ? compressed : raw;
+    put_u32(out, static_cast<uint32_t>(raw.size()));
+    put_u32(out, static_cast<uint32_t>(stored.size()));
+    put_u32(out, records);
+    out += stored;
+    raw.clear();
+    threads.clear();
+    records = 0;
+  }
+
+private:
+  struct thread_state {
+    uint64_t ip = 0;
+    uint64_t addr = 0;
+  };
+  std::unordered_map<uint64_t, thread_state> threads;
+  std::string raw;
+  std::string compressed;
+  uint32_t records;
+};
+
+// Decodes the `count` records of a raw block. Returns false if it is corrupt.
+inline bool decode_trace_block(const std::string &raw, uint32_t count,
+                               std::vector<trace_record> &records) {
+  struct thread_state {
+    uint64_t ip = 0;
+    uint64_t addr = 0;
+  };
+  std::unordered_map<uint64_t, thread_state> threads;
+  const unsigned char *in = reinterpret_cast<const unsigned char *>(raw.data());
+  const unsigned char *end = in + raw.size();
+  records.clear();
+  records.reserve(count);
+  for (uint32_t i = 0; i < count; ++i) {
+    trace_record record;
+    uint64_t flags, ip_delta, addr_delta;
+    if (!get_varint(in, end, record.thread) || !get_varint(in, end, flags) ||
+        !get_varint(in, end, ip_delta) || !get_varint(in, end, addr_delta)) {
+      return false;
+    }
+    thread_state &state = threads[record.thread];
+    record.ip = state.ip += unzigzag(ip_delta);
+    record.addr = state.addr += unzigzag(addr_delta);
+    record.size = flags >> 2;
+    record.is_write = flags & 1;
+    record.has_value = flags & 2;
+    record.value = 0;
+    if (record.has_value && !get_varint(in, end, record.value)) {
+      return false;
+    }
+    records.push_back(record);
+  }
+  return in == end;
+}
+
+// Appends a block marking `dropped` records that were left out.
+inline void put_trace_drops(std::string &out, uint64_t dropped) {
+  std::string payload;
+  put_varint(payload, dropped);
+  put_u32(out, static_cast<uint32_t>(payload.size()));
+  put_u32(out, static_cast<uint32_t>(payload.size()));
+  put_u32(out, 0);
+  out += payload;
+}
+
+enum trace_block_status {
+  TRACE_BLOCK_OK,
+  TRACE_BLOCK_DROPS,     // records were dropped here
+  TRACE_BLOCK_END,       // the block that ends the trace
+  TRACE_BLOCK_TRUNCATED, // the stream ends within a block
+  TRACE_BLOCK_CORRUPT,
+};
+
+// What read_trace_block read besides records
+struct trace_block_info {
+  uint64_t bytes;   // including the header
+  uint64_t dropped; // for TRACE_BLOCK_DROPS
+};
+
+// Reads and decodes the next block of a trace whose magic has been read.
+// Only reads forward, so `in` may be a pipe.
+inline trace_block_status read_trace_block(std::istream &in,
+                                           std::vector<trace_record> &records,
+                                           trace_block_info &info) {
+  records.clear();
+  info.bytes = info.dropped = 0;
+  unsigned char header[TRACE_BLOCK_HEADER_SIZE];
+  in.read(reinterpret_cast<char *>(header), sizeof(header));
+  if (in.gcount() != static_cast<std::streamsize>(sizeof(header))) {
+    return TRACE_BLOCK_TRUNCATED;
+  }
+  uint32_t raw_size = get_u32(header);
+  uint32_t stored_size = get_u32(header + 4);
+  uint32_t count = get_u32(header + 8);
+  if (count == 0 && raw_size == 0 && stored_size == 0) {
+    info.bytes = sizeof(header);
+    return TRACE_BLOCK_END;
+  }
+  if (stored_size > raw_size) {
+    return TRACE_BLOCK_CORRUPT;
+  }
+
+  std::string stored(stored_size, '\0');
+  in.read(&stored[0], stored_size);
+  if (in.gcount() != static_cast<std::streamsize>(stored_size)) {
+    return TRACE_BLOCK_TRUNCATED;
+  }
+  info.bytes = sizeof(header) + stored_size;
+  if (count == 0) {
+    const unsigned char *payload =
+        reinterpret_cast<const unsigned char *>(stored.data());
+    return stored_size == raw_size &&
+                   get_varint(payload, payload + stored_size, info.dropped)
+               ? TRACE_BLOCK_DROPS
+               : TRACE_BLOCK_CORRUPT;
+  }
+  std::string raw;
+  if (stored_size == raw_size) {
+    raw.swap(stored);
+  } else if (!lz_decompress(
+                 reinterpret_cast<const unsigned char *>(stored.data()),
+                 stored_size, raw_size, raw)) {
+    return TRACE_BLOCK_CORRUPT;
+  }
+  return decode_trace_block(raw, count, records) ? TRACE_BLOCK_OK
+                                                 : TRACE_BLOCK_CORRUPT;
+}
+
+// Whether the trace starting at the current position of `in` is compressed.
+// Text traces start with a comment or an ip, never with the magic's first
+// byte, so this only peeks and works on pipes.
+inline bool is_compressed_trace(std::istream &in) {
+  return in.peek() == TRACE_MAGIC[0];
+}
+
+// Reads TRACE_MAGIC, returning false if the trace does not start with it.
+inline bool read_trace_magic(std::istream &in) {
+  char magic[sizeof(TRACE_MAGIC)];
+  in.read(magic, sizeof(magic));
+  return in.gcount() == static_cast<std::streamsize>(sizeof(magic)) &&
+         std::memcmp(magic, TRACE_MAGIC, sizeof(magic)) == 0;
+}
@@ -0,0 +1,336 @@
+// Runs the detectors over the corpus written by gencorpus and scores what
+// they report against its labels.
+//
+//   accuracy [-p [detector=]min precision]... [-r [detector=]min recall]...
+//            [-a associativity] detect mdreplay MapAddr corpus_dir
+//
+// For each case, detect and mdreplay (mdcache without Pin) read its
+// pinatrace.out, and MapAddr merges both of their outputs into
+// mapped_conflicts.out, all inside the case's directory. A report counts as
+// one pair of (global, offset) accesses, found by mapping the reported
+// addresses through fs_globals.txt; addresses outside every global are
+// reported as themselves. A labeled pair that was reported is a true
+// positive, an unlabeled one a false positive, and a labeled one that was
+// not reported a false negative.
+//
+// Precision and recall are printed for detect, mdcache, and the merged
+// mapped_conflicts.out. The exit code is 1 if any of them is below its
+// minimum: the one given for that detector (e.g. -p mdcache=0.9), or else
+// the one given without a detector name (default 0).
+//
+// -a is passed on to mdreplay, to score the cache model with another
+// associativity than its default.
+
+#include "../MapAddr/AccessInfo.h"
+#include "../MapAddr/GlobalIndex.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// (global, offset) of both accesses, with the lower one first
+using Pair = std::tuple<std::string, uint64_t, std::string, uint64_t>;
+
+Pair makePair(const std::string &name1, uint64_t offset1,
+              const std::string &name2, uint64_t offset2) {
+  if (std::tie(name2, offset2) < std::tie(name1, offset1)) {
+    return Pair(name2, offset2, name1, offset1);
+  }
+  return Pair(name1, offset1, name2, offset2);
+}
+
+std::string describe(const Pair &pair) {
+  std::ostringstream out;
+  out << std::get<0>(pair) << "+" << std::get<1>(pair) << " / "
+      << std::get<2>(pair) << "+" << std::get<3>(pair);
+  return out.str();
+}
+
+struct Score {
+  uint64_t truePositives = 0;
+  uint64_t falsePositives = 0;
+  uint64_t falseNegatives = 0;
+
+  double precision() const {
+    uint64_t reported = truePositives + falsePositives;
+    return reported ? double(truePositives) / reported : 1;
+  }
+  double recall() const {
+    uint64_t expected = truePositives + falseNegatives;
+    return expected ? double(truePositives) / expected : 1;
+  }
+};
+
+const char *const DETECTORS[] = {"detect", "mdcache", "mapped"};
+const size_t NUM_DETECTORS = 3;
+
+void usage(const char *argv0) {
+  std::cerr << "Usage: " << argv0
+            << " [-p [detector=]min precision]..."
+            << " [-r [detector=]min recall]... [-a associativity]"
+            << " [path to detect]"
+            << " [path to mdreplay] [path to MapAddr] [corpus directory]"
+            << std::endl;
+  exit(2);
+}
+
+std::ifstream open(const fs::path &path) {
+  std::ifstream in(path);
+  if (!in.is_open()) {
+    std::cerr << "Could not open " << path.string() << std::endl;
+    exit(2);
+  }
+  return in;
+}
+
+void run(const std::string &command) {
+  if (std::system(command.c_str()) != 0) {
+    std::cerr << "Failed: " << command << std::endl;
+    exit(2);
+  }
+}
+
+std::string quote(const fs::path &path) { return "'" + path.string() + "'"; }
+
+// Reads labels.txt into `labels`, returning the case's kind.
+std::string readLabels(const fs::path &path, std::set<Pair> &labels) {
+  auto in = open(path);
+  std::string kind = "?";
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.rfind("# kind:", 0) == 0) {
+      std::istringstream(line.substr(7)) >> kind;
+      continue;
+    }
+    std::istringstream iss(line);
+    std::string name1, name2;
+    uint64_t offset1, offset2;
+    if (line[0] != '#' && iss >> name1 >> offset1 >> name2 >> offset2) {
+      labels.insert(makePair(name1, offset1, name2, offset2));
+    }
+  }
+  return kind;
+}
+
+// Maps the address pairs of a *.interferences file to pairs of accesses.
+std::set<Pair> readInterferences(const fs::path &path,
+                                 const GlobalIndex &index) {
+  auto in = open(path);
+  interference_reader reader(in);
+  std::set<Pair> reported;
+  interference_record record;
+  while (reader.next(record)) {
+    std::string names[2];
+    uint64_t offsets[2];
+    uint64_t addrs[2] = {record.addr1, record.addr2};
+    for (int i = 0; i < 2; ++i) {
+      uint32_t id = index.resolve(addrs[i]);
+      if (id == GlobalIndex::npos) {
+        std::ostringstream name;
+        name << "0x" << std::hex << addrs[i];
+        names[i] = name.str();
+        offsets[i] = 0;
+      } else {
+        names[i] = index.name(id);
+        offsets[i] = addrs[i] - index.start(id);
+      }
+    }
+    reported.insert(makePair(names[0], offsets[0], names[1], offsets[1]));
+  }
+  return reported;
+}
+
+std::set<Pair> readMappedConflicts(const fs::path &path) {
+  auto in = open(path);
+  std::set<Pair> reported;
+  std::string line, name1, name2;
+  uint64_t offset1, size1, offset2, size2;
+  while (std::getline(in, line)) {
+    std::istringstream iss(line);
+    if (iss >> name1 >> offset1 >> size1 >> name2 >> offset2 >> size2) {
+      reported.insert(makePair(name1, offset1, name2, offset2));
+    }
+  }
+  return reported;
+}
+
+// Adds one case's results to `score`, and returns a summary for the table.
+std::string scoreCase(const std::set<Pair> &labels,
+                      const std::set<Pair> &reported, Score &score,
+                      std::vector<std::string> &problems,
+                      const char *detector) {
+  uint64_t found = 0, falseAlarms = 0;
+  for (auto &pair : reported) {
+    if (labels.count(pair)) {
+      ++found;
+    } else {
+      ++falseAlarms;
+      problems.push_back(std::string(detector) + " false positive " +
+                         describe(pair));
+    }
+  }
+  for (auto &pair : labels) {
+    if (!reported.count(pair)) {
+      problems.push_back(std::string(detector) + " missed " + describe(pair));
+    }
+  }
+  score.truePositives += found;
+  score.falsePositives += falseAlarms;
+  score.falseNegatives += labels.size() - found;
+
+  std::ostringstream summary;
+  summary << found << "/" << labels.size();
+  if (falseAlarms) {
+    summary << " +" << falseAlarms;
+  }
+  return summary.str();
+}
+
+// Sets minimums[d] from "detector=value", or every unset one from "value".
+void parseMinimum(const char *argv0, std::string arg, double *minimums,
+                  bool *named) {
+  size_t equals = arg.find('=');
+  std::string detector =
+      equals == std::string::npos ? "" : arg.substr(0, equals);
+  std::string text = arg.substr(equals == std::string::npos ? 0 : equals + 1);
+  char *end;
+  double value = std::strtod(text.c_str(), &end);
+  if (text.empty() || *end != '\0') {
+    usage(argv0);
+  }
+  bool matched = detector.empty();
+  for (size_t d = 0; d < NUM_DETECTORS; ++d) {
+    if (detector == DETECTORS[d]) {
+      minimums[d] = value;
+      named[d] = matched = true;
+    } else if (detector.empty() && !named[d]) {
+      minimums[d] = value;
+    }
+  }
+  if (!matched) {
+    usage(argv0);
+  }
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  double minPrecision[NUM_DETECTORS] = {}, minRecall[NUM_DETECTORS] = {};
+  bool namedPrecision[NUM_DETECTORS] = {}, namedRecall[NUM_DETECTORS] = {};
+  std::string mdreplayOptions;
+  int first = 1;
+  for (; first + 1 < argc && argv[first][0] == '-'; first += 2) {
+    if (std::strcmp(argv[first], "-p") == 0) {
+      parseMinimum(argv[0], argv[first + 1], minPrecision, namedPrecision);
+    } else if (std::strcmp(argv[first], "-r") == 0) {
+      parseMinimum(argv[0], argv[first + 1], minRecall, namedRecall);
+    } else if (std::strcmp(argv[first], "-a") == 0 &&
+               std::strspn(argv[first + 1], "0123456789") ==
+                   std::strlen(argv[first + 1])) {
+      mdreplayOptions += std::string(" -a ") + argv[first + 1];
+    } else {
+      usage(argv[0]);
+    }
+  }
+  if (argc - first != 4) {
+    usage(argv[0]);
+  }
+  fs::path detect = fs::absolute(argv[first]);
+  fs::path mdreplay = fs::absolute(argv[first + 1]);
+  fs::path mapAddr = fs::absolute(argv[first + 2]);
+  fs::path corpus = argv[first + 3];
+
+  std::vector<fs::path> cases;
+  for (auto &entry : fs::directory_iterator(corpus)) {
+    if (fs::exists(entry.path() / "labels.txt")) {
+      cases.push_back(entry.path());
+    }
+  }
+  std::sort(cases.begin(), cases.end());
+  if (cases.empty()) {
+    std::cerr << "No cases in " << corpus.string() << std::endl;
+    exit(2);
+  }
+
+  Score scores[NUM_DETECTORS];
+  std::vector<std::string> problems;
+  printf("%-20s %-6s %-10s %-10s %-10s\n", "case", "kind", DETECTORS[0],
+         DETECTORS[1], DETECTORS[2]);
+  for (auto &dir : cases) {
+    std::set<Pair> labels;
+    std::string kind = readLabels(dir / "labels.txt", labels);
+    fs::path log = dir / "tools.log";
+
+    // detect always writes next to the trace, for 64 byte lines here.
+    run(quote(detect) + " " + quote(dir / "pinatrace.out") + " 64 > " +
+        quote(log));
+    run(quote(mdreplay) + mdreplayOptions + " " +
+        quote(dir / "pinatrace.out") + " " +
+        quote(dir / "mdcache.out.cacheline64.interferences") + " >> " +
+        quote(log) + " 2>&1");
+    // MapAddr writes mapped_conflicts.out in the working directory.
+    run("cd " + quote(dir) + " && " + quote(mapAddr) +
+        " pinatrace.out.cacheline64.interferences"
+        " mdcache.out.cacheline64.interferences fs_globals.txt >> tools.log");
+
+    auto globalsFile = open(dir / "fs_globals.txt");
+    GlobalIndex index(read_global_vars(globalsFile));
+    std::set<Pair> reported[NUM_DETECTORS] = {
+        readInterferences(dir / "pinatrace.out.cacheline64.interferences",
+                          index),
+        readInterferences(dir / "mdcache.out.cacheline64.interferences",
+                          index),
+        readMappedConflicts(dir / "mapped_conflicts.out"),
+    };
+
+    std::string name = dir.filename().string();
+    printf("%-20s %-6s", name.c_str(), kind.c_str());
+    for (size_t d = 0; d < NUM_DETECTORS; ++d) {
+      std::vector<std::string> caseProblems;
+      std::string summary = scoreCase(labels, reported[d], scores[d],
+                                      caseProblems, DETECTORS[d]);
+      printf(" %-10s", summary.c_str());
+      for (auto &problem : caseProblems) {
+        problems.push_back(name + ": " + problem);
+      }
+    }
+    printf("\n");
+  }
+  printf("(found/labeled +false positives)\n\n");
+
+  for (auto &problem : problems) {
+    printf("%s\n", problem.c_str());
+  }
+  if (!problems.empty()) {
+    printf("\n");
+  }
+
+  printf("%-10s %6s %6s %6s %10s %10s\n", "detector", "tp", "fp", "fn",
+         "precision", "recall");
+  bool passed = true;
+  for (size_t d = 0; d < NUM_DETECTORS; ++d) {
+    auto &score = scores[d];
+    bool ok = score.precision() >= minPrecision[d] &&
+              score.recall() >= minRecall[d];
+    passed = passed && ok;
+    printf("%-10s %6lu %6lu %6lu %10.3f %10.3f%s\n", DETECTORS[d],
+           (unsigned long)score.truePositives,
+           (unsigned long)score.falsePositives,
+           (unsigned long)score.falseNegatives, score.precision(),
+           score.recall(), ok ? "" : "  BELOW MINIMUM");
+  }
+  return passed ? 0 : 1;
+}
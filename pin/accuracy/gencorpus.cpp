@@ -0,0 +1,279 @@
+// Writes the accuracy test corpus: synthetic traces with known sharing.
+//
+//   gencorpus [-n iterations] corpus_dir
+//
+// Each case gets a directory with
+//   pinatrace.out   the trace, in the format pinatrace.cpp writes
+//   fs_globals.txt  the globals the trace accesses, as the globals pass
+//                   writes them
+//   labels.txt      "# kind: <false|true|none>", then one line
+//                   "name1 offset1 name2 offset2" per pair of accesses that
+//                   falsely share a cache line
+//
+// Threads take turns running their accesses once per iteration, as if each
+// ran on its own core. Cases follow the programs in bench/ where there is
+// one, plus true sharing and no sharing that must not be reported.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+namespace {
+
+// Cache line aligned, so offsets below decide which line a global is on.
+const uint64_t BASE_ADDR = 0x7f5a3c200000;
+const uint64_t BASE_PC = 0x401000;
+// Below every global, like a thread's stack.
+const uint64_t STACK_ADDR = 0x7ffd2e000000;
+
+struct Global {
+  const char *name;
+  uint64_t offset; // from BASE_ADDR
+  uint64_t size;
+};
+
+struct Access {
+  unsigned thread;
+  char rw;           // 'R' or 'W'
+  const char *name;  // global, or nullptr for thread's stack
+  uint64_t offset;   // within the global or stack
+  uint64_t size;
+};
+
+struct Label {
+  const char *name1;
+  uint64_t offset1;
+  const char *name2;
+  uint64_t offset2;
+};
+
+struct Case {
+  const char *name;
+  const char *kind; // false, true, or none
+  std::vector<Global> globals;
+  std::vector<Access> accesses;
+  std::vector<Label> labels;
+};
+
+const std::vector<Case> cases = {
+    // bench/sharedGlobals.cpp
+    {"shared-globals",
+     "false",
+     {{"a", 0, 4}, {"b", 4, 4}},
+     {{0, 'W', "a", 0, 4}, {1, 'W', "b", 0, 4}},
+     {{"a", 0, "b", 0}}},
+    // bench/sharedStruct.cpp
+    {"shared-struct",
+     "false",
+     {{"s", 0, 8}},
+     {{0, 'W', "s", 0, 4}, {1, 'W', "s", 4, 4}},
+     {{"s", 0, "s", 4}}},
+    // bench/sharedArray.cpp
+    {"shared-array",
+     "false",
+     {{"arr", 0, 16}},
+     {{0, 'W', "arr", 0, 4},
+      {1, 'W', "arr", 4, 4},
+      {2, 'W', "arr", 8, 4},
+      {3, 'W', "arr", 12, 4}},
+     {{"arr", 0, "arr", 4},
+      {"arr", 0, "arr", 8},
+      {"arr", 0, "arr", 12},
+      {"arr", 4, "arr", 8},
+      {"arr", 4, "arr", 12},
+      {"arr", 8, "arr", 12}}},
+    // bench/transitive.cpp
+    {"transitive",
+     "false",
+     {{"thread_data1", 0, 4}, {"thread_data2", 4, 4}, {"thread_data3", 8, 4}},
+     {{0, 'W', "thread_data1", 0, 4},
+      {1, 'W', "thread_data2", 0, 4},
+      {2, 'W', "thread_data3", 0, 4}},
+     {{"thread_data1", 0, "thread_data2", 0},
+      {"thread_data1", 0, "thread_data3", 0},
+      {"thread_data2", 0, "thread_data3", 0}}},
+    // bench/non-transitive.cpp: thread_data4 starts a new line
+    {"non-transitive",
+     "false",
+     {{"thread_data1", 0, 4},
+      {"thread_data2", 4, 4},
+      {"thread_data3", 8, 4},
+      {"thread_data4", 64, 4},
+      {"thread_data5", 68, 4}},
+     {{0, 'W', "thread_data1", 0, 4},
+      {1, 'W', "thread_data2", 0, 4},
+      {1, 'W', "thread_data4", 0, 4},
+      {2, 'W', "thread_data5", 0, 4}},
+     {{"thread_data1", 0, "thread_data2", 0},
+      {"thread_data4", 0, "thread_data5", 0}}},
+    // One writer is enough to make the line bounce.
+    {"write-read",
+     "false",
+     {{"a", 0, 8}, {"b", 8, 8}},
+     {{0, 'W', "a", 0, 8}, {1, 'R', "b", 0, 8}},
+     {{"a", 0, "b", 0}}},
+    {"mixed-sizes",
+     "false",
+     {{"flag", 0, 1}, {"total", 8, 8}},
+     {{0, 'W', "flag", 0, 1}, {1, 'W', "total", 0, 8}},
+     {{"flag", 0, "total", 0}}},
+    // A shared counter next to per-thread data: the counter itself is true
+    // sharing, but it also shares its line with the other thread's data.
+    {"counter-and-data",
+     "false",
+     {{"counter", 0, 4}, {"x", 4, 4}, {"y", 8, 4}},
+     {{0, 'W', "counter", 0, 4},
+      {0, 'W', "x", 0, 4},
+      {1, 'W', "counter", 0, 4},
+      {1, 'W', "y", 0, 4}},
+     {{"counter", 0, "x", 0},
+      {"counter", 0, "y", 0},
+      {"x", 0, "y", 0}}},
+    {"shared-counter",
+     "true",
+     {{"counter", 0, 4}},
+     {{0, 'W', "counter", 0, 4}, {1, 'W', "counter", 0, 4}},
+     {}},
+    // Copies of a whole struct, e.g. with memcpy. Threads touching different
+    // fields of it would be false sharing.
+    {"shared-struct-copy",
+     "true",
+     {{"s", 0, 16}},
+     {{0, 'W', "s", 0, 16}, {1, 'W', "s", 0, 16}},
+     {}},
+    // Accesses that overlap without starting at the same byte
+    {"overlapping",
+     "true",
+     {{"v", 0, 8}},
+     {{0, 'W', "v", 0, 8}, {1, 'W', "v", 4, 4}},
+     {}},
+    {"read-only",
+     "none",
+     {{"a", 0, 4}, {"b", 4, 4}},
+     {{0, 'R', "a", 0, 4}, {1, 'R', "b", 0, 4}},
+     {}},
+    {"padded",
+     "none",
+     {{"a", 0, 4}, {"b", 64, 4}},
+     {{0, 'W', "a", 0, 4}, {1, 'W', "b", 0, 4}},
+     {}},
+    {"single-thread",
+     "none",
+     {{"a", 0, 4}, {"b", 4, 4}},
+     {{0, 'W', "a", 0, 4}, {0, 'W', "b", 0, 4}},
+     {}},
+    // Lines that map to the same cache set only evict each other.
+    {"same-set",
+     "none",
+     {{"a", 0, 4}, {"b", 8192, 4}, {"c", 16384, 4}},
+     {{0, 'W', "a", 0, 4}, {1, 'W', "b", 0, 4}, {1, 'W', "c", 0, 4}},
+     {}},
+    // Each thread's own stack, which the globals do not cover
+    {"private-stacks",
+     "none",
+     {{"a", 0, 4}},
+     {{0, 'W', nullptr, 0, 8},
+      {0, 'R', "a", 0, 4},
+      {1, 'W', nullptr, 0, 8},
+      {1, 'R', "a", 0, 4}},
+     {}},
+};
+
+void usage(const char *argv0) {
+  std::cerr << "Usage: " << argv0 << " [-n iterations] corpus_dir"
+            << std::endl;
+  exit(1);
+}
+
+std::ofstream open(const std::string &path) {
+  std::ofstream out(path);
+  if (!out.is_open()) {
+    std::cerr << "Could not open output file: " << path << std::endl;
+    exit(1);
+  }
+  return out;
+}
+
+uint64_t address(const Case &c, const Access &access) {
+  if (!access.name) {
+    return STACK_ADDR + access.thread * 0x100000 + access.offset;
+  }
+  for (auto &global : c.globals) {
+    if (std::strcmp(global.name, access.name) == 0) {
+      return BASE_ADDR + global.offset + access.offset;
+    }
+  }
+  std::cerr << c.name << " accesses unknown global " << access.name
+            << std::endl;
+  exit(1);
+}
+
+void writeCase(const std::string &dir, const Case &c, unsigned iterations) {
+  mkdir(dir.c_str(), 0755);
+
+  auto globals = open(dir + "/fs_globals.txt");
+  for (auto &global : c.globals) {
+    globals << global.name << "\t0x" << std::hex << BASE_ADDR + global.offset
+            << std::dec << "\t" << global.size << "\n";
+  }
+
+  auto labels = open(dir + "/labels.txt");
+  labels << "# kind: " << c.kind << "\n";
+  for (auto &label : c.labels) {
+    labels << label.name1 << " " << label.offset1 << " " << label.name2 << " "
+           << label.offset2 << "\n";
+  }
+
+  auto trace = open(dir + "/pinatrace.out");
+  trace << "#\n# Memory Access Trace Generated By Pin\n#\n" << std::hex;
+  unsigned threads = 0;
+  for (auto &access : c.accesses) {
+    threads = std::max(threads, access.thread + 1);
+  }
+  uint64_t value = 0;
+  for (unsigned i = 0; i < iterations; ++i) {
+    for (unsigned thread = 0; thread < threads; ++thread) {
+      for (size_t a = 0; a < c.accesses.size(); ++a) {
+        auto &access = c.accesses[a];
+        if (access.thread != thread) {
+          continue;
+        }
+        trace << "0x" << BASE_PC + 4 * a << ": " << access.rw << " 0x"
+              << address(c, access) << " " << std::dec << access.size << " "
+              << thread << " " << std::hex << "0x" << value++ << "\n";
+      }
+    }
+  }
+  trace << "#eof\n";
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  unsigned iterations = 100;
+  int first = 1;
+  if (argc == 4 && std::strcmp(argv[1], "-n") == 0) {
+    char *end;
+    iterations = std::strtoul(argv[2], &end, 10);
+    if (*end != '\0' || iterations == 0) {
+      usage(argv[0]);
+    }
+    first = 3;
+  }
+  if (argc - first != 1) {
+    usage(argv[0]);
+  }
+
+  std::string corpus(argv[first]);
+  mkdir(corpus.c_str(), 0755);
+  for (auto &c : cases) {
+    writeCase(corpus + "/" + c.name, c, iterations);
+  }
+  std::cout << "Wrote " << cases.size() << " cases to " << corpus << std::endl;
+}
@@ -0,0 +1,192 @@
+// Replays a pinatrace.out file through the mdcache cache model, without Pin,
+// and writes the interferences mdcache would have found.
+//
+//   mdreplay [-c cache KB] [-b line size] [-a associativity]
+//            [-p rr|lru|plru] [-k interferences per cache]
+//            trace output [sites output]
+//
+// Each thread gets its own L1 data cache, set up and accessed as in
+// mdcache.cpp, so the outputs have the same format as
+// mdcache.out.cacheline64.interferences and mdcache.out.cacheline64.sites.
+
+#include "pin.H"
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+
+#include "../mdcache.H"
+#include "../mutex.PH"
+
+namespace DL1 {
+const UINT32 max_sets = KILO;
+const CACHE_ALLOC::STORE_ALLOCATION allocation = CACHE_ALLOC::STORE_ALLOCATE;
+
+typedef CACHE_BASE CACHE;
+} // namespace DL1
+
+namespace {
+
+struct Options {
+  UINT32 cacheSize = 32; // in kilobytes
+  UINT32 lineSize = 64;
+  UINT32 associativity = 4;
+  REPLACEMENT replacement = REPLACEMENT_TREE_PLRU;
+  UINT32 topK = 0; // interferences kept per cache; 0 for all
+};
+
+std::map<UINT32, DL1::CACHE *> caches;
+mutex invalidation_mutex;
+
+DL1::CACHE *cacheFor(UINT32 thread, const Options &options) {
+  auto found = caches.find(thread);
+  if (found != caches.end()) {
+    return found->second;
+  }
+  DL1::CACHE *cache = NewCache<DL1::max_sets, DL1::allocation>(
+      options.replacement, "L1 Data Cache for Core " + std::to_string(thread),
+      options.cacheSize * KILO, options.lineSize, options.associativity,
+      invalidation_mutex, options.topK);
+  if (!cache) {
+    std::cerr << "Unsupported associativity for this replacement policy: "
+              << options.associativity << std::endl;
+    exit(1);
+  }
+  for (auto &other : caches) {
+    other.second->RegisterPeer(cache);
+    cache->RegisterPeer(other.second);
+  }
+  caches[thread] = cache;
+  return cache;
+}
+
+void usage(const char *argv0) {
+  std::cerr << "Usage: " << argv0
+            << " [-c cache size in KB] [-b cache line size] [-a associativity]"
+            << " [-p rr|lru|plru] [-k interferences kept per cache]"
+            << " [path to pinatrace.out file] [output file]"
+            << " [sites output file]" << std::endl;
+  exit(1);
+}
+
+UINT32 number(const char *argv0, const char *text) {
+  char *end;
+  unsigned long value = std::strtoul(text, &end, 10);
+  if (*text == '\0' || *end != '\0' || value == 0 || value > UINT32_MAX) {
+    usage(argv0);
+  }
+  return value;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  Options options;
+  int first = 1;
+  for (; first + 1 < argc && argv[first][0] == '-'; first += 2) {
+    if (std::strcmp(argv[first], "-p") == 0) {
+      if (!ParseReplacement(argv[first + 1], options.replacement)) {
+        usage(argv[0]);
+      }
+      continue;
+    }
+    UINT32 value = number(argv[0], argv[first + 1]);
+    if (std::strcmp(argv[first], "-c") == 0) {
+      options.cacheSize = value;
+    } else if (std::strcmp(argv[first], "-b") == 0) {
+      options.lineSize = value;
+    } else if (std::strcmp(argv[first], "-a") == 0) {
+      options.associativity = value;
+    } else if (std::strcmp(argv[first], "-k") == 0) {
+      options.topK = value;
+    } else {
+      usage(argv[0]);
+    }
+  }
+  if (argc - first != 2 && argc - first != 3) {
+    usage(argv[0]);
+  }
+
+  std::ifstream trace(argv[first]);
+  if (!trace.is_open()) {
+    std::cerr << "Could not open trace file: " << argv[first] << std::endl;
+    exit(1);
+  }
+  std::ofstream out(argv[first + 1]);
+  if (!out.is_open()) {
+    std::cerr << "Could not open output file: " << argv[first + 1]
+              << std::endl;
+    exit(1);
+  }
+  std::ofstream sitesOut;
+  if (argc - first == 3) {
+    sitesOut.open(argv[first + 2]);
+    if (!sitesOut.is_open()) {
+      std::cerr << "Could not open output file: " << argv[first + 2]
+                << std::endl;
+      exit(1);
+    }
+  }
+
+  // Same columns as detect reads: pc, rw, addr, size, thread id, value
+  std::string line, pc, rw, addr, size, tid;
+  uint64_t linenum = 0;
+  while (std::getline(trace, line)) {
+    ++linenum;
+    std::istringstream iss(line);
+    if (!(iss >> pc) || pc[0] == '#') {
+      continue;
+    }
+    if (!(iss >> rw >> addr >> size >> tid) || (rw != "R" && rw != "W")) {
+      std::cerr << "Line #" << linenum << " formatted incorrectly" << std::endl;
+      continue;
+    }
+    ADDRINT ip = std::stoull(pc, nullptr, 16);
+    ADDRINT ea = std::stoull(addr, nullptr, 16);
+    UINT32 bytes = std::stoul(size);
+    DL1::CACHE *cache = cacheFor(std::stoul(tid), options);
+    auto type = rw == "W" ? CACHE_BASE::ACCESS_TYPE_STORE
+                          : CACHE_BASE::ACCESS_TYPE_LOAD;
+    // mdcache.cpp treats accesses of up to 4 bytes as within one line.
+    if (bytes <= 4) {
+      cache->AccessSingleLine(ea, bytes, type, ip);
+    } else {
+      cache->Access(ea, bytes, type, ip);
+    }
+  }
+
+  INTERFERENCE_MAP counts;
+  SITE_MAP sites;
+  for (auto &pair : caches) {
+    AddAllMappings(pair.second->InterferenceCounts(), counts);
+    AddAllSites(pair.second->SiteCounts(), sites);
+    if (options.topK > 0) {
+      std::cout << "Cache " << pair.first << ": evicted "
+                << pair.second->InterferencesEvicted()
+                << " interferences; counts may be short by up to "
+                << pair.second->InterferenceErrorBound() << std::endl;
+    }
+  }
+  out << "# sorted by addr1, addr2\n";
+  for (auto &count : counts) {
+    out << std::hex << count.first.first << "\t" << count.first.second << "\t"
+        << std::dec << count.second.count << "\t" << count.second.lowerSize
+        << "\t" << count.second.upperSize << "\t" << count.second.writeWrite
+        << "\t" << count.second.writeRead << "\t" << count.second.readWrite
+        << "\t" << count.second.transfers << "\n";
+  }
+
+  if (sitesOut.is_open()) {
+    sitesOut << "# addr1, addr2, ip1, ip2, count\n";
+    for (auto &site : sites) {
+      sitesOut << std::hex << site.first.first.first << "\t"
+               << site.first.first.second << "\t" << site.first.second.first
+               << "\t" << site.first.second.second << "\t" << std::dec
+               << site.second << "\n";
+    }
+  }
+}
@@ -0,0 +1,70 @@
+#include "CompressedTraceReader.h"
+
+#include <stdexcept>
+
+// Decoded blocks waiting to be processed. Each holds about TRACE_BLOCK_SIZE
+// bytes of encoded records.
+constexpr size_t MAX_READY_BLOCKS = 4;
+
+CompressedTraceReader::CompressedTraceReader(std::istream &in_in,
+                                             uint64_t offset)
+    : in(in_in) {
+  reader = std::thread(&CompressedTraceReader::readBlocks, this, offset);
+}
+
+CompressedTraceReader::~CompressedTraceReader() {
+  {
+    std::lock_guard<std::mutex> lock(mu);
+    stopping = true;
+  }
+  changed.notify_all();
+  reader.join();
+}
+
+void CompressedTraceReader::readBlocks(uint64_t offset) {
+  while (true) {
+    block next;
+    trace_block_info info;
+    trace_block_status status = read_trace_block(in, next.records, info);
+    next.end_offset = offset + info.bytes;
+    next.dropped = info.dropped;
+
+    std::unique_lock<std::mutex> lock(mu);
+    if (status != TRACE_BLOCK_OK && status != TRACE_BLOCK_DROPS) {
+      truncated_block = status == TRACE_BLOCK_TRUNCATED;
+      if (status == TRACE_BLOCK_CORRUPT) {
+        error = "Corrupt trace block at offset " + std::to_string(offset);
+      }
+      done = true;
+      changed.notify_all();
+      return;
+    }
+    changed.wait(lock, [this] {
+      return stopping || ready.size() < MAX_READY_BLOCKS;
+    });
+    if (stopping) {
+      return;
+    }
+    offset = next.end_offset;
+    ready.push_back(std::move(next));
+    changed.notify_all();
+  }
+}
+
+bool CompressedTraceReader::next(std::vector<trace_record> &records,
+                                 uint64_t &end_offset) {
+  std::unique_lock<std::mutex> lock(mu);
+  changed.wait(lock, [this] { return done || !ready.empty(); });
+  if (ready.empty()) {
+    if (!error.empty()) {
+      throw std::runtime_error(error);
+    }
+    return false;
+  }
+  records.swap(ready.front().records);
+  end_offset = ready.front().end_offset;
+  dropped_records += ready.front().dropped;
+  ready.pop_front();
+  changed.notify_all();
+  return true;
+}
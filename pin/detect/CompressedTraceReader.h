@@ -0,0 +1,55 @@
+#pragma once
+
+#include "../TraceCodec.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <istream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Reads a compressed trace (see TraceCodec.h) on a separate thread, which
+// reads and decompresses blocks ahead while the caller processes the records
+// of earlier ones. Only reads forward, so the trace may be a pipe.
+class CompressedTraceReader {
+public:
+  // Starts reading blocks from `in`, whose magic has been read, at `offset`
+  // bytes into the trace. `in` must not be used until the reader is gone.
+  CompressedTraceReader(std::istream &in_in, uint64_t offset);
+  ~CompressedTraceReader();
+
+  // Takes the records of the next block, and the offset just past it.
+  // Returns false at the end of the trace. Throws std::runtime_error if the
+  // trace is corrupt.
+  bool next(std::vector<trace_record> &records, uint64_t &end_offset);
+
+  // Whether the trace ended within a block, e.g. because it is still being
+  // written or its writer crashed. Only meaningful once next returns false.
+  bool truncated() const { return truncated_block; }
+
+  // Records the trace marked as dropped, in the blocks returned so far
+  uint64_t dropped() const { return dropped_records; }
+
+private:
+  void readBlocks(uint64_t offset);
+
+  struct block {
+    std::vector<trace_record> records;
+    uint64_t end_offset;
+    uint64_t dropped;
+  };
+
+  std::istream &in;
+  std::mutex mu;
+  std::condition_variable changed;
+  std::deque<block> ready;
+  bool done = false;
+  bool stopping = false;
+  bool truncated_block = false;
+  uint64_t dropped_records = 0;
+  std::string error;
+  std::thread reader;
+};
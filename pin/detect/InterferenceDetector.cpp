@@ -1,7 +1,10 @@
 #include "InterferenceDetector.h"
 
+#include <algorithm>
 #include <iostream>
 #include <cassert>
+#include <stdexcept>
+#include <tuple>
 
 constexpr int HEX_BASE = 16;
 
@@ -34,20 +37,27 @@ InterferenceDetector::InterferenceDetector(uint64_t cacheline_size_in)
 void InterferenceDetector::recordAccess(const std::string &rw,
                                         const std::string &destAddr,
                                         const std::string &accessSize,
-                                        const std::string &threadId) {
-  bool isWrite = string_to_rw(rw);
-  uint64_t destAddrNum = string_to_uint64(destAddr, HEX_BASE);
-  uint64_t accessSizeNum = string_to_uint64(accessSize);
-  uint64_t threadIdNum = string_to_uint64(threadId);
+                                        const std::string &threadId,
+                                        const std::string &ip) {
+  recordAccess(string_to_rw(rw), string_to_uint64(destAddr, HEX_BASE),
+               string_to_uint64(accessSize), string_to_uint64(threadId),
+               string_to_uint64(ip, HEX_BASE));
+}
 
+void InterferenceDetector::recordAccess(bool isWrite, uint64_t destAddrNum,
+                                        uint64_t accessSizeNum,
+                                        uint64_t threadIdNum, uint64_t ip) {
+  recordPageAccess(isWrite, destAddrNum, accessSizeNum, threadIdNum);
   uint64_t cacheline_index = destAddrNum / cacheline_size;
   CacheLine &cacheline = cachelines[cacheline_index];
   cacheline.accesses[threadIdNum];
+  countTransfers(cacheline, isWrite, destAddrNum, accessSizeNum, threadIdNum);
   for (auto &threadAccesses : cacheline.accesses) {
     if (threadAccesses.first == threadIdNum) {
       auto access_it = threadAccesses.second.emplace(
-          destAddrNum, CacheLine::Access{isWrite, accessSizeNum});
+          destAddrNum, CacheLine::Access{isWrite, accessSizeNum, ip});
       if (!access_it.second) {
+        access_it.first->second.ip = ip;
         // Mark as write if it wasn't before. TODO: Might react to this.
         access_it.first->second.isWrite =
             (access_it.first->second.isWrite) || isWrite;
@@ -76,17 +86,480 @@ void InterferenceDetector::recordAccess(const std::string &rw,
         continue; // don't mark as interference is both accesses are reads
       }
       // assert(access.first != destAddrNum);
-      conflicting_addr interference{access.first, destAddrNum};
-      interferences[interference]++;
+      // Pairs are stored as (lower, upper) so both orders count together.
+      bool otherIsLower = access.first < destAddrNum;
+      conflicting_addr interference =
+          otherIsLower ? conflicting_addr{access.first, destAddrNum}
+                       : conflicting_addr{destAddrNum, access.first};
+      Interference &info = interferences.add(interference);
+      info.count++;
+      if (!isWrite) {
+        info.writeRead++;
+      } else if (access.second.isWrite) {
+        info.writeWrite++;
+      } else {
+        info.readWrite++;
+      }
+      info.size1 = std::max(info.size1, otherIsLower
+                                            ? access.second.accessSize
+                                            : accessSizeNum);
+      info.size2 = std::max(info.size2, otherIsLower
+                                            ? accessSizeNum
+                                            : access.second.accessSize);
+      if (interference_record *slice = sliceCounts(interference)) {
+        slice->count++;
+        if (!isWrite) {
+          slice->wr++;
+        } else if (access.second.isWrite) {
+          slice->ww++;
+        } else {
+          slice->rw++;
+        }
+        slice->size1 = info.size1;
+        slice->size2 = info.size2;
+      }
+      if (ip == 0 || access.second.ip == 0) {
+        continue;
+      }
+      uint64_t ip1 = otherIsLower ? access.second.ip : ip;
+      uint64_t ip2 = otherIsLower ? ip : access.second.ip;
+      auto site = std::find_if(info.sites.begin(), info.sites.end(),
+                               [&](const Site &site) {
+                                 return site.ip1 == ip1 && site.ip2 == ip2;
+                               });
+      if (site == info.sites.end()) {
+        info.sites.push_back({ip1, ip2, 1});
+      } else {
+        site->count++;
+      }
+    }
+  }
+}
+
+static bool overlaps(uint64_t addr1, uint64_t size1, uint64_t addr2,
+                     uint64_t size2) {
+  return addr1 < addr2 + size2 && addr2 < addr1 + size1;
+}
+
+// A write takes the line from every other holder; a read only moves it when
+// another thread holds it modified. Transfers between overlapping accesses
+// are true sharing, and ones between two reads (of a line modified at some
+// other address) are not attributed to any interference.
+void InterferenceDetector::countTransfers(CacheLine &cacheline, bool isWrite,
+                                          uint64_t destAddr,
+                                          uint64_t accessSize,
+                                          uint64_t threadId) {
+  auto &holders = cacheline.holders;
+  bool holding =
+      std::find(holders.begin(), holders.end(), threadId) != holders.end();
+  std::vector<uint64_t> previous;
+  if (isWrite) {
+    for (uint64_t holder : holders) {
+      if (holder != threadId) {
+        previous.push_back(holder);
+      }
+    }
+    holders.assign(1, threadId);
+    cacheline.modified = true;
+  } else if (!holding) {
+    if (cacheline.modified) {
+      previous = holders;
+    }
+    holders.push_back(threadId);
+    cacheline.modified = false;
+  }
+
+  for (uint64_t holder : previous) {
+    uint64_t otherAddr = cacheline.lastAddr[holder];
+    const auto &other = cacheline.accesses[holder][otherAddr];
+    if (overlaps(destAddr, accessSize, otherAddr, other.accessSize) ||
+        (!isWrite && !other.isWrite)) {
+      continue;
+    }
+    bool otherIsLower = otherAddr < destAddr;
+    conflicting_addr interference =
+        otherIsLower ? conflicting_addr{otherAddr, destAddr}
+                     : conflicting_addr{destAddr, otherAddr};
+    // The pair may not have been counted yet, if an access upgraded to a
+    // write after its first touch.
+    Interference &info = interferences.add(interference);
+    info.transfers++;
+    info.size1 =
+        std::max(info.size1, otherIsLower ? other.accessSize : accessSize);
+    info.size2 =
+        std::max(info.size2, otherIsLower ? accessSize : other.accessSize);
+    if (interference_record *slice = sliceCounts(interference)) {
+      slice->transfers++;
+      slice->size1 = info.size1;
+      slice->size2 = info.size2;
     }
   }
+  cacheline.lastAddr[threadId] = destAddr;
+}
+
+static void sort_by_pair(std::vector<interference_record> &records) {
+  std::sort(records.begin(), records.end(), [](auto &left, auto &right) {
+    return std::tie(left.addr1, left.addr2) < std::tie(right.addr1, right.addr2);
+  });
+}
+
+interference_record *
+InterferenceDetector::sliceCounts(const conflicting_addr &interference) {
+  if (!track_slices) {
+    return nullptr;
+  }
+  interference_record &slice = slice_counts[interference];
+  slice.addr1 = interference.addr1;
+  slice.addr2 = interference.addr2;
+  return &slice;
+}
+
+std::vector<interference_record>
+InterferenceDetector::takeSliceInterferences() {
+  std::vector<interference_record> sorted;
+  sorted.reserve(slice_counts.size());
+  for (const auto &interference : slice_counts) {
+    sorted.push_back(interference.second);
+  }
+  slice_counts.clear();
+  sort_by_pair(sorted);
+  return sorted;
+}
+
+std::vector<interference_record>
+InterferenceDetector::sortedInterferences() const {
+  std::vector<interference_record> sorted;
+  sorted.reserve(interferences.size());
+  for (const auto &interference : interferences.entries()) {
+    const Interference &info = interference.value;
+    sorted.push_back({interference.key.addr1, interference.key.addr2,
+                      info.count, info.size1, info.size2, info.writeWrite,
+                      info.writeRead, info.readWrite, info.transfers});
+  }
+  sort_by_pair(sorted);
+  return sorted;
 }
 
+// Interferences are written sorted by address pair, so MapAddr can merge
+// several files in one streaming pass.
 void InterferenceDetector::outputInterferences(std::ostream &out) {
   std::cout << "Number of interferences: " << interferences.size() << std::endl;
-  for (const auto &interference : interferences) {
-    out << std::hex << interference.first.addr1 
-        << "\t" << interference.first.addr2 
-        << "\t" << std::dec << interference.second << std::endl;
+  if (interferences.evictions() > 0) {
+    std::cout << "Kept the top " << interferences.capacity() << " after "
+              << interferences.evictions() << " evictions; counts may be short "
+              << "by up to " << interferences.minWeight()
+              << " touches and transfers, and none left out had more"
+              << std::endl;
+  }
+  out << SORTED_INTERFERENCES_HEADER << '\n';
+  for (const auto &interference : sortedInterferences()) {
+    write_interference(out, interference);
+  }
+}
+
+std::vector<site_record> InterferenceDetector::sortedSites() const {
+  std::vector<site_record> sorted;
+  for (const auto &interference : interferences.entries()) {
+    for (const auto &site : interference.value.sites) {
+      sorted.push_back({interference.key.addr1, interference.key.addr2,
+                        site.ip1, site.ip2, site.count});
+    }
+  }
+  std::sort(sorted.begin(), sorted.end(), [](auto &left, auto &right) {
+    return std::tie(left.addr1, left.addr2, left.ip1, left.ip2) <
+           std::tie(right.addr1, right.addr2, right.ip1, right.ip2);
+  });
+  return sorted;
+}
+
+void InterferenceDetector::outputSites(std::ostream &out) {
+  out << "# addr1, addr2, ip1, ip2, count\n";
+  for (const auto &site : sortedSites()) {
+    write_site(out, site);
+  }
+}
+
+void InterferenceDetector::trackPages(uint64_t page_size) {
+  if (page_size == 0 || (page_size & (page_size - 1)) != 0) {
+    throw std::runtime_error("Page size must be a power of two: " +
+                             std::to_string(page_size));
+  }
+  if (std::find(page_sizes.begin(), page_sizes.end(), page_size) ==
+      page_sizes.end()) {
+    page_sizes.push_back(page_size);
+    pages.emplace_back();
+  }
+}
+
+void InterferenceDetector::recordPageAccess(bool isWrite, uint64_t destAddr,
+                                            uint64_t accessSize,
+                                            uint64_t threadId) {
+  uint64_t last = destAddr + (accessSize > 0 ? accessSize - 1 : 0);
+  for (size_t i = 0; i < page_sizes.size(); ++i) {
+    for (uint64_t index = destAddr / page_sizes[i];
+         index <= last / page_sizes[i]; ++index) {
+      auto page_it = pages[i].try_emplace(index, Page{threadId, {}});
+      Page::Counts &counts = page_it.first->second.threads[threadId];
+      (isWrite ? counts.writes : counts.reads)++;
+    }
+  }
+}
+
+std::vector<page_record> InterferenceDetector::sortedPages(uint64_t page_size,
+                                                           uint64_t nodes) const {
+  auto size_it = std::find(page_sizes.begin(), page_sizes.end(), page_size);
+  if (size_it == page_sizes.end()) {
+    return {};
+  }
+  auto node_of = [nodes](uint64_t thread) {
+    return nodes == 0 ? thread : thread % nodes;
+  };
+  std::vector<page_record> sorted;
+  for (const auto &page : pages[size_it - page_sizes.begin()]) {
+    const Page &info = page.second;
+    page_record record{page.first * page_size, info.threads.size(),
+                       info.firstThread, node_of(info.firstThread), 0, 0, 0,
+                       0, {}};
+    std::map<uint64_t, uint64_t> nodeWrites;
+    bool shared = false;
+    for (const auto &thread : info.threads) {
+      uint64_t node = node_of(thread.first);
+      record.reads += thread.second.reads;
+      record.writes += thread.second.writes;
+      if (node != record.homeNode) {
+        shared = true;
+        record.remoteReads += thread.second.reads;
+        record.remoteWrites += thread.second.writes;
+      }
+      if (thread.second.writes > 0) {
+        nodeWrites[node] += thread.second.writes;
+      }
+    }
+    // Pages only read everywhere can be replicated, so they are left out.
+    if (shared && record.writes > 0) {
+      record.nodeWrites.assign(nodeWrites.begin(), nodeWrites.end());
+      sorted.push_back(std::move(record));
+    }
+  }
+  std::sort(sorted.begin(), sorted.end(), [](auto &left, auto &right) {
+    return std::tie(right.remoteWrites, right.writes, left.page) <
+           std::tie(left.remoteWrites, left.writes, right.page);
+  });
+  return sorted;
+}
+
+void InterferenceDetector::outputPages(std::ostream &out, uint64_t page_size,
+                                       uint64_t nodes) {
+  auto sorted = sortedPages(page_size, nodes);
+  uint64_t remoteWrites = 0;
+  for (const auto &page : sorted) {
+    remoteWrites += page.remoteWrites;
+  }
+  std::cout << "Number of pages of " << page_size << " bytes shared across nodes: "
+            << sorted.size() << ", with " << remoteWrites << " remote writes"
+            << std::endl;
+  out << "# page, threads, first thread, home node, reads, writes, "
+         "remote reads, remote writes, node:writes...; sorted by remote writes\n";
+  for (const auto &page : sorted) {
+    out << std::hex << page.page << std::dec << '\t' << page.threads << '\t'
+        << page.firstThread << '\t' << page.homeNode << '\t' << page.reads
+        << '\t' << page.writes << '\t' << page.remoteReads << '\t'
+        << page.remoteWrites << '\t';
+    for (size_t i = 0; i < page.nodeWrites.size(); ++i) {
+      out << (i > 0 ? "," : "") << page.nodeWrites[i].first << ':'
+          << page.nodeWrites[i].second;
+    }
+    out << '\n';
+  }
+}
+
+// Checkpoints start with this and a version, then hold LEB128 varints.
+// Version 2 added the page counts, and version 3 the Space-Saving state of
+// the interferences.
+static const char CHECKPOINT_MAGIC[8] = {'F', 'S', 'D', 'E', 'T', 'C', 'K', '\0'};
+constexpr uint64_t CHECKPOINT_VERSION = 3;
+
+static void write_varint(std::ostream &out, uint64_t value) {
+  while (value >= 0x80) {
+    out.put(static_cast<char>((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  out.put(static_cast<char>(value));
+}
+
+static uint64_t read_varint(std::istream &in) {
+  uint64_t value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    int byte = in.get();
+    if (byte == std::char_traits<char>::eof()) {
+      throw std::runtime_error("Checkpoint is truncated");
+    }
+    value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return value;
+    }
+  }
+  throw std::runtime_error("Checkpoint has a malformed number");
+}
+
+void InterferenceDetector::saveCheckpoint(std::ostream &out) const {
+  out.write(CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+  write_varint(out, CHECKPOINT_VERSION);
+  write_varint(out, cacheline_size);
+
+  write_varint(out, cachelines.size());
+  for (const auto &cacheline : cachelines) {
+    const CacheLine &line = cacheline.second;
+    write_varint(out, cacheline.first);
+    write_varint(out, line.accesses.size());
+    for (const auto &threadAccesses : line.accesses) {
+      write_varint(out, threadAccesses.first);
+      write_varint(out, threadAccesses.second.size());
+      for (const auto &access : threadAccesses.second) {
+        // Addresses are stored as offsets into the line.
+        write_varint(out, access.first - cacheline.first * cacheline_size);
+        write_varint(out, access.second.accessSize << 1 | access.second.isWrite);
+        write_varint(out, access.second.ip);
+      }
+    }
+    write_varint(out, line.holders.size() << 1 | line.modified);
+    for (uint64_t holder : line.holders) {
+      write_varint(out, holder);
+    }
+    write_varint(out, line.lastAddr.size());
+    for (const auto &last : line.lastAddr) {
+      write_varint(out, last.first);
+      write_varint(out, last.second - cacheline.first * cacheline_size);
+    }
+  }
+
+  write_varint(out, interferences.capacity());
+  write_varint(out, interferences.evictions());
+  write_varint(out, interferences.size());
+  for (const auto &interference : interferences.entries()) {
+    const Interference &info = interference.value;
+    write_varint(out, interference.key.addr1);
+    write_varint(out, interference.key.addr2 - interference.key.addr1);
+    for (uint64_t value : {info.count, info.size1, info.size2, info.writeWrite,
+                           info.writeRead, info.readWrite, info.transfers}) {
+      write_varint(out, value);
+    }
+    write_varint(out, info.sites.size());
+    for (const auto &site : info.sites) {
+      write_varint(out, site.ip1);
+      write_varint(out, site.ip2);
+      write_varint(out, site.count);
+    }
+    write_varint(out, interference.weight);
+    write_varint(out, interference.error);
+  }
+
+  write_varint(out, page_sizes.size());
+  for (size_t i = 0; i < page_sizes.size(); ++i) {
+    write_varint(out, page_sizes[i]);
+    write_varint(out, pages[i].size());
+    for (const auto &page : pages[i]) {
+      write_varint(out, page.first);
+      write_varint(out, page.second.firstThread);
+      write_varint(out, page.second.threads.size());
+      for (const auto &thread : page.second.threads) {
+        write_varint(out, thread.first);
+        write_varint(out, thread.second.reads);
+        write_varint(out, thread.second.writes);
+      }
+    }
+  }
+  if (!out) {
+    throw std::runtime_error("Could not write checkpoint");
+  }
+}
+
+void InterferenceDetector::loadCheckpoint(std::istream &in) {
+  char magic[sizeof(CHECKPOINT_MAGIC)];
+  if (!in.read(magic, sizeof(magic)) ||
+      !std::equal(magic, magic + sizeof(magic), CHECKPOINT_MAGIC)) {
+    throw std::runtime_error("Not a detect checkpoint");
+  }
+  uint64_t version = read_varint(in);
+  if (version < 1 || version > CHECKPOINT_VERSION) {
+    throw std::runtime_error("Unsupported checkpoint version");
+  }
+  if (read_varint(in) != cacheline_size) {
+    throw std::runtime_error("Checkpoint has a different cache line size");
+  }
+
+  cachelines.clear();
+  interferences.clear();
+  for (auto &sizePages : pages) {
+    sizePages.clear();
+  }
+  for (uint64_t lines = read_varint(in); lines > 0; --lines) {
+    uint64_t index = read_varint(in);
+    uint64_t base = index * cacheline_size;
+    CacheLine &line = cachelines[index];
+    for (uint64_t threads = read_varint(in); threads > 0; --threads) {
+      auto &threadAccesses = line.accesses[read_varint(in)];
+      for (uint64_t accesses = read_varint(in); accesses > 0; --accesses) {
+        uint64_t addr = base + read_varint(in);
+        uint64_t sizeAndKind = read_varint(in);
+        uint64_t ip = read_varint(in);
+        threadAccesses[addr] = {(sizeAndKind & 1) != 0, sizeAndKind >> 1, ip};
+      }
+    }
+    uint64_t holdersAndModified = read_varint(in);
+    line.modified = (holdersAndModified & 1) != 0;
+    for (uint64_t holders = holdersAndModified >> 1; holders > 0; --holders) {
+      line.holders.push_back(read_varint(in));
+    }
+    for (uint64_t threads = read_varint(in); threads > 0; --threads) {
+      uint64_t thread = read_varint(in);
+      line.lastAddr[thread] = base + read_varint(in);
+    }
+  }
+
+  if (version >= 3) {
+    if (read_varint(in) != interferences.capacity()) {
+      throw std::runtime_error("Checkpoint keeps a different number of interferences");
+    }
+    interferences.restoreEvictions(read_varint(in));
+  }
+  for (uint64_t count = read_varint(in); count > 0; --count) {
+    uint64_t addr1 = read_varint(in);
+    uint64_t addr2 = addr1 + read_varint(in);
+    Interference info{};
+    for (uint64_t *value : {&info.count, &info.size1, &info.size2,
+                            &info.writeWrite, &info.writeRead, &info.readWrite,
+                            &info.transfers}) {
+      *value = read_varint(in);
+    }
+    for (uint64_t sites = read_varint(in); sites > 0; --sites) {
+      uint64_t ip1 = read_varint(in);
+      uint64_t ip2 = read_varint(in);
+      info.sites.push_back({ip1, ip2, read_varint(in)});
+    }
+    // Older checkpoints kept every pair, so their counts are exact.
+    uint64_t weight = version >= 3 ? read_varint(in) : info.count + info.transfers;
+    uint64_t error = version >= 3 ? read_varint(in) : 0;
+    interferences.restore({addr1, addr2}, info, weight, error);
+  }
+
+  uint64_t sizes = version == 1 ? 0 : read_varint(in);
+  if (sizes != page_sizes.size()) {
+    throw std::runtime_error("Checkpoint has different page sizes");
+  }
+  for (size_t i = 0; i < sizes; ++i) {
+    if (read_varint(in) != page_sizes[i]) {
+      throw std::runtime_error("Checkpoint has different page sizes");
+    }
+    for (uint64_t count = read_varint(in); count > 0; --count) {
+      uint64_t index = read_varint(in);
+      Page &page = pages[i][index];
+      page.firstThread = read_varint(in);
+      for (uint64_t threads = read_varint(in); threads > 0; --threads) {
+        Page::Counts &counts = page.threads[read_varint(in)];
+        counts.reads = read_varint(in);
+        counts.writes = read_varint(in);
+      }
+    }
   }
 }
@@ -1,8 +1,11 @@
 #pragma once
 
 #include "../MapAddr/AccessInfo.h"
+#include "../SpaceSaving.h"
 
 #include <cstdint>
+#include <istream>
+#include <map>
 #include <ostream>
 #include <set>
 #include <string>
@@ -12,15 +15,74 @@
 
 uint64_t string_to_uint64(const std::string &str, int base = 10);
 
+// A page that threads on more than one node touched, at least one of them
+// writing. Threads are assigned to nodes round-robin (thread % nodes), or
+// each thread is a node of its own when nodes is 0. The home node is that of
+// the thread that touched the page first, where first-touch placement put it.
+struct page_record {
+  uint64_t page; // address of its first byte
+  uint64_t threads;
+  uint64_t firstThread;
+  uint64_t homeNode;
+  uint64_t reads;
+  uint64_t writes;
+  uint64_t remoteReads; // from nodes other than the home node
+  uint64_t remoteWrites;
+  std::vector<std::pair<uint64_t, uint64_t>> nodeWrites; // (node, writes)
+};
+
 class InterferenceDetector {
 public:
   InterferenceDetector(uint64_t cacheline_size_in);
 
+  // `ip` is the accessing instruction, or 0 if unknown.
   void recordAccess(const std::string &rw, const std::string &destAddr,
-                    const std::string &accessSize, const std::string &threadId);
+                    const std::string &accessSize, const std::string &threadId,
+                    const std::string &ip = "0");
+  void recordAccess(bool isWrite, uint64_t destAddr, uint64_t accessSize,
+                    uint64_t threadId, uint64_t ip = 0);
+
+  // Keeps only the k address pairs with the most touches and transfers, in
+  // O(k) memory, instead of every pair (see SpaceSaving.h); 0 keeps them all.
+  // Call before recording any access.
+  void keepTopInterferences(uint64_t k) { interferences.setCapacity(k); }
 
+  // Interferences found so far, sorted by (addr1, addr2).
+  std::vector<interference_record> sortedInterferences() const;
   void outputInterferences(std::ostream &out);
 
+  // Also counts the interferences touched since the last
+  // takeSliceInterferences, so time slices cost only the pairs they touch
+  // rather than a copy of the whole table. Call before recording any access.
+  void trackSlices() { track_slices = true; }
+  // Interferences counted since the last call, sorted by (addr1, addr2), and
+  // starts a new slice. Sizes are the largest seen over the whole run so far.
+  // With keepTopInterferences, the counts are exact even for pairs evicted
+  // from the whole-run table.
+  std::vector<interference_record> takeSliceInterferences();
+  // Instruction pairs of the interferences, sorted by (addr1, addr2, ip1,
+  // ip2). Accesses recorded without an instruction are left out.
+  std::vector<site_record> sortedSites() const;
+  void outputSites(std::ostream &out);
+
+  // Also counts each thread's reads and writes to every page of page_size
+  // bytes, in the same pass. Call before recording any access; page sizes
+  // are kept in the order they were added.
+  void trackPages(uint64_t page_size);
+  const std::vector<uint64_t> &pageSizes() const { return page_sizes; }
+  // Pages shared across nodes, most remote writes first.
+  std::vector<page_record> sortedPages(uint64_t page_size,
+                                       uint64_t nodes) const;
+  void outputPages(std::ostream &out, uint64_t page_size, uint64_t nodes);
+
+  // Writes every cache line and interference to a compact binary checkpoint,
+  // and restores them from one, so a trace can be processed in several runs.
+  // A checkpoint can only be loaded into a detector with the same cache line
+  // and page sizes and the same number of interferences kept; loading throws
+  // std::runtime_error on a mismatched or corrupt file.
+  void saveCheckpoint(std::ostream &out) const;
+  void loadCheckpoint(std::istream &in);
+
 private:
   uint64_t cacheline_size;
 
@@ -28,12 +90,69 @@ private:
     struct Access {
       bool isWrite;
       uint64_t accessSize;
+      uint64_t ip; // of the thread's latest access here
     };
-    // thread id -> destAddr -> Access
-    std::unordered_map<uint64_t, std::unordered_map<uint64_t, Access>> accesses;
+    // thread id -> destAddr -> Access. Threads are kept in order, since
+    // recordAccess stops at the accessing thread's own entry, and the counts
+    // must not depend on hashing (or differ after loading a checkpoint).
+    std::map<uint64_t, std::unordered_map<uint64_t, Access>> accesses;
+
+    // MSI model of the line: the threads holding a copy, and whether the
+    // single holder has written to it since it was last shared.
+    std::vector<uint64_t> holders;
+    bool modified = false;
+    // thread id -> address of its latest access to the line
+    std::unordered_map<uint64_t, uint64_t> lastAddr;
   };
   std::unordered_map<uint64_t, CacheLine> cachelines;
 
-  // interference -> count
-  std::unordered_map<conflicting_addr, uint64_t> interferences;
+  // Counts the transfers of the line to threadId that an access causes,
+  // against the interferences with the accesses it takes the line from.
+  void countTransfers(CacheLine &cacheline, bool isWrite, uint64_t destAddr,
+                      uint64_t accessSize, uint64_t threadId);
+
+  // Instructions at addr1 and addr2 that interfered, and how often
+  struct Site {
+    uint64_t ip1;
+    uint64_t ip2;
+    uint64_t count;
+  };
+
+  struct Interference {
+    uint64_t count;
+    // Largest access sizes seen at addr1 and addr2
+    uint64_t size1;
+    uint64_t size2;
+    // count split by the kind of the earlier and the later access
+    uint64_t writeWrite;
+    uint64_t writeRead;
+    uint64_t readWrite;
+    // Estimated cache line transfers between the two accesses' threads
+    uint64_t transfers;
+    // Usually a handful, so searched linearly
+    std::vector<Site> sites;
+  };
+  // Every interference, or the heaviest ones with keepTopInterferences
+  SpaceSaving<conflicting_addr, Interference> interferences;
+
+  // Pairs touched during the slice in progress, with trackSlices
+  bool track_slices = false;
+  std::unordered_map<conflicting_addr, interference_record> slice_counts;
+  // The slice's counts for a pair, or null without trackSlices
+  interference_record *sliceCounts(const conflicting_addr &interference);
+
+  struct Page {
+    struct Counts {
+      uint64_t reads;
+      uint64_t writes;
+    };
+    uint64_t firstThread;
+    std::map<uint64_t, Counts> threads;
+  };
+  // One map of page index -> Page for each of page_sizes
+  std::vector<uint64_t> page_sizes;
+  std::vector<std::unordered_map<uint64_t, Page>> pages;
+
+  void recordPageAccess(bool isWrite, uint64_t destAddr, uint64_t accessSize,
+                        uint64_t threadId);
 };
\ No newline at end of file
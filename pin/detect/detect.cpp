@@ -1,67 +1,283 @@
-// Takes in pinatrace.out
-// Output list of interferences {addr1, addr2, [priority]}
+// Takes in pinatrace.out, as text or compressed by pinatrace -compress
+// Output list of interferences {addr1, addr2, count, size1, size2, ww, wr, rw,
+// transfers}, and the pairs of instructions behind them
+// {addr1, addr2, ip1, ip2, count}
+//
+// With -c, the detector's state is saved to a checkpoint file every -i lines
+// and at the end, along with how far into the trace it got. If the checkpoint
+// already exists, detect resumes from it instead of starting over, so a
+// crashed run can be restarted and a trace that a profiler is still appending
+// to can be processed incrementally. The outputs always cover the whole trace
+// read so far.
+//
+// The trace may also be a FIFO that pinatrace -stream writes to, so detection
+// runs alongside the program without a trace file (but without -c).
+//
+// Each -p adds a page size (such as 4096 or 2097152) at which the same pass
+// counts every thread's reads and writes per page, and writes the pages that
+// threads on different NUMA nodes share to <trace>.page<size>.pages, with the
+// write volume from each node. -n gives the number of nodes that threads are
+// spread over round-robin; by default every thread is a node of its own.
+// MapAddr -p maps those pages to the globals on them for the fix pass.
+//
+// With -s, the trace is also split into time slices of that many accesses.
+// The interferences found during each slice are written to
+// <trace>.cacheline<size>.slice<N>.interferences, so MapAddr -t can weight
+// or leave out phases of the run such as its startup, and one line per slice
+// goes to <trace>.cacheline<size>.slices. Slices cannot be resumed, so -s
+// cannot be combined with -c.
+//
+// With -k, only the k address pairs with the most touches and transfers are
+// kept, in memory bounded by k rather than by the number of distinct pairs
+// (see SpaceSaving.h). detect then reports how far off their counts can be,
+// and the most any pair left out can have had. A run resumed from a
+// checkpoint has the same bounds, but may keep other pairs among those near
+// them, as the pairs are met in another order. Slice files count every pair
+// touched during their slice, including ones -k evicts.
 
+#include <cstdio>
+#include <cstring>
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <string> 
 #include <cstdint>
+#include <vector>
+#include <utility>
 
+#include "CompressedTraceReader.h"
 #include "InterferenceDetector.h"
 
-void process_pinatrace(const std::string& pinatrace_file, uint64_t cacheline_size);
+struct checkpoint_options {
+    std::string file; // empty for no checkpoints
+    uint64_t interval = 10000000; // lines
+};
+
+struct page_options {
+    std::vector<uint64_t> sizes; // bytes; empty for no page analysis
+    uint64_t nodes = 0; // 0 for a node per thread
+};
+
+// Writes the interferences found during each slice of `records` accesses to
+// their own file, and a line per slice to the .slices histogram. With 0
+// records, it does nothing.
+class slice_writer {
+public:
+    slice_writer(InterferenceDetector& detector, const std::string& interferences_file,
+                 uint64_t records)
+        : interferences_file(interferences_file), records_per_slice(records) {
+        if (records_per_slice == 0) {
+            return;
+        }
+        detector.trackSlices();
+        std::string histogram_file =
+            interferences_file.substr(0, interferences_file.rfind(".interferences")) + ".slices";
+        histogram.open(histogram_file);
+        if (!histogram.is_open()) {
+            std::cout << "Could not open output file: " << histogram_file << std::endl;
+            exit(1);
+        }
+        histogram << "# slice, first access, accesses, interferences, count, transfers\n";
+    }
+
+    void record(InterferenceDetector& detector) {
+        if (records_per_slice != 0 && ++in_slice == records_per_slice) {
+            finish(detector);
+        }
+    }
+
+    // Writes the slice in progress, if it has any accesses.
+    void finish(InterferenceDetector& detector) {
+        if (in_slice == 0) {
+            return;
+        }
+        std::string slice_file = slice_path(interferences_file, slice);
+        std::ofstream out(slice_file);
+        if (!out.is_open()) {
+            std::cout << "Could not open output file: " << slice_file << std::endl;
+            exit(1);
+        }
+        out << SORTED_INTERFERENCES_HEADER << '\n';
+        uint64_t interferences = 0, count = 0, transfers = 0;
+        for (const interference_record& delta : detector.takeSliceInterferences()) {
+            write_interference(out, delta);
+            ++interferences;
+            count += delta.count;
+            transfers += delta.transfers;
+        }
+        histogram << slice << '\t' << slice * records_per_slice << '\t' << in_slice << '\t'
+                  << interferences << '\t' << count << '\t' << transfers << '\n';
+        ++slice;
+        in_slice = 0;
+    }
+
+    uint64_t slices() const { return slice; }
+
+private:
+    std::string interferences_file;
+    uint64_t records_per_slice;
+    uint64_t slice = 0;
+    uint64_t in_slice = 0; // accesses
+    std::ofstream histogram;
+};
+
+void process_pinatrace(const std::string& pinatrace_file, uint64_t cacheline_size,
+                       const checkpoint_options& checkpoint, const page_options& pages,
+                       uint64_t slice_records, uint64_t top_interferences);
+
+void usage(const char* argv0) {
+    std::cerr << "Usage: " << argv0 << " [-c checkpoint file [-i lines between checkpoints]]"
+              << " [-p page size in bytes]... [-n NUMA nodes] [-s accesses per slice]"
+              << " [-k interferences kept]"
+              << " [path to pinatrace.out file] [cache line size in bytes]" << std::endl;
+    exit(1);
+}
 
 int main(int argc, char **argv) {
-    if (argc != 3) {
-        std::cerr << "Usage: " << argv[0] << " [path to pinatrace.out file] [cache line size in bytes]" << std::endl;
+    checkpoint_options checkpoint;
+    page_options pages;
+    uint64_t slice_records = 0;
+    uint64_t top_interferences = 0;
+    int first = 1;
+    for (; first + 1 < argc && argv[first][0] == '-'; first += 2) {
+        if (std::strcmp(argv[first], "-c") == 0) {
+            checkpoint.file = argv[first + 1];
+        } else if (std::strcmp(argv[first], "-i") == 0) {
+            try {
+                checkpoint.interval = string_to_uint64(argv[first + 1]);
+            } catch (std::runtime_error& e) {
+                usage(argv[0]);
+            }
+            if (checkpoint.interval == 0) {
+                usage(argv[0]);
+            }
+        } else if (std::strcmp(argv[first], "-p") == 0) {
+            uint64_t page_size = 0;
+            try {
+                page_size = string_to_uint64(argv[first + 1]);
+            } catch (std::runtime_error& e) {
+                usage(argv[0]);
+            }
+            if (page_size == 0 || (page_size & (page_size - 1)) != 0) {
+                usage(argv[0]);
+            }
+            pages.sizes.push_back(page_size);
+        } else if (std::strcmp(argv[first], "-s") == 0) {
+            try {
+                slice_records = string_to_uint64(argv[first + 1]);
+            } catch (std::runtime_error& e) {
+                usage(argv[0]);
+            }
+            if (slice_records == 0) {
+                usage(argv[0]);
+            }
+        } else if (std::strcmp(argv[first], "-k") == 0) {
+            try {
+                top_interferences = string_to_uint64(argv[first + 1]);
+            } catch (std::runtime_error& e) {
+                usage(argv[0]);
+            }
+            if (top_interferences == 0) {
+                usage(argv[0]);
+            }
+        } else if (std::strcmp(argv[first], "-n") == 0) {
+            try {
+                pages.nodes = string_to_uint64(argv[first + 1]);
+            } catch (std::runtime_error& e) {
+                usage(argv[0]);
+            }
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (argc - first != 2) {
+        usage(argv[0]);
+    }
+    if (slice_records != 0 && !checkpoint.file.empty()) {
+        std::cout << "Time slices cannot be resumed from a checkpoint; use -s or -c"
+                  << std::endl;
         exit(1);
     }
-
-    std::string pinatrace_file(argv[1]);
+    std::string pinatrace_file(argv[first]);
     uint64_t cacheline_size;
     try {
-        cacheline_size = std::stoll(argv[2]);
+        cacheline_size = std::stoll(argv[first + 1]);
     } catch (...) {
         std::cout << "Exception thrown, could not convert cache line size to long long: " 
-                  << argv[2] << std::endl;
+                  << argv[first + 1] << std::endl;
         exit(1);
     }
-    if (std::to_string(cacheline_size) != argv[2]) {
+    if (std::to_string(cacheline_size) != argv[first + 1]) {
         std::cout << "Could not entirely parse cache line size to long long: "
-                  << argv[2] << std::endl;
+                  << argv[first + 1] << std::endl;
         exit(1);
     }
     std::cout << "Reading pinatrace file: " << pinatrace_file;
     std::cout << ", with cache line size: " << cacheline_size << std::endl;
 
-    process_pinatrace(pinatrace_file, cacheline_size);
+    process_pinatrace(pinatrace_file, cacheline_size, checkpoint, pages, slice_records,
+                      top_interferences);
 }
 
-void process_pinatrace(const std::string& pinatrace_file, uint64_t cacheline_size) {
-    std::ifstream infile(pinatrace_file);
-    std::string output_file = pinatrace_file + ".cacheline" + std::to_string(cacheline_size) + ".interferences";
-    std::ofstream outfile(output_file);
-    if (!outfile.is_open()) {
-        std::cout << "Could not open output file: " << output_file << std::endl;
-        exit(1);
+// A checkpoint is a line "offset linenum" giving where in the trace to resume,
+// followed by the detector's binary state.
+bool load_checkpoint(const std::string& checkpoint_file, InterferenceDetector& detector,
+                     uint64_t& offset, uint64_t& linenum) {
+    std::ifstream in(checkpoint_file, std::ios::binary);
+    if (!in.is_open()) {
+        return false;
     }
+    std::string position;
+    std::getline(in, position);
+    if (!(std::istringstream(position) >> offset >> linenum)) {
+        throw std::runtime_error("Checkpoint has no trace position: " + checkpoint_file);
+    }
+    detector.loadCheckpoint(in);
+    return true;
+}
 
+// Written to a temporary file first, so a crash leaves the last checkpoint intact.
+void save_checkpoint(const std::string& checkpoint_file, const InterferenceDetector& detector,
+                     uint64_t offset, uint64_t linenum) {
+    std::string temp_file = checkpoint_file + ".tmp";
+    {
+        std::ofstream out(temp_file, std::ios::binary);
+        out << offset << ' ' << linenum << '\n';
+        detector.saveCheckpoint(out);
+    }
+    if (std::rename(temp_file.c_str(), checkpoint_file.c_str()) != 0) {
+        throw std::runtime_error("Could not replace checkpoint: " + checkpoint_file);
+    }
+}
+
+// pinatrace -drop marks the lines it left out with "#dropped count".
+void process_text_trace(std::ifstream& infile, InterferenceDetector& detector,
+                        uint64_t& offset, uint64_t& linenum, uint64_t& dropped,
+                        const checkpoint_options& checkpoint, slice_writer& slices) {
     std::string line;
 
     // Columns of the pinatrace file:
     // program counter, read or write, dest addr, size of access, thread id, value
     std::string pc, rw, dest, sz, tid, val;
 
-    InterferenceDetector detector(cacheline_size);
-
-    uint64_t linenum = 0;
     while (std::getline(infile, line)) {
+        // The profiler may still be writing the last line; leave it for the
+        // next run.
+        if (infile.eof() && !checkpoint.file.empty()) {
+            break;
+        }
+        offset += line.size() + 1;
         std::istringstream iss(line);
 
         bool parseError = !(iss >> pc >> rw >> dest >> sz >> tid >> val);
         ++linenum;
-        if (!pc.empty() && pc[0] == '#') 
+        if (!pc.empty() && pc[0] == '#') {
+            uint64_t count;
+            if (pc == "#dropped" && std::istringstream(line.substr(pc.size())) >> count) {
+                dropped += count;
+            }
             continue; // filter out comments
+        }
         if (parseError) {
             std::cout << "Line #" << (linenum - 1) << " formatted incorrectly:" << std::endl;
             std::cout << '\t' << pc << '\t' << rw << '\t' << dest << '\t' << sz << '\t' << tid << '\t' << val << std::endl;
@@ -69,18 +285,156 @@ void process_pinatrace(const std::string& pinatrace_file, uint64_t cacheline_siz
         }
         
         try {
-            detector.recordAccess(rw, dest, sz, tid);
+            detector.recordAccess(rw, dest, sz, tid, pc);
         } catch (std::runtime_error& e) {
             std::cout << "Error processing line #" << (linenum - 1) << ": " << e.what() << std::endl;
             continue; // ignore bad access
         }
+        slices.record(detector);
 
         if (linenum % 100000 == 0) {
             std::cout << "Processed " << linenum << " lines" << std::endl;
         }
+        if (!checkpoint.file.empty() && linenum % checkpoint.interval == 0) {
+            save_checkpoint(checkpoint.file, detector, offset, linenum);
+        }
+    }
+}
+
+// Each record of a compressed trace counts as a line. Checkpoints are only
+// taken between blocks, once at least checkpoint.interval records have passed.
+void process_compressed_trace(std::ifstream& infile, InterferenceDetector& detector,
+                              uint64_t& offset, uint64_t& linenum, uint64_t& dropped,
+                              const checkpoint_options& checkpoint, slice_writer& slices) {
+    if (offset == 0) {
+        if (!read_trace_magic(infile)) {
+            throw std::runtime_error("Not a compressed trace");
+        }
+        offset = sizeof(TRACE_MAGIC);
+    }
+    CompressedTraceReader reader(infile, offset);
+    std::vector<trace_record> records;
+    uint64_t last_checkpoint = linenum;
+    while (reader.next(records, offset)) {
+        for (const trace_record& record : records) {
+            detector.recordAccess(record.is_write, record.addr, record.size, record.thread,
+                                  record.ip);
+            slices.record(detector);
+        }
+        uint64_t before = linenum;
+        linenum += records.size();
+        if (linenum / 100000 != before / 100000) {
+            std::cout << "Processed " << linenum << " records" << std::endl;
+        }
+        if (!checkpoint.file.empty() && linenum - last_checkpoint >= checkpoint.interval) {
+            save_checkpoint(checkpoint.file, detector, offset, linenum);
+            last_checkpoint = linenum;
+        }
+    }
+    // With checkpoints, the partial block is read again next time.
+    if (reader.truncated() && checkpoint.file.empty()) {
+        std::cout << "Trace ends within a block, which was skipped" << std::endl;
+    }
+    dropped += reader.dropped();
+}
+
+void process_pinatrace(const std::string& pinatrace_file, uint64_t cacheline_size,
+                       const checkpoint_options& checkpoint, const page_options& pages,
+                       uint64_t slice_records, uint64_t top_interferences) {
+    std::ifstream infile(pinatrace_file, std::ios::binary);
+    if (!infile.is_open()) {
+        std::cout << "Could not open pinatrace file: " << pinatrace_file << std::endl;
+        exit(1);
+    }
+    std::string output_file = pinatrace_file + ".cacheline" + std::to_string(cacheline_size) + ".interferences";
+    std::ofstream outfile(output_file);
+    if (!outfile.is_open()) {
+        std::cout << "Could not open output file: " << output_file << std::endl;
+        exit(1);
+    }
+    std::string sites_file = pinatrace_file + ".cacheline" + std::to_string(cacheline_size) + ".sites";
+    std::ofstream sitesfile(sites_file);
+    if (!sitesfile.is_open()) {
+        std::cout << "Could not open output file: " << sites_file << std::endl;
+        exit(1);
+    }
+
+    InterferenceDetector detector(cacheline_size);
+    detector.keepTopInterferences(top_interferences);
+    slice_writer slices(detector, output_file, slice_records);
+    for (uint64_t page_size : pages.sizes) {
+        detector.trackPages(page_size);
+    }
+
+    // Byte offset of the next line to read
+    uint64_t offset = 0;
+    uint64_t linenum = 0;
+    uint64_t dropped = 0;
+    bool compressed = is_compressed_trace(infile);
+    if (!checkpoint.file.empty()) {
+        try {
+            if (load_checkpoint(checkpoint.file, detector, offset, linenum)) {
+                std::cout << "Resuming from checkpoint at line " << linenum << std::endl;
+            }
+        } catch (std::runtime_error& e) {
+            std::cout << "Could not load checkpoint: " << e.what() << std::endl;
+            exit(1);
+        }
+        // Resuming seeks into the trace, so it cannot be a pipe.
+        infile.seekg(0, std::ios::end);
+        if (infile.tellg() < 0) {
+            std::cout << "Checkpoints need a trace file that can be read again, not a pipe"
+                      << std::endl;
+            exit(1);
+        }
+        if (static_cast<uint64_t>(infile.tellg()) < offset) {
+            std::cout << "Trace is shorter than the checkpoint; was it replaced?" << std::endl;
+            exit(1);
+        }
+        infile.seekg(offset);
+    }
+
+    if (compressed) {
+        try {
+            process_compressed_trace(infile, detector, offset, linenum, dropped, checkpoint,
+                                     slices);
+        } catch (std::runtime_error& e) {
+            std::cout << e.what() << std::endl;
+            exit(1);
+        }
+    } else {
+        process_text_trace(infile, detector, offset, linenum, dropped, checkpoint, slices);
+    }
+    if (dropped > 0) {
+        std::cout << "The trace left out " << dropped << " dropped records, so the "
+                  << "interferences are from a sample of the run" << std::endl;
+    }
+
+    if (!checkpoint.file.empty()) {
+        save_checkpoint(checkpoint.file, detector, offset, linenum);
+        std::cout << "Saved checkpoint at line " << linenum << " to file: "
+                  << checkpoint.file << std::endl;
+    }
+
+    slices.finish(detector);
+    if (slices.slices() > 0) {
+        std::cout << "Outputted " << slices.slices() << " slices of " << slice_records
+                  << " accesses next to: " << output_file << std::endl;
     }
 
     detector.outputInterferences(outfile);
     std::cout << "Outputted interferences to file: " << output_file << std::endl;
+    detector.outputSites(sitesfile);
+    std::cout << "Outputted sites to file: " << sites_file << std::endl;
+    for (uint64_t page_size : detector.pageSizes()) {
+        std::string pages_file = pages_path(pinatrace_file, page_size);
+        std::ofstream pagesfile(pages_file);
+        if (!pagesfile.is_open()) {
+            std::cout << "Could not open output file: " << pages_file << std::endl;
+            exit(1);
+        }
+        detector.outputPages(pagesfile, page_size, pages.nodes);
+        std::cout << "Outputted pages to file: " << pages_file << std::endl;
+    }
 }
 
@@ -0,0 +1,147 @@
+// Converts pinatrace.out between text and the compressed format written by
+// pinatrace -compress (see TraceCodec.h), for traces recorded without it.
+//
+//   tracepack input.out output.out      compress a text trace
+//   tracepack -d input.out output.out   decompress to text
+//
+// Values wider than 8 bytes are left out when compressing; detect does not
+// read them. "#dropped" lines and blocks are converted into each other.
+
+#include "../TraceCodec.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+void usage(const char *argv0) {
+  std::cerr << "Usage: " << argv0
+            << " [-d] [path to input trace] [path to output trace]"
+            << std::endl;
+  exit(1);
+}
+
+// Parses a text pinatrace.out line: "ip: R|W addr size thread [value]".
+bool parse_line(const std::string &line, trace_record &record) {
+  std::istringstream iss(line);
+  std::string ip, rw, addr, value;
+  if (!(iss >> ip >> rw >> addr >> record.size >> record.thread) ||
+      ip[0] == '#' || (rw != "R" && rw != "W")) {
+    return false;
+  }
+  char *end;
+  record.ip = std::strtoull(ip.c_str(), &end, 16);
+  record.addr = std::strtoull(addr.c_str(), nullptr, 16);
+  record.is_write = rw == "W";
+  record.has_value = false;
+  record.value = 0;
+  if (iss >> value && record.size <= 8) {
+    record.value = std::strtoull(value.c_str(), &end, 0);
+    record.has_value = *end == '\0';
+  }
+  return true;
+}
+
+uint64_t compress(std::ifstream &in, std::ofstream &out) {
+  out.write(TRACE_MAGIC, sizeof(TRACE_MAGIC));
+  TraceBlockEncoder encoder;
+  std::string block, line;
+  trace_record record;
+  uint64_t records = 0;
+  while (std::getline(in, line)) {
+    uint64_t dropped;
+    if (line.rfind("#dropped ", 0) == 0 &&
+        std::istringstream(line.substr(9)) >> dropped) {
+      if (encoder.size() > 0) {
+        encoder.finish(block);
+      }
+      put_trace_drops(block, dropped);
+      continue;
+    }
+    if (!parse_line(line, record)) {
+      continue;
+    }
+    encoder.add(record);
+    ++records;
+    if (encoder.size() >= TRACE_BLOCK_SIZE) {
+      encoder.finish(block);
+      out << block;
+      block.clear();
+    }
+  }
+  if (encoder.size() > 0) {
+    encoder.finish(block);
+  }
+  encoder.finish(block); // end of the trace
+  out << block;
+  return records;
+}
+
+uint64_t decompress(std::ifstream &in, std::ofstream &out) {
+  read_trace_magic(in);
+  std::vector<trace_record> records;
+  trace_block_info info;
+  uint64_t count = 0;
+  out << "#\n# Memory Access Trace Generated By Pin\n#\n";
+  trace_block_status status;
+  while ((status = read_trace_block(in, records, info)) == TRACE_BLOCK_OK ||
+         status == TRACE_BLOCK_DROPS) {
+    if (status == TRACE_BLOCK_DROPS) {
+      out << "#dropped " << info.dropped << '\n';
+    }
+    for (const trace_record &record : records) {
+      out << "0x" << std::hex << record.ip << ": "
+          << (record.is_write ? 'W' : 'R') << " 0x" << record.addr << " "
+          << std::dec << record.size << " " << record.thread << " ";
+      if (record.has_value) {
+        out << "0x" << std::hex << record.value << std::dec;
+      }
+      out << '\n';
+    }
+    count += records.size();
+  }
+  if (status == TRACE_BLOCK_CORRUPT) {
+    std::cerr << "Corrupt trace block after " << count << " records"
+              << std::endl;
+    exit(1);
+  }
+  if (status == TRACE_BLOCK_TRUNCATED) {
+    std::cerr << "Trace ends within a block, which was skipped" << std::endl;
+  }
+  out << "#eof\n";
+  return count;
+}
+
+int main(int argc, char **argv) {
+  bool unpack = argc == 4 && std::strcmp(argv[1], "-d") == 0;
+  if (argc != 3 && !unpack) {
+    usage(argv[0]);
+  }
+  const char *input = argv[argc - 2], *output = argv[argc - 1];
+  std::ifstream in(input, std::ios::binary);
+  if (!in.is_open()) {
+    std::cerr << "Could not open trace file: " << input << std::endl;
+    exit(1);
+  }
+  if (is_compressed_trace(in) != unpack) {
+    std::cerr << input << (unpack ? " is not" : " is already")
+              << " a compressed trace" << std::endl;
+    exit(1);
+  }
+  std::ofstream out(output, std::ios::binary);
+  if (!out.is_open()) {
+    std::cerr << "Could not open output file: " << output << std::endl;
+    exit(1);
+  }
+
+  uint64_t records = unpack ? decompress(in, out) : compress(in, out);
+  out.close();
+  auto mode = std::ios::binary | std::ios::ate;
+  std::ifstream packed(unpack ? input : output, mode);
+  std::ifstream text(unpack ? output : input, mode);
+  std::cout << records << " records, " << text.tellg() << " bytes as text, "
+            << packed.tellg() << " compressed" << std::endl;
+}
@@ -0,0 +1,294 @@
+/*! @file
+ *  Single-pass false sharing profiler. Runs the mdcache coherence simulation
+ *  and the detect overlap analysis on every memory access as it happens,
+ *  then resolves the interferences against fs_globals.txt and writes
+ *  mapped_conflicts.out, replacing the pinatrace + detect + mdcache + MapAddr
+ *  pipeline without writing a trace. The instruction pairs behind the
+ *  interferences are ranked into hot_sites.out, with their source locations.
+ */
+
+#include "pin.H"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <map>
+
+#include "../MapAddr/AccessInfo.h"
+#include "../MapAddr/ConflictAggregator.h"
+#include "../MapAddr/GlobalIndex.h"
+#include "../MapAddr/SiteReport.h"
+#include "../detect/InterferenceDetector.h"
+#include "../mdcache.H"
+#include "../mutex.PH"
+using std::cerr;
+using std::endl;
+using std::string;
+
+/* ===================================================================== */
+/* Commandline Switches */
+/* ===================================================================== */
+
+KNOB<string> KnobOutputFile(KNOB_MODE_WRITEONCE, "pintool", "o",
+                            "mapped_conflicts.out",
+                            "specify mapped conflicts file name");
+KNOB<string> KnobStatsFile(KNOB_MODE_WRITEONCE, "pintool", "s", "fsprof.out",
+                           "specify cache statistics file name");
+KNOB<string> KnobSitesFile(KNOB_MODE_WRITEONCE, "pintool", "sites",
+                           "hot_sites.out",
+                           "specify hot instruction pairs file name");
+KNOB<UINT32> KnobWriteWriteWeight(KNOB_MODE_WRITEONCE, "pintool", "w", "4",
+                                  "priority of a write-write interference "
+                                  "relative to a write-read one");
+KNOB<string> KnobGlobalsFile(KNOB_MODE_WRITEONCE, "pintool", "g",
+                             "fs_globals.txt",
+                             "fs_globals.txt written by the globals pass");
+KNOB<UINT32> KnobCacheSize(KNOB_MODE_WRITEONCE, "pintool", "c", "32",
+                           "cache size in kilobytes");
+KNOB<UINT32> KnobLineSize(KNOB_MODE_WRITEONCE, "pintool", "b", "64",
+                          "cache block size in bytes");
+KNOB<UINT32> KnobAssociativity(KNOB_MODE_WRITEONCE, "pintool", "a", "4",
+                               "cache associativity (1 for direct mapped)");
+KNOB<string> KnobReplacement(KNOB_MODE_WRITEONCE, "pintool", "replace",
+                             "plru",
+                             "cache replacement policy: rr (round robin), "
+                             "lru, or plru (tree pseudo-LRU)");
+KNOB<UINT32> KnobTop(KNOB_MODE_WRITEONCE, "pintool", "top", "0",
+                     "keep only this many interferences per cache and per "
+                     "detector shard, the ones found most often (0 keeps "
+                     "them all)");
+
+/* ===================================================================== */
+/* Print Help Message                                                    */
+/* ===================================================================== */
+
+INT32 Usage() {
+  cerr << "This tool simulates per-core caches and detects false sharing in "
+          "one run,\nwriting conflicts between named globals.\n"
+          "\n";
+
+  cerr << KNOB_BASE::StringKnobSummary() << endl;
+  return -1;
+}
+
+/* ===================================================================== */
+/* Global Variables */
+/* ===================================================================== */
+
+namespace DL1 {
+const UINT32 max_sets = KILO;         // cacheSize / (lineSize * associativity);
+const CACHE_ALLOC::STORE_ALLOCATION allocation = CACHE_ALLOC::STORE_ALLOCATE;
+
+// Made by NewCache for the -a and -replace knobs
+typedef CACHE_BASE CACHE;
+} // namespace DL1
+
+REPLACEMENT Replacement;
+
+std::map<UINT32, DL1::CACHE *> caches;
+shared_mutex cachelist_mu;
+mutex invalidation_mutex;
+
+// The overlap analysis is sharded by cache line, so threads touching
+// different lines rarely wait on each other. Each line belongs to exactly
+// one shard, so shards never report the same address pair.
+const UINT32 DETECTOR_SHARDS = 64;
+
+struct DETECTOR_SHARD {
+  mutex mu;
+  InterferenceDetector *detector;
+};
+DETECTOR_SHARD shards[DETECTOR_SHARDS];
+
+// You must have unique access to cachelist_mu
+void insert_cache_for(UINT32 thread) {
+  DL1::CACHE *cache = NewCache<DL1::max_sets, DL1::allocation>(
+      Replacement, "L1 Data Cache for Core " + decstr(thread),
+      KnobCacheSize.Value() * KILO, KnobLineSize.Value(),
+      KnobAssociativity.Value(), invalidation_mutex, KnobTop.Value());
+  std::map<UINT32, DL1::CACHE *>::iterator it;
+  for (it = caches.begin(); it != caches.end(); it++) {
+    it->second->RegisterPeer(cache);
+    cache->RegisterPeer(it->second);
+  }
+  caches[thread] = cache;
+}
+
+DL1::CACHE *cache_for(UINT32 thread) {
+  {
+    shared_lock lock(cachelist_mu);
+    std::map<UINT32, DL1::CACHE *>::iterator it = caches.find(thread);
+    if (it != caches.end())
+      return it->second;
+  }
+  unique_lock unique(cachelist_mu);
+  if (!caches.count(thread))
+    insert_cache_for(thread);
+  return caches[thread];
+}
+
+/* ===================================================================== */
+
+VOID MemoryAccess(ADDRINT addr, UINT32 size, UINT32 threadID, BOOL isWrite,
+                  ADDRINT ip) {
+  cache_for(threadID)->Access(addr, size,
+                              isWrite ? CACHE_BASE::ACCESS_TYPE_STORE
+                                      : CACHE_BASE::ACCESS_TYPE_LOAD,
+                              ip);
+
+  DETECTOR_SHARD &shard =
+      shards[(addr / KnobLineSize.Value()) % DETECTOR_SHARDS];
+  lock_guard lock(shard.mu);
+  shard.detector->recordAccess(isWrite, addr, size, threadID, ip);
+}
+
+/* ===================================================================== */
+
+// Every memory operand is analyzed, like pinatrace records them for detect.
+VOID Instruction(INS ins, void *v) {
+  if (!INS_IsStandardMemop(ins))
+    return;
+
+  for (UINT32 memOp = 0; memOp < INS_MemoryOperandCount(ins); memOp++) {
+    const UINT32 size = INS_MemoryOperandSize(ins, memOp);
+    if (INS_MemoryOperandIsRead(ins, memOp)) {
+      INS_InsertPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)MemoryAccess,
+                               IARG_MEMORYOP_EA, memOp, IARG_UINT32, size,
+                               IARG_THREAD_ID, IARG_BOOL, FALSE, IARG_INST_PTR,
+                               IARG_END);
+    }
+    if (INS_MemoryOperandIsWritten(ins, memOp)) {
+      INS_InsertPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)MemoryAccess,
+                               IARG_MEMORYOP_EA, memOp, IARG_UINT32, size,
+                               IARG_THREAD_ID, IARG_BOOL, TRUE, IARG_INST_PTR,
+                               IARG_END);
+    }
+  }
+}
+
+/* ===================================================================== */
+
+VOID Fini(int code, VOID *v) {
+  std::ofstream statsFile(KnobStatsFile.Value().c_str());
+  statsFile << "PIN:MEMLATENCIES 1.0. 0x0\n";
+  statsFile << "#\n"
+               "# DCACHE stats\n"
+               "#\n";
+
+  INTERFERENCE_MAP counts;
+  SITE_MAP sites;
+  std::map<UINT32, DL1::CACHE *>::iterator it;
+  for (it = caches.begin(); it != caches.end(); it++) {
+    DL1::CACHE *cache = it->second;
+    statsFile << cache->StatsLong("# ", CACHE_BASE::CACHE_TYPE_DCACHE);
+    if (KnobTop.Value() > 0) {
+      statsFile << "# Interferences-Evicted:    "
+                << cache->InterferencesEvicted()
+                << "\n# Interference-Error-Bound: "
+                << cache->InterferenceErrorBound() << "\n#\n";
+    }
+    AddAllMappings(cache->InterferenceCounts(), counts);
+    AddAllSites(cache->SiteCounts(), sites);
+  }
+
+  // The program under test has written fs_globals.txt by now.
+  std::ifstream globalsFile(KnobGlobalsFile.Value().c_str());
+  if (!globalsFile.is_open()) {
+    cerr << "Could not open globals file: " << KnobGlobalsFile.Value() << endl;
+    return;
+  }
+  GlobalIndex index(read_global_vars(globalsFile));
+  ConflictAggregator aggregator(index,
+                                std::max(KnobWriteWriteWeight.Value(), 1u));
+
+  INTERFERENCE_MAP::iterator cit;
+  for (cit = counts.begin(); cit != counts.end(); cit++) {
+    aggregator.add({cit->first.first, cit->first.second, cit->second.count,
+                    cit->second.lowerSize, cit->second.upperSize,
+                    cit->second.writeWrite, cit->second.writeRead,
+                    cit->second.readWrite, cit->second.transfers});
+  }
+  for (UINT32 i = 0; i < DETECTOR_SHARDS; i++) {
+    std::vector<interference_record> interferences =
+        shards[i].detector->sortedInterferences();
+    for (size_t j = 0; j < interferences.size(); j++) {
+      aggregator.add(interferences[j]);
+    }
+  }
+
+  std::ofstream outFile(KnobOutputFile.Value().c_str());
+  aggregator.write(outFile);
+
+  SiteReport report(index);
+  SITE_MAP::iterator sit;
+  for (sit = sites.begin(); sit != sites.end(); sit++) {
+    report.add({sit->first.first.first, sit->first.first.second,
+                sit->first.second.first, sit->first.second.second,
+                sit->second});
+  }
+  for (UINT32 i = 0; i < DETECTOR_SHARDS; i++) {
+    std::vector<site_record> detectorSites = shards[i].detector->sortedSites();
+    for (size_t j = 0; j < detectorSites.size(); j++) {
+      report.add(detectorSites[j]);
+    }
+  }
+  std::map<uint64_t, source_location> locations;
+  std::vector<uint64_t> ips = report.instructions();
+  PIN_LockClient();
+  for (size_t i = 0; i < ips.size(); i++) {
+    INT32 column = 0, line = 0;
+    string file;
+    PIN_GetSourceLocation(ips[i], &column, &line, &file);
+    source_location &location = locations[ips[i]];
+    location.function = RTN_FindNameByAddress(ips[i]);
+    location.file = file;
+    location.line = line;
+  }
+  PIN_UnlockClient();
+  std::ofstream sitesFile(KnobSitesFile.Value().c_str());
+  report.write(sitesFile, locations);
+}
+
+/* ===================================================================== */
+/* Main                                                                  */
+/* ===================================================================== */
+
+int main(int argc, char *argv[]) {
+  PIN_InitSymbols();
+
+  if (PIN_Init(argc, argv)) {
+    return Usage();
+  }
+
+  // Checks that the knobs describe a cache NewCache can make.
+  CACHE_BASE *probe = 0;
+  if (ParseReplacement(KnobReplacement.Value(), Replacement)) {
+    probe = NewCache<DL1::max_sets, DL1::allocation>(
+        Replacement, "probe", KnobCacheSize.Value() * KILO,
+        KnobLineSize.Value(), KnobAssociativity.Value(), invalidation_mutex);
+  }
+  if (!probe) {
+    cerr << "Unsupported -replace " << KnobReplacement.Value() << " with -a "
+         << KnobAssociativity.Value() << endl;
+    return Usage();
+  }
+  delete probe;
+
+  for (UINT32 i = 0; i < DETECTOR_SHARDS; i++) {
+    shards[i].detector = new InterferenceDetector(KnobLineSize.Value());
+    shards[i].detector->keepTopInterferences(KnobTop.Value());
+  }
+
+  INS_AddInstrumentFunction(Instruction, 0);
+  PIN_AddFiniFunction(Fini, 0);
+
+  // Never returns
+
+  PIN_StartProgram();
+
+  return 0;
+}
+
+/* ===================================================================== */
+/* eof */
+/* ===================================================================== */
@@ -0,0 +1,133 @@
+// Shows the counters that `pin -t mdcache.so -stats file` publishes while the
+// program runs (see LiveStats.h): each thread's cache hits and misses, and
+// the interferences that moved cache lines between threads the most.
+//
+//   fsstat [-i seconds between updates] stats-file
+//
+// The counters lag the program by up to one -stats_interval. Send the program
+// SIGUSR1 to have mdcache rewrite its interference file with them.
+
+#include "../LiveStats.h"
+
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+void usage(const char *argv0) {
+  std::cerr << "Usage: " << argv0
+            << " [-i seconds between updates] [stats file]" << std::endl;
+  exit(1);
+}
+
+double percent(uint64_t part, uint64_t whole) {
+  return whole == 0 ? 0 : 100.0 * part / whole;
+}
+
+void show(void *snapshot) {
+  const live_stats_header *header =
+      static_cast<const live_stats_header *>(snapshot);
+  bool running = kill(static_cast<pid_t>(header->pid), 0) == 0;
+  std::cout << "pid " << header->pid << (running ? "" : " (exited)")
+            << ", update " << header->updates << " at "
+            << header->elapsed_ms / 1000.0 << " s\n";
+
+  std::cout << "\n thread   load hits  load misses  store hits store misses"
+               "   miss %\n";
+  const live_stats_cache *caches = live_stats_caches(snapshot);
+  for (uint32_t i = 0; i < header->caches; ++i) {
+    const live_stats_cache &cache = caches[i];
+    uint64_t misses = cache.load_misses + cache.store_misses;
+    uint64_t accesses = misses + cache.load_hits + cache.store_hits;
+    std::cout << std::setw(7) << cache.thread << std::setw(12)
+              << cache.load_hits << std::setw(13) << cache.load_misses
+              << std::setw(12) << cache.store_hits << std::setw(13)
+              << cache.store_misses << std::setw(9) << std::fixed
+              << std::setprecision(2) << percent(misses, accesses) << '\n';
+  }
+
+  std::cout << "\n" << header->total_interferences << " interferences, "
+            << header->total_transfers << " line transfers; top "
+            << header->interferences << ":\n";
+  std::cout << "             addr1              addr2    transfers       count"
+               "        ww        wr        rw\n";
+  const live_stats_interference *interferences =
+      live_stats_interferences(snapshot);
+  for (uint32_t i = 0; i < header->interferences; ++i) {
+    const live_stats_interference &entry = interferences[i];
+    std::cout << std::hex << std::setw(18) << entry.addr1 << ' '
+              << std::setw(18) << entry.addr2 << std::dec << std::setw(13)
+              << entry.transfers << std::setw(12) << entry.count
+              << std::setw(10) << entry.ww << std::setw(10) << entry.wr
+              << std::setw(10) << entry.rw << '\n';
+  }
+  std::cout << std::flush;
+}
+
+int main(int argc, char **argv) {
+  unsigned interval = 0;
+  int first = 1;
+  for (; first + 1 < argc && argv[first][0] == '-'; first += 2) {
+    char *end;
+    if (std::strcmp(argv[first], "-i") != 0) {
+      usage(argv[0]);
+    }
+    interval = std::strtoul(argv[first + 1], &end, 10);
+    if (*end != '\0' || interval == 0) {
+      usage(argv[0]);
+    }
+  }
+  if (argc - first != 1) {
+    usage(argv[0]);
+  }
+
+  const char *path = argv[first];
+  int fd = open(path, O_RDONLY);
+  struct stat info;
+  if (fd < 0 || fstat(fd, &info) != 0) {
+    std::cerr << "Could not open stats file: " << path << std::endl;
+    exit(1);
+  }
+  void *file = MAP_FAILED;
+  if (static_cast<size_t>(info.st_size) >= sizeof(live_stats_header)) {
+    file = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  live_stats_header *header = static_cast<live_stats_header *>(file);
+  if (file == MAP_FAILED ||
+      std::memcmp(header->magic, LIVE_STATS_MAGIC, sizeof(LIVE_STATS_MAGIC)) !=
+          0 ||
+      static_cast<size_t>(info.st_size) <
+          live_stats_size(header->max_caches, header->max_interferences)) {
+    std::cerr << path << " was not written by mdcache -stats" << std::endl;
+    exit(1);
+  }
+
+  std::vector<char> snapshot(
+      live_stats_size(header->max_caches, header->max_interferences));
+  while (true) {
+    int tries = 0;
+    while (!live_stats_read(file, snapshot.data())) {
+      if (++tries == 100) {
+        std::cerr << "The stats kept changing while being read" << std::endl;
+        exit(1);
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    show(snapshot.data());
+    if (interval == 0) {
+      return 0;
+    }
+    std::this_thread::sleep_for(std::chrono::seconds(interval));
+    std::cout << '\n';
+  }
+}
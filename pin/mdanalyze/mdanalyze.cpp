@@ -0,0 +1,338 @@
+// Runs the mdcache cache model on memory accesses that the mdring Pin tool
+// passes through shared memory (see ShmRing.h), so application threads only
+// pay for recording them.
+//
+//   mdanalyze [-c cache KB] [-b line size] [-a associativity]
+//             [-p rr|lru|plru] [-k interferences per cache]
+//             [-r rings] [-n records per ring]
+//             shm-name output [sites output]
+//
+// Start it before `pin -t mdring.so -shm shm-name -- program`. Each thread of
+// the program gets its own ring and L1 data cache, drained and simulated by
+// a thread here, much as mdcache.cpp simulates each cache in the thread it
+// belongs to. Once a thread has exited and its ring is drained, the ring is
+// freed for a later thread, which gets a cache of its own. The outputs have
+// the same format as mdcache.out.cacheline64.interferences and
+// mdcache.out.cacheline64.sites.
+//
+// Accesses are only ordered within a thread. mdring publishes them in
+// batches, and each ring is simulated up to DRAIN_BATCH accesses at a time,
+// independently of the others, so the accesses of different threads meet in
+// the caches batch by batch rather than in the order they happened. Counts
+// are therefore batch-granular: interferences between accesses closer
+// together in time than a batch may be missed or miscounted, and the counts
+// are not comparable one for one with mdcache's, where each access is
+// simulated as it happens.
+
+#include "pin.H"
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <string>
+#include <sys/mman.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "../ShmRing.h"
+#include "../mdcache.H"
+#include "../mutex.PH"
+
+namespace DL1 {
+const UINT32 max_sets = KILO;
+const CACHE_ALLOC::STORE_ALLOCATION allocation = CACHE_ALLOC::STORE_ALLOCATE;
+
+typedef CACHE_BASE CACHE;
+} // namespace DL1
+
+namespace {
+
+struct Options {
+  UINT32 cacheSize = 32; // in kilobytes
+  UINT32 lineSize = 64;
+  UINT32 associativity = 4;
+  REPLACEMENT replacement = REPLACEMENT_TREE_PLRU;
+  UINT32 topK = 0; // interferences kept per cache; 0 for all
+  UINT32 rings = 64;
+  UINT32 capacity = 1 << 16;
+};
+
+// Records analyzed before the producer is told there is room again
+const uint64_t DRAIN_BATCH = 4096;
+
+void *segment;
+// by the order in which threads were analyzed
+std::map<UINT32, DL1::CACHE *> caches;
+// Held shared while simulating, and uniquely while adding a cache, because
+// RegisterPeer changes the peers of caches that may be in use.
+shared_mutex cachelist_mu;
+mutex invalidation_mutex;
+
+// You must have unique access to cachelist_mu
+DL1::CACHE *insert_cache(const Options &options) {
+  UINT32 thread = caches.size();
+  DL1::CACHE *cache = NewCache<DL1::max_sets, DL1::allocation>(
+      options.replacement, "L1 Data Cache for Core " + std::to_string(thread),
+      options.cacheSize * KILO, options.lineSize, options.associativity,
+      invalidation_mutex, options.topK);
+  for (auto &other : caches) {
+    other.second->RegisterPeer(cache);
+    cache->RegisterPeer(other.second);
+  }
+  caches[thread] = cache;
+  return cache;
+}
+
+// Simulates the accesses of the thread holding a ring until it exits, and
+// returns true, or until the program does, and returns false.
+bool simulate(UINT32 index, DL1::CACHE *cache) {
+  shm_ring_header *header = static_cast<shm_ring_header *>(segment);
+  shm_ring &ring = shm_rings(segment)[index];
+  const shm_ring_record *records = shm_ring_records(segment, index);
+  const uint64_t mask = header->capacity - 1;
+  uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+  while (true) {
+    // Read before head, so a finished ring's last records are not missed.
+    bool exited =
+        ring.state.load(std::memory_order_acquire) == SHM_RING_FINISHED;
+    bool done = header->done.load(std::memory_order_acquire);
+    uint64_t head = ring.head.load(std::memory_order_acquire);
+    if (head == tail) {
+      if (exited) {
+        return true;
+      }
+      if (done) {
+        return false;
+      }
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+      continue;
+    }
+    if (head - tail > DRAIN_BATCH) {
+      head = tail + DRAIN_BATCH;
+    }
+    {
+      shared_lock lock(cachelist_mu);
+      for (; tail != head; ++tail) {
+        const shm_ring_record &record = records[tail & mask];
+        auto type = record.is_write ? CACHE_BASE::ACCESS_TYPE_STORE
+                                    : CACHE_BASE::ACCESS_TYPE_LOAD;
+        // mdcache.cpp treats accesses of up to 4 bytes as within one line.
+        if (record.size <= 4) {
+          cache->AccessSingleLine(record.addr, record.size, type, record.ip);
+        } else {
+          cache->Access(record.addr, record.size, type, record.ip);
+        }
+      }
+    }
+    ring.tail.store(tail, std::memory_order_release);
+  }
+}
+
+// Simulates each thread that claims ring `index` in a cache of its own,
+// freeing the ring for the next one whenever a thread exits, until the
+// program does.
+void drain(UINT32 index, const Options &options) {
+  shm_ring_header *header = static_cast<shm_ring_header *>(segment);
+  shm_ring &ring = shm_rings(segment)[index];
+  while (true) {
+    DL1::CACHE *cache;
+    {
+      unique_lock lock(cachelist_mu);
+      cache = insert_cache(options);
+    }
+    if (!simulate(index, cache)) {
+      return;
+    }
+    // The thread is gone, so nothing else touches the ring until it is free.
+    ring.head.store(0, std::memory_order_relaxed);
+    ring.tail.store(0, std::memory_order_relaxed);
+    ring.state.store(SHM_RING_FREE, std::memory_order_release);
+    while (true) {
+      // Read before the state, so a thread that claims the ring before the
+      // program exits is not missed.
+      bool done = header->done.load(std::memory_order_acquire);
+      if (ring.state.load(std::memory_order_acquire) != SHM_RING_FREE) {
+        break;
+      }
+      if (done) {
+        return;
+      }
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+  }
+}
+
+void usage(const char *argv0) {
+  std::cerr << "Usage: " << argv0
+            << " [-c cache size in KB] [-b cache line size] [-a associativity]"
+            << " [-p rr|lru|plru] [-k interferences kept per cache]"
+            << " [-r rings] [-n records per ring]"
+            << " [shared memory name]"
+            << " [output file] [sites output file]" << std::endl;
+  exit(1);
+}
+
+UINT32 number(const char *argv0, const char *text) {
+  char *end;
+  unsigned long value = std::strtoul(text, &end, 10);
+  if (*text == '\0' || *end != '\0' || value == 0 || value > UINT32_MAX) {
+    usage(argv0);
+  }
+  return value;
+}
+
+// Creates the segment mdring attaches to, replacing any left by an earlier
+// run.
+shm_ring_header *create_segment(const char *name, const Options &options) {
+  shm_unlink(name);
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  size_t size = shm_ring_segment_size(options.rings, options.capacity);
+  if (fd < 0 || ftruncate(fd, size) != 0) {
+    std::cerr << "Could not create shared memory: " << name << std::endl;
+    exit(1);
+  }
+  segment = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (segment == MAP_FAILED) {
+    std::cerr << "Could not map shared memory: " << name << std::endl;
+    exit(1);
+  }
+  // A new segment is zeroed: every ring is free and empty.
+  shm_ring_header *header = static_cast<shm_ring_header *>(segment);
+  header->rings = options.rings;
+  header->capacity = options.capacity;
+  std::atomic_thread_fence(std::memory_order_release);
+  std::memcpy(header->magic, SHM_RING_MAGIC, sizeof(SHM_RING_MAGIC));
+  return header;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  Options options;
+  int first = 1;
+  for (; first + 1 < argc && argv[first][0] == '-'; first += 2) {
+    if (std::strcmp(argv[first], "-p") == 0) {
+      if (!ParseReplacement(argv[first + 1], options.replacement)) {
+        usage(argv[0]);
+      }
+      continue;
+    }
+    UINT32 value = number(argv[0], argv[first + 1]);
+    if (std::strcmp(argv[first], "-c") == 0) {
+      options.cacheSize = value;
+    } else if (std::strcmp(argv[first], "-b") == 0) {
+      options.lineSize = value;
+    } else if (std::strcmp(argv[first], "-a") == 0) {
+      options.associativity = value;
+    } else if (std::strcmp(argv[first], "-k") == 0) {
+      options.topK = value;
+    } else if (std::strcmp(argv[first], "-r") == 0) {
+      options.rings = value;
+    } else if (std::strcmp(argv[first], "-n") == 0 &&
+               (value & (value - 1)) == 0) {
+      options.capacity = value;
+    } else {
+      usage(argv[0]);
+    }
+  }
+  if (argc - first != 2 && argc - first != 3) {
+    usage(argv[0]);
+  }
+  CACHE_BASE *probe = NewCache<DL1::max_sets, DL1::allocation>(
+      options.replacement, "probe", options.cacheSize * KILO,
+      options.lineSize, options.associativity, invalidation_mutex);
+  if (!probe) {
+    std::cerr << "Unsupported associativity for this replacement policy: "
+              << options.associativity << std::endl;
+    exit(1);
+  }
+  delete probe;
+
+  const char *name = argv[first];
+  std::ofstream out(argv[first + 1]);
+  if (!out.is_open()) {
+    std::cerr << "Could not open output file: " << argv[first + 1]
+              << std::endl;
+    exit(1);
+  }
+  std::ofstream sitesOut;
+  if (argc - first == 3) {
+    sitesOut.open(argv[first + 2]);
+    if (!sitesOut.is_open()) {
+      std::cerr << "Could not open output file: " << argv[first + 2]
+                << std::endl;
+      exit(1);
+    }
+  }
+
+  shm_ring_header *header = create_segment(name, options);
+  std::cout << "Waiting for pin -t mdring.so -shm " << name << std::endl;
+
+  // Starts a thread for each ring as soon as a program thread first claims
+  // it. Threads claim the first free ring, so the claimed ones are a prefix.
+  shm_ring *rings = shm_rings(segment);
+  std::vector<std::thread> drainers;
+  UINT32 started = 0;
+  while (true) {
+    bool done = header->done.load(std::memory_order_acquire);
+    for (; started < options.rings &&
+           rings[started].state.load(std::memory_order_acquire) !=
+               SHM_RING_FREE;
+         ++started) {
+      drainers.emplace_back(drain, started, std::cref(options));
+    }
+    if (done) {
+      break;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  for (std::thread &drainer : drainers) {
+    drainer.join();
+  }
+  std::cout << "Analyzed " << caches.size() << " threads in "
+            << drainers.size() << " rings" << std::endl;
+  if (header->untracked_threads > 0) {
+    std::cout << header->untracked_threads
+              << " more threads were not analyzed; increase -r" << std::endl;
+  }
+  munmap(segment, shm_ring_segment_size(options.rings, options.capacity));
+  shm_unlink(name);
+
+  INTERFERENCE_MAP counts;
+  SITE_MAP sites;
+  for (auto &pair : caches) {
+    AddAllMappings(pair.second->InterferenceCounts(), counts);
+    AddAllSites(pair.second->SiteCounts(), sites);
+    if (options.topK > 0) {
+      std::cout << "Cache " << pair.first << ": evicted "
+                << pair.second->InterferencesEvicted()
+                << " interferences; counts may be short by up to "
+                << pair.second->InterferenceErrorBound() << std::endl;
+    }
+  }
+  out << "# sorted by addr1, addr2\n";
+  for (auto &count : counts) {
+    out << std::hex << count.first.first << "\t" << count.first.second << "\t"
+        << std::dec << count.second.count << "\t" << count.second.lowerSize
+        << "\t" << count.second.upperSize << "\t" << count.second.writeWrite
+        << "\t" << count.second.writeRead << "\t" << count.second.readWrite
+        << "\t" << count.second.transfers << "\n";
+  }
+
+  if (sitesOut.is_open()) {
+    sitesOut << "# addr1, addr2, ip1, ip2, count\n";
+    for (auto &site : sites) {
+      sitesOut << std::hex << site.first.first.first << "\t"
+               << site.first.first.second << "\t" << site.first.second.first
+               << "\t" << site.first.second.second << "\t" << std::dec
+               << site.second << "\n";
+    }
+  }
+}
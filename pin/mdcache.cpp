@@ -6,15 +6,39 @@
 /*! @file
  *  This file contains an ISA-portable cache simulator
  *  data cache hierarchies
+ *
+ *  With -slice, the run is also split into time slices of that many
+ *  milliseconds, and the interferences found during slice N are written to
+ *  the interference file's name with .sliceN before .interferences, with a
+ *  line per slice in a .slices file, for MapAddr -t.
+ *
+ *  With -stats, the cache stats and the interferences with the most
+ *  transfers are published to a memory-mapped file (see LiveStats.h) that
+ *  fsstat reads while the program runs, and SIGUSR1 rewrites the interference
+ *  file with the counts so far, for programs that never exit cleanly.
+ *
+ *  With -top, each cache only keeps the interferences it finds most often,
+ *  so memory no longer grows with every distinct address pair, and the DCACHE
+ *  stats give how far off the counts kept can be.
  */
 
 #include "pin.H"
 
+#include <algorithm>
+#include <atomic>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
 #include <fstream>
 #include <iostream>
 #include <map>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
 
+#include "LiveStats.h"
 #include "mdcache.H"
+#include "memop_filter.PH"
 #include "mutex.PH"
 #include "pin_profile.H"
 using std::cerr;
@@ -24,6 +48,8 @@ using std::string;
 
 std::ofstream outFile;
 std::ofstream interferenceFile;
+std::string interferenceFilename;
+std::ofstream sitesFile;
 
 template <typename T> std::string sstr(T t) {
   std::ostringstream sstr;
@@ -63,10 +89,42 @@ KNOB<UINT32> KnobLineSize(KNOB_MODE_WRITEONCE, "pintool", "b", "64",
                           "cache block size in bytes");
 KNOB<UINT32> KnobAssociativity(KNOB_MODE_WRITEONCE, "pintool", "a", "4",
                                "cache associativity (1 for direct mapped)");
+KNOB<string> KnobReplacement(KNOB_MODE_WRITEONCE, "pintool", "replace",
+                             "plru",
+                             "cache replacement policy: rr (round robin), "
+                             "lru, or plru (tree pseudo-LRU)");
 KNOB<string> KnobInterferenceOutputFile(
     KNOB_MODE_WRITEONCE, "pintool", "i",
     std::string("mdcache.out.cacheline") + "XX" + ".interferences",
     "specify mdcache interference file name");
+KNOB<BOOL> KnobStack(KNOB_MODE_WRITEONCE, "pintool", "stack", "0",
+                     "also simulate accesses through the stack and frame "
+                     "pointers, for programs that share stack addresses");
+KNOB<BOOL> KnobCoalesce(KNOB_MODE_WRITEONCE, "pintool", "coalesce", "1",
+                        "simulate repeated accesses to the same address "
+                        "within a basic block once");
+KNOB<UINT32> KnobSlice(KNOB_MODE_WRITEONCE, "pintool", "slice", "0",
+                        "also write the interferences of each time slice of "
+                        "this many milliseconds to a file of its own (0 for "
+                        "none)");
+KNOB<string> KnobStats(KNOB_MODE_WRITEONCE, "pintool", "stats", "",
+                       "publish per-cache stats and the top interferences to "
+                       "this memory-mapped file for fsstat while the program "
+                       "runs; SIGUSR1 then also rewrites the interference "
+                       "file");
+KNOB<UINT32> KnobStatsInterval(KNOB_MODE_WRITEONCE, "pintool",
+                               "stats_interval", "1000",
+                               "milliseconds between -stats updates, unless "
+                               "-slice gives them");
+KNOB<UINT32> KnobStatsTop(KNOB_MODE_WRITEONCE, "pintool", "stats_top", "20",
+                          "interferences with the most transfers to publish");
+KNOB<UINT32> KnobTop(KNOB_MODE_WRITEONCE, "pintool", "top", "0",
+                     "keep only this many interferences per cache, the ones "
+                     "found most often (0 keeps them all)");
+KNOB<string> KnobSitesOutputFile(
+    KNOB_MODE_WRITEONCE, "pintool", "sites",
+    std::string("mdcache.out.cacheline") + "XX" + ".sites",
+    "specify file name for the instruction pairs behind each interference");
 
 /* ===================================================================== */
 /* Print Help Message                                                    */
@@ -87,21 +145,30 @@ INT32 Usage() {
 // wrap configuation constants into their own name space to avoid name clashes
 namespace DL1 {
 const UINT32 max_sets = KILO;         // cacheSize / (lineSize * associativity);
-const UINT32 max_associativity = 256; // associativity;
 const CACHE_ALLOC::STORE_ALLOCATION allocation = CACHE_ALLOC::STORE_ALLOCATE;
 
-typedef CACHE_ROUND_ROBIN(max_sets, max_associativity, allocation) CACHE;
+// Made by NewCache for the -a and -replace knobs
+typedef CACHE_BASE CACHE;
 } // namespace DL1
 
+REPLACEMENT Replacement;
+
+// Routines whose rbp accesses are to the stack, skipped without -stack
+FRAME_POINTERS FramePointers;
+
 std::map<UINT32, DL1::CACHE *> caches;
 shared_mutex cachelist_mu;
 mutex invalidation_mutex;
 
 // You must have unique access to cachelist_mu
 void insert_cache_for(UINT32 thread) {
-  DL1::CACHE *cache = new DL1::CACHE(
-      "L1 Data Cache for Core " + sstr(thread), KnobCacheSize.Value() * KILO,
-      KnobLineSize.Value(), KnobAssociativity.Value(), invalidation_mutex);
+  DL1::CACHE *cache = NewCache<DL1::max_sets, DL1::allocation>(
+      Replacement, "L1 Data Cache for Core " + sstr(thread),
+      KnobCacheSize.Value() * KILO, KnobLineSize.Value(),
+      KnobAssociativity.Value(), invalidation_mutex, KnobTop.Value());
+  // Collected by CollectTick
+  if (KnobSlice.Value() > 0 || !KnobStats.Value().empty())
+    cache->TrackRecentInterferences();
   std::map<UINT32, DL1::CACHE *>::iterator it;
   for (it = caches.begin(); it != caches.end(); it++) {
     it->second->RegisterPeer(cache);
@@ -125,6 +192,67 @@ void ensure_cache_exists(UINT32 thread) {
   cachelist_mu.unlock_shared();
 }
 
+// Periodic work for -slice and -stats. An internal thread advances Tick every
+// TickMs, after taking what each cache found during the tick (see
+// TakeRecentInterferences) into the totals below, so threads that are blocked
+// or idle are counted too. With -slice, a tick is a time slice.
+std::atomic<UINT32> Tick(0);
+UINT32 TickMs;
+PIN_THREAD_UID TimerUid;
+std::atomic<BOOL> StopTimer(FALSE);
+
+mutex totals_mu;
+std::vector<INTERFERENCE_MAP> Slices; // with -slice
+// The whole run so far, with -stats; bounded like the caches' by -top
+typedef SpaceSaving<Interference, INTERFERENCE_INFO, INTERFERENCE_HASH>
+    LIVE_COUNTS;
+LIVE_COUNTS LiveCounts;
+
+// -stats: the mapped stats file, and whether SIGUSR1 asked for the results
+live_stats_header *LiveStats;
+std::atomic<BOOL> FlushRequested(FALSE);
+// Caches past this many are left out of the stats file
+const UINT32 max_live_caches = 256;
+
+// Adds what every cache found since the last call to the current slice and
+// to LiveCounts. You may not have possession of cachelist_mu or totals_mu.
+VOID CollectTick() {
+  shared_lock caches_lock(cachelist_mu);
+  std::map<UINT32, DL1::CACHE *>::iterator cache;
+  for (cache = caches.begin(); cache != caches.end(); cache++) {
+    INTERFERENCE_MAP found = cache->second->TakeRecentInterferences();
+    lock_guard lock(totals_mu);
+    if (KnobSlice.Value() > 0) {
+      UINT32 tick = Tick.load(std::memory_order_relaxed);
+      if (Slices.size() <= tick)
+        Slices.resize(tick + 1);
+      AddAllMappings(found, Slices[tick]);
+    }
+    if (LiveStats) {
+      INTERFERENCE_MAP::const_iterator it;
+      for (it = found.begin(); it != found.end(); it++)
+        LiveCounts.add(it->first, it->second.count).Merge(it->second);
+    }
+  }
+}
+
+// Each thread's cache, so accesses need not look it up under cachelist_mu
+TLS_KEY cache_key;
+
+DL1::CACHE *CacheFor(UINT32 thread) {
+  DL1::CACHE *cache =
+      static_cast<DL1::CACHE *>(PIN_GetThreadData(cache_key, thread));
+  if (!cache) {
+    ensure_cache_exists(thread);
+    {
+      shared_lock lock(cachelist_mu);
+      cache = caches.find(thread)->second;
+    }
+    PIN_SetThreadData(cache_key, cache, thread);
+  }
+  return cache;
+}
+
 typedef enum { COUNTER_MISS = 0, COUNTER_HIT = 1, COUNTER_NUM } COUNTER;
 
 typedef COUNTER_ARRAY<UINT64, COUNTER_NUM> COUNTER_HIT_MISS;
@@ -135,16 +263,12 @@ COMPRESSOR_COUNTER<ADDRINT, UINT32, COUNTER_HIT_MISS> profile;
 
 /* ===================================================================== */
 
-VOID LoadMulti(ADDRINT addr, UINT32 size, UINT32 instId, UINT32 threadID) {
+VOID LoadMulti(ADDRINT addr, UINT32 size, UINT32 instId, UINT32 threadID,
+               ADDRINT ip) {
   // first level D-cache
-  ensure_cache_exists(threadID);
-  DL1::CACHE *cache;
-  {
-    shared_lock lock(cachelist_mu);
-    cache = caches.find(threadID)->second;
-  }
-
-  const BOOL cacheHit = cache->Access(addr, size, CACHE_BASE::ACCESS_TYPE_LOAD);
+  DL1::CACHE *cache = CacheFor(threadID);
+  const BOOL cacheHit =
+      cache->Access(addr, size, CACHE_BASE::ACCESS_TYPE_LOAD, ip);
 
   const COUNTER counter = cacheHit ? COUNTER_HIT : COUNTER_MISS;
   profile[instId][counter]++;
@@ -152,17 +276,12 @@ VOID LoadMulti(ADDRINT addr, UINT32 size, UINT32 instId, UINT32 threadID) {
 
 /* ===================================================================== */
 
-VOID StoreMulti(ADDRINT addr, UINT32 size, UINT32 instId, UINT32 threadID) {
+VOID StoreMulti(ADDRINT addr, UINT32 size, UINT32 instId, UINT32 threadID,
+                ADDRINT ip) {
   // first level D-cache
-  ensure_cache_exists(threadID);
-  DL1::CACHE *cache;
-  {
-    shared_lock lock(cachelist_mu);
-    cache = caches.find(threadID)->second;
-  }
-
+  DL1::CACHE *cache = CacheFor(threadID);
   const BOOL cacheHit =
-      cache->Access(addr, size, CACHE_BASE::ACCESS_TYPE_STORE);
+      cache->Access(addr, size, CACHE_BASE::ACCESS_TYPE_STORE, ip);
 
   const COUNTER counter = cacheHit ? COUNTER_HIT : COUNTER_MISS;
   profile[instId][counter]++;
@@ -170,36 +289,26 @@ VOID StoreMulti(ADDRINT addr, UINT32 size, UINT32 instId, UINT32 threadID) {
 
 /* ===================================================================== */
 
-VOID LoadSingle(ADDRINT addr, UINT32 instId, UINT32 threadID) {
+VOID LoadSingle(ADDRINT addr, UINT32 size, UINT32 instId, UINT32 threadID,
+                ADDRINT ip) {
   // @todo we may access several cache lines for
   // first level D-cache
-  ensure_cache_exists(threadID);
-  DL1::CACHE *cache;
-  {
-    shared_lock lock(cachelist_mu);
-    cache = caches.find(threadID)->second;
-  }
-
+  DL1::CACHE *cache = CacheFor(threadID);
   const BOOL cacheHit =
-      cache->AccessSingleLine(addr, CACHE_BASE::ACCESS_TYPE_LOAD);
+      cache->AccessSingleLine(addr, size, CACHE_BASE::ACCESS_TYPE_LOAD, ip);
 
   const COUNTER counter = cacheHit ? COUNTER_HIT : COUNTER_MISS;
   profile[instId][counter]++;
 }
 /* ===================================================================== */
 
-VOID StoreSingle(ADDRINT addr, UINT32 instId, UINT32 threadID) {
+VOID StoreSingle(ADDRINT addr, UINT32 size, UINT32 instId, UINT32 threadID,
+                 ADDRINT ip) {
   // @todo we may access several cache lines for
   // first level D-cache
-  ensure_cache_exists(threadID);
-  DL1::CACHE *cache;
-  {
-    shared_lock lock(cachelist_mu);
-    cache = caches.find(threadID)->second;
-  }
-
+  DL1::CACHE *cache = CacheFor(threadID);
   const BOOL cacheHit =
-      cache->AccessSingleLine(addr, CACHE_BASE::ACCESS_TYPE_STORE);
+      cache->AccessSingleLine(addr, size, CACHE_BASE::ACCESS_TYPE_STORE, ip);
 
   const COUNTER counter = cacheHit ? COUNTER_HIT : COUNTER_MISS;
   profile[instId][counter]++;
@@ -207,65 +316,40 @@ VOID StoreSingle(ADDRINT addr, UINT32 instId, UINT32 threadID) {
 
 /* ===================================================================== */
 
-VOID LoadMultiFast(ADDRINT addr, UINT32 size, UINT32 threadID) {
-  ensure_cache_exists(threadID);
-  DL1::CACHE *cache;
-  {
-    shared_lock lock(cachelist_mu);
-    cache = caches.find(threadID)->second;
-  }
-
-  cache->Access(addr, size, CACHE_BASE::ACCESS_TYPE_LOAD);
+VOID LoadMultiFast(ADDRINT addr, UINT32 size, UINT32 threadID, ADDRINT ip) {
+  DL1::CACHE *cache = CacheFor(threadID);
+  cache->Access(addr, size, CACHE_BASE::ACCESS_TYPE_LOAD, ip);
 }
 
 /* ===================================================================== */
 
-VOID StoreMultiFast(ADDRINT addr, UINT32 size, UINT32 threadID) {
-  ensure_cache_exists(threadID);
-  DL1::CACHE *cache;
-  {
-    shared_lock lock(cachelist_mu);
-    cache = caches.find(threadID)->second;
-  }
-
-  cache->Access(addr, size, CACHE_BASE::ACCESS_TYPE_STORE);
+VOID StoreMultiFast(ADDRINT addr, UINT32 size, UINT32 threadID, ADDRINT ip) {
+  DL1::CACHE *cache = CacheFor(threadID);
+  cache->Access(addr, size, CACHE_BASE::ACCESS_TYPE_STORE, ip);
 }
 
 /* ===================================================================== */
 
-VOID LoadSingleFast(ADDRINT addr, UINT32 threadID) {
-  ensure_cache_exists(threadID);
-  DL1::CACHE *cache;
-  {
-    shared_lock lock(cachelist_mu);
-    cache = caches.find(threadID)->second;
-  }
-
-  cache->AccessSingleLine(addr, CACHE_BASE::ACCESS_TYPE_LOAD);
+VOID LoadSingleFast(ADDRINT addr, UINT32 size, UINT32 threadID, ADDRINT ip) {
+  DL1::CACHE *cache = CacheFor(threadID);
+  cache->AccessSingleLine(addr, size, CACHE_BASE::ACCESS_TYPE_LOAD, ip);
 }
 
 /* ===================================================================== */
 
-VOID StoreSingleFast(ADDRINT addr, UINT32 threadID) {
-  ensure_cache_exists(threadID);
-    DL1::CACHE *cache;
-  {
-    shared_lock lock(cachelist_mu);
-    cache = caches.find(threadID)->second;
-  }
-
-
-  cache->AccessSingleLine(addr, CACHE_BASE::ACCESS_TYPE_STORE);
+VOID StoreSingleFast(ADDRINT addr, UINT32 size, UINT32 threadID,
+                     ADDRINT ip) {
+  DL1::CACHE *cache = CacheFor(threadID);
+  cache->AccessSingleLine(addr, size, CACHE_BASE::ACCESS_TYPE_STORE, ip);
 }
 
 /* ===================================================================== */
 
-VOID Instruction(INS ins, void *v) {
-  if (!INS_IsStandardMemop(ins))
-    return;
-
-  if (INS_MemoryOperandCount(ins) == 0)
+VOID Instruction(INS ins, MEMOP_FILTER &filter) {
+  if (!INS_IsStandardMemop(ins) || INS_MemoryOperandCount(ins) == 0) {
+    filter.Next(ins);
     return;
+  }
 
   UINT32 readSize = 0, writeSize = 0;
   UINT32 readOperandCount = 0, writeOperandCount = 0;
@@ -273,15 +357,18 @@ VOID Instruction(INS ins, void *v) {
   for (UINT32 opIdx = 0; opIdx < INS_MemoryOperandCount(ins); opIdx++) {
     if (INS_MemoryOperandIsRead(ins, opIdx)) {
       readSize = INS_MemoryOperandSize(ins, opIdx);
-      readOperandCount++;
+      if (filter.Wanted(ins, opIdx, FALSE))
+        readOperandCount++;
       break;
     }
     if (INS_MemoryOperandIsWritten(ins, opIdx)) {
       writeSize = INS_MemoryOperandSize(ins, opIdx);
-      writeOperandCount++;
+      if (filter.Wanted(ins, opIdx, TRUE))
+        writeOperandCount++;
       break;
     }
   }
+  filter.Next(ins);
 
   if (readOperandCount > 0) {
     // map sparse INS addresses to dense IDs
@@ -293,22 +380,24 @@ VOID Instruction(INS ins, void *v) {
     if (KnobTrackLoads) {
       if (single) {
         INS_InsertPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)LoadSingle,
-                                 IARG_MEMORYREAD_EA, IARG_UINT32, instId,
-                                 IARG_THREAD_ID, IARG_END);
+                                 IARG_MEMORYREAD_EA, IARG_UINT32, readSize,
+                                 IARG_UINT32, instId, IARG_THREAD_ID,
+                                 IARG_INST_PTR, IARG_END);
       } else {
         INS_InsertPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)LoadMulti,
                                  IARG_MEMORYREAD_EA, IARG_MEMORYREAD_SIZE,
                                  IARG_UINT32, instId, IARG_THREAD_ID,
-                                   IARG_END);
+                                 IARG_INST_PTR, IARG_END);
       }
     } else {
       if (single) {
         INS_InsertPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)LoadSingleFast,
-                                 IARG_MEMORYREAD_EA, IARG_THREAD_ID, IARG_END);
+                                 IARG_MEMORYREAD_EA, IARG_UINT32, readSize,
+                                 IARG_THREAD_ID, IARG_INST_PTR, IARG_END);
       } else {
         INS_InsertPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)LoadMultiFast,
                                  IARG_MEMORYREAD_EA, IARG_MEMORYREAD_SIZE,
-                                 IARG_THREAD_ID, IARG_END);
+                                 IARG_THREAD_ID, IARG_INST_PTR, IARG_END);
       }
     }
   }
@@ -322,27 +411,169 @@ VOID Instruction(INS ins, void *v) {
     if (KnobTrackStores) {
       if (single) {
         INS_InsertPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)StoreSingle,
-                                 IARG_MEMORYWRITE_EA, IARG_UINT32, instId,
-                                 IARG_THREAD_ID, IARG_END);
+                                 IARG_MEMORYWRITE_EA, IARG_UINT32, writeSize,
+                                 IARG_UINT32, instId, IARG_THREAD_ID,
+                                 IARG_INST_PTR, IARG_END);
       } else {
         INS_InsertPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)StoreMulti,
                                  IARG_MEMORYWRITE_EA, IARG_MEMORYWRITE_SIZE,
                                  IARG_UINT32, instId, IARG_THREAD_ID,
-                                   IARG_END);
+                                 IARG_INST_PTR, IARG_END);
       }
     } else {
       if (single) {
         INS_InsertPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)StoreSingleFast,
-                                 IARG_MEMORYWRITE_EA, IARG_THREAD_ID, IARG_END);
+                                 IARG_MEMORYWRITE_EA, IARG_UINT32, writeSize,
+                                 IARG_THREAD_ID, IARG_INST_PTR, IARG_END);
       } else {
         INS_InsertPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)StoreMultiFast,
                                  IARG_MEMORYWRITE_EA, IARG_MEMORYWRITE_SIZE,
-                                 IARG_THREAD_ID, IARG_END);
+                                 IARG_THREAD_ID, IARG_INST_PTR, IARG_END);
       }
     }
   }
 }
 
+VOID Trace(TRACE trace, VOID *v) {
+  for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl)) {
+    MEMOP_FILTER filter(!KnobStack,
+                        !KnobStack && FramePointers.InFrame(TRACE_Rtn(trace)),
+                        KnobCoalesce);
+    for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins)) {
+      Instruction(ins, filter);
+    }
+  }
+}
+
+/* ===================================================================== */
+
+// counts is ordered by (lower, upper), so MapAddr can stream the file (see
+// SORTED_INTERFERENCES_HEADER in MapAddr/AccessInfo.h).
+VOID WriteInterferences(std::ofstream &out, const INTERFERENCE_MAP &counts) {
+  out << "# sorted by addr1, addr2\n";
+  INTERFERENCE_MAP::const_iterator cit;
+  for (cit = counts.begin(); cit != counts.end(); cit++) {
+    out << std::hex << cit->first.first << "\t" << cit->first.second << "\t"
+        << std::dec << cit->second.count << "\t" << cit->second.lowerSize
+        << "\t" << cit->second.upperSize << "\t" << cit->second.writeWrite
+        << "\t" << cit->second.writeRead << "\t" << cit->second.readWrite
+        << "\t" << cit->second.transfers << "\n";
+  }
+}
+
+// Writes name.sliceN.interferences for each slice, and name.slices. You must
+// hold totals_mu.
+VOID WriteSlices(std::string name) {
+  replace(name, ".interferences", "");
+  std::ofstream histogram((name + ".slices").c_str());
+  histogram << "# slice, start in ms, interferences, count, transfers\n";
+  for (size_t slice = 0; slice < Slices.size(); slice++) {
+    std::ofstream out(
+        (name + ".slice" + sstr(slice) + ".interferences").c_str());
+    WriteInterferences(out, Slices[slice]);
+    UINT64 count = 0, transfers = 0;
+    INTERFERENCE_MAP::const_iterator it;
+    for (it = Slices[slice].begin(); it != Slices[slice].end(); it++) {
+      count += it->second.count;
+      transfers += it->second.transfers;
+    }
+    histogram << slice << "\t" << slice * KnobSlice.Value() << "\t"
+              << Slices[slice].size() << "\t" << count << "\t" << transfers
+              << "\n";
+  }
+}
+
+bool MoreTransfers(const LIVE_COUNTS::Entry *left,
+                   const LIVE_COUNTS::Entry *right) {
+  return left->value.transfers > right->value.transfers;
+}
+
+// Rewrites the stats file with the counts collected so far.
+VOID PublishStats() {
+  shared_lock caches_lock(cachelist_mu);
+  lock_guard lock(totals_mu);
+  std::vector<const LIVE_COUNTS::Entry *> top;
+  UINT64 transfers = 0;
+  for (size_t i = 0; i < LiveCounts.entries().size(); i++) {
+    top.push_back(&LiveCounts.entries()[i]);
+    transfers += LiveCounts.entries()[i].value.transfers;
+  }
+  size_t shown = std::min<size_t>(top.size(), LiveStats->max_interferences);
+  std::partial_sort(top.begin(), top.begin() + shown, top.end(),
+                    MoreTransfers);
+
+  live_stats_begin(LiveStats);
+  LiveStats->updates++;
+  LiveStats->elapsed_ms = static_cast<UINT64>(Tick.load()) * TickMs;
+  LiveStats->caches = std::min<size_t>(caches.size(), max_live_caches);
+  std::map<UINT32, DL1::CACHE *>::const_iterator cit = caches.begin();
+  for (UINT32 i = 0; i < LiveStats->caches; i++, cit++) {
+    live_stats_cache &stats = live_stats_caches(LiveStats)[i];
+    const DL1::CACHE *cache = cit->second;
+    stats.thread = cit->first;
+    stats.load_hits = cache->Hits(CACHE_BASE::ACCESS_TYPE_LOAD);
+    stats.load_misses =
+        cache->Accesses(CACHE_BASE::ACCESS_TYPE_LOAD) - stats.load_hits;
+    stats.store_hits = cache->Hits(CACHE_BASE::ACCESS_TYPE_STORE);
+    stats.store_misses =
+        cache->Accesses(CACHE_BASE::ACCESS_TYPE_STORE) - stats.store_hits;
+  }
+  LiveStats->interferences = shown;
+  for (size_t i = 0; i < shown; i++) {
+    live_stats_interference &entry = live_stats_interferences(LiveStats)[i];
+    entry.addr1 = top[i]->key.first;
+    entry.addr2 = top[i]->key.second;
+    entry.count = top[i]->value.count;
+    entry.size1 = top[i]->value.lowerSize;
+    entry.size2 = top[i]->value.upperSize;
+    entry.ww = top[i]->value.writeWrite;
+    entry.wr = top[i]->value.writeRead;
+    entry.rw = top[i]->value.readWrite;
+    entry.transfers = top[i]->value.transfers;
+  }
+  LiveStats->total_interferences = LiveCounts.size();
+  LiveStats->total_transfers = transfers;
+  live_stats_end(LiveStats);
+}
+
+// Rewrites the interference file (and the slices) with the counts collected
+// so far, for SIGUSR1. Sites are only written at the end.
+VOID FlushResults() {
+  lock_guard lock(totals_mu);
+  INTERFERENCE_MAP counts;
+  for (size_t i = 0; i < LiveCounts.entries().size(); i++)
+    counts[LiveCounts.entries()[i].key] = LiveCounts.entries()[i].value;
+  std::ofstream out(interferenceFilename.c_str());
+  WriteInterferences(out, counts);
+  if (KnobSlice.Value() > 0)
+    WriteSlices(interferenceFilename);
+}
+
+VOID Timer(VOID *v) {
+  while (!PIN_IsProcessExiting() && !StopTimer) {
+    PIN_Sleep(TickMs);
+    CollectTick();
+    Tick.fetch_add(1, std::memory_order_relaxed);
+    if (LiveStats) {
+      PublishStats();
+      if (FlushRequested.exchange(FALSE))
+        FlushResults();
+    }
+  }
+}
+
+VOID PrepareForFini(VOID *v) {
+  StopTimer = TRUE;
+  PIN_WaitForThreadTermination(TimerUid, PIN_INFINITE_TIMEOUT, 0);
+}
+
+// Left for the program if it handles SIGUSR1 itself
+BOOL Usr1(THREADID tid, INT32 sig, CONTEXT *ctxt, BOOL hasHandler,
+          const EXCEPTION_INFO *info, VOID *v) {
+  FlushRequested = TRUE;
+  return hasHandler;
+}
+
 /* ===================================================================== */
 
   VOID Fini(int code, VOID *v) {
@@ -355,22 +586,45 @@ VOID Instruction(INS ins, void *v) {
                "# DCACHE stats\n"
                "#\n";
 
-    std::map<Interference, unsigned> counts;
+    INTERFERENCE_MAP counts;
+    SITE_MAP sites;
 
     std::map<UINT32, DL1::CACHE *>::iterator it;
     for (it = caches.begin(); it != caches.end(); it++) {
       DL1::CACHE *cache = it->second;
       outFile << cache->StatsLong("# ", CACHE_BASE::CACHE_TYPE_DCACHE);
+      if (KnobTop.Value() > 0) {
+        // Counts kept may be short by the error bound, and no interference
+        // left out was found more often.
+        outFile << "# Interferences-Evicted:    " << cache->InterferencesEvicted()
+                << "\n# Interference-Error-Bound: "
+                << cache->InterferenceErrorBound() << "\n#\n";
+      }
       AddAllMappings(cache->InterferenceCounts(), counts);
+      AddAllSites(cache->SiteCounts(), sites);
     }
 
-    std::map<Interference, unsigned>::iterator cit;
     // interferenceFile << "Number of interferences: " << counts.size()
     //                  << std::endl;
-    for (cit = counts.begin(); cit != counts.end(); cit++) {
-      interferenceFile << std::hex << cit->first.first << "\t"
-                       << cit->first.second << "\t" << std::dec << cit->second
-                       << std::endl;
+    WriteInterferences(interferenceFile, counts);
+    if (KnobSlice.Value() > 0) {
+      // The timer has stopped; the last slice is still open.
+      CollectTick();
+      lock_guard lock(totals_mu);
+      // Slices after the last access are empty, but still listed.
+      Slices.resize(std::max<size_t>(
+          Slices.size(), Tick.load(std::memory_order_relaxed) + 1));
+      WriteSlices(interferenceFilename);
+    }
+
+    // Same format as detect's *.sites, for MapAddr -s
+    sitesFile << "# addr1, addr2, ip1, ip2, count\n";
+    SITE_MAP::iterator sit;
+    for (sit = sites.begin(); sit != sites.end(); sit++) {
+      sitesFile << std::hex << sit->first.first.first << "\t"
+                << sit->first.first.second << "\t" << sit->first.second.first
+                << "\t" << sit->first.second.second << "\t" << std::dec
+                << sit->second << "\n";
     }
 
     if (KnobTrackLoads || KnobTrackStores) {
@@ -382,8 +636,15 @@ VOID Instruction(INS ins, void *v) {
     }
     outFile.close();
     interferenceFile.close();
+    sitesFile.close();
   }
 
+// Only registered with -stats, so the timer is running.
+VOID Detach(VOID *v) {
+  PrepareForFini(v);
+  Fini(0, v);
+}
+
 /* ===================================================================== */
 /* Main                                                                  */
 /* ===================================================================== */
@@ -395,11 +656,30 @@ VOID Instruction(INS ins, void *v) {
         return Usage();
       }
 
+      // Checks that the knobs describe a cache NewCache can make.
+      CACHE_BASE *probe = 0;
+      if (ParseReplacement(KnobReplacement.Value(), Replacement)) {
+        probe = NewCache<DL1::max_sets, DL1::allocation>(
+            Replacement, "probe", KnobCacheSize.Value() * KILO,
+            KnobLineSize.Value(), KnobAssociativity.Value(), invalidation_mutex);
+      }
+      if (!probe) {
+        cerr << "Unsupported -replace " << KnobReplacement.Value() << " with -a "
+             << KnobAssociativity.Value() << endl;
+        return Usage();
+      }
+      delete probe;
+
       outFile.open(KnobOutputFile.Value().c_str());
       // Replace XX with the cachelinesize
-      std::string interferenceFilename = KnobInterferenceOutputFile.Value();
+      interferenceFilename = KnobInterferenceOutputFile.Value();
       replace(interferenceFilename, "XX", sstr(KnobLineSize.Value()));
       interferenceFile.open(interferenceFilename.c_str());
+      std::string sitesFilename = KnobSitesOutputFile.Value();
+      replace(sitesFilename, "XX", sstr(KnobLineSize.Value()));
+      sitesFile.open(sitesFilename.c_str());
+
+      cache_key = PIN_CreateThreadDataKey(0);
 
       profile.SetKeyName("iaddr          ");
       profile.SetCounterName("dcache:miss        dcache:hit");
@@ -411,7 +691,53 @@ VOID Instruction(INS ins, void *v) {
 
       profile.SetThreshold(threshold);
 
-      INS_AddInstrumentFunction(Instruction, 0);
+      if (!KnobStats.Value().empty()) {
+        UINT32 top = KnobStatsTop.Value();
+        size_t size = live_stats_size(max_live_caches, top);
+        int fd = open(KnobStats.Value().c_str(), O_RDWR | O_CREAT | O_TRUNC,
+                      0644);
+        void *file = MAP_FAILED;
+        if (fd >= 0 && ftruncate(fd, size) == 0)
+          file = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (fd >= 0)
+          close(fd);
+        if (file == MAP_FAILED) {
+          cerr << "Could not map stats file " << KnobStats.Value() << endl;
+          return 1;
+        }
+        LiveStats = static_cast<live_stats_header *>(file);
+        LiveCounts.setCapacity(KnobTop.Value());
+        LiveStats->max_caches = max_live_caches;
+        LiveStats->max_interferences = top;
+        LiveStats->pid = PIN_GetPid();
+        std::atomic_thread_fence(std::memory_order_release);
+        memcpy(LiveStats->magic, LIVE_STATS_MAGIC, sizeof(LIVE_STATS_MAGIC));
+
+        PIN_InterceptSignal(SIGUSR1, Usr1, 0);
+        // Pin does not call Fini when it detaches, so write everything then.
+        PIN_AddDetachFunction(Detach, 0);
+      }
+
+      if (KnobSlice.Value() > 0 || LiveStats) {
+        TickMs = KnobSlice.Value() > 0 ? KnobSlice.Value()
+                                       : KnobStatsInterval.Value();
+        if (TickMs == 0) {
+          cerr << "-stats_interval must be above 0" << endl;
+          return Usage();
+        }
+        if (PIN_SpawnInternalThread(Timer, 0, 0, &TimerUid) ==
+            INVALID_THREADID) {
+          cerr << "Could not start the timer thread" << endl;
+          return 1;
+        }
+        PIN_AddPrepareForFiniFunction(PrepareForFini, 0);
+      }
+
+      if (!KnobStack) {
+        IMG_AddInstrumentFunction(FRAME_POINTERS::ImageLoad, &FramePointers);
+        IMG_AddUnloadFunction(FRAME_POINTERS::ImageUnload, &FramePointers);
+      }
+      TRACE_AddInstrumentFunction(Trace, 0);
       PIN_AddFiniFunction(Fini, 0);
 
       // Never returns
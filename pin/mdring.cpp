@@ -0,0 +1,250 @@
+/*
+ * Copyright (C) 2004-2021 Intel Corporation.
+ * SPDX-License-Identifier: MIT
+ */
+
+/*! @file
+ *  This file contains a PIN tool that hands memory accesses to mdanalyze
+ *  through shared memory (see ShmRing.h) instead of simulating the caches
+ *  itself, as mdcache does. Start mdanalyze first:
+ *
+ *    mdanalyze /fs583 mdcache.out.cacheline64.interferences &
+ *    pin -t mdring.so -shm /fs583 -- program
+ *
+ *  Each thread writes its accesses into its own ring with an inlined
+ *  analysis routine and only leaves the inlined code to publish a batch or
+ *  to wait while its ring is full. Since accesses are published a batch at
+ *  a time, mdanalyze sees different threads' accesses interleaved by batch,
+ *  not in the order they happened (see mdanalyze.cpp).
+ */
+
+#include "pin.H"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
+
+#include "ShmRing.h"
+#include "mutex.PH"
+using std::cerr;
+using std::endl;
+using std::string;
+
+/* ===================================================================== */
+/* Commandline Switches */
+/* ===================================================================== */
+
+KNOB<string> KnobShm(KNOB_MODE_WRITEONCE, "pintool", "shm", "/fs583",
+                     "shared memory segment created by mdanalyze");
+KNOB<UINT32> KnobBatch(KNOB_MODE_WRITEONCE, "pintool", "batch", "1024",
+                       "accesses written before they are published to "
+                       "mdanalyze");
+
+/* ===================================================================== */
+/* Print Help Message                                                    */
+/* ===================================================================== */
+
+INT32 Usage() {
+  cerr << "This tool sends memory accesses to mdanalyze.\n"
+          "\n";
+
+  cerr << KNOB_BASE::StringKnobSummary() << endl;
+  return -1;
+}
+
+/* ===================================================================== */
+/* Global Variables */
+/* ===================================================================== */
+
+// A thread's position in its ring. Only the thread itself uses it, through
+// the tool register CursorReg, so the inlined routines need no lookups.
+struct RING_CURSOR {
+  shm_ring_record *records;
+  UINT64 mask;  // ring capacity - 1
+  UINT64 head;  // records written
+  UINT64 limit; // records that may be written before calling Refill
+  shm_ring *ring; // null for threads without a ring
+};
+
+VOID *Segment;
+shm_ring_header *Header;
+REG CursorReg;
+
+// Cursors of running threads, published once more at exit
+mutex cursors_mu;
+std::vector<RING_CURSOR *> Cursors;
+
+/* ===================================================================== */
+
+ADDRINT PIN_FAST_ANALYSIS_CALL IsFull(RING_CURSOR *cursor) {
+  return cursor->head == cursor->limit;
+}
+
+VOID PIN_FAST_ANALYSIS_CALL Record(RING_CURSOR *cursor, ADDRINT ip,
+                                   ADDRINT addr, UINT32 size, UINT32 isWrite) {
+  shm_ring_record &record = cursor->records[cursor->head & cursor->mask];
+  record.ip = ip;
+  record.addr = addr;
+  record.size = size;
+  record.is_write = isWrite;
+  cursor->head++;
+}
+
+// Publishes the records written so far, then waits for room for the next
+// batch. Threads without a ring overwrite their private buffer instead.
+VOID PIN_FAST_ANALYSIS_CALL Refill(RING_CURSOR *cursor) {
+  if (!cursor->ring) {
+    cursor->limit = cursor->head + cursor->mask + 1;
+    return;
+  }
+  cursor->ring->head.store(cursor->head, std::memory_order_release);
+  UINT64 tail;
+  while (cursor->head - (tail = cursor->ring->tail.load(
+                             std::memory_order_acquire)) > cursor->mask) {
+    PIN_Yield();
+  }
+  cursor->limit =
+      std::min(tail + cursor->mask + 1, cursor->head + KnobBatch.Value());
+}
+
+/* ===================================================================== */
+
+VOID Instruction(INS ins, VOID *v) {
+  if (!INS_IsStandardMemop(ins))
+    return;
+
+  for (UINT32 memOp = 0; memOp < INS_MemoryOperandCount(ins); memOp++) {
+    const BOOL isWrite = INS_MemoryOperandIsWritten(ins, memOp);
+    if (!isWrite && !INS_MemoryOperandIsRead(ins, memOp))
+      continue;
+
+    INS_InsertIfPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)IsFull,
+                               IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE,
+                               CursorReg, IARG_END);
+    INS_InsertThenPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)Refill,
+                                 IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE,
+                                 CursorReg, IARG_END);
+    INS_InsertPredicatedCall(
+        ins, IPOINT_BEFORE, (AFUNPTR)Record, IARG_FAST_ANALYSIS_CALL,
+        IARG_REG_VALUE, CursorReg, IARG_INST_PTR, IARG_MEMORYOP_EA, memOp,
+        IARG_UINT32, INS_MemoryOperandSize(ins, memOp), IARG_UINT32, isWrite,
+        IARG_END);
+  }
+}
+
+/* ===================================================================== */
+
+VOID ThreadStart(THREADID tid, CONTEXT *ctxt, INT32 flags, VOID *v) {
+  RING_CURSOR *cursor = new RING_CURSOR();
+  shm_ring *rings = shm_rings(Segment);
+  // A freed ring is emptied first, so its head and tail start from 0 again.
+  for (UINT32 i = 0; i < Header->rings && !cursor->ring; i++) {
+    UINT32 state = SHM_RING_FREE;
+    if (rings[i].state.compare_exchange_strong(state, SHM_RING_ATTACHED)) {
+      cursor->ring = &rings[i];
+      cursor->records = shm_ring_records(Segment, i);
+      cursor->mask = Header->capacity - 1;
+    }
+  }
+  if (!cursor->ring) {
+    // Analyzed by no one; mdanalyze reports how many threads were missed.
+    Header->untracked_threads++;
+    cursor->mask = KnobBatch.Value() - 1;
+    cursor->records = new shm_ring_record[KnobBatch.Value()];
+  }
+  {
+    lock_guard lock(cursors_mu);
+    Cursors.push_back(cursor);
+  }
+  PIN_SetContextReg(ctxt, CursorReg, reinterpret_cast<ADDRINT>(cursor));
+}
+
+VOID ThreadFini(THREADID tid, const CONTEXT *ctxt, INT32 code, VOID *v) {
+  RING_CURSOR *cursor = reinterpret_cast<RING_CURSOR *>(
+      PIN_GetContextReg(ctxt, CursorReg));
+  {
+    lock_guard lock(cursors_mu);
+    Cursors.erase(std::find(Cursors.begin(), Cursors.end(), cursor));
+  }
+  if (cursor->ring) {
+    cursor->ring->head.store(cursor->head, std::memory_order_release);
+    cursor->ring->state.store(SHM_RING_FINISHED, std::memory_order_release);
+  } else {
+    delete[] cursor->records;
+  }
+  delete cursor;
+}
+
+VOID Fini(INT32 code, VOID *v) {
+  {
+    lock_guard lock(cursors_mu);
+    for (RING_CURSOR *cursor : Cursors) {
+      if (cursor->ring) {
+        cursor->ring->head.store(cursor->head, std::memory_order_release);
+      }
+    }
+  }
+  Header->done.store(1, std::memory_order_release);
+  munmap(Segment, shm_ring_segment_size(Header->rings, Header->capacity));
+}
+
+/* ===================================================================== */
+/* Main                                                                  */
+/* ===================================================================== */
+
+int main(int argc, char *argv[]) {
+  if (PIN_Init(argc, argv)) {
+    return Usage();
+  }
+  if (KnobBatch.Value() == 0 ||
+      (KnobBatch.Value() & (KnobBatch.Value() - 1)) != 0) {
+    cerr << "-batch must be a power of two" << endl;
+    return 1;
+  }
+
+  int fd = shm_open(KnobShm.Value().c_str(), O_RDWR, 0);
+  if (fd < 0) {
+    cerr << "Could not open " << KnobShm.Value() << "; is mdanalyze running?"
+         << endl;
+    return 1;
+  }
+  shm_ring_header header;
+  if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+      !std::equal(header.magic, header.magic + sizeof(SHM_RING_MAGIC),
+                  SHM_RING_MAGIC)) {
+    cerr << KnobShm.Value() << " was not created by mdanalyze" << endl;
+    return 1;
+  }
+  Segment = mmap(0, shm_ring_segment_size(header.rings, header.capacity),
+                 PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (Segment == MAP_FAILED) {
+    cerr << "Could not map " << KnobShm.Value() << endl;
+    return 1;
+  }
+  Header = static_cast<shm_ring_header *>(Segment);
+
+  CursorReg = PIN_ClaimToolRegister();
+  if (!REG_valid(CursorReg)) {
+    cerr << "Cannot allocate a scratch register" << endl;
+    return 1;
+  }
+
+  INS_AddInstrumentFunction(Instruction, 0);
+  PIN_AddThreadStartFunction(ThreadStart, 0);
+  PIN_AddThreadFiniFunction(ThreadFini, 0);
+  PIN_AddFiniFunction(Fini, 0);
+
+  // Never returns
+
+  PIN_StartProgram();
+
+  return 0;
+}
+
+/* ===================================================================== */
+/* eof */
+/* ===================================================================== */
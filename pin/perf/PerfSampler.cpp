@@ -0,0 +1,308 @@
+#include "PerfSampler.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <poll.h>
+#include <sstream>
+#include <stdexcept>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Data pages in each per-CPU ring buffer (must be a power of two)
+constexpr size_t RING_PAGES = 64;
+
+static const char *const PMU_DIRS[] = {
+    "/sys/bus/event_source/devices/cpu",
+    "/sys/bus/event_source/devices/cpu_core", // hybrid Intel CPUs
+};
+
+static int perf_event_open(perf_event_attr *attr, pid_t pid, int cpu) {
+  return static_cast<int>(
+      syscall(__NR_perf_event_open, attr, pid, cpu, -1, PERF_FLAG_FD_CLOEXEC));
+}
+
+static bool read_file(const std::string &path, std::string &contents) {
+  std::ifstream in(path);
+  return static_cast<bool>(std::getline(in, contents));
+}
+
+// Places value into the attr bits that pmu/format/term names, e.g.
+// "config:0-7" or "config1:0-15".
+static bool set_format_term(const std::string &pmu, const std::string &term,
+                            uint64_t value, perf_event_attr &attr) {
+  std::string format;
+  if (!read_file(pmu + "/format/" + term, format)) {
+    return false;
+  }
+  size_t colon = format.find(':');
+  if (colon == std::string::npos) {
+    return false;
+  }
+  std::string field = format.substr(0, colon);
+  __u64 *target = field == "config"    ? &attr.config
+                  : field == "config1" ? &attr.config1
+                  : field == "config2" ? &attr.config2
+                                       : nullptr;
+  if (target == nullptr) {
+    return false;
+  }
+
+  // Bits may be split over several ranges, low bits of value first.
+  std::istringstream ranges(format.substr(colon + 1));
+  std::string range;
+  while (std::getline(ranges, range, ',')) {
+    unsigned low = std::strtoul(range.c_str(), nullptr, 10);
+    size_t dash = range.find('-');
+    unsigned high =
+        dash == std::string::npos
+            ? low
+            : std::strtoul(range.c_str() + dash + 1, nullptr, 10);
+    for (unsigned bit = low; bit <= high && bit < 64; ++bit, value >>= 1) {
+      if (value & 1) {
+        *target |= 1ULL << bit;
+      }
+    }
+  }
+  return true;
+}
+
+// Fills attr with the named event exported by the CPU PMU in sysfs, e.g.
+// mem-loads = "event=0xcd,umask=0x1,ldlat=3".
+static bool sysfs_event(const std::string &name, perf_event_attr &attr) {
+  for (const char *pmu : PMU_DIRS) {
+    std::string type, event;
+    if (!read_file(std::string(pmu) + "/type", type) ||
+        !read_file(std::string(pmu) + "/events/" + name, event)) {
+      continue;
+    }
+    attr.type = std::strtoul(type.c_str(), nullptr, 10);
+    attr.config = attr.config1 = attr.config2 = 0;
+
+    std::istringstream terms(event);
+    std::string term;
+    bool ok = true;
+    while (ok && std::getline(terms, term, ',')) {
+      size_t equals = term.find('=');
+      uint64_t value =
+          equals == std::string::npos
+              ? 1
+              : std::strtoull(term.c_str() + equals + 1, nullptr, 0);
+      ok = set_format_term(pmu, term.substr(0, equals), value, attr);
+    }
+    if (ok) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Finds the highest precise_ip the CPU accepts for attr, by opening it on
+// this process. Returns false if it cannot be opened at all.
+static bool probe_precise(perf_event_attr &attr) {
+  for (int precise = 3; precise >= 1; --precise) {
+    perf_event_attr probe = attr;
+    probe.precise_ip = precise;
+    probe.inherit = 0;
+    probe.enable_on_exec = 0;
+    int fd = perf_event_open(&probe, 0, -1);
+    if (fd >= 0) {
+      close(fd);
+      attr.precise_ip = precise;
+      return true;
+    }
+  }
+  return false;
+}
+
+PerfSampler::PerfSampler(const std::vector<pid_t> &tids, uint64_t period,
+                         bool enableOnExec) {
+  perf_event_attr attr;
+  std::memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.sample_type = PERF_SAMPLE_IDENTIFIER | PERF_SAMPLE_TID |
+                     PERF_SAMPLE_ADDR | PERF_SAMPLE_DATA_SRC;
+  attr.sample_period = period;
+  attr.disabled = 1;
+  attr.inherit = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.enable_on_exec = enableOnExec;
+  attr.watermark = 1;
+  attr.wakeup_watermark = RING_PAGES * sysconf(_SC_PAGESIZE) / 4;
+
+  perf_event_attr loads = attr, stores = attr;
+  if (sysfs_event("mem-loads", loads) && sysfs_event("mem-stores", stores) &&
+      probe_precise(loads) && probe_precise(stores)) {
+    modeName = "mem-loads,mem-stores";
+    openOnAllCpus(tids, loads, false);
+    openOnAllCpus(tids, stores, true);
+    return;
+  }
+
+  // Without precise memory events, the faulting address of page faults is
+  // the only data address the kernel samples. A fault usually comes from the
+  // first write to a page, so these samples are treated as writes.
+  perf_event_attr faults = attr;
+  faults.type = PERF_TYPE_SOFTWARE;
+  faults.config = PERF_COUNT_SW_PAGE_FAULTS;
+  faults.sample_period = 1;
+  modeName = "page-faults";
+  openOnAllCpus(tids, faults, true);
+}
+
+PerfSampler::~PerfSampler() {
+  for (auto &ring : rings) {
+    if (ring.base != nullptr) {
+      munmap(ring.base, (RING_PAGES + 1) * sysconf(_SC_PAGESIZE));
+    }
+  }
+  for (int fd : fds) {
+    close(fd);
+  }
+}
+
+void PerfSampler::openOnAllCpus(const std::vector<pid_t> &tids,
+                                perf_event_attr attr, bool isWrite) {
+  const long pageSize = sysconf(_SC_PAGESIZE);
+  const int cpus = static_cast<int>(sysconf(_SC_NPROCESSORS_CONF));
+  if (rings.empty()) {
+    rings.assign(cpus, Ring{-1, nullptr, 0});
+  }
+
+  // Inherited events can only be mapped per CPU, so there is one event per
+  // (thread, CPU), all writing to the CPU's ring.
+  for (int cpu = 0; cpu < cpus; ++cpu) {
+    for (pid_t tid : tids) {
+      int fd = perf_event_open(&attr, tid, cpu);
+      if (fd < 0) {
+        if (errno == ENODEV) {
+          break; // offline CPU
+        }
+        throw std::runtime_error("perf_event_open failed for thread " +
+                                 std::to_string(tid) + ": " +
+                                 std::strerror(errno));
+      }
+      fds.push_back(fd);
+
+      uint64_t id;
+      if (isWrite && ioctl(fd, PERF_EVENT_IOC_ID, &id) == 0) {
+        writeEventIds.push_back(id);
+      }
+
+      Ring &ring = rings[cpu];
+      if (ring.fd >= 0) {
+        if (ioctl(fd, PERF_EVENT_IOC_SET_OUTPUT, ring.fd) != 0) {
+          throw std::runtime_error(std::string("Could not share ring buffer: ") +
+                                   std::strerror(errno));
+        }
+        continue;
+      }
+      void *base = mmap(nullptr, (RING_PAGES + 1) * pageSize,
+                        PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (base == MAP_FAILED) {
+        throw std::runtime_error(std::string("Could not map ring buffer: ") +
+                                 std::strerror(errno));
+      }
+      ring = Ring{fd, base, RING_PAGES * pageSize};
+    }
+  }
+  if (fds.empty()) {
+    throw std::runtime_error("No CPU accepted the sampling event");
+  }
+}
+
+void PerfSampler::enable() {
+  for (int fd : fds) {
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+}
+
+void PerfSampler::disable() {
+  for (int fd : fds) {
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+  }
+}
+
+size_t
+PerfSampler::poll(int timeoutMs,
+                  const std::function<void(const perf_sample &)> &onSample) {
+  std::vector<pollfd> pollfds;
+  for (auto &ring : rings) {
+    if (ring.fd >= 0) {
+      pollfds.push_back(pollfd{ring.fd, POLLIN, 0});
+    }
+  }
+  ::poll(pollfds.data(), pollfds.size(), timeoutMs);
+
+  size_t samples = 0;
+  for (auto &ring : rings) {
+    if (ring.fd >= 0) {
+      samples += drain(ring, onSample);
+    }
+  }
+  return samples;
+}
+
+size_t
+PerfSampler::drain(Ring &ring,
+                   const std::function<void(const perf_sample &)> &onSample) {
+  auto *meta = static_cast<perf_event_mmap_page *>(ring.base);
+  const unsigned char *data =
+      static_cast<const unsigned char *>(ring.base) + sysconf(_SC_PAGESIZE);
+  uint64_t head = __atomic_load_n(&meta->data_head, __ATOMIC_ACQUIRE);
+  uint64_t tail = meta->data_tail;
+
+  size_t samples = 0;
+  while (tail < head) {
+    // Records are 8-byte aligned, so a header never straddles the end.
+    size_t offset = tail % ring.dataSize;
+    perf_event_header header;
+    std::memcpy(&header, data + offset, sizeof(header));
+    if (header.size == 0) {
+      break;
+    }
+    const unsigned char *record = data + offset;
+    if (offset + header.size > ring.dataSize) {
+      size_t first = ring.dataSize - offset;
+      wrapBuffer.resize(header.size);
+      std::memcpy(wrapBuffer.data(), data + offset, first);
+      std::memcpy(wrapBuffer.data() + first, data, header.size - first);
+      record = wrapBuffer.data();
+    }
+
+    if (header.type == PERF_RECORD_SAMPLE) {
+      // IDENTIFIER, TID, ADDR, DATA_SRC, in that order
+      struct {
+        perf_event_header header;
+        uint64_t id;
+        uint32_t pid, tid;
+        uint64_t addr;
+        uint64_t dataSrc;
+      } sample;
+      std::memcpy(&sample, record, std::min<size_t>(sizeof(sample), header.size));
+      if (sample.addr != 0) {
+        bool isWrite = std::find(writeEventIds.begin(), writeEventIds.end(),
+                                 sample.id) != writeEventIds.end();
+        onSample(perf_sample{sample.tid, sample.addr, isWrite});
+        ++samples;
+      }
+    } else if (header.type == PERF_RECORD_LOST) {
+      struct {
+        perf_event_header header;
+        uint64_t id;
+        uint64_t lost;
+      } lost;
+      std::memcpy(&lost, record, std::min<size_t>(sizeof(lost), header.size));
+      lostSamples += lost.lost;
+    }
+    tail += header.size;
+  }
+
+  __atomic_store_n(&meta->data_tail, tail, __ATOMIC_RELEASE);
+  return samples;
+}
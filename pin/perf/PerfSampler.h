@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <linux/perf_event.h>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+// One sampled data access.
+struct perf_sample {
+  uint32_t tid;
+  uint64_t addr;
+  bool isWrite;
+};
+
+// Samples data addresses of a set of threads (and the threads they create)
+// with perf_event_open. Uses the precise mem-loads/mem-stores events when the
+// CPU exports them, and falls back to sampling page faults otherwise. All
+// events on a CPU share one ring buffer.
+class PerfSampler {
+public:
+  // Throws std::runtime_error if no event can be opened.
+  // If enableOnExec, counting starts when the threads call exec; otherwise
+  // call enable().
+  PerfSampler(const std::vector<pid_t> &tids, uint64_t period,
+              bool enableOnExec);
+  ~PerfSampler();
+
+  PerfSampler(const PerfSampler &) = delete;
+  PerfSampler &operator=(const PerfSampler &) = delete;
+
+  void enable();
+  void disable();
+
+  // Waits up to timeoutMs for samples, then passes every pending sample to
+  // onSample. Returns the number of samples read.
+  size_t poll(int timeoutMs,
+              const std::function<void(const perf_sample &)> &onSample);
+
+  // Which events are sampled, for reporting.
+  const std::string &mode() const { return modeName; }
+  // Samples the kernel dropped because a ring buffer was full.
+  uint64_t lost() const { return lostSamples; }
+
+private:
+  struct Ring {
+    int fd;
+    void *base;
+    size_t dataSize;
+  };
+
+  void openOnAllCpus(const std::vector<pid_t> &tids, perf_event_attr attr,
+                     bool isWrite);
+  size_t drain(Ring &ring,
+               const std::function<void(const perf_sample &)> &onSample);
+
+  std::vector<int> fds;
+  std::vector<Ring> rings;               // one per CPU
+  std::vector<uint64_t> writeEventIds;   // event ids that sample stores
+  std::vector<unsigned char> wrapBuffer; // records split by the ring's end
+  std::string modeName;
+  uint64_t lostSamples = 0;
+};
@@ -0,0 +1,173 @@
+// Samples data addresses with perf_event_open instead of running under Pin,
+// and outputs a list of interferences {addr1, addr2, [priority]} for MapAddr.
+// Overhead depends on the sample period, so it can profile live processes.
+
+#include <atomic>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <dirent.h>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#include "../detect/InterferenceDetector.h"
+#include "PerfSampler.h"
+
+// Sample every Nth memory access (prime, to avoid aliasing with loops)
+constexpr uint64_t DEFAULT_SAMPLE_PERIOD = 4001;
+// How long to wait for samples before checking on the target
+constexpr int POLL_TIMEOUT_MS = 100;
+
+static std::atomic<bool> stopRequested(false);
+
+static void usage(const char *argv0) {
+  std::cerr << "Usage: " << argv0
+            << " [-b cache line size] [-c sample period] [-o output file]"
+            << " (-p pid | -- command [args...])" << std::endl;
+  exit(1);
+}
+
+static std::vector<pid_t> threads_of(pid_t pid) {
+  std::vector<pid_t> tids;
+  std::string path = "/proc/" + std::to_string(pid) + "/task";
+  DIR *dir = opendir(path.c_str());
+  if (dir == nullptr) {
+    return tids;
+  }
+  while (dirent *entry = readdir(dir)) {
+    if (entry->d_name[0] != '.') {
+      tids.push_back(std::stoi(entry->d_name));
+    }
+  }
+  closedir(dir);
+  return tids;
+}
+
+int main(int argc, char **argv) {
+  uint64_t cacheline_size = 64;
+  uint64_t period = DEFAULT_SAMPLE_PERIOD;
+  std::string output_file;
+  pid_t attach_pid = 0;
+  int command_index = 0;
+
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--") == 0) {
+      command_index = i + 1;
+      break;
+    }
+    if (i + 1 == argc) {
+      usage(argv[0]);
+    }
+    try {
+      if (std::strcmp(argv[i], "-b") == 0) {
+        cacheline_size = std::stoull(argv[++i]);
+      } else if (std::strcmp(argv[i], "-c") == 0) {
+        period = std::stoull(argv[++i]);
+      } else if (std::strcmp(argv[i], "-o") == 0) {
+        output_file = argv[++i];
+      } else if (std::strcmp(argv[i], "-p") == 0) {
+        attach_pid = std::stoi(argv[++i]);
+      } else {
+        usage(argv[0]);
+      }
+    } catch (...) {
+      usage(argv[0]);
+    }
+  }
+  if ((attach_pid == 0) == (command_index == 0 || command_index == argc) ||
+      cacheline_size == 0 || period == 0) {
+    usage(argv[0]);
+  }
+  if (output_file.empty()) {
+    output_file =
+        "perf.out.cacheline" + std::to_string(cacheline_size) + ".interferences";
+  }
+  std::ofstream outfile(output_file);
+  if (!outfile.is_open()) {
+    std::cout << "Could not open output file: " << output_file << std::endl;
+    exit(1);
+  }
+
+  signal(SIGINT, [](int) { stopRequested = true; });
+  signal(SIGTERM, [](int) { stopRequested = true; });
+
+  // The child waits for a byte on this pipe, so sampling is set up (and armed
+  // to start at exec) before the command runs.
+  int go[2] = {-1, -1};
+  pid_t child = 0;
+  if (attach_pid == 0) {
+    if (pipe(go) != 0) {
+      perror("pipe");
+      exit(1);
+    }
+    child = fork();
+    if (child == 0) {
+      close(go[1]);
+      char c;
+      if (read(go[0], &c, 1) != 1) {
+        _exit(127);
+      }
+      execvp(argv[command_index], argv + command_index);
+      perror("execvp");
+      _exit(127);
+    }
+    close(go[0]);
+  }
+
+  InterferenceDetector detector(cacheline_size);
+  uint64_t samples = 0;
+  auto record = [&](const perf_sample &sample) {
+    // Samples carry no access size, so every access is treated as 1 byte.
+    detector.recordAccess(sample.isWrite, sample.addr, 1, sample.tid);
+    ++samples;
+  };
+
+  try {
+    std::vector<pid_t> tids =
+        attach_pid != 0 ? threads_of(attach_pid) : std::vector<pid_t>{child};
+    if (tids.empty()) {
+      throw std::runtime_error("No such process: " + std::to_string(attach_pid));
+    }
+    PerfSampler sampler(tids, period, attach_pid == 0);
+    std::cout << "Sampling " << sampler.mode()
+              << ", with cache line size: " << cacheline_size << std::endl;
+
+    if (attach_pid == 0) {
+      if (write(go[1], "x", 1) != 1) {
+        perror("write");
+      }
+      close(go[1]);
+    } else {
+      sampler.enable();
+    }
+
+    while (!stopRequested) {
+      sampler.poll(POLL_TIMEOUT_MS, record);
+      if (attach_pid == 0) {
+        int status;
+        if (waitpid(child, &status, WNOHANG) == child) {
+          break;
+        }
+      } else if (kill(attach_pid, 0) != 0) {
+        break;
+      }
+    }
+    sampler.disable();
+    sampler.poll(0, record);
+    std::cout << "Recorded " << samples << " samples (" << sampler.lost()
+              << " lost)" << std::endl;
+  } catch (std::runtime_error &e) {
+    std::cout << e.what() << std::endl;
+    if (child > 0) {
+      kill(child, SIGKILL);
+    }
+    exit(1);
+  }
+
+  detector.outputInterferences(outfile);
+  std::cout << "Outputted interferences to file: " << output_file << std::endl;
+}
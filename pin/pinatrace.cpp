@@ -8,11 +8,15 @@
  */
 
 // #include "mutex.PH"
+#include <deque>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <pin.H>
 #include <sstream>
+
+#include "TraceCodec.h"
+#include "memop_filter.PH"
 using std::cerr;
 using std::dec;
 using std::endl;
@@ -43,8 +47,35 @@ public:
 /* Global Variables */
 /* ===================================================================== */
 
+// Routines whose rbp accesses are to the stack, skipped without -stack
+FRAME_POINTERS FramePointers;
+
 mutex tf_mu;
 std::ofstream TraceFile;
+// Records of the block being built, with -compress
+TraceBlockEncoder TraceEncoder;
+std::string TraceBlock;
+// Records in the block or -stream text chunk being built
+UINT64 ChunkRecords = 0;
+
+// With -stream, the trace is handed in chunks to an internal thread that
+// writes it, typically to a FIFO read by detect. The program only waits for
+// the reader when -queue chunks are already waiting; with -drop, the chunk is
+// dropped instead, and the trace marks how many records are missing.
+struct CHUNK {
+  string bytes;
+  UINT64 records;
+  UINT64 droppedBefore;
+};
+const size_t TEXT_CHUNK_SIZE = 64 * 1024;
+std::ostringstream TextChunk;
+mutex chunks_mu;
+std::deque<CHUNK> Chunks;
+PIN_SEMAPHORE ChunkAdded;
+PIN_SEMAPHORE ChunkTaken;
+BOOL StreamDone = false; // the last chunk has been queued
+UINT64 DroppedRecords = 0; // since the last chunk queued
+PIN_THREAD_UID WriterUid;
 
 /* ===================================================================== */
 /* Commandline Switches */
@@ -54,6 +85,24 @@ KNOB<string> KnobOutputFile(KNOB_MODE_WRITEONCE, "pintool", "o",
                             "pinatrace.out", "specify trace file name");
 KNOB<BOOL> KnobValues(KNOB_MODE_WRITEONCE, "pintool", "values", "1",
                       "Output memory values reads and written");
+KNOB<BOOL> KnobCompress(KNOB_MODE_WRITEONCE, "pintool", "compress", "0",
+                        "write a delta-encoded, block-compressed trace "
+                        "(see TraceCodec.h) instead of text");
+KNOB<BOOL> KnobStream(KNOB_MODE_WRITEONCE, "pintool", "stream", "0",
+                      "write the trace from a separate thread, e.g. to a FIFO "
+                      "that detect reads while the program runs");
+KNOB<UINT32> KnobQueue(KNOB_MODE_WRITEONCE, "pintool", "queue", "64",
+                       "with -stream, chunks of the trace waiting to be "
+                       "written before the program waits or drops");
+KNOB<BOOL> KnobDrop(KNOB_MODE_WRITEONCE, "pintool", "drop", "0",
+                    "with -stream, drop chunks of the trace instead of waiting "
+                    "when the queue is full, and mark them as dropped");
+KNOB<BOOL> KnobStack(KNOB_MODE_WRITEONCE, "pintool", "stack", "0",
+                     "also trace accesses through the stack and frame "
+                     "pointers, for programs that share stack addresses");
+KNOB<BOOL> KnobCoalesce(KNOB_MODE_WRITEONCE, "pintool", "coalesce", "1",
+                        "trace repeated accesses to the same address within "
+                        "a basic block once");
 
 /* ===================================================================== */
 /* Print Help Message                                                    */
@@ -108,15 +157,144 @@ static VOID EmitMem(std::ostream &os, VOID *ea, INT32 size) {
   }
 }
 
+// Queues bytes of the trace for the writer thread, holding tf_mu. Unless
+// `last`, waits or drops them while the queue is full.
+static VOID QueueChunk(string &bytes, BOOL last) {
+  CHUNK chunk;
+  chunk.bytes.swap(bytes);
+  chunk.records = ChunkRecords;
+  ChunkRecords = 0;
+
+  lock_guard lock(chunks_mu);
+  if (StreamDone) {
+    return; // recorded after the program started exiting
+  }
+  while (!last && Chunks.size() >= KnobQueue.Value()) {
+    if (KnobDrop) {
+      DroppedRecords += chunk.records;
+      return;
+    }
+    PIN_SemaphoreClear(&ChunkTaken);
+    chunks_mu.unlock();
+    PIN_SemaphoreWait(&ChunkTaken);
+    chunks_mu.lock();
+  }
+  chunk.droppedBefore = DroppedRecords;
+  DroppedRecords = 0;
+  Chunks.push_back(chunk);
+  if (last) {
+    StreamDone = true;
+  }
+  PIN_SemaphoreSet(&ChunkAdded);
+}
+
+static VOID WriteChunks(VOID *arg) {
+  while (true) {
+    CHUNK chunk;
+    {
+      lock_guard lock(chunks_mu);
+      while (Chunks.empty() && !StreamDone) {
+        PIN_SemaphoreClear(&ChunkAdded);
+        chunks_mu.unlock();
+        PIN_SemaphoreWait(&ChunkAdded);
+        chunks_mu.lock();
+      }
+      if (Chunks.empty()) {
+        return;
+      }
+      chunk.bytes.swap(Chunks.front().bytes);
+      chunk.droppedBefore = Chunks.front().droppedBefore;
+      Chunks.pop_front();
+      PIN_SemaphoreSet(&ChunkTaken);
+    }
+
+    if (chunk.droppedBefore > 0) {
+      if (KnobCompress) {
+        string marker;
+        put_trace_drops(marker, chunk.droppedBefore);
+        TraceFile.write(marker.data(), marker.size());
+      } else {
+        TraceFile << "#dropped " << dec << chunk.droppedBefore << "\n";
+      }
+    }
+    TraceFile.write(chunk.bytes.data(), chunk.bytes.size());
+    TraceFile.flush();
+  }
+}
+
+// Writes out the block built so far; with no records, it ends the trace.
+static VOID FlushBlock(BOOL last) {
+  TraceEncoder.finish(TraceBlock);
+  if (KnobStream) {
+    QueueChunk(TraceBlock, last);
+    return;
+  }
+  TraceFile.write(TraceBlock.data(), TraceBlock.size());
+  TraceBlock.clear();
+}
+
+static VOID RecordCompressed(VOID *ip, CHAR r, VOID *addr, INT32 size,
+                             THREADID id, BOOL isPrefetch) {
+  trace_record record;
+  record.ip = reinterpret_cast<ADDRINT>(ip);
+  record.addr = reinterpret_cast<ADDRINT>(addr);
+  record.size = size;
+  record.thread = id;
+  record.is_write = r == 'W';
+  record.has_value = KnobValues && !isPrefetch;
+  switch (record.has_value ? size : 0) {
+  case 1:
+    record.value = *static_cast<UINT8 *>(addr);
+    break;
+  case 2:
+    record.value = *static_cast<UINT16 *>(addr);
+    break;
+  case 4:
+    record.value = *static_cast<UINT32 *>(addr);
+    break;
+  case 8:
+    record.value = *static_cast<UINT64 *>(addr);
+    break;
+  default:
+    // Wider values are not kept; detect does not read them.
+    record.has_value = false;
+    record.value = 0;
+    break;
+  }
+
+  lock_guard lock(tf_mu);
+  TraceEncoder.add(record);
+  ChunkRecords++;
+  if (TraceEncoder.size() >= TRACE_BLOCK_SIZE) {
+    FlushBlock(false);
+  }
+}
+
 static VOID RecordMem(VOID *ip, CHAR r, VOID *addr, INT32 size, THREADID id,
                       BOOL isPrefetch) {
+  if (KnobCompress) {
+    RecordCompressed(ip, r, addr, size, id, isPrefetch);
+    return;
+  }
   lock_guard lock(tf_mu);
-  TraceFile << ip << ": " << r << " " << setw(2 + 2 * sizeof(ADDRINT)) << addr
-            << " " << dec << setw(2) << size << " " << id << " " << hex
-            << setw(2 + 2 * sizeof(ADDRINT));
+  std::ostream &os = KnobStream ? static_cast<std::ostream &>(TextChunk)
+                                : TraceFile;
+  os << ip << ": " << r << " " << setw(2 + 2 * sizeof(ADDRINT)) << addr
+     << " " << dec << setw(2) << size << " " << id << " " << hex
+     << setw(2 + 2 * sizeof(ADDRINT));
   if (!isPrefetch)
-    EmitMem(TraceFile, addr, size);
-  TraceFile << endl;
+    EmitMem(os, addr, size);
+  if (!KnobStream) {
+    os << endl;
+    return;
+  }
+  os << "\n";
+  ChunkRecords++;
+  if (static_cast<size_t>(TextChunk.tellp()) >= TEXT_CHUNK_SIZE) {
+    string bytes = TextChunk.str();
+    TextChunk.str("");
+    QueueChunk(bytes, false);
+  }
   //   if (TraceString.str().length() > 68)
   //     cerr << TraceString.str().length() << " " << TraceString.str() << endl;
 }
@@ -136,18 +314,41 @@ static VOID RecordMemWrite(VOID *ip) {
   RecordMem(ip, 'W', WriteAddr, WriteSize, ThreadId, false);
 }
 
-VOID Instruction(INS ins, VOID *v) {
+VOID Instruction(INS ins, MEMOP_FILTER &filter) {
+  if (!INS_IsStandardMemop(ins)) {
+    filter.Next(ins);
+    return;
+  }
+
+  // Memory operands behind IARG_MEMORYREAD_EA, IARG_MEMORYREAD2_EA, and
+  // IARG_MEMORYWRITE_EA
+  UINT32 readOps[2], readCount = 0, writeOp = 0;
+  BOOL writes = FALSE;
+  for (UINT32 memOp = 0; memOp < INS_MemoryOperandCount(ins); memOp++) {
+    if (INS_MemoryOperandIsRead(ins, memOp) && readCount < 2) {
+      readOps[readCount++] = memOp;
+    }
+    if (INS_MemoryOperandIsWritten(ins, memOp) && !writes) {
+      writeOp = memOp;
+      writes = TRUE;
+    }
+  }
+  BOOL read = readCount > 0 && filter.Wanted(ins, readOps[0], FALSE);
+  BOOL read2 = readCount > 1 && filter.Wanted(ins, readOps[1], FALSE);
+  BOOL write = writes && filter.Wanted(ins, writeOp, TRUE);
+  filter.Next(ins);
+
   // instruments loads using a predicated call, i.e.
   // the call happens iff the load will be actually executed
 
-  if (INS_IsMemoryRead(ins) && INS_IsStandardMemop(ins)) {
+  if (read && INS_IsMemoryRead(ins) && INS_IsStandardMemop(ins)) {
     INS_InsertPredicatedCall(
         ins, IPOINT_BEFORE, (AFUNPTR)RecordMem, IARG_INST_PTR, IARG_UINT32, 'R',
         IARG_MEMORYREAD_EA, IARG_MEMORYREAD_SIZE, IARG_THREAD_ID, IARG_BOOL,
         INS_IsPrefetch(ins), IARG_END);
   }
 
-  if (INS_HasMemoryRead2(ins) && INS_IsStandardMemop(ins)) {
+  if (read2 && INS_HasMemoryRead2(ins) && INS_IsStandardMemop(ins)) {
     INS_InsertPredicatedCall(
         ins, IPOINT_BEFORE, (AFUNPTR)RecordMem, IARG_INST_PTR, IARG_UINT32, 'R',
         IARG_MEMORYREAD2_EA, IARG_MEMORYREAD_SIZE, IARG_THREAD_ID, IARG_BOOL,
@@ -156,7 +357,7 @@ VOID Instruction(INS ins, VOID *v) {
 
   // instruments stores using a predicated call, i.e.
   // the call happens iff the store will be actually executed
-  if (INS_IsMemoryWrite(ins) && INS_IsStandardMemop(ins)) {
+  if (write && INS_IsMemoryWrite(ins) && INS_IsStandardMemop(ins)) {
     INS_InsertPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)RecordWriteAddrSize,
                              IARG_MEMORYWRITE_EA, IARG_MEMORYWRITE_SIZE,
                              IARG_END);
@@ -174,10 +375,51 @@ VOID Instruction(INS ins, VOID *v) {
   }
 }
 
+VOID Trace(TRACE trace, VOID *v) {
+  for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl)) {
+    MEMOP_FILTER filter(!KnobStack,
+                        !KnobStack && FramePointers.InFrame(TRACE_Rtn(trace)),
+                        KnobCoalesce);
+    for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins)) {
+      Instruction(ins, filter);
+    }
+  }
+}
+
 /* ===================================================================== */
 
+// With -stream, the rest of the trace is queued here, while the writer
+// thread still runs, and Fini waits for it to be written.
+VOID PrepareForFini(VOID *v) {
+  lock_guard lock(tf_mu);
+  if (KnobCompress) {
+    if (TraceEncoder.size() > 0) {
+      FlushBlock(false);
+    }
+    FlushBlock(true);
+  } else {
+    TextChunk << "#eof\n";
+    string bytes = TextChunk.str();
+    TextChunk.str("");
+    QueueChunk(bytes, true);
+  }
+}
+
 VOID Fini(INT32 code, VOID *v) {
+  if (KnobStream) {
+    PIN_WaitForThreadTermination(WriterUid, PIN_INFINITE_TIMEOUT, 0);
+    TraceFile.close();
+    return;
+  }
   lock_guard lock(tf_mu);
+  if (KnobCompress) {
+    if (TraceEncoder.size() > 0) {
+      FlushBlock(false);
+    }
+    FlushBlock(true);
+    TraceFile.close();
+    return;
+  }
   TraceFile << "#eof" << endl;
 
   TraceFile.close();
@@ -192,18 +434,42 @@ int main(int argc, char *argv[]) {
                                "# Memory Access Trace Generated By Pin\n"
                                "#\n");
 
+  // For FRAME_POINTERS to find the routines
+  PIN_InitSymbols();
+
   if (PIN_Init(argc, argv)) {
     return Usage();
   }
 
   {
     lock_guard lock(tf_mu);
-    TraceFile.open(KnobOutputFile.Value().c_str());
-    TraceFile.write(trace_header.c_str(), trace_header.size());
-    TraceFile.setf(ios::showbase);
+    if (KnobCompress) {
+      TraceFile.open(KnobOutputFile.Value().c_str(), ios::binary);
+      TraceFile.write(TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    } else {
+      TraceFile.open(KnobOutputFile.Value().c_str());
+      TraceFile.write(trace_header.c_str(), trace_header.size());
+      TraceFile.setf(ios::showbase);
+    }
   }
 
-  INS_AddInstrumentFunction(Instruction, 0);
+  if (KnobStream) {
+    TextChunk.setf(ios::showbase);
+    PIN_SemaphoreInit(&ChunkAdded);
+    PIN_SemaphoreInit(&ChunkTaken);
+    if (PIN_SpawnInternalThread(WriteChunks, 0, 0, &WriterUid) ==
+        INVALID_THREADID) {
+      cerr << "Could not start the trace writer thread" << endl;
+      return 1;
+    }
+    PIN_AddPrepareForFiniFunction(PrepareForFini, 0);
+  }
+
+  if (!KnobStack) {
+    IMG_AddInstrumentFunction(FRAME_POINTERS::ImageLoad, &FramePointers);
+    IMG_AddUnloadFunction(FRAME_POINTERS::ImageUnload, &FramePointers);
+  }
+  TRACE_AddInstrumentFunction(Trace, 0);
   PIN_AddFiniFunction(Fini, 0);
 
   // Never returns
@@ -18,14 +18,7 @@ if [ ! -f ${PINATRACE_DIR}/pinatrace.cpp ]; then
     exit 1
 fi
 
-# Copy over modified pinatrace, and build pinatrace
-cp pin/pinatrace.cpp ${PINATRACE_DIR}
-cd ${PINATRACE_DIR}
-make obj-intel64/pinatrace.so
-echo "Successfully compiled pinatrace.so"
-echo
-
-# Copy over modified mdcache, and build mdcache 
+# Copy over modified mdcache, and build mdcache (used to evaluate the fix)
 cd ${REPO_ROOT}
 cp pin/mdcache.cpp ${PINATRACE_DIR}
 cp pin/mdcache.H ${PINATRACE_DIR}
@@ -35,9 +28,16 @@ make obj-intel64/mdcache.so
 echo "Successfully compiled mdcache.so"
 echo
 
+# Build the single-pass profiler
+FSPROF_DIR=${REPO_ROOT}/pin/fsprof
+cd ${FSPROF_DIR}
+make PIN_ROOT=${PATH_TO_PIN} obj-intel64/fsprof.so
+echo "Successfully compiled fsprof.so"
+echo
+
 # Clean up old files
 cd ${REPO_ROOT}
-rm -f *.out *.interferences fs_globals.txt ${REPO_ROOT}/src/mapped_conflicts.out
+rm -f *.out *.interferences *.fsprofdata fs_globals.txt ${REPO_ROOT}/src/mapped_conflicts.out
 echo "Cleaned up old output files"
 echo
 
@@ -49,52 +49,32 @@ cd src/
 echo "Successfully instrumented the globals pass"
 echo
 
-# Run pinatrace on the global pass 
+# Profile the globals pass in a single run: fsprof simulates the caches, finds
+# overlapping accesses, and maps them to globals without writing a trace
 cd ${REPO_ROOT}
-${PATH_TO_PIN}/pin -t ${PINATRACE_DIR}/obj-intel64/pinatrace.so -- ${REPO_ROOT}/src/build/run/${BENCHNAME}_globals
-echo "Successfully ran pinatrace on the globals pass. Got pinatrace.out as well as fs_globals.txt."
-echo
-
-# Run detect on pinatrace.out to get a list of interferences
-cd pin/detect 
-make clean
-make detect 
-./detect ${REPO_ROOT}/pinatrace.out $CACHELINESIZE
-DETECT_OUTPUT_FNAME=pinatrace.out.cacheline${CACHELINESIZE}.interferences
-echo "Successfully ran detect to produce ${DETECT_OUTPUT_FNAME}"
+${PATH_TO_PIN}/pin -t ${FSPROF_DIR}/obj-intel64/fsprof.so -b $CACHELINESIZE -- ${REPO_ROOT}/src/build/run/${BENCHNAME}_globals
+cp ${REPO_ROOT}/mapped_conflicts.out ${REPO_ROOT}/src # So that manual runs of src/run.sh with fix will work
+echo "Successfully ran fsprof on the globals pass. Got fsprof.out, fs_globals.txt, and mapped_conflicts.out."
 echo
 
-# Run mdcache on the global pass 
-cd ${REPO_ROOT}
-${PATH_TO_PIN}/pin -t ${PINATRACE_DIR}/obj-intel64/mdcache.so -- ${REPO_ROOT}/src/build/run/${BENCHNAME}_globals
-MDCACHE_OUTPUT_FNAME=mdcache.out.cacheline64.interferences
-echo "Successfully ran mdcache on the globals pass. Got mdcache.out as well as ${MDCACHE_OUTPUT_FNAME}"
+# Index the conflicts so the fix pass only reads the slice for each module
+${REPO_ROOT}/src/build/profdata/fs-profdata merge -o ${REPO_ROOT}/${BENCHNAME}.fsprofdata ${REPO_ROOT}/mapped_conflicts.out
+echo "Successfully merged mapped_conflicts.out into ${BENCHNAME}.fsprofdata"
 echo
 
-# Run MapAddr to get mapped_conflicts.out
-cd pin/MapAddr 
-make clean 
-make all 
-./MapAddr "${REPO_ROOT}/${MDCACHE_OUTPUT_FNAME}" "${REPO_ROOT}/${DETECT_OUTPUT_FNAME}" "${REPO_ROOT}/fs_globals.txt"
-mv mapped_conflicts.out ${REPO_ROOT}
-cp ${REPO_ROOT}/mapped_conflicts.out ${REPO_ROOT}/src # So that manual runs of src/run.sh with fix will work
-cd ${REPO_ROOT}
-echo "Successfully ran MapAddr to get mapped_conflicts.out"
-echo 
-
 # Apply the fix LLVM pass
 echo "Applying fix and running optimized binary"
-./src/run.sh ${BENCH} fix
+./src/run.sh ${BENCH} fix ${REPO_ROOT}/${BENCHNAME}.fsprofdata
 echo "Successfully applied fix"
 echo
 
 # Evaluate the fixed binary with mdcache
-mv mdcache.out pre_mdcache.out
-mv $MDCACHE_OUTPUT_FNAME "pre_${MDCACHE_OUTPUT_FNAME}"
+MDCACHE_OUTPUT_FNAME=mdcache.out.cacheline64.interferences
+mv fsprof.out pre_mdcache.out
 ${PATH_TO_PIN}/pin -t ${PINATRACE_DIR}/obj-intel64/mdcache.so -- ${REPO_ROOT}/src/build/run/${BENCHNAME}_fix
 mv mdcache.out post_mdcache.out
 mv $MDCACHE_OUTPUT_FNAME "post_${MDCACHE_OUTPUT_FNAME}"
 echo "Evaluated fixed binary with mdcache, and renamed old mdcache files."
-echo "See pre_mdcache.out, pre_${MDCACHE_OUTPUT_FNAME}, post_mdcache.out, post_${MDCACHE_OUTPUT_FNAME}"
+echo "See pre_mdcache.out, post_mdcache.out, post_${MDCACHE_OUTPUT_FNAME}"
 echo
 
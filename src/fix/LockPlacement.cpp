@@ -0,0 +1,351 @@
+#include "LockPlacement.h"
+
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/GlobalAlias.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+
+using namespace llvm;
+
+static const uint64_t cacheLineSize = 64; // in bytes
+
+// Named types of lock objects, without the class./struct./union. prefix.
+static const StringSet<> lockTypeNames = {
+    "pthread_mutex_t",      "pthread_rwlock_t", "std::mutex",
+    "std::recursive_mutex", "std::timed_mutex", "std::shared_mutex",
+    "std::__mutex_base",
+};
+
+// Functions that take a lock, given as their first argument. std::mutex
+// methods are usually inlined down to the pthread calls at -O1 and above.
+static const StringSet<> acquireFunctions = {
+    "pthread_mutex_lock",      "pthread_mutex_trylock",
+    "pthread_mutex_timedlock", "pthread_spin_lock",
+    "pthread_spin_trylock",    "pthread_rwlock_rdlock",
+    "pthread_rwlock_wrlock",   "pthread_rwlock_tryrdlock",
+    "pthread_rwlock_trywrlock", "_ZNSt5mutex4lockEv",
+    "_ZNSt5mutex8try_lockEv",
+};
+static const StringSet<> releaseFunctions = {
+    "pthread_mutex_unlock", "pthread_spin_unlock", "pthread_rwlock_unlock",
+    "_ZNSt5mutex6unlockEv",
+};
+
+static bool isLockType(Type *type) {
+  auto *structType = dyn_cast<StructType>(type);
+  if (!structType || !structType->hasName()) {
+    return false;
+  }
+  // e.g. "class.std::mutex" or "union.pthread_mutex_t.12"
+  StringRef name = structType->getName();
+  name = name.substr(name.find('.') + 1);
+  while (!lockTypeNames.count(name) && name.contains('.') &&
+         name.rsplit('.').second.find_first_not_of("0123456789") ==
+             StringRef::npos) {
+    name = name.rsplit('.').first;
+  }
+  return lockTypeNames.count(name) > 0;
+}
+
+static Function *calledFunction(const Instruction &inst) {
+  auto *call = dyn_cast<CallBase>(&inst);
+  return call ? call->getCalledFunction() : nullptr;
+}
+
+// Adds the pointers that `inst` loads, stores or passes to a call through.
+static void accessedPointers(Instruction &inst,
+                             SmallVectorImpl<Value *> &pointers) {
+  if (auto *load = dyn_cast<LoadInst>(&inst)) {
+    pointers.push_back(load->getPointerOperand());
+  } else if (auto *store = dyn_cast<StoreInst>(&inst)) {
+    pointers.push_back(store->getPointerOperand());
+  } else if (auto *rmw = dyn_cast<AtomicRMWInst>(&inst)) {
+    pointers.push_back(rmw->getPointerOperand());
+  } else if (auto *cmpxchg = dyn_cast<AtomicCmpXchgInst>(&inst)) {
+    pointers.push_back(cmpxchg->getPointerOperand());
+  } else if (auto *call = dyn_cast<CallBase>(&inst)) {
+    // e.g. the `this` of an out-of-line std::vector method
+    for (auto &arg : call->args()) {
+      if (arg->getType()->isPointerTy()) {
+        pointers.push_back(arg);
+      }
+    }
+  }
+}
+
+LockLocation LockAnalysis::lockArgument(CallBase *call) const {
+  if (call->arg_size() == 0) {
+    return {nullptr, 0};
+  }
+  auto *argument = call->getArgOperand(0);
+  APInt offset(dataLayout.getIndexTypeSizeInBits(argument->getType()), 0);
+  auto *base =
+      argument->stripAndAccumulateConstantOffsets(dataLayout, offset, true);
+  auto *global = dyn_cast<GlobalVariable>(base);
+  if (!global || offset.isNegative()) {
+    return {nullptr, 0};
+  }
+  return {global, offset.getZExtValue()};
+}
+
+LockAnalysis::LockAnalysis(Module &M) : dataLayout(M.getDataLayout()) {
+  for (auto &global : M.globals()) {
+    if (!global.isDeclaration()) {
+      findLockTypes(&global, global.getValueType(), 0);
+    }
+  }
+
+  SmallVector<std::pair<LockLocation, Instruction *>, 16> acquires;
+  for (auto &function : M) {
+    for (auto &block : function) {
+      for (auto &inst : block) {
+        auto *callee = calledFunction(inst);
+        if (!callee || !acquireFunctions.count(callee->getName())) {
+          continue;
+        }
+        auto lock = lockArgument(cast<CallBase>(&inst));
+        if (!lock.global || lock.global->isDeclaration()) {
+          continue;
+        }
+        lockLocations.insert(lock);
+        lockGlobals.insert(lock.global);
+        acquires.push_back({lock, &inst});
+      }
+    }
+  }
+
+  for (auto &acquire : acquires) {
+    walkCriticalSection(acquire.first, acquire.second);
+  }
+
+  for (auto &function : M) {
+    for (auto &block : function) {
+      for (auto &inst : block) {
+        auto *callee = calledFunction(inst);
+        if (criticalInstructions.count(&inst) ||
+            (callee && (acquireFunctions.count(callee->getName()) ||
+                        releaseFunctions.count(callee->getName())))) {
+          continue;
+        }
+        SmallVector<Value *, 4> pointers;
+        accessedPointers(inst, pointers);
+        for (auto *pointer : pointers) {
+          auto *global =
+              dyn_cast<GlobalVariable>(getUnderlyingObject(pointer));
+          if (global && !global->isConstant() && !lockGlobals.count(global)) {
+            unguardedGlobals.insert(global);
+          }
+        }
+      }
+    }
+  }
+}
+
+void LockAnalysis::findLockTypes(GlobalVariable *global, Type *type,
+                                 uint64_t offset) {
+  if (isLockType(type)) {
+    lockLocations.insert({global, offset});
+    lockGlobals.insert(global);
+    return;
+  }
+  // Arrays of locks cannot be padded element by element, so only struct
+  // fields are looked into.
+  if (auto *structType = dyn_cast<StructType>(type)) {
+    auto *layout = dataLayout.getStructLayout(structType);
+    for (unsigned i = 0; i < structType->getNumElements(); ++i) {
+      findLockTypes(global, structType->getElementType(i),
+                    offset + layout->getElementOffset(i));
+    }
+  }
+}
+
+// Visits every instruction reachable from `start` without passing a release
+// of `lock`, counting the globals accessed on the way.
+void LockAnalysis::walkCriticalSection(const LockLocation &lock,
+                                       Instruction *start) {
+  SmallPtrSet<BasicBlock *, 16> visited;
+  SmallVector<Instruction *, 16> worklist = {start->getNextNode()};
+  while (!worklist.empty()) {
+    for (auto *inst = worklist.pop_back_val(); inst;
+         inst = inst->getNextNode()) {
+      criticalInstructions.insert(inst);
+      auto *callee = calledFunction(*inst);
+      bool isAcquire = callee && acquireFunctions.count(callee->getName());
+      bool isRelease = callee && releaseFunctions.count(callee->getName());
+      SmallVector<Value *, 4> pointers;
+      if (isAcquire || isRelease) {
+        auto other = lockArgument(cast<CallBase>(inst));
+        if (isRelease && other == lock) {
+          break; // The critical section ends on this path.
+        }
+        if (isAcquire && other.global && !(other == lock)) {
+          nested.insert({lock, other});
+        }
+      } else {
+        accessedPointers(*inst, pointers);
+      }
+      for (auto *pointer : pointers) {
+        auto *global = dyn_cast<GlobalVariable>(getUnderlyingObject(pointer));
+        if (global && !global->isConstant() && !lockGlobals.count(global)) {
+          ++guardedAccesses[global][lock];
+        }
+      }
+
+      if (inst->isTerminator()) {
+        for (auto *successor : successors(inst)) {
+          if (visited.insert(successor).second) {
+            worklist.push_back(&successor->front());
+          }
+        }
+      }
+    }
+  }
+}
+
+bool LockAnalysis::isWholeLock(GlobalVariable *global) const {
+  auto *type = global->getValueType();
+  if (!lockLocations.count({global, 0}) ||
+      (!isLockType(type) && type->isAggregateType())) {
+    return false;
+  }
+  auto next = lockLocations.upper_bound({global, 0});
+  return next == lockLocations.end() || next->global != global;
+}
+
+std::vector<LockLocation> LockAnalysis::independentLocks() const {
+  std::vector<LockLocation> independent;
+  for (auto &lock : lockLocations) {
+    for (auto &other : lockLocations) {
+      if (!(other == lock) && !nested.count({lock, other}) &&
+          !nested.count({other, lock})) {
+        independent.push_back(lock);
+        break;
+      }
+    }
+  }
+  return independent;
+}
+
+std::map<LockLocation, std::vector<GlobalVariable *>>
+LockAnalysis::guardedData() const {
+  std::map<LockLocation, std::vector<std::pair<uint64_t, GlobalVariable *>>>
+      counted;
+  for (auto &pair : guardedAccesses) {
+    if (pair.second.size() == 1 && !unguardedGlobals.count(pair.first)) {
+      auto &access = *pair.second.begin();
+      counted[access.first].push_back({access.second, pair.first});
+    }
+  }
+
+  std::map<LockLocation, std::vector<GlobalVariable *>> guarded;
+  for (auto &pair : counted) {
+    std::stable_sort(pair.second.begin(), pair.second.end(),
+                     [](auto &a, auto &b) { return a.first > b.first; });
+    for (auto &data : pair.second) {
+      guarded[pair.first].push_back(data.second);
+    }
+  }
+  return guarded;
+}
+
+// Whether `global` can be replaced by a field of another global.
+static bool isMovable(GlobalVariable *global) {
+  return global->hasInitializer() && global->hasExactDefinition() &&
+         !global->hasComdat() && !global->isThreadLocal() &&
+         !global->hasSection() && !global->isExternallyInitialized() &&
+         global->getAddressSpace() == 0 &&
+         !global->getName().startswith("llvm.");
+}
+
+bool colocateGuardedData(Module &M, const LockAnalysis &locks,
+                         std::set<GlobalValue::GUID> &movedGUIDs,
+                         std::set<std::string> &movedNames) {
+  auto &dataLayout = M.getDataLayout();
+  auto &context = M.getContext();
+  auto *int8Ty = Type::getInt8Ty(context);
+  auto *int32Ty = Type::getInt32Ty(context);
+  bool changed = false;
+
+  for (auto &pair : locks.guardedData()) {
+    auto *lock = pair.first.global;
+    if (!locks.isWholeLock(lock) || !isMovable(lock)) {
+      continue;
+    }
+
+    // Lay out the lock, then as much of its data as fits in its cache line.
+    SmallVector<Type *, 8> fields = {lock->getValueType()};
+    SmallVector<Constant *, 8> initializers = {lock->getInitializer()};
+    SmallVector<std::pair<GlobalVariable *, unsigned>, 4> members = {
+        {lock, 0}};
+    uint64_t size = dataLayout.getTypeAllocSize(lock->getValueType());
+    for (auto *data : pair.second) {
+      if (!isMovable(data)) {
+        continue;
+      }
+      uint64_t dataSize = dataLayout.getTypeAllocSize(data->getValueType());
+      uint64_t offset = alignTo(size, data->getPointerAlignment(dataLayout));
+      if (offset + dataSize > cacheLineSize) {
+        continue;
+      }
+      if (offset > size) {
+        auto *padding = ArrayType::get(int8Ty, offset - size);
+        fields.push_back(padding);
+        initializers.push_back(ConstantAggregateZero::get(padding));
+      }
+      members.push_back({data, fields.size()});
+      fields.push_back(data->getValueType());
+      initializers.push_back(data->getInitializer());
+      size = offset + dataSize;
+    }
+    if (members.size() == 1) {
+      continue; // None of the data fits.
+    }
+    // Pad to the end of the line, so nothing else is placed on it.
+    if (size % cacheLineSize != 0) {
+      auto *padding = ArrayType::get(int8Ty, alignTo(size, cacheLineSize) - size);
+      fields.push_back(padding);
+      initializers.push_back(ConstantAggregateZero::get(padding));
+    }
+
+    auto *type = StructType::get(context, fields, true /* packed */);
+    auto *colocated = new GlobalVariable(
+        M, type, false, GlobalValue::InternalLinkage,
+        ConstantStruct::get(type, initializers),
+        lock->getName() + ".colocated");
+    colocated->setAlignment(Align(cacheLineSize));
+
+    errs() << "Placing lock " << lock->getName() << " on a cache line with";
+    for (auto &member : members) {
+      auto *global = member.first;
+      if (global != lock) {
+        errs() << ' ' << global->getName();
+      }
+      movedGUIDs.insert(global->getGUID());
+      movedNames.insert(global->getName().str());
+
+      Constant *indices[] = {ConstantInt::get(int32Ty, 0),
+                             ConstantInt::get(int32Ty, member.second)};
+      auto *field =
+          ConstantExpr::getInBoundsGetElementPtr(type, colocated, indices);
+      global->replaceAllUsesWith(field);
+      if (!global->hasLocalLinkage()) {
+        // Other modules still refer to the global by name.
+        auto *alias = GlobalAlias::create(global->getValueType(), 0,
+                                          global->getLinkage(), "", field, &M);
+        alias->setVisibility(global->getVisibility());
+        alias->setDSOLocal(global->isDSOLocal());
+        alias->takeName(global);
+      }
+      global->eraseFromParent();
+    }
+    errs() << '\n';
+    changed = true;
+  }
+  return changed;
+}
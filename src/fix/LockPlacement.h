@@ -0,0 +1,83 @@
+//// Recognizes lock objects among globals for the fix pass ////
+#pragma once
+
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/InstrTypes.h"
+#include "llvm/IR/Module.h"
+#include <cstdint>
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+// A lock object: a global, or a field of one `offset` bytes in.
+struct LockLocation {
+  llvm::GlobalVariable *global;
+  uint64_t offset;
+
+  bool operator<(const LockLocation &other) const {
+    return std::make_pair(global, offset) <
+           std::make_pair(other.global, other.offset);
+  }
+  bool operator==(const LockLocation &other) const {
+    return global == other.global && offset == other.offset;
+  }
+};
+
+// Finds globals and struct fields that are locks, either by type
+// (pthread_mutex_t, std::mutex, ...) or because their address is passed to
+// a lock function, and which other globals are accessed between each lock
+// call and the matching unlock, or outside of any.
+class LockAnalysis {
+public:
+  explicit LockAnalysis(llvm::Module &M);
+
+  const std::set<LockLocation> &locks() const { return lockLocations; }
+
+  // Whether `global` holds no lock other than one at offset 0 that is the
+  // whole variable, so it can be moved as a unit.
+  bool isWholeLock(llvm::GlobalVariable *global) const;
+
+  // Locks taken without some other lock, which therefore gain from being on
+  // different cache lines. Locks only ever taken inside each other's critical
+  // sections hand off together and are left alone.
+  std::vector<LockLocation> independentLocks() const;
+
+  // The globals accessed in the critical sections of exactly one lock, and
+  // nowhere outside them, grouped by that lock, most frequently accessed
+  // first. Accesses in functions called from a critical section count as
+  // outside, since the walk does not follow calls.
+  std::map<LockLocation, std::vector<llvm::GlobalVariable *>>
+  guardedData() const;
+
+private:
+  // The lock a lock function is called on, or a null global if unknown.
+  LockLocation lockArgument(llvm::CallBase *call) const;
+  void findLockTypes(llvm::GlobalVariable *global, llvm::Type *type,
+                     uint64_t offset);
+  void walkCriticalSection(const LockLocation &lock, llvm::Instruction *start);
+
+  const llvm::DataLayout &dataLayout;
+  std::set<LockLocation> lockLocations;
+  std::set<llvm::GlobalVariable *> lockGlobals;
+  // Pairs (outer, inner) where inner was taken while holding outer
+  std::set<std::pair<LockLocation, LockLocation>> nested;
+  // Accesses to each global inside each lock's critical sections
+  std::map<llvm::GlobalVariable *, std::map<LockLocation, uint64_t>>
+      guardedAccesses;
+  // Instructions in some critical section, and the globals accessed by any
+  // other instruction
+  llvm::SmallPtrSet<llvm::Instruction *, 32> criticalInstructions;
+  std::set<llvm::GlobalVariable *> unguardedGlobals;
+};
+
+// Moves each lock that is a whole global, together with the data only it
+// guards, into one cache line aligned and padded global, so handing over the
+// lock also brings over that data. Data that does not fit in the lock's
+// cache line is left in place. The moved globals keep their symbols as
+// aliases, whose GUIDs and names are added to movedGUIDs and movedNames.
+bool colocateGuardedData(llvm::Module &M, const LockAnalysis &locks,
+                         std::set<llvm::GlobalValue::GUID> &movedGUIDs,
+                         std::set<std::string> &movedNames);
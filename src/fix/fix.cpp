@@ -1,16 +1,26 @@
 ///// LLVM analysis pass to mitigate false sharing based on profiling data /////
+#include "FalseSharingProfile.h"
+#include "LockPlacement.h"
+#include "ModuleHash.h"
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/Optional.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/Pass.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include <algorithm>
 #include <cassert>
 #include <cstdint>
+#include <cstdlib>
 #include <fstream>
+#include <sstream>
 #include <string>
 #include <unordered_map>
 #include <set>
@@ -24,11 +34,47 @@ static const bool enableStructPadding = true;
 // This must be a power of 2 for other code to work.
 static const size_t cacheLineSize = 64; // in bytes
 
+static cl::opt<std::string> ProfileFile(
+    "false-sharing-profile",
+    cl::desc("Conflict profile from MapAddr or fs-profdata merge. Defaults to "
+             "mapped_conflicts.out in the current directory"),
+    cl::value_desc("filename"), cl::init(""));
+
+static cl::opt<bool> ColocateLocks(
+    "false-sharing-colocate-locks",
+    cl::desc("Move each lock onto one cache line with the globals accessed "
+             "only in its critical sections, so they are handed over together"),
+    cl::init(false));
+
+static cl::opt<unsigned> PageSize(
+    "false-sharing-page-size",
+    cl::desc("Instead of aligning conflicting globals to a cache line, give "
+             "each pages of its own of this many bytes, so threads on "
+             "different NUMA nodes do not write to one page. Link with "
+             "-Wl,-T,fs583-pages.ld to pad the last page. 0 to disable"),
+    cl::init(0));
+
+static cl::opt<std::string> PagesProfile(
+    "false-sharing-pages-profile",
+    cl::desc("Globals on pages that threads on different NUMA nodes shared, "
+             "from MapAddr -p (mapped_pages.out). Each gets pages of its own "
+             "of the size given there, or -false-sharing-page-size if larger. "
+             "Link with -Wl,-T,fs583-pages.ld"),
+    cl::value_desc("filename"), cl::init(""));
+
+// The sections that fs583-pages.ld gathers page-placed globals from. Zero
+// initialized globals go to a .bss. section, which is emitted as @nobits, so
+// their pages take no space in the file.
+static const char *pageSection = ".fs583.pages";
+static const char *pageBSSSection = ".bss.fs583.pages";
+
 namespace {
 struct CacheLineEntry {
   std::string variableName;
   size_t accessOffsetInVariable; // The offset of the access within this variable, in bytes.
   size_t accessSize;             // The size of the read/write, in bytes.
+  uint64_t moduleHash = 0;       // The module defining the variable, if known.
+  uint64_t guid = 0;             // GlobalValue::getGUID() of the variable, if known.
 };
 }
 
@@ -49,6 +95,18 @@ std::istream &operator>>(std::istream &in, Conflict &conflict) {
   return in >> conflict.entry1 >> conflict.entry2 >> conflict.priority;
 }
 
+namespace {
+// A conflict with its variables looked up in the current module. A variable
+// is null if it is defined in a different module.
+struct ResolvedConflict {
+  GlobalVariable *global1;
+  size_t offset1;
+  GlobalVariable *global2;
+  size_t offset2;
+  uint64_t priority;
+};
+}
+
 namespace {
 struct PaddedStruct {
   StructType *type;
@@ -226,31 +284,312 @@ static bool fixGlobalStruct(Module &M, GlobalVariable *globalVar, PaddedStruct &
 }
 
 namespace{
-struct Fix583 : public ModulePass {
-  static char ID;
-
-  // TODO: Come up with a better way of taking input.
-  // Maybe consider doing something similar to profiling passes.
+// The fix itself, shared by the legacy and new pass manager passes.
+struct FalseSharingFixer {
+  // Used when -false-sharing-profile is not given.
   static const std::string inputFile;
 
+  // Set at full LTO, where the module is the whole program. Its hash matches
+  // none of the modules in the profile, so entries are matched by GUID alone.
+  bool wholeProgram = false;
+
+  // Globals moved next to their lock, which conflicts no longer apply to.
+  std::set<GlobalValue::GUID> movedGUIDs;
+  std::set<std::string> movedNames;
+
+  // Puts independent locks on cache lines of their own: whole-global locks
+  // are aligned here, and lock fields are added to `lockFields` to be padded
+  // like conflicting struct elements.
+  bool separateLocks(const LockAnalysis &locks,
+                     std::unordered_map<GlobalVariable *, std::set<size_t>> &lockFields) {
+    bool changed = false;
+    for (auto &lock : locks.independentLocks()) {
+      auto *global = lock.global;
+      if (locks.isWholeLock(global)) {
+        if (!global->getAlign() || *global->getAlign() < cacheLineSize) {
+          errs() << "Aligning lock " << global->getName() << " to cache boundary\n";
+          global->setAlignment(Align(cacheLineSize));
+          changed = true;
+        }
+      } else if (isa<StructType>(global->getValueType())) {
+        lockFields[global].insert(lock.offset);
+      }
+    }
+    return changed;
+  }
+
+  // Puts a global at the start of a page of pageSize bytes in pageSection (or
+  // pageBSSSection), where the linker script keeps anything else from
+  // following it onto its last page. Returns false for globals that cannot be
+  // moved to a section of ours.
+  bool placeOnOwnPage(GlobalVariable *global, uint64_t pageSize, bool &changed) {
+    if (global->isDeclaration() || global->isConstant() ||
+        global->isThreadLocal() || global->hasComdat() ||
+        global->hasCommonLinkage()) {
+      return false;
+    }
+    const char *section =
+        global->getInitializer()->isNullValue() ? pageBSSSection : pageSection;
+    if (global->hasSection() && global->getSection() != section) {
+      return false;
+    }
+    if (global->getSection() != section || !global->getAlign() ||
+        *global->getAlign() < pageSize) {
+      errs() << "Placing " << global->getName() << " on pages of its own\n";
+      global->setSection(section);
+      global->setAlignment(Align(pageSize));
+      changed = true;
+    }
+    return true;
+  }
 
-  std::vector<Conflict> getPotentialFS() {
-    std::ifstream in(inputFile);
+  // Gives the globals of a pages profile (mapped_pages.out from MapAddr -p)
+  // pages of their own. Lines without the module hash and GUID columns are
+  // matched by name.
+  bool placeSharedPages(Module &M, const std::string &path) {
+    std::ifstream in(path);
+    if (!in.is_open()) {
+      errs() << "Unable to open pages profile " << path << '\n';
+      return false;
+    }
 
-    std::vector<Conflict> conflicts;
-    Conflict conflict;
-    while (in >> conflict) {
-      conflicts.push_back(std::move(conflict));
+    auto moduleHash = fs583::getModuleHash(M);
+    DenseMap<GlobalValue::GUID, GlobalVariable *> globalsByGUID;
+    for (auto &global : M.globals()) {
+      globalsByGUID[global.getGUID()] = &global;
     }
 
+    bool changed = false;
+    std::string line;
+    while (std::getline(in, line)) {
+      std::istringstream iss(line);
+      std::string name;
+      uint64_t pageSize, remoteWrites, hash = 0, guid = 0;
+      if (!(iss >> name >> pageSize >> remoteWrites)) {
+        continue;
+      }
+      iss >> std::hex >> hash >> guid;
+      if (pageSize == 0 || (pageSize & (pageSize - 1))) {
+        errs() << "Ignoring " << name << ": page size " << pageSize
+               << " is not a power of 2\n";
+        continue;
+      }
+      if (movedGUIDs.count(guid) || (guid == 0 && movedNames.count(name))) {
+        continue; // Already placed with its lock.
+      }
+      GlobalVariable *global = nullptr;
+      if (guid == 0) {
+        global = M.getGlobalVariable(name, true);
+      } else if (wholeProgram || hash == moduleHash) {
+        global = globalsByGUID.lookup(guid);
+      }
+      if (global) {
+        placeOnOwnPage(global, std::max<uint64_t>(pageSize, PageSize), changed);
+      }
+    }
+    return changed;
+  }
+
+  // Reads a text profile (mapped_conflicts.out). Lines written by an older
+  // MapAddr lack the module hash and GUID columns and are matched by name.
+  std::vector<ResolvedConflict> getTextConflicts(Module &M, const std::string &path) {
+    std::ifstream in(path);
+    if (!in.is_open()) {
+      errs() << "Unable to open false sharing profile " << path << '\n';
+      return {};
+    }
+
+    auto moduleHash = fs583::getModuleHash(M);
+    DenseMap<GlobalValue::GUID, GlobalVariable *> globalsByGUID;
+    for (auto &global : M.globals()) {
+      globalsByGUID[global.getGUID()] = &global;
+    }
+
+    auto lookup = [&](const CacheLineEntry &entry, bool &found) -> GlobalVariable * {
+      found = true;
+      if (movedGUIDs.count(entry.guid) ||
+          (entry.guid == 0 && movedNames.count(entry.variableName))) {
+        return nullptr; // Already placed with its lock.
+      }
+      if (entry.guid == 0) {
+        auto *global = M.getGlobalVariable(entry.variableName, true);
+        found = global != nullptr;
+        return global;
+      }
+      if (!wholeProgram && entry.moduleHash != moduleHash) {
+        return nullptr; // Lives in another module; that module will fix it.
+      }
+      auto *global = globalsByGUID.lookup(entry.guid);
+      // At LTO, one missing from the whole program lives in a non-LTO object.
+      found = global != nullptr || wholeProgram;
+      return global;
+    };
+
+    std::vector<ResolvedConflict> conflicts;
+    std::string line;
+    while (std::getline(in, line)) {
+      std::istringstream iss(line);
+      Conflict conflict;
+      if (!(iss >> conflict)) {
+        continue;
+      }
+      iss >> std::hex >> conflict.entry1.moduleHash >> conflict.entry1.guid >>
+          conflict.entry2.moduleHash >> conflict.entry2.guid;
+
+      bool found1, found2;
+      auto *global1 = lookup(conflict.entry1, found1);
+      auto *global2 = lookup(conflict.entry2, found2);
+      if (!found1) {
+        errs() << "Did not find global with name " << conflict.entry1.variableName << '\n';
+        continue;
+      }
+      if (!found2) {
+        errs() << "Did not find global with name " << conflict.entry2.variableName << '\n';
+        continue;
+      }
+      conflicts.push_back({global1, conflict.entry1.accessOffsetInVariable,
+                           global2, conflict.entry2.accessOffsetInVariable,
+                           conflict.priority});
+    }
     return conflicts;
   }
 
-  Fix583() : ModulePass(ID) {}
+  // Reads a whole indexed profile at full LTO, where every module's globals
+  // are in M. Conflicts with neither global in M are left out.
+  std::vector<ResolvedConflict> getWholeProgramConflicts(Module &M, const std::string &path,
+                                                         uint64_t &maxPriority) {
+    fs583::Profile profile;
+    std::string error;
+    if (!profile.read(path, error)) {
+      errs() << "Unable to read false sharing profile " << path << ": " << error << '\n';
+      return {};
+    }
+    maxPriority = profile.maxPriority();
 
-  bool runOnModule(Module &M) override {
+    DenseMap<GlobalValue::GUID, GlobalVariable *> globalsByGUID;
+    for (auto &global : M.globals()) {
+      globalsByGUID[global.getGUID()] = &global;
+    }
+    auto lookup = [&](const fs583::ProfileEntry &entry) -> GlobalVariable * {
+      return movedGUIDs.count(entry.guid) ? nullptr : globalsByGUID.lookup(entry.guid);
+    };
+
+    std::vector<ResolvedConflict> conflicts;
+    for (auto &conflict : profile.getConflicts()) {
+      ResolvedConflict resolved{lookup(conflict.entry1), conflict.entry1.offset,
+                                lookup(conflict.entry2), conflict.entry2.offset,
+                                conflict.priority};
+      if (!resolved.global1) {
+        std::swap(resolved.global1, resolved.global2);
+        std::swap(resolved.offset1, resolved.offset2);
+      }
+      if (resolved.global1) {
+        conflicts.push_back(resolved);
+      }
+    }
+    return conflicts;
+  }
+
+  // Reads only this module's slice of an indexed profile.
+  std::vector<ResolvedConflict> getIndexedConflicts(Module &M, const std::string &path,
+                                                    uint64_t &maxPriority) {
+    auto moduleHash = fs583::getModuleHash(M);
+    std::vector<fs583::ModuleConflict> moduleConflicts;
+    std::string error;
+    if (!fs583::readModuleConflicts(path, moduleHash, moduleConflicts, maxPriority, error)) {
+      errs() << "Unable to read false sharing profile " << path << ": " << error << '\n';
+      return {};
+    }
+
+    DenseMap<GlobalValue::GUID, GlobalVariable *> globalsByGUID;
+    for (auto &global : M.globals()) {
+      globalsByGUID[global.getGUID()] = &global;
+    }
+
+    // Globals of fs583::unknownModule (from name-only text profiles) may be
+    // defined here or anywhere else, so only those claimed by this module must
+    // be found.
+    auto lookup = [&](const fs583::ProfileEntry &entry, bool &found) -> GlobalVariable * {
+      found = true;
+      if (movedGUIDs.count(entry.guid)) {
+        return nullptr; // Already placed with its lock.
+      }
+      if (entry.moduleHash != moduleHash && entry.moduleHash != fs583::unknownModule) {
+        return nullptr; // Lives in another module; that module will fix it.
+      }
+      auto *global = globalsByGUID.lookup(entry.guid);
+      found = global != nullptr || entry.moduleHash == fs583::unknownModule;
+      return global;
+    };
+
+    std::vector<ResolvedConflict> conflicts;
+    for (auto &conflict : moduleConflicts) {
+      bool found1, found2;
+      auto *global1 = lookup(conflict.local, found1);
+      auto *global2 = lookup(conflict.peer, found2);
+      if (!found1) {
+        errs() << "Did not find global with GUID " << conflict.local.guid << '\n';
+        continue;
+      }
+      if (!found2) {
+        errs() << "Did not find global with GUID " << conflict.peer.guid << '\n';
+        continue;
+      }
+      conflicts.push_back({global1, conflict.local.offset, global2,
+                           conflict.peer.offset, conflict.priority});
+    }
+    return conflicts;
+  }
+
+  std::vector<ResolvedConflict> getPotentialFS(Module &M, Optional<uint64_t> &maxPriority) {
+    // Linkers parse -mllvm options before loading pass plugins, so at LTO the
+    // profile is given through the environment instead.
+    std::string path = ProfileFile.getValue();
+    if (path.empty()) {
+      const char *envPath = std::getenv("FALSE_SHARING_PROFILE");
+      path = envPath ? envPath : inputFile;
+    }
+    if (fs583::isIndexedProfile(path)) {
+      uint64_t max = 0;
+      auto conflicts = wholeProgram ? getWholeProgramConflicts(M, path, max)
+                                    : getIndexedConflicts(M, path, max);
+      maxPriority = max;
+      return conflicts;
+    }
+    return getTextConflicts(M, path);
+  }
+
+  bool run(Module &M) {
     bool changed = false;
-    auto conflicts = getPotentialFS();
+    if (PageSize & (PageSize - 1)) {
+      errs() << "-false-sharing-page-size must be a power of 2\n";
+      return false;
+    }
+
+    // Locks are placed before reading the profile, since co-locating them
+    // replaces the globals the profile refers to.
+    std::unordered_map<GlobalVariable *, std::set<size_t>> lockFields;
+    {
+      LockAnalysis locks(M);
+      changed = separateLocks(locks, lockFields);
+      if (ColocateLocks) {
+        changed = colocateGuardedData(M, locks, movedGUIDs, movedNames) || changed;
+      }
+    }
+
+    // Linkers parse -mllvm options before loading pass plugins, so at LTO the
+    // pages profile is given through the environment instead.
+    std::string pagesPath = PagesProfile.getValue();
+    if (pagesPath.empty()) {
+      const char *envPath = std::getenv("FALSE_SHARING_PAGES_PROFILE");
+      pagesPath = envPath ? envPath : "";
+    }
+    if (!pagesPath.empty()) {
+      changed = placeSharedPages(M, pagesPath) || changed;
+    }
+
+    Optional<uint64_t> maxPriority;
+    auto conflicts = getPotentialFS(M, maxPriority);
     std::sort(conflicts.begin(), conflicts.end(), [](auto &c1, auto &c2) {
       return c1.priority > c2.priority;
     });
@@ -258,8 +597,20 @@ struct Fix583 : public ModulePass {
     auto &dataLayout = M.getDataLayout();
 
     std::unordered_map<StructType *, std::unordered_map<GlobalVariable *, std::set<size_t>>> structAccesses;
+    for (auto &pair : lockFields) {
+      auto *global = pair.first;
+      if (enableStructPadding && GlobalValue::isLocalLinkage(global->getLinkage())) {
+        auto *type = cast<StructType>(global->getValueType());
+        structAccesses[type][global].insert(pair.second.begin(), pair.second.end());
+      }
+    }
 
+    // Indexed profiles only contain this module's conflicts, so the threshold
+    // comes from the whole-program maximum stored in the profile.
     Optional<uint64_t> priorityThreshold;
+    if (maxPriority) {
+      priorityThreshold = *maxPriority / 1000;
+    }
 
     for (auto &conflict : conflicts) {
       if (!priorityThreshold) {
@@ -268,30 +619,30 @@ struct Fix583 : public ModulePass {
       if (conflict.priority < *priorityThreshold) {
         break;
       }
-      auto *global1 = M.getGlobalVariable(conflict.entry1.variableName, true);
-      auto *global2 = M.getGlobalVariable(conflict.entry2.variableName, true);
-      if (!global1) {
-        errs() << "Did not find global with name " << conflict.entry1.variableName << '\n';
-        continue;
-      }
-      if (!global2) {
-        errs() << "Did not find global with name " << conflict.entry2.variableName << '\n';
-        continue;
+      auto *global1 = conflict.global1;
+      auto *global2 = conflict.global2;
+      if (!global1 && !global2) {
+        continue; // Both variables live in other modules.
       }
-      if (conflict.entry1.variableName == conflict.entry2.variableName) {
+      if (global1 == global2) {
         if (auto *type = dyn_cast<StructType>(global1->getValueType())) {
           if (enableStructPadding && GlobalValue::isLocalLinkage(global1->getLinkage())) {
             auto &set = structAccesses[type][global1];
-            set.insert(conflict.entry1.accessOffsetInVariable);
-            set.insert(conflict.entry2.accessOffsetInVariable);
+            set.insert(conflict.offset1);
+            set.insert(conflict.offset2);
           }
         }
       } else {
-        errs() << "Aligning " << conflict.entry1.variableName << " to cache boundary\n";
-        global1->setAlignment(Align(cacheLineSize));
-        errs() << "Aligning " << conflict.entry2.variableName << " to cache boundary\n";
-        global2->setAlignment(Align(cacheLineSize));
-        changed = true;
+        for (auto *global : {global1, global2}) {
+          if (global && PageSize && placeOnOwnPage(global, PageSize, changed)) {
+            continue;
+          }
+          if (global && (!global->getAlign() || *global->getAlign() < cacheLineSize)) {
+            errs() << "Aligning " << global->getName() << " to cache boundary\n";
+            global->setAlignment(Align(cacheLineSize));
+            changed = true;
+          }
+        }
       }
     }
 
@@ -318,11 +669,57 @@ struct Fix583 : public ModulePass {
     }
     return changed;
   }
+}; // end of struct FalseSharingFixer
+
+struct Fix583 : public ModulePass {
+  static char ID;
+  Fix583() : ModulePass(ID) {}
+
+  bool runOnModule(Module &M) override {
+    return FalseSharingFixer().run(M);
+  }
 }; // end of struct Fix583
+
+// New pass manager version, usable from clang -fpass-plugin and at LTO link.
+struct Fix583Pass : public PassInfoMixin<Fix583Pass> {
+  explicit Fix583Pass(bool wholeProgram = false) : wholeProgram(wholeProgram) {}
+
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &) {
+    FalseSharingFixer fixer;
+    fixer.wholeProgram = wholeProgram;
+    return fixer.run(M) ? PreservedAnalyses::none() : PreservedAnalyses::all();
+  }
+
+  bool wholeProgram;
+}; // end of struct Fix583Pass
 }  // end of anonymous namespace
 
+const std::string FalseSharingFixer::inputFile = "mapped_conflicts.out";
+
 char Fix583::ID = 0;
-const std::string Fix583::inputFile = "mapped_conflicts.out";
 static RegisterPass<Fix583> X("false-sharing-fix", "Pass to fix false sharing",
                               false /* Only looks at CFG */,
                               false /* Analysis Pass */);
+
+// Lets `opt -passes=false-sharing-fix` run the pass, and runs it over the
+// whole program at the end of full LTO when the plugin is loaded by the linker.
+extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo() {
+  return {LLVM_PLUGIN_API_VERSION, "Fix583", LLVM_VERSION_STRING,
+          [](PassBuilder &PB) {
+            PB.registerPipelineParsingCallback(
+                [](StringRef name, ModulePassManager &MPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                  if (name == "false-sharing-fix") {
+                    MPM.addPass(Fix583Pass());
+                    return true;
+                  }
+                  return false;
+                });
+#if LLVM_VERSION_MAJOR >= 15
+            PB.registerFullLinkTimeOptimizationLastEPCallback(
+                [](ModulePassManager &MPM, OptimizationLevel) {
+                  MPM.addPass(Fix583Pass(/*wholeProgram=*/true));
+                });
+#endif
+          }};
+}
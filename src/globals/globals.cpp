@@ -1,4 +1,5 @@
 //// LLVM pass to output address of all global variables ////
+#include "ModuleHash.h"
 #include "llvm/ADT/SmallVector.h"
 #include "llvm/Pass.h"
 #include "llvm/IR/BasicBlock.h"
@@ -6,6 +7,9 @@
 #include "llvm/IR/GlobalVariable.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/Utils/ModuleUtils.h"
 #include "llvm/IR/DataLayout.h"
@@ -14,91 +18,111 @@ using namespace llvm;
 
 namespace {
 
-struct Globals583 : public ModulePass {
-  static char ID;
-  Globals583() : ModulePass(ID) {}
+// Adds a constructor that prints every global, shared by the legacy and new
+// pass manager passes.
+bool instrumentGlobals(Module &M) {
+  auto &context = M.getContext();
+  IRBuilder<> builder(context);
 
-  bool runOnModule(Module &M) override {
-    auto &context = M.getContext();
-    IRBuilder<> builder(context);
-
-    // def __ctor583():
-    auto *ctor = Function::Create(
-      FunctionType::get(builder.getVoidTy(), false),
-      Function::InternalLinkage,
-      "__ctor583",
-      M
-    );
+  // def __ctor583():
+  auto *ctor = Function::Create(
+    FunctionType::get(builder.getVoidTy(), false),
+    Function::InternalLinkage,
+    "__ctor583",
+    M
+  );
 
-    auto *ctorBB = BasicBlock::Create(context, "initHandle", ctor);
-    builder.SetInsertPoint(ctorBB);
+  auto *ctorBB = BasicBlock::Create(context, "initHandle", ctor);
+  builder.SetInsertPoint(ctorBB);
 
-    // FILE *fileHandle = fopen("./fs_globals.txt", "a");
-    auto *fopenType = FunctionType::get(
-      builder.getInt8PtrTy(),
-      SmallVector<Type *>{builder.getInt8PtrTy(), builder.getInt8PtrTy()},
-      false
-    );
-    auto fopenFunc = M.getOrInsertFunction("fopen", fopenType);
-    auto *fileHandle = builder.CreateCall(fopenFunc, SmallVector<Value *>{
-      builder.CreateGlobalStringPtr("./fs_globals.txt"),
-      builder.CreateGlobalStringPtr("a")
-    });
-    
-    // Printed lines will be in the format "name<tab>address<tab>size"
-    auto *fprintfType = FunctionType::get(
-      builder.getInt32Ty(),
-      SmallVector<Type *>{builder.getInt8PtrTy()},
-      true
-    );
-    auto fprintfFunc = M.getOrInsertFunction("fprintf", fprintfType);
-
-    DataLayout dataLayout(&M);
-
-    // We need to collect all globals before adding to them to avoid an infinite
-    // loop.
-    SmallVector<GlobalVariable *> globals;
-    for (auto &global : M.globals()) {
-      // Skip thread local variables
-      if (!global.isThreadLocal() &&
-          !global.getName().startswith("llvm.") && // used internally, e.g. llvm.global_ctors
-          !global.getName().empty()) {
-        globals.push_back(&global);
-      }
-    }
+  // FILE *fileHandle = fopen("./fs_globals.txt", "a");
+  auto *fopenType = FunctionType::get(
+    builder.getInt8PtrTy(),
+    SmallVector<Type *>{builder.getInt8PtrTy(), builder.getInt8PtrTy()},
+    false
+  );
+  auto fopenFunc = M.getOrInsertFunction("fopen", fopenType);
+  auto *fileHandle = builder.CreateCall(fopenFunc, SmallVector<Value *>{
+    builder.CreateGlobalStringPtr("./fs_globals.txt"),
+    builder.CreateGlobalStringPtr("a")
+  });
+  
+  // Printed lines will be in the format
+  // "name<tab>address<tab>size<tab>module hash<tab>GUID"
+  auto *fprintfType = FunctionType::get(
+    builder.getInt32Ty(),
+    SmallVector<Type *>{builder.getInt8PtrTy()},
+    true
+  );
+  auto fprintfFunc = M.getOrInsertFunction("fprintf", fprintfType);
 
-    for (auto *global : globals) {
-      // fprintf("%s\t%p\t%lld\n", name, address, size);
-      auto *name = builder.CreateGlobalStringPtr(global->getName());
-      auto *size = ConstantInt::get(
-        builder.getInt64Ty(),
-        dataLayout.getTypeSizeInBits(global->getValueType()).getFixedSize() / 8
-      );
-      builder.CreateCall(fprintfFunc, SmallVector<Value *>{
-        fileHandle,
-        builder.CreateGlobalStringPtr("%s\t%p\t%lld\n"),
-        name,
-        global,
-        size
-      });
+  DataLayout dataLayout(&M);
+
+  // We need to collect all globals before adding to them to avoid an infinite
+  // loop.
+  SmallVector<GlobalVariable *> globals;
+  for (auto &global : M.globals()) {
+    // Skip thread local variables and declarations; the module that
+    // defines a variable reports it.
+    if (!global.isThreadLocal() &&
+        !global.isDeclaration() &&
+        !global.getName().startswith("llvm.") && // used internally, e.g. llvm.global_ctors
+        !global.getName().empty()) {
+      globals.push_back(&global);
     }
+  }
 
-    // fclose(fileHandle);
-    auto *fcloseType = FunctionType::get(
-      builder.getInt8PtrTy(),
-      SmallVector<Type *>{builder.getInt8PtrTy()},
-      false
+  auto *moduleHash = builder.getInt64(fs583::getModuleHash(M));
+  for (auto *global : globals) {
+    // fprintf("%s\t%p\t%lld\t%llx\t%llx\n", name, address, size, moduleHash, guid);
+    auto *name = builder.CreateGlobalStringPtr(global->getName());
+    auto *size = ConstantInt::get(
+      builder.getInt64Ty(),
+      dataLayout.getTypeSizeInBits(global->getValueType()).getFixedSize() / 8
     );
-    auto fcloseFunc = M.getOrInsertFunction("fclose", fcloseType);
-    builder.CreateCall(fcloseFunc, SmallVector<Value *>{fileHandle});
+    builder.CreateCall(fprintfFunc, SmallVector<Value *>{
+      fileHandle,
+      builder.CreateGlobalStringPtr("%s\t%p\t%lld\t%llx\t%llx\n"),
+      name,
+      global,
+      size,
+      moduleHash,
+      builder.getInt64(global->getGUID())
+    });
+  }
+
+  // fclose(fileHandle);
+  auto *fcloseType = FunctionType::get(
+    builder.getInt8PtrTy(),
+    SmallVector<Type *>{builder.getInt8PtrTy()},
+    false
+  );
+  auto fcloseFunc = M.getOrInsertFunction("fclose", fcloseType);
+  builder.CreateCall(fcloseFunc, SmallVector<Value *>{fileHandle});
+
+  builder.CreateRetVoid();
+  appendToGlobalCtors(M, ctor, 0);
 
-    builder.CreateRetVoid();
-    appendToGlobalCtors(M, ctor, 0);
+  return true;
+}
 
-    return true;
+struct Globals583 : public ModulePass {
+  static char ID;
+  Globals583() : ModulePass(ID) {}
+
+  bool runOnModule(Module &M) override {
+    return instrumentGlobals(M);
   }
 }; // end of struct Globals583
 
+// New pass manager version, usable from clang -fpass-plugin and at LTO link.
+struct Globals583Pass : public PassInfoMixin<Globals583Pass> {
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &) {
+    return instrumentGlobals(M) ? PreservedAnalyses::none()
+                                : PreservedAnalyses::all();
+  }
+}; // end of struct Globals583Pass
+
 }  // end of anonymous namespace
 
 char Globals583::ID = 0;
@@ -106,3 +130,30 @@ static RegisterPass<Globals583> X("false-sharing-globals",
                                   "Pass to output information about global variables",
                                    false /* Only looks at CFG */,
                                    false /* Analysis Pass */);
+
+// Lets `opt -passes=false-sharing-globals` run the pass, and instruments the
+// whole program at the end of full LTO when the plugin is loaded by the
+// linker, so the addresses printed match the globals the fix pass sees there.
+// There every global is printed with the merged module's hash, and static
+// globals get GUIDs of that module, so a profile made this way only fits a
+// fix pass that also runs at LTO.
+extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo() {
+  return {LLVM_PLUGIN_API_VERSION, "Globals583", LLVM_VERSION_STRING,
+          [](PassBuilder &PB) {
+            PB.registerPipelineParsingCallback(
+                [](StringRef name, ModulePassManager &MPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                  if (name == "false-sharing-globals") {
+                    MPM.addPass(Globals583Pass());
+                    return true;
+                  }
+                  return false;
+                });
+#if LLVM_VERSION_MAJOR >= 15
+            PB.registerFullLinkTimeOptimizationLastEPCallback(
+                [](ModulePassManager &MPM, OptimizationLevel) {
+                  MPM.addPass(Globals583Pass());
+                });
+#endif
+          }};
+}
@@ -0,0 +1,305 @@
+//// LLVM pass to route accesses to globals through the fs583 runtime ////
+//
+// Every load, store, and atomic access to a selected global is rewritten to
+// use the address returned by fs583_acquire(), and is followed by
+// fs583_release(), so the runtime (src/runtime) can move the global to its
+// own cache line while the program runs, and move it back. Only globals
+// whose address never escapes these accesses can be moved safely.
+#include "FalseSharingProfile.h"
+#include "ModuleHash.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/IR/ValueHandle.h"
+#include "llvm/Pass.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include <cstdlib>
+#include <set>
+#include <string>
+
+using namespace llvm;
+
+// The runtime allocates one cache line per relocated variable.
+static const uint64_t cacheLineSize = 64; // in bytes
+
+static cl::opt<std::string> IndirectProfile(
+    "false-sharing-indirect-profile",
+    cl::desc("Only relocate globals that appear in this conflict profile "
+             "(from MapAddr or fs-profdata merge). Defaults to the "
+             "FALSE_SHARING_PROFILE environment variable"),
+    cl::value_desc("filename"), cl::init(""));
+
+static cl::opt<bool> IndirectAll(
+    "false-sharing-indirect-all",
+    cl::desc("Relocate every eligible global, leaving detection entirely to "
+             "the runtime"),
+    cl::init(false));
+
+static cl::opt<bool> IndirectExternal(
+    "false-sharing-indirect-external",
+    cl::desc("Also relocate globals with external linkage. Only safe if every "
+             "module that accesses them is compiled with this pass"),
+    cl::init(false));
+
+namespace {
+
+struct GlobalIndirector {
+  Module &M;
+  const DataLayout &dataLayout;
+  // At full LTO, where M is the whole program and profile entries are
+  // matched by GUID alone.
+  bool wholeProgram;
+  StructType *varType;
+  FunctionCallee acquireFunc;
+  FunctionCallee releaseFunc;
+
+  explicit GlobalIndirector(Module &M, bool wholeProgram = false)
+      : M(M), dataLayout(M.getDataLayout()), wholeProgram(wholeProgram) {
+    auto &context = M.getContext();
+    auto *int8PtrTy = Type::getInt8PtrTy(context);
+    auto *int64Ty = Type::getInt64Ty(context);
+    // Matches struct fs583_var in runtime/fs583.h
+    varType = StructType::create(
+        context, {int8PtrTy, int8PtrTy, int8PtrTy, int64Ty, int8PtrTy},
+        "struct.fs583_var");
+    acquireFunc = M.getOrInsertFunction(
+        "fs583_acquire", int8PtrTy, varType->getPointerTo(),
+        Type::getInt32Ty(context));
+    releaseFunc =
+        M.getOrInsertFunction("fs583_release", Type::getVoidTy(context));
+  }
+
+  // Whether `user` accesses memory through `pointer` as its address.
+  static bool isAccessThrough(User *user, Value *pointer) {
+    if (auto *load = dyn_cast<LoadInst>(user)) {
+      return load->getPointerOperand() == pointer;
+    }
+    if (auto *store = dyn_cast<StoreInst>(user)) {
+      return store->getPointerOperand() == pointer &&
+             store->getValueOperand() != pointer;
+    }
+    if (auto *rmw = dyn_cast<AtomicRMWInst>(user)) {
+      return rmw->getPointerOperand() == pointer &&
+             rmw->getValOperand() != pointer;
+    }
+    if (auto *cmpxchg = dyn_cast<AtomicCmpXchgInst>(user)) {
+      return cmpxchg->getPointerOperand() == pointer &&
+             cmpxchg->getCompareOperand() != pointer &&
+             cmpxchg->getNewValOperand() != pointer;
+    }
+    return false;
+  }
+
+  // Whether every use of `pointer` (the global, or an address derived from it)
+  // is a memory access in a function, collecting those accesses.
+  static bool collectAccesses(Value *pointer,
+                              SmallVectorImpl<Instruction *> &accesses) {
+    for (auto *user : pointer->users()) {
+      if (isAccessThrough(user, pointer)) {
+        accesses.push_back(cast<Instruction>(user));
+        continue;
+      }
+      bool derived = isa<GetElementPtrInst>(user) || isa<BitCastInst>(user);
+      if (auto *expr = dyn_cast<ConstantExpr>(user)) {
+        derived = expr->getOpcode() == Instruction::GetElementPtr ||
+                  expr->getOpcode() == Instruction::BitCast;
+      }
+      if (!derived || user->getOperand(0) != pointer ||
+          !collectAccesses(user, accesses)) {
+        return false; // The address escapes, so a moved copy could be missed.
+      }
+    }
+    return true;
+  }
+
+  bool isEligible(GlobalVariable &global,
+                  SmallVectorImpl<Instruction *> &accesses) {
+    if (global.isDeclaration() || global.isConstant() ||
+        global.isThreadLocal() || global.getAddressSpace() != 0 ||
+        global.getName().startswith("llvm.") || global.hasSection()) {
+      return false;
+    }
+    if (!global.hasLocalLinkage() && !IndirectExternal) {
+      return false;
+    }
+    if (global.getPointerAlignment(dataLayout).value() > cacheLineSize) {
+      return false; // The runtime only aligns fresh copies to a cache line.
+    }
+    return collectAccesses(&global, accesses) && !accesses.empty();
+  }
+
+  // Rebuilds the address `pointer` (derived from `global`) on top of `base`,
+  // the global's current address, just before the access.
+  Value *rebase(Value *pointer, GlobalVariable *global, Value *base,
+                IRBuilder<> &builder) {
+    if (pointer == global) {
+      return builder.CreateBitCast(base, global->getType());
+    }
+    auto *user = cast<User>(pointer);
+    auto *rebasedOperand = rebase(user->getOperand(0), global, base, builder);
+    if (auto *gep = dyn_cast<GEPOperator>(user)) {
+      SmallVector<Value *, 4> indices(gep->idx_begin(), gep->idx_end());
+      return gep->isInBounds()
+                 ? builder.CreateInBoundsGEP(gep->getSourceElementType(),
+                                             rebasedOperand, indices)
+                 : builder.CreateGEP(gep->getSourceElementType(),
+                                     rebasedOperand, indices);
+    }
+    return builder.CreateBitCast(rebasedOperand, pointer->getType());
+  }
+
+  GlobalVariable *createDescriptor(GlobalVariable *global) {
+    IRBuilder<> builder(M.getContext());
+    auto *int8PtrTy = builder.getInt8PtrTy();
+    auto *address = ConstantExpr::getBitCast(global, int8PtrTy);
+    auto *name = new GlobalVariable(
+        M, ArrayType::get(builder.getInt8Ty(), global->getName().size() + 1),
+        true, GlobalValue::PrivateLinkage,
+        ConstantDataArray::getString(M.getContext(), global->getName()),
+        global->getName() + ".fs583.name");
+    uint64_t size = dataLayout.getTypeAllocSize(global->getValueType());
+    auto *initializer = ConstantStruct::get(
+        varType, {address, address, ConstantExpr::getBitCast(name, int8PtrTy),
+                  builder.getInt64(size), ConstantPointerNull::get(int8PtrTy)});
+    return new GlobalVariable(M, varType, false, GlobalValue::PrivateLinkage,
+                              initializer, global->getName() + ".fs583");
+  }
+
+  void indirect(GlobalVariable *global, ArrayRef<Instruction *> accesses) {
+    auto *descriptor = createDescriptor(global);
+    SmallVector<WeakTrackingVH, 8> deadAddresses;
+    for (auto *access : accesses) {
+      unsigned pointerIndex = isa<StoreInst>(access) ? 1 : 0;
+      bool isWrite = !isa<LoadInst>(access);
+
+      IRBuilder<> builder(access);
+      auto *base = builder.CreateCall(
+          acquireFunc, {descriptor, builder.getInt32(isWrite)});
+      auto *oldPointer = access->getOperand(pointerIndex);
+      access->setOperand(pointerIndex,
+                         rebase(oldPointer, global, base, builder));
+      if (auto *oldInst = dyn_cast<Instruction>(oldPointer)) {
+        deadAddresses.push_back(oldInst);
+      }
+
+      builder.SetInsertPoint(access->getNextNode());
+      builder.CreateCall(releaseFunc);
+    }
+    RecursivelyDeleteTriviallyDeadInstructionsPermissive(deadAddresses);
+  }
+
+  // GUIDs of this module's globals (every module's at full LTO) that
+  // conflicted during profiling.
+  bool getProfiledGlobals(std::set<uint64_t> &guids) {
+    std::string path = IndirectProfile.getValue();
+    if (path.empty()) {
+      const char *envPath = std::getenv("FALSE_SHARING_PROFILE");
+      path = envPath ? envPath : "";
+    }
+    if (path.empty()) {
+      errs() << "No false sharing profile given; pass "
+                "-false-sharing-indirect-profile or -false-sharing-indirect-all\n";
+      return false;
+    }
+
+    std::string error;
+    bool read = wholeProgram
+                    ? fs583::readProfileGlobals(path, guids, error)
+                    : fs583::readModuleGlobals(path, fs583::getModuleHash(M),
+                                               guids, error);
+    if (!read) {
+      errs() << "Unable to read false sharing profile " << path << ": "
+             << error << '\n';
+      return false;
+    }
+    return true;
+  }
+
+  bool run() {
+    std::set<uint64_t> profiled;
+    if (!IndirectAll && !getProfiledGlobals(profiled)) {
+      return false;
+    }
+
+    bool changed = false;
+    SmallVector<GlobalVariable *, 16> globals;
+    for (auto &global : M.globals()) {
+      globals.push_back(&global);
+    }
+    for (auto *global : globals) {
+      if (!IndirectAll && !profiled.count(global->getGUID())) {
+        continue;
+      }
+      SmallVector<Instruction *, 16> accesses;
+      if (!isEligible(*global, accesses)) {
+        continue;
+      }
+      errs() << "Routing " << accesses.size() << " accesses to "
+             << global->getName() << " through the runtime\n";
+      indirect(global, accesses);
+      changed = true;
+    }
+    return changed;
+  }
+}; // end of struct GlobalIndirector
+
+struct Indirect583 : public ModulePass {
+  static char ID;
+  Indirect583() : ModulePass(ID) {}
+
+  bool runOnModule(Module &M) override { return GlobalIndirector(M).run(); }
+}; // end of struct Indirect583
+
+// New pass manager version, usable from clang -fpass-plugin and at LTO link.
+struct Indirect583Pass : public PassInfoMixin<Indirect583Pass> {
+  explicit Indirect583Pass(bool wholeProgram = false)
+      : wholeProgram(wholeProgram) {}
+
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &) {
+    return GlobalIndirector(M, wholeProgram).run() ? PreservedAnalyses::none()
+                                                   : PreservedAnalyses::all();
+  }
+
+  bool wholeProgram;
+}; // end of struct Indirect583Pass
+
+} // end of anonymous namespace
+
+char Indirect583::ID = 0;
+static RegisterPass<Indirect583>
+    X("false-sharing-indirect",
+      "Pass to let the runtime relocate falsely shared globals",
+      false /* Only looks at CFG */, false /* Analysis Pass */);
+
+// Lets `opt -passes=false-sharing-indirect` run the pass, and runs it over the
+// whole program at the end of full LTO when the plugin is loaded by the
+// linker, where every access to a global is visible.
+extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo() {
+  return {LLVM_PLUGIN_API_VERSION, "Indirect583", LLVM_VERSION_STRING,
+          [](PassBuilder &PB) {
+            PB.registerPipelineParsingCallback(
+                [](StringRef name, ModulePassManager &MPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                  if (name == "false-sharing-indirect") {
+                    MPM.addPass(Indirect583Pass());
+                    return true;
+                  }
+                  return false;
+                });
+#if LLVM_VERSION_MAJOR >= 15
+            PB.registerFullLinkTimeOptimizationLastEPCallback(
+                [](ModulePassManager &MPM, OptimizationLevel) {
+                  MPM.addPass(Indirect583Pass(/*wholeProgram=*/true));
+                });
+#endif
+          }};
+}
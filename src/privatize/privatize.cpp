@@ -0,0 +1,457 @@
+//// LLVM pass to give contended accumulators per-thread copies ////
+//
+// A global that threads only ever add to or subtract from (`x += n`,
+// `array[i] -= n`) does not need every update to reach the same cache line.
+// This pass gives each selected global FS583_PRIVATE_SLOTS copies, each
+// padded to whole cache lines, and turns every update into an atomic add to
+// the calling thread's copy. The value of the global is then the original
+// plus the sum of the copies, so reads add the copies up (see
+// fs583_private_sum() in src/runtime), and plain stores subtract them. Reads
+// usually happen once the workers have been joined, so the reduction is paid
+// once while the updates stay on lines no other thread writes.
+//
+// Only globals whose address never escapes, and whose accesses all have the
+// same integer type, are privatized. An update must be a load, add/sub, and
+// store to the same address whose intermediate values are not otherwise
+// used, or an atomicrmw add/sub whose result is unused.
+#include "../runtime/fs583.h"
+#include "FalseSharingProfile.h"
+#include "ModuleHash.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/IR/ValueHandle.h"
+#include "llvm/Pass.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include <cstdlib>
+#include <set>
+#include <string>
+
+using namespace llvm;
+
+static const uint64_t cacheLineSize = 64; // in bytes
+// Larger globals would need FS583_PRIVATE_SLOTS times their size in copies.
+static const uint64_t maxPrivatizedSize = 4096; // in bytes
+
+static cl::opt<std::string> PrivatizeProfile(
+    "false-sharing-privatize-profile",
+    cl::desc("Only privatize globals that appear in this conflict profile "
+             "(from MapAddr or fs-profdata merge). Defaults to the "
+             "FALSE_SHARING_PROFILE environment variable"),
+    cl::value_desc("filename"), cl::init(""));
+
+static cl::opt<bool> PrivatizeAll(
+    "false-sharing-privatize-all",
+    cl::desc("Privatize every eligible global, whether or not it conflicted"),
+    cl::init(false));
+
+static cl::opt<bool> PrivatizeExternal(
+    "false-sharing-privatize-external",
+    cl::desc("Also privatize globals with external linkage. Only safe if every "
+             "module that accesses them is compiled with this pass"),
+    cl::init(false));
+
+namespace {
+
+// A read-modify-write that only adds `delta` to the value at `pointer`.
+struct Update {
+  Value *pointer;
+  Value *delta;
+  AtomicRMWInst::BinOp operation; // Add or Sub
+  bool isVolatile;
+  Align alignment;
+  SmallVector<Instruction *, 3> instructions; // in program order
+};
+
+struct GlobalAccesses {
+  SmallVector<Update, 8> updates;
+  SmallVector<LoadInst *, 8> reads;
+  SmallVector<StoreInst *, 8> writes;
+  IntegerType *type = nullptr; // of every access
+};
+
+struct GlobalPrivatizer {
+  Module &M;
+  const DataLayout &dataLayout;
+  // At full LTO, where M is the whole program and profile entries are
+  // matched by GUID alone.
+  bool wholeProgram;
+  FunctionCallee slotFunc;
+  FunctionCallee sumFunc;
+
+  explicit GlobalPrivatizer(Module &M, bool wholeProgram = false)
+      : M(M), dataLayout(M.getDataLayout()), wholeProgram(wholeProgram) {
+    auto &context = M.getContext();
+    auto *int64Ty = Type::getInt64Ty(context);
+    auto *int32Ty = Type::getInt32Ty(context);
+    slotFunc = M.getOrInsertFunction("fs583_private_slot", int32Ty);
+    sumFunc = M.getOrInsertFunction("fs583_private_sum", int64Ty,
+                                    Type::getInt8PtrTy(context), int64Ty,
+                                    int64Ty, int32Ty);
+  }
+
+  // Matches `store (add|sub (load pointer), delta), pointer` starting from
+  // its load, where nothing else uses the loaded or computed value.
+  static bool matchUpdate(LoadInst *load, Update &update) {
+    if (load->isAtomic() || !load->hasOneUse()) {
+      return false;
+    }
+    auto *binary = dyn_cast<BinaryOperator>(load->user_back());
+    if (!binary || !binary->hasOneUse()) {
+      return false;
+    }
+    if (binary->getOpcode() == Instruction::Add) {
+      update.operation = AtomicRMWInst::Add;
+      update.delta = binary->getOperand(binary->getOperand(0) == load);
+    } else if (binary->getOpcode() == Instruction::Sub &&
+               binary->getOperand(0) == load) {
+      update.operation = AtomicRMWInst::Sub;
+      update.delta = binary->getOperand(1);
+    } else {
+      return false;
+    }
+    auto *store = dyn_cast<StoreInst>(binary->user_back());
+    if (!store || store->isAtomic() || store->getValueOperand() != binary ||
+        store->getPointerOperand() != load->getPointerOperand() ||
+        store->getParent() != load->getParent() || update.delta == load) {
+      return false;
+    }
+    // Any access to the global between the load and the store would see
+    // the update happen at a different time.
+    for (auto *inst = load->getNextNode(); inst != store;
+         inst = inst->getNextNode()) {
+      if (inst->mayReadOrWriteMemory()) {
+        return false;
+      }
+    }
+    update.pointer = load->getPointerOperand();
+    update.isVolatile = load->isVolatile() || store->isVolatile();
+    update.alignment = std::min(load->getAlign(), store->getAlign());
+    update.instructions = {load, binary, store};
+    return true;
+  }
+
+  bool setType(Type *type, GlobalAccesses &accesses) {
+    auto *intType = dyn_cast<IntegerType>(type);
+    if (!intType || !isPowerOf2_32(intType->getBitWidth()) ||
+        intType->getBitWidth() < 8 || intType->getBitWidth() > 64) {
+      return false;
+    }
+    if (accesses.type && accesses.type != intType) {
+      return false; // The copies could not be summed field by field.
+    }
+    accesses.type = intType;
+    return true;
+  }
+
+  // Classifies a use of `pointer` (the global, or an address derived from it)
+  // as an update, read, or write. Returns false for any other use.
+  bool classify(User *user, Value *pointer, GlobalAccesses &accesses) {
+    if (auto *load = dyn_cast<LoadInst>(user)) {
+      if (load->isAtomic() || !setType(load->getType(), accesses)) {
+        return false;
+      }
+      Update update;
+      if (matchUpdate(load, update)) {
+        accesses.updates.push_back(update);
+      } else {
+        accesses.reads.push_back(load);
+      }
+      return true;
+    }
+    if (auto *store = dyn_cast<StoreInst>(user)) {
+      if (store->getPointerOperand() != pointer ||
+          store->getValueOperand() == pointer || store->isAtomic() ||
+          !setType(store->getValueOperand()->getType(), accesses)) {
+        return false;
+      }
+      // The store ending an update is rewritten along with its load.
+      auto *binary = dyn_cast<BinaryOperator>(store->getValueOperand());
+      auto *load = binary ? dyn_cast<LoadInst>(binary->getOperand(0)) : nullptr;
+      auto *other = binary ? dyn_cast<LoadInst>(binary->getOperand(1)) : nullptr;
+      Update update;
+      if ((load && load->getPointerOperand() == pointer &&
+           matchUpdate(load, update)) ||
+          (other && other->getPointerOperand() == pointer &&
+           matchUpdate(other, update))) {
+        return true;
+      }
+      accesses.writes.push_back(store);
+      return true;
+    }
+    if (auto *rmw = dyn_cast<AtomicRMWInst>(user)) {
+      if (rmw->getPointerOperand() != pointer ||
+          rmw->getValOperand() == pointer || !rmw->use_empty() ||
+          (rmw->getOperation() != AtomicRMWInst::Add &&
+           rmw->getOperation() != AtomicRMWInst::Sub) ||
+          !setType(rmw->getType(), accesses)) {
+        return false;
+      }
+      Update update;
+      update.pointer = pointer;
+      update.delta = rmw->getValOperand();
+      update.operation = rmw->getOperation();
+      update.isVolatile = rmw->isVolatile();
+      update.alignment = rmw->getAlign();
+      update.instructions = {rmw};
+      accesses.updates.push_back(update);
+      return true;
+    }
+    return false;
+  }
+
+  bool collectAccesses(Value *pointer, GlobalAccesses &accesses) {
+    for (auto *user : pointer->users()) {
+      bool derived = isa<GetElementPtrInst>(user) || isa<BitCastInst>(user);
+      if (auto *expr = dyn_cast<ConstantExpr>(user)) {
+        derived = expr->getOpcode() == Instruction::GetElementPtr ||
+                  expr->getOpcode() == Instruction::BitCast;
+      }
+      if (derived) {
+        if (user->getOperand(0) != pointer ||
+            !collectAccesses(user, accesses)) {
+          return false;
+        }
+      } else if (!classify(user, pointer, accesses)) {
+        return false; // The address escapes, or is used in some other way.
+      }
+    }
+    return true;
+  }
+
+  bool isEligible(GlobalVariable &global, GlobalAccesses &accesses) {
+    if (global.isDeclaration() || global.isConstant() ||
+        global.isThreadLocal() || global.getAddressSpace() != 0 ||
+        global.getName().startswith("llvm.") || global.hasSection()) {
+      return false;
+    }
+    if (!global.hasLocalLinkage() && !PrivatizeExternal) {
+      return false;
+    }
+    if (global.getPointerAlignment(dataLayout).value() > cacheLineSize ||
+        dataLayout.getTypeAllocSize(global.getValueType()) >
+            maxPrivatizedSize) {
+      return false;
+    }
+    return collectAccesses(&global, accesses) && !accesses.updates.empty();
+  }
+
+  // Rebuilds the address `pointer` (derived from `global`) on top of `base`,
+  // the calling thread's copy of the global.
+  Value *rebase(Value *pointer, GlobalVariable *global, Value *base,
+                IRBuilder<> &builder) {
+    if (pointer == global) {
+      return builder.CreateBitCast(base, global->getType());
+    }
+    auto *user = cast<User>(pointer);
+    auto *rebasedOperand = rebase(user->getOperand(0), global, base, builder);
+    if (auto *gep = dyn_cast<GEPOperator>(user)) {
+      SmallVector<Value *, 4> indices(gep->idx_begin(), gep->idx_end());
+      return gep->isInBounds()
+                 ? builder.CreateInBoundsGEP(gep->getSourceElementType(),
+                                             rebasedOperand, indices)
+                 : builder.CreateGEP(gep->getSourceElementType(),
+                                     rebasedOperand, indices);
+    }
+    return builder.CreateBitCast(rebasedOperand, pointer->getType());
+  }
+
+  // The sum of every copy of the integer at `pointer`, truncated to `type`.
+  Value *sumCopies(Value *pointer, GlobalVariable *global,
+                   GlobalVariable *copies, uint64_t stride, IntegerType *type,
+                   IRBuilder<> &builder) {
+    auto *int64Ty = builder.getInt64Ty();
+    auto *offset =
+        builder.CreateSub(builder.CreatePtrToInt(pointer, int64Ty),
+                          builder.CreatePtrToInt(global, int64Ty));
+    auto *sum = builder.CreateCall(
+        sumFunc, {builder.CreateBitCast(copies, builder.getInt8PtrTy()),
+                  builder.getInt64(stride), offset,
+                  builder.getInt32(type->getBitWidth() / 8)});
+    return builder.CreateTrunc(sum, type);
+  }
+
+  void privatize(GlobalVariable *global, GlobalAccesses &accesses) {
+    auto &context = M.getContext();
+    uint64_t stride = alignTo(
+        dataLayout.getTypeAllocSize(global->getValueType()), cacheLineSize);
+    auto *copiesType =
+        ArrayType::get(Type::getInt8Ty(context), stride * FS583_PRIVATE_SLOTS);
+    auto *copies = new GlobalVariable(
+        M, copiesType, false, GlobalValue::InternalLinkage,
+        ConstantAggregateZero::get(copiesType),
+        global->getName() + ".fs583.private");
+    copies->setAlignment(Align(cacheLineSize));
+
+    // Each function looks up its thread's copy once, on entry.
+    DenseMap<Function *, Value *> threadCopies;
+    auto threadCopy = [&](Function *function) {
+      Value *&copy = threadCopies[function];
+      if (!copy) {
+        auto &entry = function->getEntryBlock();
+        IRBuilder<> builder(&entry, entry.getFirstInsertionPt());
+        auto *slot = builder.CreateZExt(builder.CreateCall(slotFunc),
+                                        builder.getInt64Ty());
+        copy = builder.CreateInBoundsGEP(
+            builder.getInt8Ty(),
+            builder.CreateBitCast(copies, builder.getInt8PtrTy()),
+            builder.CreateMul(slot, builder.getInt64(stride)));
+      }
+      return copy;
+    };
+
+    SmallVector<WeakTrackingVH, 8> deadAddresses;
+    for (auto &update : accesses.updates) {
+      auto *first = update.instructions.front();
+      IRBuilder<> builder(first);
+      auto *pointer = rebase(update.pointer, global,
+                             threadCopy(first->getFunction()), builder);
+      auto *rmw = builder.CreateAtomicRMW(update.operation, pointer,
+                                          update.delta, update.alignment,
+                                          AtomicOrdering::Monotonic);
+      rmw->setVolatile(update.isVolatile);
+      for (auto *inst : reverse(update.instructions)) {
+        inst->eraseFromParent();
+      }
+      if (auto *oldInst = dyn_cast<Instruction>(update.pointer)) {
+        deadAddresses.push_back(oldInst);
+      }
+    }
+
+    for (auto *load : accesses.reads) {
+      IRBuilder<> builder(load->getNextNode());
+      auto *sum = sumCopies(load->getPointerOperand(), global, copies, stride,
+                            accesses.type, builder);
+      auto *value = builder.CreateAdd(load, sum);
+      load->replaceUsesWithIf(
+          value, [&](Use &use) { return use.getUser() != value; });
+    }
+
+    for (auto *store : accesses.writes) {
+      IRBuilder<> builder(store);
+      auto *sum = sumCopies(store->getPointerOperand(), global, copies, stride,
+                            accesses.type, builder);
+      store->setOperand(0, builder.CreateSub(store->getValueOperand(), sum));
+    }
+    RecursivelyDeleteTriviallyDeadInstructionsPermissive(deadAddresses);
+  }
+
+  // GUIDs of this module's globals (every module's at full LTO) that
+  // conflicted during profiling.
+  bool getProfiledGlobals(std::set<uint64_t> &guids) {
+    std::string path = PrivatizeProfile.getValue();
+    if (path.empty()) {
+      const char *envPath = std::getenv("FALSE_SHARING_PROFILE");
+      path = envPath ? envPath : "";
+    }
+    if (path.empty()) {
+      errs() << "No false sharing profile given; pass "
+                "-false-sharing-privatize-profile or "
+                "-false-sharing-privatize-all\n";
+      return false;
+    }
+
+    std::string error;
+    bool read = wholeProgram
+                    ? fs583::readProfileGlobals(path, guids, error)
+                    : fs583::readModuleGlobals(path, fs583::getModuleHash(M),
+                                               guids, error);
+    if (!read) {
+      errs() << "Unable to read false sharing profile " << path << ": "
+             << error << '\n';
+      return false;
+    }
+    return true;
+  }
+
+  bool run() {
+    std::set<uint64_t> profiled;
+    if (!PrivatizeAll && !getProfiledGlobals(profiled)) {
+      return false;
+    }
+
+    bool changed = false;
+    SmallVector<GlobalVariable *, 16> globals;
+    for (auto &global : M.globals()) {
+      globals.push_back(&global);
+    }
+    for (auto *global : globals) {
+      if (!PrivatizeAll && !profiled.count(global->getGUID())) {
+        continue;
+      }
+      GlobalAccesses accesses;
+      if (!isEligible(*global, accesses)) {
+        continue;
+      }
+      errs() << "Privatizing " << global->getName() << ": "
+             << accesses.updates.size() << " updates, "
+             << accesses.reads.size() << " reads, " << accesses.writes.size()
+             << " writes\n";
+      privatize(global, accesses);
+      changed = true;
+    }
+    return changed;
+  }
+}; // end of struct GlobalPrivatizer
+
+struct Privatize583 : public ModulePass {
+  static char ID;
+  Privatize583() : ModulePass(ID) {}
+
+  bool runOnModule(Module &M) override { return GlobalPrivatizer(M).run(); }
+}; // end of struct Privatize583
+
+// New pass manager version, usable from clang -fpass-plugin and at LTO link.
+struct Privatize583Pass : public PassInfoMixin<Privatize583Pass> {
+  explicit Privatize583Pass(bool wholeProgram = false)
+      : wholeProgram(wholeProgram) {}
+
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &) {
+    return GlobalPrivatizer(M, wholeProgram).run() ? PreservedAnalyses::none()
+                                                   : PreservedAnalyses::all();
+  }
+
+  bool wholeProgram;
+}; // end of struct Privatize583Pass
+
+} // end of anonymous namespace
+
+char Privatize583::ID = 0;
+static RegisterPass<Privatize583>
+    X("false-sharing-privatize",
+      "Pass to give contended accumulators per-thread copies",
+      false /* Only looks at CFG */, false /* Analysis Pass */);
+
+// Lets `opt -passes=false-sharing-privatize` run the pass, and runs it over
+// the whole program at the end of full LTO when the plugin is loaded by the
+// linker, where every access to a global is visible.
+extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo() {
+  return {LLVM_PLUGIN_API_VERSION, "Privatize583", LLVM_VERSION_STRING,
+          [](PassBuilder &PB) {
+            PB.registerPipelineParsingCallback(
+                [](StringRef name, ModulePassManager &MPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                  if (name == "false-sharing-privatize") {
+                    MPM.addPass(Privatize583Pass());
+                    return true;
+                  }
+                  return false;
+                });
+#if LLVM_VERSION_MAJOR >= 15
+            PB.registerFullLinkTimeOptimizationLastEPCallback(
+                [](ModulePassManager &MPM, OptimizationLevel) {
+                  MPM.addPass(Privatize583Pass(/*wholeProgram=*/true));
+                });
+#endif
+          }};
+}
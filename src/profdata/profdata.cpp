@@ -0,0 +1,88 @@
+// Merges MapAddr output (mapped_conflicts.out) and indexed profiles into a
+// single indexed profile for -false-sharing-profile, like llvm-profdata.
+
+#include "FalseSharingProfile.h"
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+static void usage(const char *argv0) {
+  std::cerr << "Usage: " << argv0
+            << " merge [-o output.fsprofdata] [input files...]\n"
+            << "       " << argv0 << " show [input file]" << std::endl;
+  exit(1);
+}
+
+static int merge(const std::string &outputFile,
+                 const std::vector<std::string> &inputFiles) {
+  fs583::Profile merged;
+  for (auto &inputFile : inputFiles) {
+    fs583::Profile profile;
+    std::string error;
+    if (!profile.read(inputFile, error)) {
+      std::cerr << "Could not read " << inputFile << ": " << error << std::endl;
+      return 1;
+    }
+    merged.merge(profile);
+  }
+
+  std::ofstream out(outputFile, std::ios::binary);
+  if (!out.is_open()) {
+    std::cerr << "Could not open output file: " << outputFile << std::endl;
+    return 1;
+  }
+  merged.writeIndexed(out);
+  std::cout << "Merged " << inputFiles.size() << " profiles with "
+            << merged.size() << " conflicts into " << outputFile << std::endl;
+  return 0;
+}
+
+static int show(const std::string &inputFile) {
+  fs583::Profile profile;
+  std::string error;
+  if (!profile.read(inputFile, error)) {
+    std::cerr << "Could not read " << inputFile << ": " << error << std::endl;
+    return 1;
+  }
+  std::cout << "# Conflicts: " << profile.size()
+            << ", maximum priority: " << profile.maxPriority() << std::endl;
+  profile.writeText(std::cout);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    usage(argv[0]);
+  }
+
+  std::string command(argv[1]);
+  if (command == "show") {
+    if (argc != 3) {
+      usage(argv[0]);
+    }
+    return show(argv[2]);
+  }
+  if (command != "merge") {
+    usage(argv[0]);
+  }
+
+  std::string outputFile = "default.fsprofdata";
+  std::vector<std::string> inputFiles;
+  for (int i = 2; i < argc; ++i) {
+    if (std::strcmp(argv[i], "-o") == 0) {
+      if (++i == argc) {
+        usage(argv[0]);
+      }
+      outputFile = argv[i];
+    } else {
+      inputFiles.push_back(argv[i]);
+    }
+  }
+  if (inputFiles.empty()) {
+    usage(argv[0]);
+  }
+  return merge(outputFile, inputFiles);
+}
@@ -0,0 +1,367 @@
+#include "FalseSharingProfile.h"
+
+#include "llvm/Support/MD5.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+namespace fs583 {
+
+// Layout of an indexed profile:
+//   Header
+//   ModuleIndexEntry[numModules], sorted by moduleHash
+//   Record[numRecords], grouped by module in index order
+// A conflict between globals of two different modules is stored once under
+// each module, so a module only ever needs to read its own slice.
+static const char indexedMagic[8] = {'F', 'S', '5', '8', '3', 'P', 'R', 'F'};
+static const uint32_t indexedVersion = 1;
+
+namespace {
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t numModules;
+  uint64_t numRecords;
+  uint64_t maxPriority;
+};
+
+struct ModuleIndexEntry {
+  uint64_t moduleHash;
+  uint64_t firstRecord;
+  uint64_t numRecords;
+};
+
+struct Record {
+  uint64_t guid;
+  uint64_t offset;
+  uint64_t size;
+  uint64_t peerModuleHash;
+  uint64_t peerGuid;
+  uint64_t peerOffset;
+  uint64_t peerSize;
+  uint64_t priority;
+};
+} // namespace
+
+template <typename T> static void writeRaw(std::ostream &out, const T &value) {
+  out.write(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+template <typename T> static bool readRaw(std::istream &in, T &value) {
+  return static_cast<bool>(
+      in.read(reinterpret_cast<char *>(&value), sizeof(value)));
+}
+
+static bool readHeader(std::istream &in, Header &header, std::string &error) {
+  if (!readRaw(in, header) ||
+      std::memcmp(header.magic, indexedMagic, sizeof(indexedMagic)) != 0) {
+    error = "not an indexed false sharing profile";
+    return false;
+  }
+  if (header.version != indexedVersion) {
+    error = "unsupported profile version " + std::to_string(header.version);
+    return false;
+  }
+  return true;
+}
+
+bool operator<(const ProfileEntry &left, const ProfileEntry &right) {
+  return std::tie(left.moduleHash, left.guid, left.offset, left.size) <
+         std::tie(right.moduleHash, right.guid, right.offset, right.size);
+}
+
+void Profile::addConflict(ProfileConflict conflict) {
+  if (conflict.entry2 < conflict.entry1) {
+    std::swap(conflict.entry1, conflict.entry2);
+  }
+  conflicts[std::make_pair(conflict.entry1, conflict.entry2)] +=
+      conflict.priority;
+}
+
+void Profile::merge(const Profile &other) {
+  for (auto &pair : other.conflicts) {
+    conflicts[pair.first] += pair.second;
+  }
+}
+
+uint64_t Profile::maxPriority() const {
+  uint64_t max = 0;
+  for (auto &pair : conflicts) {
+    max = std::max(max, pair.second);
+  }
+  return max;
+}
+
+std::vector<ProfileConflict> Profile::getConflicts() const {
+  std::vector<ProfileConflict> result;
+  result.reserve(conflicts.size());
+  for (auto &pair : conflicts) {
+    result.push_back({pair.first.first, pair.first.second, pair.second});
+  }
+  return result;
+}
+
+bool Profile::read(const std::string &path, std::string &error) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in.is_open()) {
+    error = "could not open " + path;
+    return false;
+  }
+  if (isIndexedProfile(path)) {
+    return readIndexed(in, error);
+  }
+  return readText(in, error);
+}
+
+// Text lines are in the format written by MapAddr:
+// name1 offset1 size1 name2 offset2 size2 priority module1 guid1 module2 guid2
+// where the module hashes and GUIDs are hexadecimal. Older MapAddr lines end
+// after the priority.
+bool Profile::readText(std::istream &in, std::string &error) {
+  std::string line;
+  uint64_t linenum = 0;
+  while (std::getline(in, line)) {
+    ++linenum;
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    std::istringstream iss(line);
+    std::string name1, name2;
+    ProfileConflict conflict;
+    if (!(iss >> name1 >> std::dec >> conflict.entry1.offset >>
+          conflict.entry1.size >> name2 >> conflict.entry2.offset >>
+          conflict.entry2.size >> conflict.priority)) {
+      error = "line " + std::to_string(linenum) + " formatted incorrectly";
+      return false;
+    }
+    if ((iss >> std::ws).eof()) {
+      // As GlobalValue::getGUID() for a global with external linkage
+      conflict.entry1.moduleHash = conflict.entry2.moduleHash = unknownModule;
+      conflict.entry1.guid = llvm::MD5Hash(name1);
+      conflict.entry2.guid = llvm::MD5Hash(name2);
+    } else if (!(iss >> std::hex >> conflict.entry1.moduleHash >>
+                 conflict.entry1.guid >> conflict.entry2.moduleHash >>
+                 conflict.entry2.guid)) {
+      error = "line " + std::to_string(linenum) + " formatted incorrectly";
+      return false;
+    }
+    addConflict(conflict);
+  }
+  return true;
+}
+
+bool Profile::readIndexed(std::istream &in, std::string &error) {
+  Header header;
+  if (!readHeader(in, header, error)) {
+    return false;
+  }
+  std::vector<ModuleIndexEntry> index(header.numModules);
+  for (auto &entry : index) {
+    if (!readRaw(in, entry)) {
+      error = "truncated module index";
+      return false;
+    }
+  }
+  for (auto &module : index) {
+    for (uint64_t i = 0; i < module.numRecords; ++i) {
+      Record record;
+      if (!readRaw(in, record)) {
+        error = "truncated profile records";
+        return false;
+      }
+      // Cross-module conflicts are stored under both modules; only take them
+      // from the lower one so reading back does not double priorities.
+      if (record.peerModuleHash < module.moduleHash) {
+        continue;
+      }
+      addConflict({{module.moduleHash, record.guid, record.offset, record.size},
+                   {record.peerModuleHash, record.peerGuid, record.peerOffset,
+                    record.peerSize},
+                   record.priority});
+    }
+  }
+  return true;
+}
+
+void Profile::writeIndexed(std::ostream &out) const {
+  std::map<uint64_t, std::vector<Record>> recordsByModule;
+  for (auto &pair : conflicts) {
+    const ProfileEntry &entry1 = pair.first.first;
+    const ProfileEntry &entry2 = pair.first.second;
+    recordsByModule[entry1.moduleHash].push_back(
+        {entry1.guid, entry1.offset, entry1.size, entry2.moduleHash,
+         entry2.guid, entry2.offset, entry2.size, pair.second});
+    if (entry2.moduleHash != entry1.moduleHash) {
+      recordsByModule[entry2.moduleHash].push_back(
+          {entry2.guid, entry2.offset, entry2.size, entry1.moduleHash,
+           entry1.guid, entry1.offset, entry1.size, pair.second});
+    }
+  }
+
+  Header header;
+  std::memcpy(header.magic, indexedMagic, sizeof(indexedMagic));
+  header.version = indexedVersion;
+  header.reserved = 0;
+  header.numModules = recordsByModule.size();
+  header.numRecords = 0;
+  for (auto &pair : recordsByModule) {
+    header.numRecords += pair.second.size();
+  }
+  header.maxPriority = maxPriority();
+  writeRaw(out, header);
+
+  uint64_t firstRecord = 0;
+  for (auto &pair : recordsByModule) {
+    writeRaw(out, ModuleIndexEntry{pair.first, firstRecord,
+                                   static_cast<uint64_t>(pair.second.size())});
+    firstRecord += pair.second.size();
+  }
+  for (auto &pair : recordsByModule) {
+    for (auto &record : pair.second) {
+      writeRaw(out, record);
+    }
+  }
+}
+
+void Profile::writeText(std::ostream &out) const {
+  for (auto &pair : conflicts) {
+    const ProfileEntry &entry1 = pair.first.first;
+    const ProfileEntry &entry2 = pair.first.second;
+    // Names are not stored in indexed profiles, so print the GUID instead.
+    out << std::hex << entry1.guid << ' ' << std::dec << entry1.offset << ' '
+        << entry1.size << ' ' << std::hex << entry2.guid << ' ' << std::dec
+        << entry2.offset << ' ' << entry2.size << ' ' << pair.second << ' '
+        << std::hex << entry1.moduleHash << ' ' << entry1.guid << ' '
+        << entry2.moduleHash << ' ' << entry2.guid << std::dec << '\n';
+  }
+}
+
+bool isIndexedProfile(const std::string &path) {
+  std::ifstream in(path, std::ios::binary);
+  char magic[sizeof(indexedMagic)];
+  return in.read(magic, sizeof(magic)) &&
+         std::memcmp(magic, indexedMagic, sizeof(indexedMagic)) == 0;
+}
+
+// Appends the records stored under `moduleHash` to `conflicts`, leaving out
+// those whose peer is in module `*skipPeer`, if given.
+static bool readModuleSlice(std::istream &in, const Header &header,
+                            uint64_t moduleHash, const uint64_t *skipPeer,
+                            std::vector<ModuleConflict> &conflicts,
+                            std::string &error) {
+  // Binary search the module index in place rather than reading all of it.
+  const std::streamoff indexStart = sizeof(Header);
+  const std::streamoff recordsStart =
+      indexStart + header.numModules * sizeof(ModuleIndexEntry);
+  uint64_t low = 0;
+  uint64_t high = header.numModules;
+  while (low < high) {
+    uint64_t mid = low + (high - low) / 2;
+    ModuleIndexEntry entry;
+    in.seekg(indexStart + mid * sizeof(ModuleIndexEntry));
+    if (!readRaw(in, entry)) {
+      error = "truncated module index";
+      return false;
+    }
+    if (entry.moduleHash < moduleHash) {
+      low = mid + 1;
+    } else if (entry.moduleHash > moduleHash) {
+      high = mid;
+    } else {
+      in.seekg(recordsStart + entry.firstRecord * sizeof(Record));
+      for (uint64_t i = 0; i < entry.numRecords; ++i) {
+        Record record;
+        if (!readRaw(in, record)) {
+          error = "truncated profile records";
+          return false;
+        }
+        if (skipPeer && record.peerModuleHash == *skipPeer) {
+          continue;
+        }
+        conflicts.push_back(
+            {{moduleHash, record.guid, record.offset, record.size},
+             {record.peerModuleHash, record.peerGuid, record.peerOffset,
+              record.peerSize},
+             record.priority});
+      }
+      return true;
+    }
+  }
+  return true; // No conflicts for this module.
+}
+
+bool readModuleConflicts(const std::string &path, uint64_t moduleHash,
+                         std::vector<ModuleConflict> &conflicts,
+                         uint64_t &maxPriority, std::string &error) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in.is_open()) {
+    error = "could not open " + path;
+    return false;
+  }
+  Header header;
+  if (!readHeader(in, header, error)) {
+    return false;
+  }
+  maxPriority = header.maxPriority;
+
+  if (!readModuleSlice(in, header, moduleHash, nullptr, conflicts, error)) {
+    return false;
+  }
+  // Conflicts between this module and unknownModule are stored under both,
+  // and were just read from this module's records.
+  return moduleHash == unknownModule ||
+         readModuleSlice(in, header, unknownModule, &moduleHash, conflicts,
+                         error);
+}
+
+bool readModuleGlobals(const std::string &path, uint64_t moduleHash,
+                       std::set<uint64_t> &guids, std::string &error) {
+  if (isIndexedProfile(path)) {
+    std::vector<ModuleConflict> conflicts;
+    uint64_t maxPriority;
+    if (!readModuleConflicts(path, moduleHash, conflicts, maxPriority, error)) {
+      return false;
+    }
+    for (auto &conflict : conflicts) {
+      guids.insert(conflict.local.guid);
+      // A conflict within a module is only stored under its first global.
+      if (conflict.peer.moduleHash == moduleHash ||
+          conflict.peer.moduleHash == unknownModule) {
+        guids.insert(conflict.peer.guid);
+      }
+    }
+    return true;
+  }
+
+  Profile profile;
+  if (!profile.read(path, error)) {
+    return false;
+  }
+  for (auto &conflict : profile.getConflicts()) {
+    for (auto &entry : {conflict.entry1, conflict.entry2}) {
+      if (entry.moduleHash == moduleHash ||
+          entry.moduleHash == unknownModule) {
+        guids.insert(entry.guid);
+      }
+    }
+  }
+  return true;
+}
+
+bool readProfileGlobals(const std::string &path, std::set<uint64_t> &guids,
+                        std::string &error) {
+  Profile profile;
+  if (!profile.read(path, error)) {
+    return false;
+  }
+  for (auto &conflict : profile.getConflicts()) {
+    guids.insert(conflict.entry1.guid);
+    guids.insert(conflict.entry2.guid);
+  }
+  return true;
+}
+
+} // namespace fs583
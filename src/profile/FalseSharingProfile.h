@@ -0,0 +1,96 @@
+//// Indexed false sharing profile shared by the fix pass and fs-profdata ////
+#pragma once
+
+#include <cstdint>
+#include <istream>
+#include <map>
+#include <ostream>
+#include <set>
+#include <string>
+#include <tuple>
+#include <vector>
+
+namespace fs583 {
+
+// One side of a conflict. Globals are identified by the hash of the module
+// that defines them and their LLVM GUID (GlobalValue::getGUID()), both of
+// which are printed by the globals pass into fs_globals.txt. Text lines from
+// an older MapAddr have names only; their entries have module hash
+// unknownModule and the GUID of an external global of that name, so they
+// match it in whichever module defines it (but never a static global).
+const uint64_t unknownModule = 0;
+
+struct ProfileEntry {
+  uint64_t moduleHash;
+  uint64_t guid;
+  uint64_t offset; // The offset of the access within the variable, in bytes.
+  uint64_t size;   // The size of the read/write, in bytes.
+};
+
+bool operator<(const ProfileEntry &left, const ProfileEntry &right);
+
+// A pair of accesses that shared a cache line during profiling.
+struct ProfileConflict {
+  ProfileEntry entry1;
+  ProfileEntry entry2;
+  uint64_t priority;
+};
+
+// A conflict as read from a single module's slice of an indexed profile.
+// `local` always belongs to the requested module; `peer` may not.
+struct ModuleConflict {
+  ProfileEntry local;
+  ProfileEntry peer;
+  uint64_t priority;
+};
+
+// The in-memory form of a profile, used for merging. Conflicts are keyed by
+// their (normalized) pair of entries so merging sums priorities.
+class Profile {
+public:
+  void addConflict(ProfileConflict conflict);
+  void merge(const Profile &other);
+
+  uint64_t maxPriority() const;
+  size_t size() const { return conflicts.size(); }
+  std::vector<ProfileConflict> getConflicts() const;
+
+  // Reads either a text profile (mapped_conflicts.out with module/GUID
+  // columns) or an indexed binary profile. Returns false on a malformed file.
+  bool read(const std::string &path, std::string &error);
+  bool readText(std::istream &in, std::string &error);
+  bool readIndexed(std::istream &in, std::string &error);
+
+  void writeIndexed(std::ostream &out) const;
+  void writeText(std::ostream &out) const;
+
+private:
+  std::map<std::pair<ProfileEntry, ProfileEntry>, uint64_t> conflicts;
+};
+
+// Whether the file at `path` starts with the indexed profile magic.
+bool isIndexedProfile(const std::string &path);
+
+// Loads only the conflicts involving globals defined in the module with hash
+// `moduleHash`, using the module index to seek directly to them, and those of
+// unknownModule, whose globals may be defined in any module. Also returns
+// the maximum priority across the whole profile so thresholds are consistent
+// between modules.
+bool readModuleConflicts(const std::string &path, uint64_t moduleHash,
+                         std::vector<ModuleConflict> &conflicts,
+                         uint64_t &maxPriority, std::string &error);
+
+// Collects the GUIDs of the globals defined in the module with hash
+// `moduleHash`, or in unknownModule, that appear in any conflict of the
+// profile at `path`, which may be in either format.
+bool readModuleGlobals(const std::string &path, uint64_t moduleHash,
+                       std::set<uint64_t> &guids, std::string &error);
+
+// Collects the GUIDs of every global in any conflict of the profile at
+// `path`, whatever module defines it. At full LTO all modules are merged into
+// one, whose hash matches none of the profile's, so globals are matched by
+// GUID alone.
+bool readProfileGlobals(const std::string &path, std::set<uint64_t> &guids,
+                        std::string &error);
+
+} // namespace fs583
@@ -0,0 +1,17 @@
+//// Module identity shared by the globals pass and the fix pass ////
+#pragma once
+
+#include "llvm/IR/Module.h"
+#include "llvm/Support/MD5.h"
+
+#include <cstdint>
+
+namespace fs583 {
+
+// Identifies a module across the instrumented and the fixed compile. Both
+// compile the same source file, so hash its name rather than the bitcode path.
+inline uint64_t getModuleHash(const llvm::Module &M) {
+  return llvm::MD5Hash(M.getSourceFileName());
+}
+
+} // namespace fs583
@@ -5,11 +5,11 @@ set -Eeuo pipefail
 # set -x
 
 usage() {
-    >&2 echo "Usage: ./run.sh <path to benchmark, without the file extension .cpp> [globals|fix]"
+    >&2 echo "Usage: ./run.sh <path to benchmark, without the file extension .cpp> [globals|fix|indirect|privatize] [profile for fix, indirect, or privatize]"
     exit 1
 }
 
-if [ $# -lt 1 ] || [ $# -gt 2 ]; then
+if [ $# -lt 1 ] || [ $# -gt 3 ]; then
     usage
 fi
 
@@ -18,18 +18,37 @@ if [ $# -gt 1 ]; then
     PASS=${2}
 fi
 
+# Without a profile, the fix pass reads mapped_conflicts.out from the current
+# directory, the indirect pass lets the runtime watch every eligible global,
+# and the privatize pass privatizes every eligible accumulator
+PROFILEARG=()
+if [ $# -gt 2 ]; then
+    PROFILEARG=("-false-sharing-profile=${3}")
+    if [ "${PASS}" = indirect ] || [ "${PASS}" = privatize ]; then
+        PROFILEARG=("-false-sharing-${PASS}-profile=${3}")
+    fi
+elif [ "${PASS}" = indirect ] || [ "${PASS}" = privatize ]; then
+    PROFILEARG=("-false-sharing-${PASS}-all")
+fi
+
 BENCH=${1}.cpp
 NAME="$(basename "${1}")"
 
  # Specify your build directory in the project
 PATH2GLOBALS=${SRC_DIR}/build/globals/LLVMGLOBALS.so
 PATH2FIX=${SRC_DIR}/build/fix/LLVMFALSEFIX.so
-PASSGLOBALS=-false-sharing-globals
-PASSFIX=-false-sharing-fix   
+PATH2INDIRECT=${SRC_DIR}/build/indirect/LLVMFALSEINDIRECT.so
+PATH2PRIVATIZE=${SRC_DIR}/build/privatize/LLVMFALSEPRIVATIZE.so
+PASSGLOBALS=false-sharing-globals
+PASSFIX=false-sharing-fix
+PASSINDIRECT=false-sharing-indirect
+PASSPRIVATIZE=false-sharing-privatize
 
 case "${PASS}" in
     globals) PASSARG="${PASSGLOBALS}"; PASSPATH="${PATH2GLOBALS}";;
     fix)     PASSARG="${PASSFIX}";     PASSPATH="${PATH2FIX}";;
+    indirect) PASSARG="${PASSINDIRECT}"; PASSPATH="${PATH2INDIRECT}";;
+    privatize) PASSARG="${PASSPRIVATIZE}"; PASSPATH="${PATH2PRIVATIZE}";;
     *) usage
 esac
 
@@ -43,10 +62,16 @@ echo 'Compiling benchmark to bitcode...'
 clang -O3 -emit-llvm -I/usr/include/llvm-c-10 -I/usr/include/llvm-10 "${BENCH}" -c -o "${RUN_DIR}/${NAME}.bc"
 
 echo 'Running pass...'
-opt -load "${PASSPATH}" "${PASSARG}" "${RUN_DIR}/${NAME}.bc" -o "${RUN_DIR}/${NAME}.${PASS}.bc"
+# -load registers the pass options before the command line is parsed
+opt -load "${PASSPATH}" -load-pass-plugin "${PASSPATH}" -passes="${PASSARG}" ${PROFILEARG[@]+"${PROFILEARG[@]}"} "${RUN_DIR}/${NAME}.bc" -o "${RUN_DIR}/${NAME}.${PASS}.bc"
 
 echo 'Generating final executable...'
-clang -O3 -pthread -lstdc++ "${RUN_DIR}/${NAME}.${PASS}.bc" -o "${RUN_DIR}/${NAME}_${PASS}"
+# The indirect and privatize passes call into the runtime
+LINKARGS=()
+if [ "${PASS}" = indirect ] || [ "${PASS}" = privatize ]; then
+    LINKARGS=("${SRC_DIR}/build/runtime/libfs583rt.a")
+fi
+clang -O3 -pthread "${RUN_DIR}/${NAME}.${PASS}.bc" ${LINKARGS[@]+"${LINKARGS[@]}"} -lstdc++ -o "${RUN_DIR}/${NAME}_${PASS}"
 
 echo 'Running final executable...'
 "${RUN_DIR}/${NAME}_${PASS}" || true # Ignore return code of actual executable
@@ -0,0 +1,43 @@
+//// Runtime interface for the indirection and privatization passes ////
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Emitted by the indirection pass for each global it routes through the
+// runtime. Accesses use `addr`, which the runtime may move to a fresh cache
+// line while the program runs, and move back to `original` later.
+struct fs583_var {
+  void *addr;       // where the variable currently lives
+  void *original;   // where the compiler placed it
+  const char *name;
+  uint64_t size;
+  void *runtime;    // runtime bookkeeping, set on first access
+};
+
+// Starts an access to var and returns its current address. The variable is
+// not moved until the matching fs583_release(), so each access must be
+// bracketed by one acquire/release pair and must not be nested.
+void *fs583_acquire(struct fs583_var *var, uint32_t is_write);
+void fs583_release(void);
+
+// Number of private copies the privatization pass gives each global.
+#define FS583_PRIVATE_SLOTS 64
+
+// Which private copy the calling thread updates, in [0, FS583_PRIVATE_SLOTS).
+// Threads are handed slots in turn, so more than FS583_PRIVATE_SLOTS threads
+// share slots; the pass updates slots atomically, so that is only slower.
+uint32_t fs583_private_slot(void);
+
+// Sums the `size`-byte integers at `offset` within each of the
+// FS583_PRIVATE_SLOTS copies starting at `slots`, `stride` bytes apart.
+// The result is truncated to `size` bytes by the caller.
+uint64_t fs583_private_sum(const void *slots, uint64_t stride, uint64_t offset,
+                           uint32_t size);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,51 @@
+//// Runtime support for globals privatized by the privatization pass ////
+//
+// The pass gives each privatized global FS583_PRIVATE_SLOTS padded copies.
+// Threads add to their own copy, and readers sum the original and every copy.
+
+#include "fs583.h"
+
+#include <atomic>
+
+namespace {
+
+std::atomic<uint32_t> nextSlot{0};
+thread_local uint32_t slot = FS583_PRIVATE_SLOTS; // unassigned
+
+template <typename T> uint64_t load(const unsigned char *address) {
+  return __atomic_load_n(reinterpret_cast<const T *>(address),
+                         __ATOMIC_RELAXED);
+}
+
+} // end of anonymous namespace
+
+extern "C" uint32_t fs583_private_slot(void) {
+  if (slot == FS583_PRIVATE_SLOTS) {
+    slot = nextSlot.fetch_add(1, std::memory_order_relaxed) %
+           FS583_PRIVATE_SLOTS;
+  }
+  return slot;
+}
+
+extern "C" uint64_t fs583_private_sum(const void *slots, uint64_t stride,
+                                      uint64_t offset, uint32_t size) {
+  const auto *address = static_cast<const unsigned char *>(slots) + offset;
+  uint64_t sum = 0;
+  for (unsigned i = 0; i < FS583_PRIVATE_SLOTS; ++i, address += stride) {
+    switch (size) {
+    case 1:
+      sum += load<uint8_t>(address);
+      break;
+    case 2:
+      sum += load<uint16_t>(address);
+      break;
+    case 4:
+      sum += load<uint32_t>(address);
+      break;
+    default:
+      sum += load<uint64_t>(address);
+      break;
+    }
+  }
+  return sum;
+}
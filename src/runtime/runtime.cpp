@@ -0,0 +1,383 @@
+//// Runtime that relocates falsely shared globals while the program runs ////
+//
+// Every access to a relocatable global is bracketed by fs583_acquire() and
+// fs583_release(), which make the calling thread's epoch odd for the length
+// of the access. A sampled fraction of accesses also records which thread
+// last wrote each cache line, to count how often a line moved between
+// threads because of a different variable on it (false sharing) or the same
+// one (true sharing).
+//
+// A monitor thread looks at those counts periodically. When a variable
+// suffers mostly false sharing, it is moved to a cache line of its own:
+// accessors of that variable are held back, threads still inside an access
+// are waited out by epoch, the value is copied, and the new address is
+// published. If the variable is not accessed faster afterwards, it is moved
+// back the same way and left alone for a while.
+//
+// Environment variables:
+//   FS583_INTERVAL_MS  monitor period (default 10)
+//   FS583_THRESHOLD    false sharing transfers per period that trigger a move
+//                      (default 16)
+//   FS583_MIN_GAIN     percent speedup a move must show to be kept (default 5)
+//   FS583_DISABLE      if set, never move anything
+//   FS583_VERBOSE      if set, log moves to stderr
+
+#include "fs583.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <linux/membarrier.h>
+#include <mutex>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <unordered_map>
+
+namespace {
+
+constexpr size_t cacheLineSize = 64;
+// One in this many accesses per thread updates the sharing counts (power of 2)
+constexpr uint32_t samplePeriod = 64;
+// Periods a move is measured for before deciding whether to keep it
+constexpr unsigned trialIntervals = 10;
+// Periods to wait before retrying a variable whose move was undone; doubles
+// each time, up to maxBackoff times.
+constexpr unsigned revertedIntervals = 100;
+constexpr unsigned maxBackoff = 64;
+constexpr uint32_t noThread = 0;
+
+struct Config {
+  unsigned intervalMs = 10;
+  uint64_t threshold = 16;
+  uint64_t minGainPercent = 5;
+  bool disabled = false;
+  bool verbose = false;
+};
+
+struct alignas(cacheLineSize) ThreadState {
+  std::atomic<uint64_t> epoch{0}; // odd while inside an access
+  std::atomic<bool> exited{false};
+  uint32_t id = noThread;
+  uint32_t accesses = 0;
+  ThreadState *next = nullptr;
+};
+
+// Who last wrote a cache line holding relocatable globals.
+struct alignas(cacheLineSize) LineState {
+  std::atomic<uint32_t> owner{noThread};
+  std::atomic<fs583_var *> lastVar{nullptr};
+};
+
+enum class Placement {
+  Home,      // at the compiler's address
+  Trial,     // moved, and being measured
+  Relocated, // moved, and it helped
+  Reverted,  // moved back; waiting before it may be moved again
+};
+
+struct alignas(cacheLineSize) VarState {
+  // Shared with accessors
+  std::atomic<bool> migrating{false};
+  std::atomic<LineState *> line{nullptr};
+  std::atomic<uint64_t> samples{0};
+  std::atomic<uint64_t> falseTransfers{0};
+  std::atomic<uint64_t> trueTransfers{0};
+
+  // Only used by the monitor thread
+  fs583_var *var = nullptr;
+  VarState *next = nullptr;
+  Placement placement = Placement::Home;
+  void *fresh = nullptr; // the variable's own cache line(s), once allocated
+  uint64_t lastSamples = 0, lastFalse = 0, lastTrue = 0;
+  uint64_t samplesBefore = 0; // samples in the period that triggered the move
+  uint64_t trialSamples = 0;
+  unsigned intervals = 0;
+  unsigned backoff = 1;
+};
+
+Config config;
+bool useMembarrier = false;
+pthread_once_t initOnce = PTHREAD_ONCE_INIT;
+pthread_key_t threadExitKey;
+
+std::mutex registryMutex;
+std::unordered_map<uintptr_t, LineState *> lines; // guarded by registryMutex
+std::atomic<ThreadState *> threads{nullptr};
+std::atomic<VarState *> vars{nullptr};
+std::atomic<uint32_t> nextThreadId{noThread + 1};
+
+thread_local ThreadState *self = nullptr;
+
+uint64_t envOr(const char *name, uint64_t fallback) {
+  const char *value = std::getenv(name);
+  return value ? std::strtoull(value, nullptr, 10) : fallback;
+}
+
+// Pairs with writerFence(): either the accessor sees the migrating flag, or
+// the monitor sees the accessor's odd epoch. With membarrier, the monitor
+// pays for the fence on behalf of every thread.
+inline void readerFence() {
+  if (useMembarrier) {
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+  } else {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+}
+
+void writerFence() {
+  if (useMembarrier) {
+    syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0);
+  } else {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+}
+
+void threadExited(void *thread) {
+  static_cast<ThreadState *>(thread)->exited.store(true,
+                                                   std::memory_order_release);
+}
+
+// You must hold registryMutex
+LineState *lineFor(const void *addr) {
+  auto &line = lines[reinterpret_cast<uintptr_t>(addr) / cacheLineSize];
+  if (!line) {
+    line = new LineState;
+  }
+  return line;
+}
+
+// Waits until no thread is inside an access that started before the caller
+// raised a migrating flag.
+void waitForReaders() {
+  for (auto *thread = threads.load(std::memory_order_acquire); thread;
+       thread = thread->next) {
+    if (thread->exited.load(std::memory_order_acquire)) {
+      continue;
+    }
+    uint64_t epoch = thread->epoch.load(std::memory_order_acquire);
+    if (epoch & 1) {
+      while (thread->epoch.load(std::memory_order_acquire) == epoch) {
+        sched_yield();
+      }
+    }
+  }
+}
+
+void migrate(VarState *state, void *to) {
+  fs583_var *var = state->var;
+  void *from = __atomic_load_n(&var->addr, __ATOMIC_RELAXED);
+  if (from == to) {
+    return;
+  }
+  state->migrating.store(true, std::memory_order_seq_cst);
+  writerFence();
+  waitForReaders();
+
+  std::memcpy(to, from, var->size);
+  {
+    std::lock_guard<std::mutex> lock(registryMutex);
+    state->line.store(lineFor(to), std::memory_order_release);
+  }
+  __atomic_store_n(&var->addr, to, __ATOMIC_RELEASE);
+  state->migrating.store(false, std::memory_order_release);
+}
+
+void *freshLocation(VarState *state) {
+  if (!state->fresh) {
+    size_t size = (state->var->size + cacheLineSize - 1) & ~(cacheLineSize - 1);
+    state->fresh = std::aligned_alloc(cacheLineSize, std::max(size, cacheLineSize));
+  }
+  return state->fresh;
+}
+
+void evaluate(VarState *state) {
+  uint64_t samples = state->samples.load(std::memory_order_relaxed);
+  uint64_t falseTransfers = state->falseTransfers.load(std::memory_order_relaxed);
+  uint64_t trueTransfers = state->trueTransfers.load(std::memory_order_relaxed);
+  uint64_t newSamples = samples - state->lastSamples;
+  uint64_t newFalse = falseTransfers - state->lastFalse;
+  uint64_t newTrue = trueTransfers - state->lastTrue;
+  state->lastSamples = samples;
+  state->lastFalse = falseTransfers;
+  state->lastTrue = trueTransfers;
+
+  const char *name = state->var->name;
+  switch (state->placement) {
+  case Placement::Home:
+    if (newFalse >= config.threshold && newFalse > newTrue) {
+      void *to = freshLocation(state);
+      if (!to) {
+        return;
+      }
+      if (config.verbose) {
+        std::fprintf(stderr,
+                     "fs583: moving %s to its own cache line (%llu false, "
+                     "%llu true sharing transfers)\n",
+                     name, (unsigned long long)newFalse,
+                     (unsigned long long)newTrue);
+      }
+      migrate(state, to);
+      state->samplesBefore = newSamples;
+      state->trialSamples = 0;
+      state->intervals = 0;
+      state->placement = Placement::Trial;
+    }
+    break;
+
+  case Placement::Trial:
+    state->trialSamples += newSamples;
+    if (++state->intervals < trialIntervals) {
+      break;
+    }
+    // Accesses per period are the throughput of the threads using it.
+    if (state->trialSamples * 100 <
+        state->samplesBefore * trialIntervals * (100 + config.minGainPercent)) {
+      if (config.verbose) {
+        std::fprintf(stderr, "fs583: moving %s back; moving it did not help\n",
+                     name);
+      }
+      migrate(state, state->var->original);
+      state->intervals = revertedIntervals * state->backoff;
+      state->backoff = std::min(state->backoff * 2, maxBackoff);
+      state->placement = Placement::Reverted;
+    } else {
+      if (config.verbose) {
+        std::fprintf(stderr, "fs583: keeping %s on its own cache line\n", name);
+      }
+      state->backoff = 1;
+      state->placement = Placement::Relocated;
+    }
+    break;
+
+  case Placement::Relocated:
+    break;
+
+  case Placement::Reverted:
+    if (state->intervals == 0 || --state->intervals == 0) {
+      state->placement = Placement::Home;
+    }
+    break;
+  }
+}
+
+void *monitor(void *) {
+  for (;;) {
+    usleep(config.intervalMs * 1000);
+    for (auto *state = vars.load(std::memory_order_acquire); state;
+         state = state->next) {
+      evaluate(state);
+    }
+  }
+  return nullptr;
+}
+
+void init() {
+  config.intervalMs = envOr("FS583_INTERVAL_MS", config.intervalMs);
+  config.threshold = envOr("FS583_THRESHOLD", config.threshold);
+  config.minGainPercent = envOr("FS583_MIN_GAIN", config.minGainPercent);
+  config.disabled = std::getenv("FS583_DISABLE") != nullptr;
+  config.verbose = std::getenv("FS583_VERBOSE") != nullptr;
+
+  useMembarrier = syscall(__NR_membarrier,
+                          MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0) == 0;
+  pthread_key_create(&threadExitKey, threadExited);
+
+  if (!config.disabled) {
+    pthread_t thread;
+    if (pthread_create(&thread, nullptr, monitor, nullptr) == 0) {
+      pthread_detach(thread);
+    }
+  }
+}
+
+ThreadState *registerThread() {
+  pthread_once(&initOnce, init);
+  auto *thread = new ThreadState;
+  thread->id = nextThreadId.fetch_add(1, std::memory_order_relaxed);
+  thread->next = threads.load(std::memory_order_relaxed);
+  while (!threads.compare_exchange_weak(thread->next, thread,
+                                        std::memory_order_release,
+                                        std::memory_order_relaxed)) {
+  }
+  pthread_setspecific(threadExitKey, thread);
+  self = thread;
+  return thread;
+}
+
+VarState *registerVar(fs583_var *var) {
+  pthread_once(&initOnce, init);
+  std::lock_guard<std::mutex> lock(registryMutex);
+  auto *state = static_cast<VarState *>(
+      __atomic_load_n(&var->runtime, __ATOMIC_ACQUIRE));
+  if (state) {
+    return state; // registered by another thread meanwhile
+  }
+  state = new VarState;
+  state->var = var;
+  state->line.store(lineFor(var->addr), std::memory_order_relaxed);
+  state->next = vars.load(std::memory_order_relaxed);
+  vars.store(state, std::memory_order_release);
+  __atomic_store_n(&var->runtime, state, __ATOMIC_RELEASE);
+  return state;
+}
+
+// Counts the line as having moved between threads if another thread wrote
+// it since this thread's last sample on it.
+void sample(VarState *state, fs583_var *var, uint32_t thread, bool isWrite) {
+  state->samples.fetch_add(1, std::memory_order_relaxed);
+  LineState *line = state->line.load(std::memory_order_acquire);
+  uint32_t owner = line->owner.load(std::memory_order_relaxed);
+  fs583_var *lastVar = line->lastVar.load(std::memory_order_relaxed);
+  if (owner != noThread && owner != thread) {
+    if (lastVar != var) {
+      state->falseTransfers.fetch_add(1, std::memory_order_relaxed);
+    } else {
+      state->trueTransfers.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+  if (isWrite && (owner != thread || lastVar != var)) {
+    line->owner.store(thread, std::memory_order_relaxed);
+    line->lastVar.store(var, std::memory_order_relaxed);
+  }
+}
+
+} // end of anonymous namespace
+
+extern "C" void *fs583_acquire(fs583_var *var, uint32_t is_write) {
+  auto *state =
+      static_cast<VarState *>(__atomic_load_n(&var->runtime, __ATOMIC_ACQUIRE));
+  if (!state) {
+    state = registerVar(var);
+  }
+  ThreadState *thread = self ? self : registerThread();
+
+  uint64_t epoch = thread->epoch.load(std::memory_order_relaxed);
+  for (;;) {
+    thread->epoch.store(epoch + 1, std::memory_order_relaxed);
+    readerFence();
+    if (!state->migrating.load(std::memory_order_acquire)) {
+      break;
+    }
+    // Step out of the way until the move is done.
+    epoch += 2;
+    thread->epoch.store(epoch, std::memory_order_release);
+    while (state->migrating.load(std::memory_order_acquire)) {
+      sched_yield();
+    }
+  }
+
+  if ((++thread->accesses & (samplePeriod - 1)) == 0) {
+    sample(state, var, thread->id, is_write);
+  }
+  return __atomic_load_n(&var->addr, __ATOMIC_ACQUIRE);
+}
+
+extern "C" void fs583_release(void) {
+  ThreadState *thread = self;
+  thread->epoch.store(thread->epoch.load(std::memory_order_relaxed) + 1,
+                      std::memory_order_release);
+}